@@ -0,0 +1,567 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+/*
+ * End-to-end benchmark; generates deterministic synthetic corpus
+ * and for each corpus file and every combination of mode bits it
+ * measures compression and decompression throughput, compression
+ * ratio and peak RSS. Each measurement runs in its own process so
+ * that the peak RSS belongs to that single run.
+ */
+
+#define _POSIX_C_SOURCE		200809L
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "tight.h"
+
+
+/* message format */
+#define MSGFMT(msg)			"tbench: " msg ".\n"
+
+/* die with formatted error message */
+#define bdief(fmt, ...) \
+	{ fprintf(stderr, MSGFMT(fmt), __VA_ARGS__); exit(EXIT_FAILURE); }
+
+
+/* all mode bits */
+#define ALLMODES	(TIGHT_HUFFMAN | TIGHT_RLE | TIGHT_ORDER1 | TIGHT_FSE)
+
+
+/* output formats */
+#define FMTCSV		0
+#define FMTJSON		1
+
+
+typedef unsigned char uchar;
+
+
+/* benchmark options */
+typedef struct BenchOpts {
+	const char *dir; /* directory for corpus and outputs */
+	size_t size; /* size of each corpus file */
+	int reps; /* repetitions, best time is reported */
+	int format; /* 'FMTCSV' or 'FMTJSON' */
+	int corpus; /* corpus index or -1 for all */
+} BenchOpts;
+
+
+/* result of a single run (sent from child through pipe) */
+typedef struct BenchResult {
+	double ctime; /* compression time [sec] */
+	double dtime; /* decompression time [sec] */
+	off_t insize; /* input size */
+	off_t outsize; /* compressed size */
+	int ok; /* decompressed output matches input */
+	int status; /* tight status code */
+} BenchResult;
+
+
+
+/*--------------------------------------------------------------------------
+ * Corpus
+ *-------------------------------------------------------------------------- */
+
+/* xorshift64* pseudo random generator (deterministic) */
+static uint64_t rngstate;
+
+static void rngseed(uint64_t seed) {
+	rngstate = seed * 0x9E3779B97F4A7C15ull + 1;
+}
+
+static uint64_t rng(void) {
+	rngstate ^= rngstate >> 12;
+	rngstate ^= rngstate << 25;
+	rngstate ^= rngstate >> 27;
+	return rngstate * 0x2545F4914F6CDD1Dull;
+}
+
+/* uniform in [0, n) */
+static uint32_t rngn(uint32_t n) {
+	return (uint32_t)((rng() >> 32) * n >> 32);
+}
+
+/* uniform in [0, 1) */
+static double rngf(void) {
+	return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+/* uniformly random bytes */
+static void genuniform(uchar *p, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		p[i] = rng() >> 56;
+}
+
+
+/* number of words in 'genzipf' vocabulary */
+#define NWORDS		4096
+
+/* word of generated vocabulary */
+typedef struct Word {
+	char s[12];
+	int len;
+} Word;
+
+
+/* make vocabulary of pronounceable-ish random words */
+static void genwords(Word *words, int n) {
+	static const char *cons = "bcdfghjklmnprstvwz";
+	static const char *vows = "aeiou";
+	for (int i = 0; i < n; i++) {
+		int len = 1 + rngn(10);
+		for (int j = 0; j < len; j++)
+			words[i].s[j] = (j & 1 ? vows[rngn(5)] : cons[rngn(18)]);
+		words[i].len = len;
+	}
+}
+
+
+/* cumulative Zipf distribution (s = 1.1) over 'n' ranks */
+static void zipfcdf(double *cdf, int n) {
+	double sum = 0.0;
+	for (int i = 0; i < n; i++)
+		cdf[i] = (sum += 1.0 / pow(i + 1, 1.1));
+	for (int i = 0; i < n; i++)
+		cdf[i] /= sum;
+}
+
+
+/* draw rank from 'cdf' */
+static int zipfdraw(const double *cdf, int n) {
+	double u = rngf();
+	int lo = 0, hi = n - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) >> 1;
+		if (cdf[mid] < u) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+
+/* text made of Zipf distributed words */
+static void genzipf(uchar *p, size_t n) {
+	static Word words[NWORDS];
+	static double cdf[NWORDS];
+	size_t i = 0, col = 0;
+
+	genwords(words, NWORDS);
+	zipfcdf(cdf, NWORDS);
+	while (i < n) {
+		const Word *w = &words[zipfdraw(cdf, NWORDS)];
+		for (int j = 0; j < w->len && i < n; j++)
+			p[i++] = w->s[j];
+		col += w->len + 1;
+		if (i < n) {
+			if (col > 72) {
+				p[i++] = '\n';
+				col = 0;
+			} else {
+				p[i++] = (rngn(16) == 0 ? ',' : ' ');
+			}
+		}
+	}
+}
+
+
+/* runs of random bytes with geometric run lengths */
+static void genruns(uchar *p, size_t n) {
+	size_t i = 0;
+	while (i < n) {
+		uchar c = rng() >> 56;
+		size_t len = 1;
+		while (rngn(8) != 0 && len < 1024) /* mean run of 8 */
+			len++;
+		while (len-- > 0 && i < n)
+			p[i++] = c;
+	}
+}
+
+
+/* mostly zero bytes with sparse random records */
+static void genzeros(uchar *p, size_t n) {
+	memset(p, 0, n);
+	for (size_t i = 0; i < n; i += 64) {
+		if (rngn(10) == 0) { /* 10% of 64 byte records are used */
+			size_t len = 4 + rngn(28);
+			for (size_t j = 0; j < len && i + j < n; j++)
+				p[i + j] = rng() >> 56;
+		}
+	}
+}
+
+
+/* web server like log lines */
+static void genlogs(uchar *p, size_t n) {
+	static const char *levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+	static const char *methods[] = { "GET", "GET", "GET", "POST", "PUT", "DELETE" };
+	static const char *paths[] = {
+		"/api/v1/items", "/api/v1/users", "/api/v2/orders", "/static/app.js",
+		"/health", "/api/v1/items/search", "/login", "/metrics",
+	};
+	static const int codes[] = { 200, 200, 200, 200, 201, 204, 304, 404, 500 };
+	char line[256];
+	size_t i = 0;
+	long t = 1722686400; /* 2024-08-03 */
+	int ms = 0;
+
+	while (i < n) {
+		ms += rngn(50);
+		t += ms / 1000;
+		ms %= 1000;
+		time_t tt = t;
+		struct tm tm;
+		gmtime_r(&tt, &tm);
+		int len = snprintf(line, sizeof(line),
+				"%04d-%02d-%02dT%02d:%02d:%02d.%03dZ %s [worker-%u] %s %s/%u "
+				"%d %ums user=u%05u req=%08x\n",
+				tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+				tm.tm_min, tm.tm_sec, ms, levels[rngn(6)], rngn(16),
+				methods[rngn(6)], paths[rngn(8)], rngn(100000),
+				codes[rngn(9)], rngn(500), rngn(20000), (uint)(rng() >> 32));
+		for (int j = 0; j < len && i < n; j++)
+			p[i++] = line[j];
+	}
+}
+
+
+/* corpus */
+static const struct Corpus {
+	const char *name;
+	void (*gen)(uchar *p, size_t n);
+} corpus[] = {
+	{ "uniform", genuniform },
+	{ "zipf", genzipf },
+	{ "runs", genruns },
+	{ "zeros", genzeros },
+	{ "logs", genlogs },
+};
+
+#define NCORPUS		((int)(sizeof(corpus) / sizeof(corpus[0])))
+
+
+
+/*--------------------------------------------------------------------------
+ * Runs
+ *-------------------------------------------------------------------------- */
+
+/* memory allocator */
+static void *brealloc(void *block, void *ud, size_t os, size_t ns) {
+	(void)ud; (void)os;
+	if (ns == 0) {
+		free(block);
+		return NULL;
+	}
+	return realloc(block, ns);
+}
+
+
+/* monotonic time in seconds */
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* path of file 'name' in benchmark directory */
+static void mkpath(char *buf, size_t size, const BenchOpts *o, const char *name) {
+	snprintf(buf, size, "%s/%s", o->dir, name);
+}
+
+
+/* write corpus file */
+static void writecorpus(const BenchOpts *o, int i) {
+	char path[4096];
+	uchar *p = malloc(o->size);
+	if (p == NULL)
+		bdief("out of memory (%zu bytes)", o->size);
+	rngseed(i + 1);
+	corpus[i].gen(p, o->size);
+	mkpath(path, sizeof(path), o, corpus[i].name);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		bdief("open '%s': %s", path, strerror(errno));
+	for (size_t off = 0; off < o->size;) {
+		ssize_t n = write(fd, p + off, o->size - off);
+		if (n < 0)
+			bdief("write '%s': %s", path, strerror(errno));
+		off += n;
+	}
+	close(fd);
+	free(p);
+}
+
+
+/* byte frequencies of 'fd', rewinds 'fd' */
+static void frequencies(int fd, size_t *freqs) {
+	static uchar buf[TIGHT_RBUFFSIZE];
+	ssize_t n;
+	memset(freqs, 0, 256 * sizeof(size_t));
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		for (ssize_t i = 0; i < n; i++)
+			freqs[buf[i]]++;
+	lseek(fd, 0, SEEK_SET);
+}
+
+
+/* compare two files */
+static int samefiles(const char *a, const char *b) {
+	static uchar ba[65536], bb[65536];
+	int fa = open(a, O_RDONLY), fb = open(b, O_RDONLY);
+	int same = (fa >= 0 && fb >= 0);
+	while (same) {
+		ssize_t na = read(fa, ba, sizeof(ba));
+		ssize_t nb = read(fb, bb, sizeof(bb));
+		if (na != nb || na < 0 || memcmp(ba, bb, na) != 0)
+			same = 0;
+		else if (na == 0)
+			break;
+	}
+	if (fa >= 0) close(fa);
+	if (fb >= 0) close(fb);
+	return same;
+}
+
+
+/* compress and decompress corpus 'ci' with 'mode', best of 'reps' */
+static void run(const BenchOpts *o, int ci, int mode, BenchResult *res) {
+	char in[4096], comp[4096 + 16], out[4096 + 16];
+	size_t freqs[256];
+	struct stat st;
+	tight_State *ts = tight_new(brealloc, NULL);
+
+	if (ts == NULL)
+		bdief("%s", "couldn't allocate state");
+	mkpath(in, sizeof(in), o, corpus[ci].name);
+	snprintf(comp, sizeof(comp), "%s.%d.tit", in, mode);
+	snprintf(out, sizeof(out), "%s.%d.out", in, mode);
+	memset(res, 0, sizeof(*res));
+	res->ctime = res->dtime = -1.0;
+	for (int r = 0; r < o->reps; r++) {
+		int rfd = open(in, O_RDONLY);
+		int wfd = open(comp, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		if (rfd < 0 || wfd < 0)
+			bdief("open: %s", strerror(errno));
+		double start = now();
+		if (mode & TIGHT_HUFFMAN) /* like 'tight' binary does */
+			frequencies(rfd, freqs);
+		tight_setfiles(ts, rfd, wfd);
+		res->status = tight_compress(ts, mode, (mode & TIGHT_HUFFMAN) ? freqs : NULL);
+		double t = now() - start;
+		close(rfd); close(wfd);
+		if (res->status != TIGHT_OK)
+			goto done;
+		if (res->ctime < 0 || t < res->ctime)
+			res->ctime = t;
+
+		rfd = open(comp, O_RDONLY);
+		wfd = open(out, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+		if (rfd < 0 || wfd < 0)
+			bdief("open: %s", strerror(errno));
+		start = now();
+		tight_setfiles(ts, rfd, wfd);
+		res->status = tight_decompress(ts);
+		t = now() - start;
+		close(rfd); close(wfd);
+		if (res->status != TIGHT_OK)
+			goto done;
+		if (res->dtime < 0 || t < res->dtime)
+			res->dtime = t;
+	}
+	if (stat(in, &st) == 0) res->insize = st.st_size;
+	if (stat(comp, &st) == 0) res->outsize = st.st_size;
+	res->ok = samefiles(in, out);
+done:
+	unlink(comp);
+	unlink(out);
+	tight_free(ts);
+}
+
+
+/* run in child process, 'maxrss' is the child's peak RSS in KiB */
+static void forkrun(const BenchOpts *o, int ci, int mode, BenchResult *res,
+					long *maxrss)
+{
+	struct rusage ru;
+	int fds[2], wstatus;
+	pid_t pid;
+
+	if (pipe(fds) < 0)
+		bdief("pipe: %s", strerror(errno));
+	fflush(stdout);
+	if ((pid = fork()) < 0)
+		bdief("fork: %s", strerror(errno));
+	if (pid == 0) { /* child */
+		close(fds[0]);
+		run(o, ci, mode, res);
+		if (write(fds[1], res, sizeof(*res)) != sizeof(*res))
+			_exit(EXIT_FAILURE);
+		_exit(EXIT_SUCCESS);
+	}
+	close(fds[1]);
+	memset(res, 0, sizeof(*res));
+	res->status = -1;
+	if (read(fds[0], res, sizeof(*res)) != sizeof(*res))
+		res->status = -1;
+	close(fds[0]);
+	if (wait4(pid, &wstatus, 0, &ru) < 0)
+		bdief("wait4: %s", strerror(errno));
+	*maxrss = ru.ru_maxrss;
+}
+
+
+
+/*--------------------------------------------------------------------------
+ * Output
+ *-------------------------------------------------------------------------- */
+
+/* mode bits as string */
+static const char *modename(int mode, char *buf, size_t size) {
+	static const struct { int bit; const char *name; } bits[] = {
+		{ TIGHT_HUFFMAN, "huffman" }, { TIGHT_RLE, "rle" },
+		{ TIGHT_ORDER1, "order1" }, { TIGHT_FSE, "fse" },
+	};
+	size_t len = 0;
+	buf[0] = '\0';
+	for (size_t i = 0; i < sizeof(bits) / sizeof(bits[0]); i++) {
+		if (mode & bits[i].bit)
+			len += snprintf(buf + len, size - len, "%s%s", len ? "+" : "",
+							bits[i].name);
+	}
+	if (len == 0)
+		snprintf(buf, size, "none");
+	return buf;
+}
+
+
+/* MB/s */
+static double mbs(off_t size, double t) {
+	return (t > 0 ? (size / (1024.0 * 1024.0)) / t : 0.0);
+}
+
+
+static void printheader(const BenchOpts *o) {
+	if (o->format == FMTCSV)
+		printf("version,corpus,mode,size,compressed,ratio,"
+			   "compress_mbs,decompress_mbs,maxrss_kib,ok\n");
+	else
+		printf("{\"version\": \"%s\", \"results\": [\n", tight_version());
+}
+
+
+static void printresult(const BenchOpts *o, int ci, int mode,
+						const BenchResult *r, long maxrss, int first)
+{
+	char name[64];
+	double ratio = (r->insize ? (double)r->outsize / r->insize : 0.0);
+	int ok = (r->status == TIGHT_OK && r->ok);
+
+	modename(mode, name, sizeof(name));
+	if (o->format == FMTCSV) {
+		printf("%s,%s,%s,%ld,%ld,%.4f,%.2f,%.2f,%ld,%d\n", tight_version(),
+				corpus[ci].name, name, (long)r->insize, (long)r->outsize, ratio,
+				mbs(r->insize, r->ctime), mbs(r->insize, r->dtime), maxrss, ok);
+	} else {
+		printf("%s  {\"corpus\": \"%s\", \"mode\": \"%s\", \"size\": %ld, "
+			   "\"compressed\": %ld, \"ratio\": %.4f, \"compress_mbs\": %.2f, "
+			   "\"decompress_mbs\": %.2f, \"maxrss_kib\": %ld, \"ok\": %s}",
+				first ? "" : ",\n", corpus[ci].name, name, (long)r->insize,
+				(long)r->outsize, ratio, mbs(r->insize, r->ctime),
+				mbs(r->insize, r->dtime), maxrss, ok ? "true" : "false");
+	}
+	fflush(stdout);
+}
+
+
+static void printfooter(const BenchOpts *o) {
+	if (o->format == FMTJSON)
+		printf("\n]}\n");
+}
+
+
+
+static void usage(void) {
+	fputs("usage: tbench [-d DIR] [-s SIZE] [-r REPS] [-f csv|json] [-c CORPUS]\n"
+		  "               -d  directory for corpus files (default '.')\n"
+		  "               -s  size of each corpus file in bytes, K/M suffix ok\n"
+		  "               -r  repetitions per run, best time is reported\n"
+		  "               -f  output format, 'csv' (default) or 'json'\n"
+		  "               -c  run only corpus named CORPUS\n", stderr);
+}
+
+
+/* parse size with optional K/M suffix */
+static size_t parsesize(const char *s) {
+	char *end;
+	size_t n = strtoull(s, &end, 10);
+	if (*end == 'K' || *end == 'k') n <<= 10;
+	else if (*end == 'M' || *end == 'm') n <<= 20;
+	return n;
+}
+
+
+int main(int argc, char **argv) {
+	BenchOpts o = { ".", 8u << 20, 3, FMTCSV, -1 };
+	int opt, first = 1;
+
+	while ((opt = getopt(argc, argv, "d:s:r:f:c:h")) != -1) {
+		switch (opt) {
+		case 'd': o.dir = optarg; break;
+		case 's': o.size = parsesize(optarg); break;
+		case 'r': o.reps = atoi(optarg); break;
+		case 'f':
+			if (strcmp(optarg, "json") == 0) o.format = FMTJSON;
+			else if (strcmp(optarg, "csv") == 0) o.format = FMTCSV;
+			else bdief("unknown format '%s'", optarg);
+			break;
+		case 'c':
+			for (o.corpus = 0; o.corpus < NCORPUS; o.corpus++)
+				if (strcmp(corpus[o.corpus].name, optarg) == 0) break;
+			if (o.corpus == NCORPUS)
+				bdief("unknown corpus '%s'", optarg);
+			break;
+		default:
+			usage();
+			return (opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (o.size == 0 || o.reps <= 0)
+		bdief("%s", "size and repetitions must be positive");
+
+	printheader(&o);
+	for (int ci = 0; ci < NCORPUS; ci++) {
+		char path[4096];
+		if (o.corpus >= 0 && ci != o.corpus) continue;
+		writecorpus(&o, ci);
+		for (int mode = 0; mode <= ALLMODES; mode++) {
+			BenchResult r;
+			long maxrss = 0;
+			forkrun(&o, ci, mode, &r, &maxrss);
+			printresult(&o, ci, mode, &r, maxrss, first);
+			first = 0;
+		}
+		mkpath(path, sizeof(path), &o, corpus[ci].name);
+		unlink(path);
+	}
+	printfooter(&o);
+	return EXIT_SUCCESS;
+}
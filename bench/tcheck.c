@@ -0,0 +1,223 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+/*
+ * Round trip and size check of huffman coding on skewed inputs; each
+ * input is compressed with 'TIGHT_HUFFMAN' through memfds, decompressed
+ * and compared, and the compressed size must stay within the size of
+ * optimal (unlimited) huffman codes of each block plus tree and header
+ * slack. Exits with failure on the first failed check.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "tight.h"
+
+
+/* message format */
+#define MSGFMT(msg)			"tcheck: " msg ".\n"
+
+/* die with formatted error message */
+#define cdief(fmt, ...) \
+	{ fprintf(stderr, MSGFMT(fmt), __VA_ARGS__); exit(EXIT_FAILURE); }
+
+
+/* size of each input */
+#define INSIZE		((size_t)8 << 20)
+
+/* allowed bytes over optimal codes per block (tree, block header) */
+#define BLOCKSLACK	384
+
+/* allowed bytes over optimal codes per file (header, header tree) */
+#define FILESLACK	1024
+
+
+typedef unsigned char uchar;
+
+
+
+/* memory allocator */
+static void *crealloc(void *block, void *ud, size_t os, size_t ns) {
+	(void)ud; (void)os;
+	if (ns == 0) {
+		free(block);
+		return NULL;
+	}
+	return realloc(block, ns);
+}
+
+
+/* xorshift64* pseudo random generator (deterministic) */
+static uint64_t rng(void) {
+	static uint64_t s = 0x9E3779B97F4A7C15ull;
+	s ^= s >> 12;
+	s ^= s << 25;
+	s ^= s >> 27;
+	return s * 0x2545F4914F6CDD1Dull;
+}
+
+
+/* zeros with a random nonzero byte about every KiB (sparse file) */
+static void gensparse(uchar *p, size_t n) {
+	memset(p, 0, n);
+	for (size_t i = rng() % 1024; i < n; i += 1 + rng() % 2048)
+		p[i] = 1 + rng() % 255;
+}
+
+
+/* symbol 'k' with probability 2^-(k+1) (optimal codes are exact) */
+static void gengeometric(uchar *p, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		uint64_t x = rng() | ((uint64_t)1 << 24);
+		int k = 0;
+		while (!(x & 1)) {
+			x >>= 1;
+			k++;
+		}
+		p[i] = k;
+	}
+}
+
+
+/* skewed bytes, roughly the distribution of text */
+static void gentext(uchar *p, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		double u = (rng() >> 11) * (1.0 / 9007199254740992.0);
+		p[i] = (uchar)(' ' + (int)(u * u * u * 96));
+	}
+}
+
+
+/* inputs */
+static const struct {
+	const char *name;
+	void (*gen)(uchar *p, size_t n);
+} inputs[] = {
+	{ "sparse", gensparse },
+	{ "geometric", gengeometric },
+	{ "text", gentext },
+};
+
+
+/* bits of optimal huffman codes of 'n' bytes at 'p' */
+static size_t optimalbits(const uchar *p, size_t n) {
+	size_t w[512]; /* weights of nodes, 0 once combined */
+	int nnodes = 0, alive;
+	size_t bits = 0;
+
+	memset(w, 0, sizeof(w));
+	for (size_t i = 0; i < n; i++)
+		w[p[i]]++;
+	for (int i = 0; i < 256; i++) /* leafs with nonzero weight first */
+		if (w[i] != 0)
+			w[nnodes++] = w[i];
+	if (nnodes <= 1) /* single symbol still takes a bit */
+		return n;
+	alive = nnodes;
+	while (alive > 1) { /* combine two lightest nodes */
+		int a = -1, b = -1;
+		for (int i = 0; i < nnodes; i++) {
+			if (w[i] == 0)
+				continue;
+			if (a < 0 || w[i] < w[a]) {
+				b = a;
+				a = i;
+			} else if (b < 0 || w[i] < w[b]) {
+				b = i;
+			}
+		}
+		w[nnodes] = w[a] + w[b];
+		bits += w[nnodes++]; /* each combined byte gets one more bit */
+		w[a] = w[b] = 0;
+		alive--;
+	}
+	return bits;
+}
+
+
+static int newmemfd(const char *name) {
+	int fd = memfd_create(name, 0);
+	if (fd < 0)
+		cdief("memfd_create: %s", strerror(errno));
+	return fd;
+}
+
+
+/* write 'n' bytes at 'p' into 'fd' and rewind it */
+static void writeall(int fd, const uchar *p, size_t n) {
+	for (size_t off = 0; off < n;) {
+		ssize_t res = write(fd, p + off, n - off);
+		if (res < 0)
+			cdief("write: %s", strerror(errno));
+		off += res;
+	}
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		cdief("lseek: %s", strerror(errno));
+}
+
+
+/* check input 'i', returns compressed size */
+static size_t check(int i, uchar *in, uchar *out) {
+	size_t freqs[256] = { 0 }, bound = FILESLACK;
+	int infd = newmemfd("in"), codedfd = newmemfd("coded");
+	int outfd = newmemfd("out");
+	tight_State *ts = tight_new(crealloc, NULL);
+	off_t size;
+
+	if (ts == NULL)
+		cdief("%s", "out of memory");
+	inputs[i].gen(in, INSIZE);
+	for (size_t k = 0; k < INSIZE; k++)
+		freqs[in[k]]++;
+	for (size_t off = 0; off < INSIZE; off += TIGHT_BLOCKSIZE) {
+		size_t n = (INSIZE - off < TIGHT_BLOCKSIZE ? INSIZE - off : TIGHT_BLOCKSIZE);
+		bound += (optimalbits(in + off, n) + 7) / 8 + BLOCKSLACK;
+	}
+	writeall(infd, in, INSIZE);
+	tight_setfiles(ts, infd, codedfd);
+	if (tight_compress(ts, TIGHT_HUFFMAN, freqs) != TIGHT_OK)
+		cdief("%s: compress: %s", inputs[i].name, tight_geterror(ts));
+	if ((size = lseek(codedfd, 0, SEEK_CUR)) < 0 ||
+			lseek(codedfd, 0, SEEK_SET) < 0)
+		cdief("lseek: %s", strerror(errno));
+	tight_reset(ts);
+	tight_setfiles(ts, codedfd, outfd);
+	if (tight_decompress(ts) != TIGHT_OK)
+		cdief("%s: decompress: %s", inputs[i].name, tight_geterror(ts));
+	if (pread(outfd, out, INSIZE + 1, 0) != (ssize_t)INSIZE ||
+			memcmp(in, out, INSIZE) != 0)
+		cdief("%s: round trip failed", inputs[i].name);
+	if ((size_t)size > bound)
+		cdief("%s: compressed to %lld bytes, optimal codes need at most %zu",
+			  inputs[i].name, (long long)size, bound);
+	tight_free(ts);
+	close(infd);
+	close(codedfd);
+	close(outfd);
+	return size;
+}
+
+
+int main(void) {
+	uchar *in = malloc(INSIZE), *out = malloc(INSIZE + 1);
+
+	if (in == NULL || out == NULL)
+		cdief("%s", "out of memory");
+	for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+		size_t size = check(i, in, out);
+		printf("%-10s %zu -> %zu ok\n", inputs[i].name, INSIZE, size);
+	}
+	free(in);
+	free(out);
+	return 0;
+}
@@ -0,0 +1,246 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+/*
+ * I/O engine benchmark; a generated file is compressed and decompressed
+ * (stored blocks by default, so the run is I/O bound) with plain
+ * syscalls, I/O threads and io_uring at several buffer sizes. Reported
+ * are throughput of the best repetition and I/O system calls ('read',
+ * 'write', 'io_uring_enter' and 'lseek') per GiB of uncompressed data.
+ */
+
+#define _POSIX_C_SOURCE		200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tight.h"
+
+
+/* message format */
+#define MSGFMT(msg)			"tio: " msg ".\n"
+
+/* die with formatted error message */
+#define iodief(fmt, ...) \
+	{ fprintf(stderr, MSGFMT(fmt), __VA_ARGS__); exit(EXIT_FAILURE); }
+
+
+/* file names (in '-d' directory) */
+#define INNAME		"tio.in"
+#define CODEDNAME	"tio.tit"
+#define OUTNAME		"tio.out"
+
+/* max length of a path */
+#define MAXPATH		1024
+
+
+typedef unsigned char uchar;
+
+
+/* one measured direction */
+typedef struct Result {
+	double secs; /* best time */
+	unsigned long long syscalls; /* I/O syscalls of the best run */
+} Result;
+
+
+/* benchmark context */
+typedef struct IO {
+	char in[MAXPATH]; /* generated input */
+	char coded[MAXPATH]; /* compressed input */
+	char out[MAXPATH]; /* decompressed output */
+	size_t size; /* size of input */
+	int mode; /* compression mode */
+	int reps; /* repetitions, best is reported */
+	int cold; /* drop input pages before each run */
+} IO;
+
+
+
+/* memory allocator */
+static void *iorealloc(void *block, void *ud, size_t os, size_t ns) {
+	(void)ud; (void)os;
+	if (ns == 0) {
+		free(block);
+		return NULL;
+	}
+	return realloc(block, ns);
+}
+
+
+/* xorshift64* pseudo random generator (deterministic) */
+static uint64_t rng(void) {
+	static uint64_t s = 0x9E3779B97F4A7C15ull;
+	s ^= s >> 12;
+	s ^= s << 25;
+	s ^= s >> 27;
+	return s * 0x2545F4914F6CDD1Dull;
+}
+
+
+/* write 'size' bytes of skewed data (roughly text) into 'path' */
+static void genfile(const char *path, size_t size) {
+	uchar buf[1 << 16];
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0)
+		iodief("open '%s': %s", path, strerror(errno));
+	while (size > 0) {
+		size_t n = (size < sizeof(buf) ? size : sizeof(buf));
+		for (size_t i = 0; i < n; i++) {
+			double u = (rng() >> 11) * (1.0 / 9007199254740992.0);
+			buf[i] = (uchar)(' ' + (int)(u * u * u * 96));
+		}
+		if (write(fd, buf, n) != (ssize_t)n)
+			iodief("write '%s': %s", path, strerror(errno));
+		size -= n;
+	}
+	close(fd);
+}
+
+
+/* monotonic time in seconds */
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* run one (de)compression of 'from' into 'to', keeps the best in 'r' */
+static void run(IO *io, tight_State *ts, const char *from, const char *to,
+				int decompress, Result *r)
+{
+	tight_Stats st;
+	int rfd = open(from, O_RDONLY);
+	int wfd = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int status;
+
+	if (rfd < 0 || wfd < 0)
+		iodief("open: %s", strerror(errno));
+	if (io->cold) /* clean pages of input can be dropped without root */
+		posix_fadvise(rfd, 0, 0, POSIX_FADV_DONTNEED);
+	tight_reset(ts);
+	tight_setfiles(ts, rfd, wfd);
+	double start = now();
+	status = (decompress ? tight_decompress(ts) :
+			  tight_compress(ts, io->mode, NULL));
+	double secs = now() - start;
+	if (status != TIGHT_OK)
+		iodief("%s", tight_geterror(ts));
+	tight_getstats(ts, &st);
+	if (r->secs == 0 || secs < r->secs) {
+		r->secs = secs;
+		r->syscalls = st.syscalls + st.seeks;
+	}
+	close(rfd);
+	close(wfd);
+}
+
+
+/* compare 'out' with 'in' */
+static void verify(IO *io) {
+	uchar a[1 << 16], b[1 << 16];
+	FILE *fa = fopen(io->in, "rb"), *fb = fopen(io->out, "rb");
+	size_t na, nb;
+
+	if (fa == NULL || fb == NULL)
+		iodief("fopen: %s", strerror(errno));
+	do {
+		na = fread(a, 1, sizeof(a), fa);
+		nb = fread(b, 1, sizeof(b), fb);
+		if (na != nb || memcmp(a, b, na) != 0)
+			iodief("%s", "round trip failed");
+	} while (na > 0);
+	fclose(fa);
+	fclose(fb);
+}
+
+
+/* measure 'engine' with buffers of 'buffsize' bytes (0 if automatic) */
+static void measure(IO *io, int engine, size_t buffsize) {
+	static const char *names[] = { "syscalls", "threads", "io_uring" };
+	tight_State *ts = tight_new(iorealloc, NULL);
+	Result c = {0}, d = {0};
+	double gib = io->size / (double)(1 << 30);
+	double mb = io->size / 1e6;
+
+	if (ts == NULL)
+		iodief("%s", "out of memory");
+	tight_setstats(ts, 1);
+	tight_setbuffers(ts, buffsize, buffsize);
+	tight_setpipelined(ts, engine);
+	for (int i = 0; i < io->reps; i++) {
+		run(io, ts, io->in, io->coded, 0, &c);
+		run(io, ts, io->coded, io->out, 1, &d);
+	}
+	verify(io);
+	tight_free(ts);
+	if (buffsize)
+		printf("%-9s %8zuK", names[engine], buffsize >> 10);
+	else
+		printf("%-9s %9s", names[engine], "auto");
+	printf(" %10.1f %10.1f %12.0f %12.0f\n", mb / c.secs, mb / d.secs,
+		   c.syscalls / gib, d.syscalls / gib);
+	fflush(stdout);
+}
+
+
+static void usage(void) {
+	fputs("usage: tio [-c] [-d DIR] [-m MODE] [-r REPS] [-s MIB]\n"
+		  "           -c  drop cached input pages before each run\n"
+		  "           -d  directory for the files (default /tmp)\n"
+		  "           -m  mode bits (default 0, stored blocks)\n"
+		  "           -r  repetitions, best is reported (default 3)\n"
+		  "           -s  size of the input in MiB (default 256)\n",
+		  stderr);
+}
+
+
+int main(int argc, char **argv) {
+	static const size_t buffsizes[] = { 4 << 10, 16 << 10, 64 << 10, 256 << 10, 0 };
+	const char *dir = "/tmp";
+	IO io;
+	int opt;
+
+	memset(&io, 0, sizeof(io));
+	io.size = (size_t)256 << 20;
+	io.reps = 3;
+	while ((opt = getopt(argc, argv, "cd:m:r:s:h")) != -1) {
+		switch (opt) {
+		case 'c': io.cold = 1; break;
+		case 'd': dir = optarg; break;
+		case 'm': io.mode = atoi(optarg); break;
+		case 'r': io.reps = atoi(optarg); break;
+		case 's': io.size = (size_t)atol(optarg) << 20; break;
+		default:
+			usage();
+			return (opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (io.reps <= 0 || io.size == 0)
+		iodief("%s", "invalid options");
+	snprintf(io.in, sizeof(io.in), "%s/%s", dir, INNAME);
+	snprintf(io.coded, sizeof(io.coded), "%s/%s", dir, CODEDNAME);
+	snprintf(io.out, sizeof(io.out), "%s/%s", dir, OUTNAME);
+	genfile(io.in, io.size);
+
+	printf("%-9s %9s %10s %10s %12s %12s   (%zu MiB, mode %d, reps %d%s)\n",
+		   "engine", "buffer", "comp MB/s", "dec MB/s", "sys/GiB c", "sys/GiB d",
+		   io.size >> 20, io.mode, io.reps, (io.cold ? ", cold" : ""));
+	for (int i = 0; i < (int)(sizeof(buffsizes) / sizeof(buffsizes[0])); i++)
+		for (int e = TIGHT_PIPE_OFF; e <= TIGHT_PIPE_URING; e++)
+			measure(&io, e, buffsizes[i]);
+	unlink(io.in);
+	unlink(io.coded);
+	unlink(io.out);
+	return 0;
+}
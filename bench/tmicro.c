@@ -0,0 +1,408 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+/*
+ * Microbenchmarks of the hot kernels; each kernel runs on in-memory
+ * input (memfd for the 'BuffReader' and '/dev/null' for 'BuffWriter'
+ * so that 'read()' and 'write()' are just copies), after warmup it is
+ * repeated and median, minimum and spread of the run times are
+ * reported. Internal functions are linked from 'libtight.a',
+ * 'tdecompress.c' is included directly to reach the static decoder.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "tdecompress.c"
+#include "tmd5.h"
+
+
+/* message format */
+#define MSGFMT(msg)			"tmicro: " msg ".\n"
+
+/* die with formatted error message */
+#define mdief(fmt, ...) \
+	{ fprintf(stderr, MSGFMT(fmt), __VA_ARGS__); exit(EXIT_FAILURE); }
+
+
+/* max repetitions */
+#define MAXREPS		101
+
+
+/* kernel inputs */
+typedef struct Micro {
+	tight_State *ts;
+	byte *data; /* input bytes */
+	size_t size; /* size of 'data' */
+	size_t freqs[TIGHTBYTES]; /* frequencies of 'data' */
+	HuffCode codes[TIGHTBYTES]; /* codes for 'freqs' */
+	TreeData *tree; /* tree of 'codes' */
+	DecodeEntry tab[DECSIZE]; /* decode table for 'tree' */
+	int datafd; /* memfd with 'data' */
+	int codedfd; /* memfd with 'data' huffman coded */
+	size_t codedsize; /* size of coded 'data' */
+	int nullfd; /* '/dev/null' */
+	ulong sink; /* keeps results alive */
+} Micro;
+
+
+/* kernel, 'ops' is how many operations one call performs */
+typedef struct Kernel {
+	const char *name;
+	void (*fn)(Micro *m);
+	size_t (*ops)(const Micro *m);
+	const char *unit; /* what one operation is */
+} Kernel;
+
+
+
+/*--------------------------------------------------------------------------
+ * Kernels
+ *-------------------------------------------------------------------------- */
+
+/* rewind memfd 'fd' */
+static void rewindfd(int fd) {
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		mdief("lseek: %s", strerror(errno));
+}
+
+
+/* histogram with the selected kernels ('TIGHT_KERNELS' overrides) */
+static void khistogram(Micro *m) {
+	m->ts->kernels->histogram(m->freqs, m->data, m->size);
+	m->sink += m->freqs[0];
+}
+
+
+/* split 'data' into runs (at most 'RLEMAXRUN') as 'rleencode' does */
+static void krunlength(Micro *m) {
+	ulong runs = 0;
+	for (size_t i = 0; i < m->size; runs++) {
+		size_t n = m->size - i;
+		i += m->ts->kernels->runlength(&m->data[i], (n > RLEMAXRUN ? RLEMAXRUN : n));
+	}
+	m->sink += runs;
+}
+
+
+/* read all of 'datafd' with 'tightB_brgetc' */
+static void kbrgetc(Micro *m) {
+	BuffReader br;
+	ulong sum = 0;
+	int c;
+
+	rewindfd(m->datafd);
+	tightB_initbr(&br, m->ts, m->datafd);
+	while ((c = tightB_brgetc(&br)) != TIGHTEOF)
+		sum += c;
+	m->sink += sum;
+}
+
+
+/* write huffman codes of 'data' with 'tightB_writenbits' */
+static void kwritenbits(Micro *m) {
+	BuffWriter bw;
+
+	tightB_initbw(&bw, m->ts, m->nullfd);
+	for (size_t i = 0; i < m->size; i++)
+		tightB_writenbits(&bw, m->codes[m->data[i]].code,
+						  m->codes[m->data[i]].nbits);
+	tightB_writepending(&bw);
+	tightB_writefile(&bw);
+}
+
+
+/* write huffman codes of 'data' with the selected kernels */
+static void khuffencode(Micro *m) {
+	BuffWriter bw;
+
+	tightB_initbw(&bw, m->ts, m->nullfd);
+	m->ts->kernels->huffencode(&bw, m->codes, m->data, m->size);
+	tightB_writepending(&bw);
+	tightB_writefile(&bw);
+}
+
+
+/* decode huffman coded 'data' with 'getsymbol' */
+static void kgetsymbol(Micro *m) {
+	BuffReader br;
+	BitReader b;
+	ulong sum = 0;
+
+	rewindfd(m->codedfd);
+	tightB_initbr(&br, m->ts, m->codedfd);
+	initbits(&b, &br, m->codedsize);
+	for (size_t i = 0; i < m->size; i++)
+		sum += getsymbol(&b, m->tab);
+	m->sink += sum;
+}
+
+
+/* build tree and codes from 'freqs' */
+static void kgencodes(Micro *m) {
+	tightS_gencodes(m->ts, m->freqs);
+	m->sink += m->ts->codes[0].nbits;
+}
+
+
+/* MD5 of 'data' in memory */
+static void kmd5update(Micro *m) {
+	MD5ctx ctx;
+	byte out[16];
+
+	tight5_init(&ctx);
+	for (size_t off = 0; off < m->size;) {
+		size_t n = m->size - off;
+		if (n > TIGHT_RBUFFSIZE) n = TIGHT_RBUFFSIZE;
+		tight5_update(&ctx, m->data + off, n);
+		off += n;
+	}
+	tight5_final(&ctx, out);
+	m->sink += out[0];
+}
+
+
+/* MD5 of 'datafd' through 'BuffReader' */
+static void kgenmd5(Micro *m) {
+	byte out[16];
+
+	rewindfd(m->datafd);
+	tightB_genMD5(m->ts, m->size, m->datafd, out);
+	m->sink += out[0];
+}
+
+
+static size_t bytesops(const Micro *m) { return m->size; }
+
+static size_t oneop(const Micro *m) { (void)m; return 1; }
+
+
+static const Kernel kernels[] = {
+	{ "histogram", khistogram, bytesops, "byte" },
+	{ "runlength", krunlength, bytesops, "byte" },
+	{ "brgetc", kbrgetc, bytesops, "byte" },
+	{ "writenbits", kwritenbits, bytesops, "symbol" },
+	{ "huffencode", khuffencode, bytesops, "symbol" },
+	{ "getsymbol", kgetsymbol, bytesops, "symbol" },
+	{ "gencodes", kgencodes, oneop, "tree" },
+	{ "md5update", kmd5update, bytesops, "byte" },
+	{ "genMD5", kgenmd5, bytesops, "byte" },
+};
+
+#define NKERNELS	((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+
+
+/*--------------------------------------------------------------------------
+ * Setup
+ *-------------------------------------------------------------------------- */
+
+/* memory allocator */
+static void *mrealloc(void *block, void *ud, size_t os, size_t ns) {
+	(void)ud; (void)os;
+	if (ns == 0) {
+		free(block);
+		return NULL;
+	}
+	return realloc(block, ns);
+}
+
+
+/* xorshift64* pseudo random generator (deterministic) */
+static uint64_t rng(void) {
+	static uint64_t s = 0x9E3779B97F4A7C15ull;
+	s ^= s >> 12;
+	s ^= s << 25;
+	s ^= s >> 27;
+	return s * 0x2545F4914F6CDD1Dull;
+}
+
+
+/* skewed bytes, roughly the distribution of text */
+static void gendata(byte *p, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		uint64_t r = rng();
+		double u = (r >> 11) * (1.0 / 9007199254740992.0);
+		p[i] = (byte)(' ' + (int)(u * u * u * 96));
+	}
+}
+
+
+/* new memfd containing 'n' bytes of 'p' */
+static int newmemfd(const char *name, const byte *p, size_t n) {
+	int fd = memfd_create(name, 0);
+	if (fd < 0)
+		mdief("memfd_create: %s", strerror(errno));
+	for (size_t off = 0; off < n;) {
+		ssize_t w = write(fd, p + off, n - off);
+		if (w < 0)
+			mdief("write: %s", strerror(errno));
+		off += w;
+	}
+	return fd;
+}
+
+
+static void setup(Micro *m, size_t size) {
+	BuffWriter bw;
+
+	m->ts = tight_new(mrealloc, NULL);
+	if (m->ts == NULL || (m->data = malloc(size)) == NULL)
+		mdief("%s", "out of memory");
+	m->size = size;
+	m->sink = 0;
+	gendata(m->data, size);
+	khistogram(m);
+	m->tree = tightS_gentree(m->ts, m->freqs, m->codes);
+	filltable(m->tab, m->tree, 0, 0);
+	m->datafd = newmemfd("data", m->data, size);
+	m->codedfd = memfd_create("coded", 0);
+	if (m->codedfd < 0)
+		mdief("memfd_create: %s", strerror(errno));
+	if ((m->nullfd = open("/dev/null", O_WRONLY)) < 0)
+		mdief("open '/dev/null': %s", strerror(errno));
+	tightB_initbw(&bw, m->ts, m->codedfd);
+	for (size_t i = 0; i < size; i++)
+		tightB_writenbits(&bw, m->codes[m->data[i]].code,
+						  m->codes[m->data[i]].nbits);
+	tightB_writepending(&bw);
+	tightB_writefile(&bw);
+	m->codedsize = lseek(m->codedfd, 0, SEEK_CUR);
+}
+
+
+static void cleanup(Micro *m) {
+	tightT_freeparent(m->ts, m->tree);
+	tight_free(m->ts);
+	close(m->datafd);
+	close(m->codedfd);
+	close(m->nullfd);
+	free(m->data);
+}
+
+
+
+/*--------------------------------------------------------------------------
+ * Measure
+ *-------------------------------------------------------------------------- */
+
+/* monotonic time in seconds */
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int cmpdouble(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+/* run kernel 'k' and print median, min and spread */
+static void measure(Micro *m, const Kernel *k, int warmup, int reps) {
+	double t[MAXREPS];
+	size_t ops = k->ops(m);
+	int calls = 1;
+
+	for (int i = 0; i < warmup; i++)
+		k->fn(m);
+	if (ops == 1) { /* batch tiny kernels so the clock can resolve them */
+		double start = now();
+		k->fn(m);
+		double once = now() - start;
+		calls = (once > 0 ? (int)(1e-3 / once) : 1000);
+		if (calls < 1) calls = 1;
+	}
+	for (int r = 0; r < reps; r++) {
+		double start = now();
+		for (int i = 0; i < calls; i++)
+			k->fn(m);
+		t[r] = (now() - start) / calls;
+	}
+	qsort(t, reps, sizeof(t[0]), cmpdouble);
+	double median = (reps & 1 ? t[reps / 2] : (t[reps / 2 - 1] + t[reps / 2]) / 2);
+	double spread = (median > 0 ? (t[reps - 1] - t[0]) / median * 100.0 : 0.0);
+	printf("%-12s %12.2f %12.2f %10.2f %9.1f%%   ns/%s\n", k->name,
+			median * 1e9 / ops, t[0] * 1e9 / ops,
+			(ops > 1 ? (ops / median) / (1024.0 * 1024.0) : 1.0 / median),
+			spread, k->unit);
+	fflush(stdout);
+}
+
+
+static void usage(void) {
+	fputs("usage: tmicro [-s SIZE] [-w WARMUP] [-r REPS] [KERNEL...]\n"
+		  "               -s  input size in bytes, K/M suffix ok (default 4M)\n"
+		  "               -w  warmup runs (default 2)\n"
+		  "               -r  measured repetitions (default 11)\n"
+		  "kernels: histogram runlength brgetc writenbits huffencode getsymbol\n"
+		  "         gencodes md5update genMD5\n"
+		  "variant of kernels is selected with 'TIGHT_KERNELS' environment\n"
+		  "variable (scalar, sse42, avx2, bmi)\n",
+		  stderr);
+}
+
+
+/* parse size with optional K/M suffix */
+static size_t parsesize(const char *s) {
+	char *end;
+	size_t n = strtoull(s, &end, 10);
+	if (*end == 'K' || *end == 'k') n <<= 10;
+	else if (*end == 'M' || *end == 'm') n <<= 20;
+	return n;
+}
+
+
+int main(int argc, char **argv) {
+	size_t size = 4u << 20;
+	int warmup = 2, reps = 11;
+	Micro m;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:w:r:h")) != -1) {
+		switch (opt) {
+		case 's': size = parsesize(optarg); break;
+		case 'w': warmup = atoi(optarg); break;
+		case 'r': reps = atoi(optarg); break;
+		default:
+			usage();
+			return (opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (size == 0 || warmup < 0 || reps <= 0 || reps > MAXREPS)
+		mdief("invalid options (repetitions must be in 1..%d)", MAXREPS);
+	for (int i = optind; i < argc; i++) {
+		int k;
+		for (k = 0; k < NKERNELS; k++)
+			if (strcmp(kernels[k].name, argv[i]) == 0) break;
+		if (k == NKERNELS)
+			mdief("unknown kernel '%s'", argv[i]);
+	}
+
+	setup(&m, size);
+	printf("%-12s %12s %12s %10s %10s   (size %zu, warmup %d, reps %d, %s)\n",
+			"kernel", "median", "min", "MB/s|op/s", "spread", size, warmup, reps,
+			m.ts->kernels->name);
+	for (int k = 0; k < NKERNELS; k++) {
+		int run = (optind == argc);
+		for (int i = optind; i < argc && !run; i++)
+			run = (strcmp(kernels[k].name, argv[i]) == 0);
+		if (run)
+			measure(&m, &kernels[k], warmup, reps);
+	}
+	cleanup(&m);
+	return (m.sink == 0xdeadbeef); /* use 'sink' */
+}
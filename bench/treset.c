@@ -0,0 +1,280 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+/*
+ * Per-call latency of small objects (1 KiB - 64 KiB); each object is
+ * compressed and decompressed through memfds with a fresh state per
+ * object ('tight_new'/'tight_free'), with a single state reused with
+ * 'tight_reset' and with a reused state that also has an arena.
+ * Median of the repetitions is reported in microseconds per call.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "tight.h"
+
+
+/* message format */
+#define MSGFMT(msg)			"treset: " msg ".\n"
+
+/* die with formatted error message */
+#define rdief(fmt, ...) \
+	{ fprintf(stderr, MSGFMT(fmt), __VA_ARGS__); exit(EXIT_FAILURE); }
+
+
+/* max repetitions */
+#define MAXREPS		101
+
+/* smallest and largest object */
+#define MINOBJ		1024
+#define MAXOBJ		(64 * 1024)
+
+/* arena size of 'VARENA' */
+#define ARENASIZE	(2 * 1024 * 1024)
+
+
+/* state variants */
+#define VFRESH		0 /* new state for each call */
+#define VREUSE		1 /* state reused with 'tight_reset' */
+#define VARENA		2 /* reused state with arena */
+#define NVARIANTS	3
+
+
+typedef unsigned char uchar;
+
+
+/* benchmark context */
+typedef struct Reset {
+	tight_State *ts; /* reused state (if any) */
+	uchar *data; /* object bytes */
+	int infd; /* memfd with the object */
+	int codedfd; /* memfd with compressed object */
+	int outfd; /* memfd with decompressed object */
+	int mode; /* compression mode */
+} Reset;
+
+
+
+/* memory allocator */
+static void *rrealloc(void *block, void *ud, size_t os, size_t ns) {
+	(void)ud; (void)os;
+	if (ns == 0) {
+		free(block);
+		return NULL;
+	}
+	return realloc(block, ns);
+}
+
+
+/* xorshift64* pseudo random generator (deterministic) */
+static uint64_t rng(void) {
+	static uint64_t s = 0x9E3779B97F4A7C15ull;
+	s ^= s >> 12;
+	s ^= s << 25;
+	s ^= s >> 27;
+	return s * 0x2545F4914F6CDD1Dull;
+}
+
+
+/* skewed bytes, roughly the distribution of text */
+static void gendata(uchar *p, size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		double u = (rng() >> 11) * (1.0 / 9007199254740992.0);
+		p[i] = (uchar)(' ' + (int)(u * u * u * 96));
+	}
+}
+
+
+static int newmemfd(const char *name) {
+	int fd = memfd_create(name, 0);
+	if (fd < 0)
+		rdief("memfd_create: %s", strerror(errno));
+	return fd;
+}
+
+
+/* truncate and rewind memfd 'fd' */
+static void clearfd(int fd) {
+	if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0)
+		rdief("ftruncate: %s", strerror(errno));
+}
+
+
+/* rewind memfd 'fd' */
+static void rewindfd(int fd) {
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		rdief("lseek: %s", strerror(errno));
+}
+
+
+/* get state for the next call of 'variant' */
+static tight_State *getstate(Reset *r, int variant) {
+	if (variant == VFRESH) {
+		tight_State *ts = tight_new(rrealloc, NULL);
+		if (ts == NULL)
+			rdief("%s", "out of memory");
+		return ts;
+	}
+	tight_reset(r->ts);
+	return r->ts;
+}
+
+
+/* release state of the call */
+static void putstate(Reset *r, tight_State *ts) {
+	if (ts != r->ts)
+		tight_free(ts);
+}
+
+
+/* compress 'infd' into 'codedfd' */
+static void compress(Reset *r, int variant) {
+	tight_State *ts = getstate(r, variant);
+	rewindfd(r->infd);
+	clearfd(r->codedfd);
+	tight_setfiles(ts, r->infd, r->codedfd);
+	if (tight_compress(ts, r->mode, NULL) != TIGHT_OK)
+		rdief("compress: %s", tight_geterror(ts));
+	putstate(r, ts);
+}
+
+
+/* decompress 'codedfd' into 'outfd' */
+static void decompress(Reset *r, int variant) {
+	tight_State *ts = getstate(r, variant);
+	rewindfd(r->codedfd);
+	clearfd(r->outfd);
+	tight_setfiles(ts, r->codedfd, r->outfd);
+	if (tight_decompress(ts) != TIGHT_OK)
+		rdief("decompress: %s", tight_geterror(ts));
+	putstate(r, ts);
+}
+
+
+/* check that 'outfd' holds the object of 'size' bytes */
+static void verify(Reset *r, size_t size) {
+	static uchar buf[MAXOBJ];
+	rewindfd(r->outfd);
+	if (read(r->outfd, buf, sizeof(buf)) != (ssize_t)size ||
+			memcmp(buf, r->data, size) != 0)
+		rdief("round trip of %zu bytes failed", size);
+}
+
+
+/* monotonic time in seconds */
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int cmpdouble(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+/* median time [us] of one call of 'fn' over 'reps' batches of 'calls' */
+static double measure(Reset *r, void (*fn)(Reset *, int), int variant,
+					  int calls, int reps)
+{
+	double t[MAXREPS];
+
+	for (int i = 0; i < calls / 10 + 1; i++) /* warmup */
+		fn(r, variant);
+	for (int k = 0; k < reps; k++) {
+		double start = now();
+		for (int i = 0; i < calls; i++)
+			fn(r, variant);
+		t[k] = (now() - start) / calls;
+	}
+	qsort(t, reps, sizeof(t[0]), cmpdouble);
+	return (reps & 1 ? t[reps / 2] : (t[reps / 2 - 1] + t[reps / 2]) / 2) * 1e6;
+}
+
+
+static void usage(void) {
+	fputs("usage: treset [-m MODE] [-n CALLS] [-r REPS]\n"
+		  "               -m  mode bits (default TIGHT_DEFAULT)\n"
+		  "               -n  calls per repetition (default 500)\n"
+		  "               -r  measured repetitions (default 11)\n",
+		  stderr);
+}
+
+
+int main(int argc, char **argv) {
+	static const char *names[NVARIANTS] = { "fresh", "reuse", "arena" };
+	int calls = 500, reps = 11;
+	Reset r;
+	int opt;
+
+	r.mode = TIGHT_DEFAULT;
+	while ((opt = getopt(argc, argv, "m:n:r:h")) != -1) {
+		switch (opt) {
+		case 'm': r.mode = atoi(optarg); break;
+		case 'n': calls = atoi(optarg); break;
+		case 'r': reps = atoi(optarg); break;
+		default:
+			usage();
+			return (opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (calls <= 0 || reps <= 0 || reps > MAXREPS)
+		rdief("invalid options (repetitions must be in 1..%d)", MAXREPS);
+	if ((r.data = malloc(MAXOBJ)) == NULL)
+		rdief("%s", "out of memory");
+	gendata(r.data, MAXOBJ);
+	r.infd = newmemfd("in");
+	r.codedfd = newmemfd("coded");
+	r.outfd = newmemfd("out");
+
+	printf("%-8s", "size");
+	for (int v = 0; v < NVARIANTS; v++)
+		printf(" %9s-c", names[v]);
+	for (int v = 0; v < NVARIANTS; v++)
+		printf(" %9s-d", names[v]);
+	printf("   [us/call] (mode %d, calls %d, reps %d)\n", r.mode, calls, reps);
+	for (size_t size = MINOBJ; size <= MAXOBJ; size <<= 1) {
+		double c[NVARIANTS], d[NVARIANTS];
+		clearfd(r.infd);
+		if (write(r.infd, r.data, size) != (ssize_t)size)
+			rdief("write: %s", strerror(errno));
+		for (int v = 0; v < NVARIANTS; v++) {
+			r.ts = NULL;
+			if (v != VFRESH && (r.ts = tight_new(rrealloc, NULL)) == NULL)
+				rdief("%s", "out of memory");
+			if (v == VARENA && tight_setarena(r.ts, ARENASIZE) != TIGHT_OK)
+				rdief("%s", "out of memory");
+			c[v] = measure(&r, compress, v, calls, reps);
+			d[v] = measure(&r, decompress, v, calls, reps);
+			verify(&r, size);
+			if (r.ts)
+				tight_free(r.ts);
+		}
+		printf("%-8zu", size);
+		for (int v = 0; v < NVARIANTS; v++)
+			printf(" %11.2f", c[v]);
+		for (int v = 0; v < NVARIANTS; v++)
+			printf(" %11.2f", d[v]);
+		printf("\n");
+		fflush(stdout);
+	}
+	close(r.infd);
+	close(r.codedfd);
+	close(r.outfd);
+	free(r.data);
+	return 0;
+}
@@ -1,5 +1,5 @@
 # tight version
-VERSION = 1.0.0
+VERSION = 1.1.0
 
 # paths
 PREFIX = /usr/local
@@ -13,6 +13,9 @@ OPTS = -O3
 #ASANFLAGS = -fsanitize=address -fsanitize=undefined
 #DBGFLAGS = ${ASANFLAGS} -g
 
+# libraries
+LIBS = -lm -lpthread
+
 # flags
 CFLAGS   = -std=c99 -Wpedantic -Wall -Wextra ${DDEFS} ${DBGFLAGS} ${OPTS}
 LDFLAGS  = ${LIBS} ${ASANFLAGS}
@@ -3,8 +3,14 @@
  * Refer to 'tight.h' for license details.
  *****************************************/
 
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+#include <sys/mman.h>
+
 #include "talloc.h"
 #include "tdebug.h"
+#include "tstate.h"
 
 
 
@@ -30,8 +36,228 @@ void tightA_freetempmem(tight_State *ts, TempMem *tm) {
 }
 
 
+/*--------------------------------------------------------------------------
+ * Arena
+ *-------------------------------------------------------------------------- */
+
+/* round 'size' up to 'ARENAALIGN' */
+#define arenasize(size)		(((size) + (ARENAALIGN - 1)) & ~(size_t)(ARENAALIGN - 1))
+
+/* true if 'p' was allocated from arena 'a' */
+#define inarena(a,p) \
+	((a)->base != NULL && (byte *)(p) >= (a)->base && \
+	 (byte *)(p) < (a)->base + (a)->size)
+
+/* true if 'p' is a per-state buffer of arena 'a' */
+#define inkept(a,p) \
+	((a)->base != NULL && (byte *)(p) >= (a)->base + (a)->size - (a)->kept && \
+	 (byte *)(p) < (a)->base + (a)->size)
+
+
+/* allocate 'size' bytes from arena, returns NULL if arena is full */
+static void *arenamalloc(Arena *a, size_t size) {
+	void *block;
+
+	size = arenasize(size);
+	if (size <= ARENASMALL) { /* try free list ? */
+		void **fl = &a->freelist[size / ARENAALIGN - 1];
+		if ((block = *fl) != NULL) {
+			*fl = *(void **)block;
+			return block;
+		}
+	}
+	if (t_unlikely(a->size - a->kept - a->used < size))
+		return NULL;
+	block = a->base + a->used;
+	a->used += size;
+	return block;
+}
+
+
+/* allocate per-state buffer of 'size' bytes, returns NULL if it doesn't fit */
+static void *keptmalloc(Arena *a, size_t size) {
+	size = arenasize(size);
+	if (a->base == NULL || a->size - a->kept - a->used < size)
+		return NULL;
+	a->kept += size;
+	return a->base + a->size - a->kept;
+}
+
+
+/* free per-state 'block' of 'osize' bytes */
+static void keptfree(Arena *a, void *block, size_t osize) {
+	if ((byte *)block == a->base + a->size - a->kept) /* lowest block ? */
+		a->kept -= arenasize(osize);
+	/* else reclaimed by 'tight_setarena' */
+}
+
+
+/* free arena 'block' of 'osize' bytes */
+static void arenafree(Arena *a, void *block, size_t osize) {
+	osize = arenasize(osize);
+	if ((byte *)block + osize == a->base + a->used) /* top block ? */
+		a->used -= osize;
+	else if (osize <= ARENASMALL) { /* keep for reuse */
+		*(void **)block = a->freelist[osize / ARENAALIGN - 1];
+		a->freelist[osize / ARENAALIGN - 1] = block;
+	} /* else reclaimed by 'tightA_resetarena' */
+}
+
+
+/* 
+ * Enable or disable serving allocations from arena, returns previous
+ * setting; used for memory that must outlive the protected call.
+ */
+int tightA_usearena(tight_State *ts, int on) {
+	int old = ts->arena.on;
+	ts->arena.on = (on && ts->arena.base != NULL);
+	return old;
+}
+
+
+/* release all arena allocations (O(1)), per-state buffers are kept */
+void tightA_resetarena(tight_State *ts) {
+	Arena *a = &ts->arena;
+	a->used = 0;
+	a->spilled = 0;
+	memset(a->freelist, 0, sizeof(a->freelist));
+}
+
+
+TIGHT_API int tight_setarena(tight_State *ts, size_t size) {
+	Arena *a = &ts->arena;
+	t_assert(ts->errjmp == NULL);
+	tightS_freehufftree(ts);
+	ts->htree = NULL; /* its nodes are in cache */
+	tightA_freecache(ts); /* might be in arena */
+	if (a->base) {
+		ts->frealloc(a->base, ts->ud, a->size, 0);
+		a->base = NULL;
+		a->size = 0;
+	}
+	a->kept = 0;
+	tightA_resetarena(ts);
+	if (size > 0) {
+		size = arenasize(size);
+		a->base = ts->frealloc(NULL, ts->ud, 0, size);
+		if (t_unlikely(a->base == NULL))
+			return TIGHT_ERRMEM;
+		a->size = size;
+	}
+	return TIGHT_OK;
+}
+
+
+
+/*--------------------------------------------------------------------------
+ * Cache
+ *-------------------------------------------------------------------------- */
+
+/* 
+ * Allocate per-state buffer of 'size' bytes (it outlives the call),
+ * from the end of arena if it fits there.
+ */
+static void *cachemalloc(tight_State *ts, size_t size) {
+	void *block = keptmalloc(&ts->arena, size);
+	if (block == NULL) {
+		int arena = tightA_usearena(ts, 0);
+		block = tightA_malloc(ts, size);
+		tightA_usearena(ts, arena);
+	}
+	return block;
+}
+
+
+/* 
+ * Get per-state buffer of 'size' bytes in 'slot'; buffer is zeroed
+ * when allocated, afterwards it holds whatever the last call left in it.
+ */
+void *tightA_cached(tight_State *ts, int slot, size_t size) {
+	CacheMem *c = &ts->cache[slot];
+	t_assert(0 <= slot && slot < NCACHE);
+	if (t_unlikely(c->size != size)) {
+		if (c->mem) {
+			tightA_free(ts, c->mem, c->size);
+			c->mem = NULL;
+			c->size = 0;
+		}
+		c->mem = cachemalloc(ts, size);
+		memset(c->mem, 0, size);
+		c->size = size;
+	}
+	return c->mem;
+}
+
+
+/*
+ * Get I/O buffer of (at least) 'size' bytes in cache 'slot', aligned
+ * to 'BUFFALIGN' or to 'HUGEPAGESIZE' (and advised to be backed by
+ * huge pages) if it is that large; contents are not cleared and the
+ * buffer is only reallocated when it has to grow.
+ */
+byte *tightA_cachedbuffer(tight_State *ts, int slot, size_t size) {
+	CacheMem *c = &ts->cache[slot];
+	size_t align = (size >= HUGEPAGESIZE ? HUGEPAGESIZE : BUFFALIGN);
+	t_assert(0 <= slot && slot < NCACHE);
+	if (t_unlikely(c->mem == NULL || (byte *)c->mem + c->size < c->aligned + size ||
+				   ((uintptr_t)c->aligned & (align - 1)) != 0)) {
+		if (c->mem) {
+			tightA_free(ts, c->mem, c->size);
+			c->mem = NULL;
+			c->size = 0;
+		}
+		c->mem = cachemalloc(ts, size + align - 1);
+		c->size = size + align - 1;
+		c->aligned = (byte *)(((uintptr_t)c->mem + align - 1) & ~(uintptr_t)(align - 1));
+#if defined(MADV_HUGEPAGE)
+		if (align == HUGEPAGESIZE) /* hint only, errors are ignored */
+			madvise(c->aligned, size & ~(HUGEPAGESIZE - 1), MADV_HUGEPAGE);
+#endif
+	}
+	return c->aligned;
+}
+
+
+/* free all per-state buffers */
+void tightA_freecache(tight_State *ts) {
+	for (int i = 0; i < NCACHE; i++) {
+		if (ts->cache[i].mem)
+			tightA_free(ts, ts->cache[i].mem, ts->cache[i].size);
+		ts->cache[i].mem = NULL;
+		ts->cache[i].size = 0;
+		ts->cache[i].aligned = NULL;
+	}
+}
+
+
+
+/*--------------------------------------------------------------------------
+ * Allocation
+ *-------------------------------------------------------------------------- */
+
 /* realloc */
 void *tightA_realloc(tight_State *ts, void *block, size_t osize, size_t nsize) {
+	Arena *a = &ts->arena;
+
+	t_assert(nsize > 0);
+	if (block == NULL)
+		return tightA_malloc(ts, nsize);
+	t_assert(!inkept(a, block));
+	if (inarena(a, block)) {
+		size_t os = arenasize(osize), ns = arenasize(nsize);
+		void *nblock;
+		if ((byte *)block + os == a->base + a->used &&
+				ns <= a->size - a->kept - (a->used - os)) { /* grow/shrink top block */
+			a->used += ns - os;
+			return block;
+		}
+		nblock = tightA_malloc(ts, nsize);
+		memcpy(nblock, block, (osize < nsize ? osize : nsize));
+		arenafree(a, block, osize);
+		return nblock;
+	}
+	tightS_count(ts, allocs, 1);
+	ts->arena.spilled += (ts->arena.base != NULL);
 	block = ts->frealloc(block, ts->ud, osize, nsize);
 	if (t_unlikely(block == NULL))
 		tightS_throw(ts, TIGHT_ERRMEM);
@@ -41,7 +267,13 @@ void *tightA_realloc(tight_State *ts, void *block, size_t osize, size_t nsize) {
 
 /* malloc */
 void *tightA_malloc(tight_State *ts, size_t size) {
-	void *block = ts->frealloc(NULL, ts->ud, 0, size);
+	void *block;
+	if (ts->arena.on &&
+			t_likely((block = arenamalloc(&ts->arena, size)) != NULL))
+		return block;
+	ts->arena.spilled += (ts->arena.base != NULL);
+	block = ts->frealloc(NULL, ts->ud, 0, size);
+	tightS_count(ts, allocs, 1);
 	if (t_unlikely(block == NULL))
 		tightS_throw(ts, TIGHT_ERRMEM);
 	return block;
@@ -50,6 +282,14 @@ void *tightA_malloc(tight_State *ts, size_t size) {
 
 /* free */
 void tightA_free(tight_State *ts, void *block, size_t osize) {
+	if (inkept(&ts->arena, block)) {
+		keptfree(&ts->arena, block, osize);
+		return;
+	} else if (inarena(&ts->arena, block)) {
+		arenafree(&ts->arena, block, osize);
+		return;
+	}
+	tightS_count(ts, frees, 1);
 	ts->frealloc(block, ts->ud, osize, 0);
 }
 
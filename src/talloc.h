@@ -23,6 +23,68 @@
 #define updatetm(tm,p,s)		((tm)->mem = (p), (tm)->size = (s))
 
 
+/* alignment of arena allocations */
+#define ARENAALIGN		16
+
+/* freed arena blocks up to this size are kept in free lists */
+#define ARENASMALL		256
+
+/* number of arena free lists (one for each 'ARENAALIGN' size class) */
+#define ARENACLASSES	(ARENASMALL / ARENAALIGN)
+
+
+/* 
+ * Arena, single block sized once with 'tight_setarena'; during protected
+ * calls all allocations are bumped from it and it is reset at the end of
+ * the call (or on error). Freed small blocks (tree nodes, 'TempMem') are
+ * reused from free lists, top block is popped and other freed blocks are
+ * only reclaimed by the reset. Per-state buffers (cache slots) are carved
+ * downward from the end of 'base' and survive resets; only the lowest of
+ * them is reclaimed when freed. In case arena is full, allocation falls
+ * back to 'frealloc'.
+ */
+typedef struct Arena {
+	byte *base; /* memory block, NULL if arena is not used */
+	size_t size; /* size of 'base' */
+	size_t used; /* bytes in use from the start of 'base' */
+	size_t kept; /* bytes of per-state buffers at the end of 'base' */
+	void *freelist[ARENACLASSES]; /* freed small blocks by size class */
+	size_t spilled; /* 'frealloc' allocations since the last reset */
+	byte on; /* true if allocations are served from arena */
+} Arena;
+
+
+/* 
+ * Slots of per-state buffers; these are allocated on first use,
+ * kept across calls (and 'tight_reset') and freed by 'tight_free'.
+ */
+#define CACHE_DECTABLES		0	/* decoder tables */
+#define CACHE_DECFSE		1	/* decoder FSE scratch */
+#define CACHE_ORDER1		2	/* encoder order-1 statistics */
+#define CACHE_ENCFSE		3	/* encoder FSE output */
+#define CACHE_RBUF			4	/* 'BuffReader' buffer */
+#define CACHE_WBUF			5	/* 'BuffWriter' buffer */
+#define CACHE_MD5BUF		6	/* 'tightB_genMD5' reader buffer */
+#define CACHE_REFBUF		7	/* reference window or reader buffer (delta) */
+#define CACHE_HTREE			8	/* nodes of cached header tree */
+#define NCACHE				9
+
+
+/* alignment of I/O buffers */
+#define BUFFALIGN		4096
+
+/* I/O buffers this large are aligned to and advised to use huge pages */
+#define HUGEPAGESIZE	((size_t)2 << 20)
+
+
+/* per-state buffer */
+typedef struct CacheMem {
+	void *mem;
+	size_t size; /* size of 'mem' */
+	byte *aligned; /* aligned start of 'mem' (I/O buffers) */
+} CacheMem;
+
+
 /*
  * Used when allocating in order to properly
  * cleanup temporary memory in case of memory errors.
@@ -43,6 +105,12 @@ TIGHT_FUNC void tightA_free(tight_State *ts, void *block, size_t osize);
 TIGHT_FUNC void *tightA_realloc(tight_State *ts, void *block, size_t osize,
 								size_t nsize);
 
+TIGHT_FUNC void *tightA_cached(tight_State *ts, int slot, size_t size);
+TIGHT_FUNC byte *tightA_cachedbuffer(tight_State *ts, int slot, size_t size);
+TIGHT_FUNC void tightA_freecache(tight_State *ts);
+TIGHT_FUNC int tightA_usearena(tight_State *ts, int on);
+TIGHT_FUNC void tightA_resetarena(tight_State *ts);
+
 TIGHT_FUNC void *tightA_growarray_(tight_State *ts, void *block, uint *sizep,
 								   uint limit, uint nelems, uint elemsize, 
 								   const char *what);
@@ -3,14 +3,20 @@
  * Refer to 'tight.h' for license details.
  *****************************************/
 
+#define _GNU_SOURCE /* 'copy_file_range' and 'splice' */
+
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <memory.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "talloc.h"
 #include "tbuffer.h"
 #include "tdebug.h"
 #include "tmd5.h"
+#include "tpipe.h"
 
 
 #define ensurebuf(ts,b,n) \
@@ -28,6 +34,15 @@
 #define MINBUFSIZE			64
 
 
+/* methods of 'tightB_copy' (kernel copy is tried in this order) */
+#define COPY_RANGE			0	/* 'copy_file_range' */
+#define COPY_SPLICE			1	/* 'splice' (one side is a pipe) */
+#define COPY_BUFFERS		2	/* through 'br' and 'bw' buffers */
+
+/* fill after kernel copy only reads this much (next block header) */
+#define PEEKSIZE			4096
+
+
 
 /*--------------------------------------------------------------------------
  * Buffer
@@ -120,18 +135,204 @@ void tightB_free(tight_State *ts, Buffer *buf) {
 
 
 
+/*--------------------------------------------------------------------------
+ * Buffer sizes
+ *-------------------------------------------------------------------------- */
+
+/* clamp explicit buffer size, 0 stays 0 (automatic) */
+static size_t clampsize(size_t size) {
+	if (size == 0)
+		return 0;
+	if (size < TIGHT_MINBUFFSIZE)
+		return TIGHT_MINBUFFSIZE;
+	return (size > TIGHT_MAXBUFFSIZE ? TIGHT_MAXBUFFSIZE : size);
+}
+
+
+TIGHT_API void tight_setbuffers(tight_State *ts, size_t rsize, size_t wsize) {
+	ts->rbuffsize = clampsize(rsize);
+	ts->wbuffsize = clampsize(wsize);
+}
+
+
+TIGHT_API void tight_setpipelined(tight_State *ts, int engine) {
+	ts->pipelined = (engine == TIGHT_PIPE_URING ? TIGHT_PIPE_URING :
+					 engine != TIGHT_PIPE_OFF);
+}
+
+
+TIGHT_API void tight_setiopolicy(tight_State *ts, int policy) {
+	ts->iopolicy = policy & (TIGHT_IO_DONTNEED | TIGHT_IO_WRITEBACK |
+							 TIGHT_IO_DIRECT);
+}
+
+
+/* 
+ * Size of I/O buffer for 'fd', 'size' if it is not 0; otherwise it is
+ * 'def' or 16 blocks of preferred I/O size of 'fd' if that is larger,
+ * doubled up to 'TIGHT_MAXAUTOBUFF' while it is less than 1/64 of the
+ * size of 'sizefd' (if that is a regular file). In case 'shrink' is
+ * true, files smaller than that get a buffer just large enough to
+ * hold them; blocks never span more than a buffer, so this does not
+ * change the output.
+ */
+static size_t buffsize(int fd, int sizefd, size_t size, size_t def, int shrink) {
+	struct stat st;
+	size_t n = def;
+
+	if (size != 0)
+		return size;
+	if (fstat(fd, &st) == 0 && st.st_blksize > 0 && (size_t)st.st_blksize > n / 16)
+		n = ((size_t)st.st_blksize > TIGHT_MAXAUTOBUFF / 16 ? TIGHT_MAXAUTOBUFF :
+			 (size_t)st.st_blksize * 16);
+	if (sizefd >= 0 && fstat(sizefd, &st) == 0 && S_ISREG(st.st_mode)) {
+		size_t fsize = (size_t)st.st_size;
+		if (shrink && fsize < n) {
+			size_t small = TIGHT_MINBUFFSIZE;
+			while (small < fsize)
+				small <<= 1;
+			n = (small < n ? small : n);
+		}
+		while (n < TIGHT_MAXAUTOBUFF && n < fsize / 64)
+			n <<= 1;
+	}
+	return n;
+}
+
+
+
+/*--------------------------------------------------------------------------
+ * File descriptor I/O
+ *-------------------------------------------------------------------------- */
+
+/* built-in I/O callbacks, 'ud' points to the file descriptor */
+static long fdread(void *ud, void *buf, size_t n) {
+	return read(*(int *)ud, buf, n);
+}
+
+
+static long fdwrite(void *ud, const void *buf, size_t n) {
+	return write(*(int *)ud, buf, n);
+}
+
+
+static long long fdseek(void *ud, long long off, int whence) {
+	return lseek(*(int *)ud, off, whence);
+}
+
+
+static const tight_IO fdio = { fdread, fdwrite, fdseek, NULL, NULL, NULL };
+
+
+/* 
+ * Set I/O callbacks of reader or writer; 'fd' gets the built-in ones,
+ * -1 gets the callbacks of 'tight_setio' (if any).
+ */
+#define setio(ts,b,fd) \
+	((fd) < 0 && (ts)->io ? ((b)->io = (ts)->io, (b)->ud = (ts)->ioud) : \
+							((b)->io = &fdio, (b)->ud = &(b)->fd))
+
+
+
 /*--------------------------------------------------------------------------
  * BuffReader
  *-------------------------------------------------------------------------- */
 
-/* initialize buff reader */
-void tightB_initbr(BuffReader *br, tight_State *ts, int fd) {
+/* initialize buff reader 'br' with buffer in cache 'slot' */
+static void initreader(BuffReader *br, tight_State *ts, int fd, int slot) {
 	br->ts = ts;
+	br->size = buffsize(fd, fd, ts->rbuffsize, TIGHT_RBUFFSIZE, 1);
+	br->buf = tightA_cachedbuffer(ts, slot, br->size);
 	br->current = br->buf;
 	br->n = 0;
 	br->validbits = 0;
 	br->tmpbuf = 0;
 	br->fd = fd;
+	setio(ts, br, fd);
+	br->pos = 0;
+	br->chunk = NULL;
+	br->chunkn = 0;
+	br->md5 = NULL;
+	br->mark = NULL;
+	br->pipe = NULL;
+	br->peek = 0;
+	tightC_init(&br->cache, -1, TIGHT_IO_CACHED, 0, 0);
+	br->cacheoff = 0;
+}
+
+
+/* 
+ * Initialize buff reader; buffer is kept in the state, so only
+ * a single reader can be in use at a time.
+ */
+void tightB_initbr(BuffReader *br, tight_State *ts, int fd) {
+	initreader(br, ts, fd, CACHE_RBUF);
+}
+
+
+/* initialize reader of reference 'fd' (next to the one of input) */
+void tightB_initrefbr(BuffReader *br, tight_State *ts, int fd) {
+	initreader(br, ts, fd, CACHE_REFBUF);
+}
+
+
+/* get the next chunk lent by 'io->readbuf' (empty on EOF) */
+static void nextchunk(BuffReader *br) {
+	const void *p = NULL;
+	int phase = tightS_phase(br->ts, TIGHT_PHASE_READ);
+	long n = br->io->readbuf(br->ud, &p);
+	tightS_phase(br->ts, phase);
+	if (t_unlikely(n < 0))
+		tightD_errnoerror(br->ts, "read");
+	br->chunk = (const byte *)p;
+	br->chunkn = n;
+	br->pos += n;
+	tightS_count(br->ts, reads, 1);
+	tightS_count(br->ts, bytesin, n);
+}
+
+
+/* 'read' from 'io', lent chunks (copying them) or read-ahead pipe */
+static ssize_t rawread(BuffReader *br, byte *out, size_t n) {
+	ssize_t readn;
+	if (br->pipe)
+		readn = tightP_read(br->pipe, out, n);
+	else if (br->io->readbuf) {
+		if (br->chunkn == 0)
+			nextchunk(br);
+		readn = (br->chunkn < n ? br->chunkn : n);
+		if (readn > 0)
+			memcpy(out, br->chunk, readn);
+		br->chunk += readn;
+		br->chunkn -= readn;
+		return readn; /* counted by 'nextchunk' */
+	} else {
+		readn = br->io->read(br->ud, out, n);
+		if (br->fd >= 0)
+			tightS_count(br->ts, syscalls, 1);
+		if (readn > 0)
+			br->pos += readn;
+	}
+	if (t_unlikely(readn < 0))
+		tightD_errnoerror(br->ts, "read");
+	if (br->cache.fd >= 0) { /* without pipe */
+		br->cacheoff += readn;
+		tightC_advance(&br->cache, br->cacheoff);
+	}
+	tightS_count(br->ts, reads, 1);
+	tightS_count(br->ts, bytesin, readn);
+	return readn;
+}
+
+
+/* add bytes consumed since the last fill to 'md5' */
+static void digest(BuffReader *br) {
+	t_assert(br->mark <= br->current);
+	if (br->current > br->mark) {
+		int phase = tightS_phase(br->ts, TIGHT_PHASE_MD5);
+		tight5_update(br->md5, (byte *)br->mark, br->current - br->mark);
+		tightS_phase(br->ts, phase);
+	}
 }
 
 
@@ -141,29 +342,50 @@ void tightB_initbr(BuffReader *br, tight_State *ts, int fd) {
  * much as possible.
  */
 int tightB_brfill(BuffReader *br, ulong *n) {
-	size_t nbytes = sizeof(br->buf);
+	size_t nbytes = br->size;
 
-	t_assert(sizeof(br->buf) <= UINT_MAX);
+	t_assert(br->size <= UINT_MAX);
 	br->n = br->n + (br->n < 0); /* in case buffer is empty */
 	t_assert(br->n >= 0);
+	if (t_unlikely(br->md5 != NULL))
+		digest(br);
 	if (n) {
 		if ((ulong)br->n >= *n) 
 			goto ret;
 		nbytes = (*n > nbytes ? nbytes : *n);
+	} else if (br->peek && nbytes > PEEKSIZE) /* next block may be stored */
+		nbytes = PEEKSIZE;
+	br->peek = 0;
+	if (br->io->readbuf && br->n == 0) { /* use lent chunk in place */
+		if (br->chunkn == 0)
+			nextchunk(br);
+		br->current = (byte *)br->chunk;
+		br->n = (br->chunkn < nbytes ? br->chunkn : nbytes);
+		br->chunk += br->n;
+		br->chunkn -= br->n;
+		if (n) *n = br->n;
+		if (br->n == 0) { /* EOF ? */
+			br->mark = br->current;
+			return TIGHTEOF;
+		}
+		goto ret;
 	}
 	nbytes -= br->n;
 	memmove(br->buf, br->current, br->n);
 	br->current = &br->buf[br->n - (br->n > 0)];
-	ssize_t readn = read(br->fd, br->current, nbytes);
-	if (t_unlikely(readn < 0))
-		tightD_errnoerror(br->ts, "read");
+	int phase = tightS_phase(br->ts, TIGHT_PHASE_READ);
+	ssize_t readn = rawread(br, br->current, nbytes);
+	tightS_phase(br->ts, phase);
 	br->n += readn;
 	t_assert(br->n <= (ssize_t)nbytes);
-	t_assert(br->n <= (ssize_t)sizeof(br->buf));
+	t_assert(br->n <= (ssize_t)br->size);
 	if (n) *n = br->n;
-	if (br->n == 0) /* EOF ? */
+	if (br->n == 0) { /* EOF ? */
+		br->mark = br->current;
 		return TIGHTEOF;
+	}
 ret:
+	br->mark = br->current;
 	br->n--;
 	return *br->current++;
 }
@@ -208,20 +430,265 @@ int tightB_readpending(BuffReader *br, int *out) {
 
 /* get adjusted offset */
 off_t tightB_offsetreader(BuffReader *br) {
-	off_t n = lseek(br->fd, 0, SEEK_CUR);
+	if (br->pipe) /* 'fd' is ahead of what was consumed */
+		return br->pipe->base + br->pipe->bytes - br->n;
+	if (br->fd < 0) /* callbacks need not seek */
+		return br->pos - (br->n > 0 ? br->n : 0) - br->chunkn;
+	off_t n = br->io->seek(br->ud, 0, SEEK_CUR);
+	tightS_count(br->ts, seeks, 1);
 	if (t_unlikely(n < 0))
 		tightD_errnoerror(br->ts, "lseek (input file)");
 	return n - br->n;
 }
 
 
+/* move input of 'br' (like 'lseek'), unread bytes are dropped */
+off_t tightB_seekreader(BuffReader *br, off_t off, int whence) {
+	off_t res = -1;
+
+	t_assert(br->pipe == NULL && br->md5 == NULL);
+	tightS_count(br->ts, seeks, 1);
+	if (br->io->seek)
+		res = br->io->seek(br->ud, off, whence);
+	else
+		errno = ESPIPE;
+	if (t_unlikely(res < 0))
+		tightD_errnoerror(br->ts, "lseek (input file)");
+	br->pos = res;
+	br->chunkn = 0;
+	br->current = br->buf;
+	br->n = 0;
+	br->validbits = 0;
+	br->tmpbuf = 0;
+	br->peek = 0;
+	return res;
+}
+
+
+/* start digest of bytes consumed with 'tightB_brgetc' into 'md5' */
+void tightB_startdigest(BuffReader *br, MD5ctx *md5) {
+	br->md5 = md5;
+	br->mark = br->current;
+}
+
+
+/* add the rest of consumed bytes to digest and stop it */
+void tightB_enddigest(BuffReader *br) {
+	digest(br);
+	br->md5 = NULL;
+}
+
+
+/* 
+ * Get the next (up to) '*n' unread bytes as a contiguous block
+ * and consume them; '*n' is set to the number of bytes in the
+ * returned block, which is less than requested only on EOF.
+ */
+const byte *tightB_brblock(BuffReader *br, ulong *n) {
+	const byte *block;
+	ssize_t readn;
+
+	t_assert(*n <= br->size && br->md5 == NULL);
+	if (br->n < 0) /* buffer is empty ? */
+		br->n = 0;
+	if (br->io->readbuf && br->n == 0) { /* block of a lent chunk ? */
+		if (br->chunkn == 0)
+			nextchunk(br);
+		if (br->chunkn >= *n || br->chunkn == 0) { /* in place */
+			block = br->chunk;
+			*n = (br->chunkn < *n ? br->chunkn : *n);
+			br->chunk += *n;
+			br->chunkn -= *n;
+			return block;
+		}
+	}
+	if ((ulong)br->n < *n) { /* need more ? */
+		int phase = tightS_phase(br->ts, TIGHT_PHASE_READ);
+		memmove(br->buf, br->current, br->n);
+		br->current = br->buf;
+		do {
+			readn = rawread(br, &br->buf[br->n], br->size - br->n);
+			br->n += readn;
+		} while (readn > 0 && (ulong)br->n < *n);
+		tightS_phase(br->ts, phase);
+		if ((ulong)br->n < *n) /* EOF ? */
+			*n = br->n;
+	}
+	block = br->current;
+	br->current += *n;
+	br->n -= *n;
+	return block;
+}
+
+
+/*
+ * Give back the last 'n' bytes of the block ending at 'end' returned by
+ * the latest 'tightB_brblock', they are returned again by the next one.
+ */
+void tightB_unread(BuffReader *br, const byte *end, ulong n) {
+	if (end == br->chunk) { /* block of a lent chunk (in place) */
+		br->chunk -= n;
+		br->chunkn += n;
+	} else {
+		t_assert(end == br->current);
+		br->current -= n;
+		br->n += n;
+	}
+}
+
+
+/* 
+ * Copy the next (up to) 'n' unread bytes into 'out', unlike
+ * 'tightB_brblock' 'n' can be larger than the buffer; returns the
+ * number of copied bytes, which is less than 'n' only on EOF.
+ */
+size_t tightB_brread(BuffReader *br, byte *out, size_t n) {
+	size_t total = 0;
+	while (total < n) {
+		ulong len = (n - total > br->size ? br->size : n - total);
+		const byte *p = tightB_brblock(br, &len);
+		if (len == 0) /* EOF ? */
+			break;
+		memcpy(out + total, p, len);
+		total += len;
+	}
+	return total;
+}
+
+
+/* bytes from the current position of 'br' to the end of (regular) file */
+off_t tightB_readerleft(BuffReader *br) {
+	struct stat st;
+	if (fstat(br->fd, &st) != 0 || !S_ISREG(st.st_mode))
+		return 0;
+	off_t left = st.st_size - tightB_offsetreader(br);
+	return (left > 0 ? left : 0);
+}
+
+
+/*
+ * Find the first hole of 'fd' at or after 'pos' (offset of the next
+ * unread byte of 'br') in a file of 'size' bytes; hole is stored into
+ * 'start' - 'end'. Returns false if there are no more holes or the
+ * file system does not report them, offset of 'fd' is kept.
+ */
+int tightB_nexthole(BuffReader *br, off_t pos, off_t size, off_t *start,
+					off_t *end)
+{
+#if defined(SEEK_HOLE) && defined(SEEK_DATA)
+	off_t cur = pos + (br->n > 0 ? br->n : 0);
+	off_t hole = lseek(br->fd, pos, SEEK_HOLE);
+	off_t data = (hole >= 0 ? lseek(br->fd, hole, SEEK_DATA) : -1);
+	int err = errno;
+
+	t_assert(br->pipe == NULL);
+	tightS_count(br->ts, seeks, 3);
+	if (t_unlikely(lseek(br->fd, cur, SEEK_SET) < 0))
+		tightD_errnoerror(br->ts, "lseek (input file)");
+	if (hole < 0 || hole >= size) /* only the implicit hole at EOF ? */
+		return 0;
+	if (data < 0) { /* hole up to EOF ? */
+		if (err != ENXIO)
+			return 0;
+		data = size;
+	}
+	*start = hole;
+	*end = (data < size ? data : size);
+	return 1;
+#else
+	(void)br; (void)pos; (void)size; (void)start; (void)end;
+	return 0;
+#endif
+}
+
+
+/* consume the next 'n' bytes of 'br' without reading them */
+void tightB_skip(BuffReader *br, size_t n) {
+	size_t len;
+
+	t_assert(br->pipe == NULL && br->fd >= 0);
+	if (br->n < 0) /* buffer is empty ? */
+		br->n = 0;
+	len = ((size_t)br->n < n ? (size_t)br->n : n);
+	br->current += len;
+	br->n -= len;
+	if ((n -= len) > 0) {
+		tightS_count(br->ts, seeks, 1);
+		if (t_unlikely(lseek(br->fd, n, SEEK_CUR) < 0))
+			tightD_errnoerror(br->ts, "lseek (input file)");
+		br->cacheoff += n;
+	}
+}
+
+
+/* true if 'fd' is a regular file large enough for pipe (or I/O policy) */
+static int bigfile(int fd) {
+	struct stat st;
+	return (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+			st.st_size > PIPEMINSIZE);
+}
+
+
+/* true if pipe is wanted for a file of size of 'fd' */
+static int pipeworth(tight_State *ts, int fd) {
+	return ((ts->pipelined || (ts->iopolicy & TIGHT_IO_DIRECT)) && bigfile(fd));
+}
+
+
+/*
+ * Start page cache policy 'pc' of 'fd' (for I/O without pipe, which
+ * does it on its own) at the current offset, stored into '*off'.
+ */
+static void startcache(tight_State *ts, PageCache *pc, int fd, int sizefd,
+					   int write, off_t *off)
+{
+	if (!(ts->iopolicy & (TIGHT_IO_DONTNEED | TIGHT_IO_WRITEBACK)) ||
+			!bigfile(sizefd))
+		return;
+	*off = lseek(fd, 0, SEEK_CUR);
+	tightS_count(ts, seeks, 1);
+	if (*off >= 0)
+		tightC_init(pc, fd, ts->iopolicy, write, *off);
+}
+
+
+/* 
+ * Start reading 'fd' ahead in a thread (if enabled and the input is
+ * large enough); 'br' then must not be used with 'lseek'.
+ */
+void tightB_readahead(BuffReader *br) {
+	tight_State *ts = br->ts;
+	t_assert(br->pipe == NULL && ts->rpipe == NULL);
+	if (pipeworth(ts, br->fd))
+		br->pipe = ts->rpipe = tightP_open(ts, br->fd, br->size, 0);
+	if (br->pipe == NULL)
+		startcache(ts, &br->cache, br->fd, br->fd, 0, &br->cacheoff);
+}
+
+
+/* stop read-ahead, 'fd' is left at the offset of the unread bytes in 'buf' */
+void tightB_endreadahead(BuffReader *br) {
+	tight_State *ts = br->ts;
+	tightC_finish(&br->cache, br->cacheoff);
+	if (br->pipe) {
+		off_t off = br->pipe->base + br->pipe->bytes;
+		tightP_close(ts, br->pipe, 1);
+		br->pipe = ts->rpipe = NULL;
+		tightS_count(ts, seeks, 1);
+		if (t_unlikely(lseek(br->fd, off, SEEK_SET) < 0))
+			tightD_errnoerror(ts, "lseek (input file)");
+	}
+}
+
+
 /* generate MD5 digest and store it into 'out' */
 void tightB_genMD5(tight_State *ts, ulong size, int fd, byte *out) {
 	MD5ctx ctx;
 	BuffReader br;
+	int phase = tightS_phase(ts, TIGHT_PHASE_MD5);
 
 	/* 'fd' is already rewinded to start of data */
-	tightB_initbr(&br, ts, fd);
+	initreader(&br, ts, fd, CACHE_MD5BUF); /* 'BuffReader' can be in use */
 	tight5_init(&ctx);
 	do {
 		ulong n = size;
@@ -233,6 +700,7 @@ void tightB_genMD5(tight_State *ts, ulong size, int fd, byte *out) {
 	t_assert(br.n == 0);
 	t_assert(size == 0);
 	tight5_final(&ctx, out);
+	tightS_phase(ts, phase);
 }
 
 
@@ -241,32 +709,262 @@ void tightB_genMD5(tight_State *ts, ulong size, int fd, byte *out) {
  * BuffWriter
  *-------------------------------------------------------------------------- */
 
-/* initialize buff writer */
+/* 
+ * Initialize buff writer; buffer is kept in the state, so only
+ * a single writer can be in use at a time. With 'io->writebuf'
+ * buffers are lent by callbacks when bytes are written ('makeroom').
+ */
 void tightB_initbw(BuffWriter *bw, tight_State *ts, int fd) {
 	bw->ts = ts;
+	bw->fd = fd;
+	setio(ts, bw, fd);
+	if (bw->io->writebuf) {
+		bw->size = 0;
+		bw->buf = NULL;
+	} else { /* output size is not known, size of input file is the hint */
+		bw->size = buffsize(fd, ts->rfd, ts->wbuffsize, TIGHT_WBUFFSIZE, 0);
+		bw->buf = tightA_cachedbuffer(ts, CACHE_WBUF, bw->size);
+	}
 	bw->len = 0;
 	bw->validbits = 0;
 	bw->tmpbuf = 0;
-	bw->fd = fd;
+	bw->pos = 0;
+	bw->md5 = NULL;
+	bw->mark = 0;
+	bw->skip = 0;
+	bw->limit = SIZE_MAX;
+	bw->pipe = NULL;
+	bw->usersize = bw->size;
+	tightC_init(&bw->cache, -1, TIGHT_IO_CACHED, 1, 0);
+	bw->cacheoff = 0;
+	bw->copy = (fd >= 0 ? COPY_RANGE : COPY_BUFFERS);
+	bw->hole = 0;
 }
 
 
-/* flush 'buf' into the current 'wfd' */
-void tightB_writefile(BuffWriter *bw) {
-	if (t_unlikely(bw->len > 0 && write(bw->fd, bw->buf, bw->len) < 0))
+/* write 'n' zero bytes into 'fd' of 'bw' */
+static void writezerobytes(BuffWriter *bw, off_t n) {
+	static const byte zeros[4096];
+	while (n > 0) {
+		size_t len = (n < (off_t)sizeof(zeros) ? (size_t)n : sizeof(zeros));
+		ssize_t res = write(bw->fd, zeros, len);
+		tightS_count(bw->ts, syscalls, 1);
+		if (t_unlikely(res < 0))
+			tightD_errnoerror(bw->ts, "write");
+		n -= res;
+	}
+}
+
+
+/*
+ * Write pending 'hole' by moving the offset of 'fd' past it; bytes of
+ * the file in its range are punched out (or overwritten with zeros),
+ * in case 'last' is true (no bytes follow) file is extended to its
+ * end. Files that cannot have holes get zero bytes.
+ */
+static void writehole(BuffWriter *bw, int last) {
+	off_t n = bw->hole;
+	off_t off = lseek(bw->fd, 0, SEEK_CUR);
+	struct stat st;
+
+	bw->hole = 0;
+	tightS_count(bw->ts, seeks, 1);
+	if (off < 0 || fstat(bw->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+		writezerobytes(bw, n);
+		return;
+	}
+	if (off < st.st_size) { /* existing bytes must read as zeros */
+		off_t len = (st.st_size - off < n ? st.st_size - off : n);
+#if defined(FALLOC_FL_PUNCH_HOLE)
+		if (fallocate(bw->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					  off, len) != 0)
+#endif
+		{
+			writezerobytes(bw, len); /* moves 'off' */
+			off += len;
+			n -= len;
+		}
+	}
+	tightS_count(bw->ts, seeks, 1);
+	if (t_unlikely(lseek(bw->fd, off + n, SEEK_SET) < 0))
+		tightD_errnoerror(bw->ts, "lseek (output file)");
+	if (last && off + n > st.st_size && ftruncate(bw->fd, off + n) < 0)
+		tightD_errnoerror(bw->ts, "ftruncate");
+	if (bw->cache.fd >= 0) {
+		bw->cacheoff += n;
+		tightC_advance(&bw->cache, bw->cacheoff);
+	}
+}
+
+
+/* write all 'n' bytes of 'p' with 'io->write' */
+static void writeall(BuffWriter *bw, const byte *p, size_t n) {
+	while (n > 0) {
+		long res = bw->io->write(bw->ud, p, n);
+		if (bw->fd >= 0)
+			tightS_count(bw->ts, syscalls, 1);
+		if (t_unlikely(res <= 0)) {
+			if (res == 0) /* no progress */
+				errno = EIO;
+			tightD_errnoerror(bw->ts, "write");
+		}
+		p += res;
+		n -= res;
+	}
+}
+
+
+/* hand lent 'buf' back with 'n' bytes at 'p' being the output */
+static void commitbuf(BuffWriter *bw, const byte *p, size_t n) {
+	int phase = tightS_phase(bw->ts, TIGHT_PHASE_WRITE);
+	int res = bw->io->commit(bw->ud, p, n);
+	tightS_phase(bw->ts, phase);
+	bw->buf = NULL;
+	bw->size = 0;
+	if (t_unlikely(res < 0))
 		tightD_errnoerror(bw->ts, "write");
-	bw->len = 0;
+}
+
+
+/* 
+ * Add bytes put into 'buf' since the last digest to 'md5' (if any);
+ * without 'md5' they are just skipped, so a digest can start with
+ * the next byte.
+ */
+void tightB_digestwriter(BuffWriter *bw) {
+	if (bw->md5 && bw->len > bw->mark) {
+		int phase = tightS_phase(bw->ts, TIGHT_PHASE_MD5);
+		tight5_update(bw->md5, &bw->buf[bw->mark], bw->len - bw->mark);
+		tightS_phase(bw->ts, phase);
+	}
+	bw->mark = bw->len;
+}
+
+
+/* flush 'buf' into the current 'wfd' (honoring 'skip' and 'limit') */
+void tightB_writefile(BuffWriter *bw) {
+	const byte *p = bw->buf;
+	size_t n = bw->len;
+
+	tightB_digestwriter(bw); /* all of 'buf', skipped bytes too */
+	if (t_unlikely(bw->skip > 0)) { /* discard ? */
+		size_t skip = (bw->skip < n ? bw->skip : n);
+		bw->skip -= skip;
+		p += skip;
+		n -= skip;
+	}
+	if (n > bw->limit)
+		n = bw->limit;
+	bw->limit -= n;
+	if (bw->hole > 0) /* holes come before 'buf' */
+		writehole(bw, n == 0);
+	if (n > 0) {
+		int phase = tightS_phase(bw->ts, TIGHT_PHASE_WRITE);
+		if (bw->pipe) { /* hand 'buf' to the writer thread */
+			int err = tightP_write(bw->pipe, p - bw->buf, n);
+			bw->buf = tightP_writebuf(bw->pipe);
+			bw->size = bw->pipe->size;
+			if (t_unlikely(err != 0)) {
+				errno = err;
+				tightD_errnoerror(bw->ts, "write");
+			}
+		} else if (bw->io->writebuf == NULL) {
+			writeall(bw, p, n);
+			if (bw->cache.fd >= 0) {
+				bw->cacheoff += n;
+				tightC_advance(&bw->cache, bw->cacheoff);
+			}
+		}
+		tightS_phase(bw->ts, phase);
+		tightS_count(bw->ts, writes, 1);
+		tightS_count(bw->ts, bytesout, n);
+		bw->pos += n;
+	}
+	if (bw->io->writebuf && bw->len > 0) /* 'buf' is lent ? */
+		commitbuf(bw, p, n);
+	bw->len = bw->mark = 0;
+}
+
+
+/* flush full 'buf', so there is room for more bytes */
+static void makeroom(BuffWriter *bw) {
+	tightB_writefile(bw);
+	if (bw->buf == NULL) { /* get the next lent buffer */
+		void *p = NULL;
+		int phase = tightS_phase(bw->ts, TIGHT_PHASE_WRITE);
+		long n = bw->io->writebuf(bw->ud, &p);
+		tightS_phase(bw->ts, phase);
+		if (t_unlikely(n <= 0)) {
+			if (n == 0) /* no room */
+				errno = ENOBUFS;
+			tightD_errnoerror(bw->ts, "write");
+		}
+		bw->buf = (byte *)p;
+		bw->size = n;
+	}
 }
 
 
 /* write 'byte' into 'buf' */
 void tightB_writebyte(BuffWriter *bw, byte byte) {
-	if (t_unlikely(bw->len >= sizeof(bw->buf)))
-		tightB_writefile(bw); /* flush */
+	if (t_unlikely(bw->len >= bw->size))
+		makeroom(bw);
 	bw->buf[bw->len++] = byte;
 }
 
 
+/*
+ * Write 'n' zero bytes; unless output is pipelined or filtered (digest,
+ * 'skip'), they become a hole of 'fd' (see 'writehole').
+ */
+void tightB_writezeros(BuffWriter *bw, size_t n) {
+	static const byte zeros[4096];
+	if (bw->fd >= 0 && bw->pipe == NULL && bw->md5 == NULL &&
+			bw->skip == 0 &&
+			bw->limit - (bw->len < bw->limit ? bw->len : bw->limit) >= n) {
+		if (bw->len > 0)
+			tightB_writefile(bw); /* bytes before the hole */
+		bw->limit -= n;
+		bw->hole += n;
+		tightS_count(bw->ts, bytesout, n);
+		return;
+	}
+	while (n > 0) {
+		size_t len = (n < sizeof(zeros) ? n : sizeof(zeros));
+		tightB_writebytes(bw, zeros, len);
+		n -= len;
+	}
+}
+
+
+/* write 'n' bytes from 'p' into 'buf' */
+void tightB_writebytes(BuffWriter *bw, const byte *p, size_t n) {
+	while (n > 0) {
+		size_t avail = bw->size - bw->len;
+		if (avail == 0) {
+			makeroom(bw);
+			avail = bw->size;
+		}
+		if (avail > n)
+			avail = n;
+		memcpy(&bw->buf[bw->len], p, avail);
+		bw->len += avail;
+		p += avail;
+		n -= avail;
+	}
+}
+
+
+/* write 'n' as varint (7 bits per byte, least significant first) */
+void tightB_writevarint(BuffWriter *bw, size_t n) {
+	while (n >= 0x80) {
+		tightB_writebyte(bw, (n & 0x7f) | 0x80);
+		n >>= 7;
+	}
+	tightB_writebyte(bw, n);
+}
+
+
 /* write 'ushrt' into 'buf' */
 static inline void writeshort(BuffWriter *bw, ushrt shrt) {
 	tightB_writebyte(bw, shrt & 0xff);
@@ -311,13 +1009,167 @@ void tightB_writepending(BuffWriter *bw) {
 
 /* lseek for writer */
 off_t tightB_seekwriter(BuffWriter *bw, off_t off, int whence) {
-	off_t offset = lseek(bw->fd, off, whence);
+	if (bw->hole > 0)
+		writehole(bw, 1);
+	if (bw->pipe) {
+		if (whence == SEEK_CUR && off == 0) /* offset after queued bytes */
+			return bw->pipe->base + bw->pipe->bytes;
+		int err = tightP_sync(bw->pipe); /* 'fd' must not move under it */
+		if (t_unlikely(err != 0)) {
+			errno = err;
+			tightD_errnoerror(bw->ts, "write");
+		}
+	}
+	if (bw->fd < 0) { /* callbacks only write forward */
+		if (whence == SEEK_CUR && off == 0)
+			return bw->pos;
+		errno = ESPIPE;
+		tightD_errnoerror(bw->ts, "lseek (output file)");
+	}
+	off_t offset = bw->io->seek(bw->ud, off, whence);
+	tightS_count(bw->ts, seeks, 1);
 	if (t_unlikely(offset < 0))
 		tightD_errnoerror(bw->ts, "lseek (output file)");
+	if (bw->pipe) {
+		bw->pipe->base = offset;
+		bw->pipe->bytes = 0;
+	}
 	return offset;
 }
 
 
+/* 
+ * Write 'buf' in a thread from now on (if enabled and the input is
+ * large enough), pending bytes are flushed first.
+ */
+void tightB_writebehind(BuffWriter *bw) {
+	tight_State *ts = bw->ts;
+	t_assert(bw->pipe == NULL && ts->wpipe == NULL);
+	tightB_writefile(bw);
+	bw->usersize = bw->size;
+	if (pipeworth(ts, ts->rfd) &&
+			(bw->pipe = ts->wpipe = tightP_open(ts, bw->fd, bw->size, 1))) {
+		bw->buf = tightP_writebuf(bw->pipe);
+		bw->size = bw->pipe->first; /* rest of slots is block aligned */
+	} else
+		startcache(ts, &bw->cache, bw->fd, ts->rfd, 1, &bw->cacheoff);
+}
+
+
+/* flush 'buf' and wait until the writer thread (if any) has written all */
+void tightB_endwritebehind(BuffWriter *bw) {
+	tight_State *ts = bw->ts;
+	tightB_writefile(bw);
+	tightC_finish(&bw->cache, bw->cacheoff);
+	if (bw->pipe) {
+		int err = tightP_close(ts, bw->pipe, 0);
+		bw->pipe = ts->wpipe = NULL;
+		bw->size = bw->usersize;
+		bw->buf = tightA_cachedbuffer(ts, CACHE_WBUF, bw->size);
+		if (t_unlikely(err != 0)) {
+			errno = err;
+			tightD_errnoerror(ts, "write");
+		}
+	}
+}
+
+
+/* true if 'errno' of kernel copy means the files are not supported */
+static int copyrefused(int err) {
+	return (err == EINVAL || err == EXDEV || err == ENOSYS || err == EBADF ||
+			err == EOPNOTSUPP || err == EPERM || err == ESPIPE);
+}
+
+
+/*
+ * Copy up to 'n' bytes from 'fd' of 'br' to 'fd' of 'bw' in the kernel,
+ * falling back to the next method of 'bw->copy' when one is refused;
+ * returns the number of copied bytes, less than 'n' on EOF or when no
+ * kernel method works.
+ */
+static size_t kernelcopy(BuffWriter *bw, BuffReader *br, size_t n) {
+	tight_State *ts = bw->ts;
+	size_t total = 0;
+
+#if defined(__linux__)
+	while (total < n && bw->copy != COPY_BUFFERS) {
+		size_t len = n - total;
+		ssize_t res = (bw->copy == COPY_RANGE ?
+					   copy_file_range(br->fd, NULL, bw->fd, NULL, len, 0) :
+					   splice(br->fd, NULL, bw->fd, NULL, len, SPLICE_F_MOVE));
+		tightS_count(ts, syscalls, 1);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			if (!copyrefused(errno))
+				tightD_errnoerror(ts, (bw->copy == COPY_RANGE ?
+									   "copy_file_range" : "splice"));
+			bw->copy++; /* try the next method */
+			continue;
+		}
+		if (res == 0) /* EOF */
+			break;
+		total += res;
+		bw->limit -= res;
+		if (br->cache.fd >= 0) {
+			br->cacheoff += res;
+			tightC_advance(&br->cache, br->cacheoff);
+		}
+		if (bw->cache.fd >= 0) {
+			bw->cacheoff += res;
+			tightC_advance(&bw->cache, bw->cacheoff);
+		}
+	}
+#else
+	(void)br; (void)n;
+	bw->copy = COPY_BUFFERS;
+#endif
+	tightS_count(ts, bytesin, total);
+	tightS_count(ts, bytesout, total);
+	return total;
+}
+
+
+/*
+ * Copy 'n' bytes of 'br' into 'bw'; unless one of them is pipelined or
+ * 'bw' filters these bytes (digest, 'skip', 'limit'), bytes past those
+ * already buffered in 'br' are copied in the kernel ('copy_file_range'
+ * between files, 'splice' to or from a pipe), otherwise (or if the
+ * kernel refuses) through the buffers. Returns the number of copied
+ * bytes, which is less than 'n' only on EOF.
+ */
+size_t tightB_copy(BuffWriter *bw, BuffReader *br, size_t n) {
+	size_t total = 0;
+
+	if (br->n > 0) { /* buffered bytes first */
+		total = ((size_t)br->n < n ? (size_t)br->n : n);
+		tightB_writebytes(bw, br->current, total);
+		br->current += total;
+		br->n -= total;
+	}
+	if (total < n && bw->copy != COPY_BUFFERS && br->fd >= 0 &&
+			br->pipe == NULL && bw->pipe == NULL && bw->md5 == NULL) {
+		tightB_writefile(bw); /* 'fd' of 'bw' must be at the end */
+		if (bw->skip > 0 || bw->limit < n - total)
+			goto buffers;
+		int phase = tightS_phase(bw->ts, TIGHT_PHASE_WRITE);
+		total += kernelcopy(bw, br, n - total);
+		tightS_phase(bw->ts, phase);
+		br->peek = (bw->copy != COPY_BUFFERS);
+	}
+buffers:
+	while (total < n) {
+		ulong len = (n - total > br->size ? br->size : n - total);
+		const byte *p = tightB_brblock(br, &len);
+		if (len == 0) /* EOF ? */
+			break;
+		tightB_writebytes(bw, p, len);
+		total += len;
+	}
+	return total;
+}
+
+
 /* 
  * - MISC -
  */
@@ -9,8 +9,10 @@
 #include <stdio.h>
 #include <sys/types.h>
 
+#include "tcache.h"
 #include "tight.h"
 #include "tinternal.h"
+#include "tmd5.h"
 
 
 /* end of file */
@@ -58,20 +60,45 @@ TIGHT_FUNC void tightB_addstring(tight_State *ts, Buffer *buf, const char *str,
 /* buffered reader */
 typedef struct BuffReader {
 	tight_State *ts;
-	byte *current; /* current position in 'rbuf' */
-	byte buf[TIGHT_RBUFFSIZE]; /* read buffer */
-	ssize_t n; /* chars left to read in 'rbuf' */
+	byte *current; /* current position in 'buf' */
+	byte *buf; /* read buffer (per-state, see 'tightB_initbr') */
+	size_t size; /* size of 'buf' */
+	ssize_t n; /* chars left to read in 'buf' */
 	int validbits; /* valid bits in 'tmpbuf' */
 	ushrt tmpbuf; /* temporary bits buffer */
-	int fd; /* file descriptor */
+	int fd; /* file descriptor (-1 with I/O callbacks) */
+	const tight_IO *io; /* I/O callbacks (built-in ones for 'fd') */
+	void *ud; /* userdata of 'io' */
+	off_t pos; /* offset of input after the bytes read from 'io' */
+	const byte *chunk; /* unread bytes lent by 'io->readbuf' */
+	size_t chunkn; /* number of bytes in 'chunk' */
+	MD5ctx *md5; /* if not NULL, digest of consumed bytes */
+	const byte *mark; /* consumed bytes up to here are in 'md5' */
+	struct Pipe *pipe; /* read-ahead pipe (if any) */
+	byte peek; /* next fill reads only a block header ('tightB_copy') */
+	PageCache cache; /* page cache policy (without 'pipe') */
+	off_t cacheoff; /* offset of 'fd' (if 'cache' is active) */
 } BuffReader;
 
 
 TIGHT_FUNC void tightB_initbr(BuffReader *br, tight_State *ts, int fd);
+TIGHT_FUNC void tightB_initrefbr(BuffReader *br, tight_State *ts, int fd);
 TIGHT_FUNC int tightB_brfill(BuffReader *br, ulong *n);
 TIGHT_FUNC byte tightB_readnbits(BuffReader *br, int n);
 TIGHT_FUNC int tightB_readpending(BuffReader *br, int *out);
 TIGHT_FUNC off_t tightB_offsetreader(BuffReader *br);
+TIGHT_FUNC off_t tightB_seekreader(BuffReader *br, off_t off, int whence);
+TIGHT_FUNC void tightB_startdigest(BuffReader *br, MD5ctx *md5);
+TIGHT_FUNC void tightB_enddigest(BuffReader *br);
+TIGHT_FUNC const byte *tightB_brblock(BuffReader *br, ulong *n);
+TIGHT_FUNC void tightB_unread(BuffReader *br, const byte *end, ulong n);
+TIGHT_FUNC size_t tightB_brread(BuffReader *br, byte *out, size_t n);
+TIGHT_FUNC off_t tightB_readerleft(BuffReader *br);
+TIGHT_FUNC int tightB_nexthole(BuffReader *br, off_t pos, off_t size,
+							   off_t *start, off_t *end);
+TIGHT_FUNC void tightB_skip(BuffReader *br, size_t n);
+TIGHT_FUNC void tightB_readahead(BuffReader *br);
+TIGHT_FUNC void tightB_endreadahead(BuffReader *br);
 TIGHT_FUNC void tightB_genMD5(tight_State *ts, ulong size, int fd, byte *out);
 
 
@@ -80,19 +107,40 @@ TIGHT_FUNC void tightB_genMD5(tight_State *ts, ulong size, int fd, byte *out);
 typedef struct BuffWriter {
 	tight_State *ts; /* state */
 	uint len; /* number of elements in 'buf' */
-	byte buf[TIGHT_WBUFFSIZE]; /* write buffer */
+	byte *buf; /* write buffer (per-state or lent, see 'tightB_initbw') */
+	size_t size; /* size of 'buf' */
 	int validbits; /* valid bits in 'tmpbuf' */
 	ushrt tmpbuf; /* temporary bits buffer */
-	int fd; /* file descriptor */
+	int fd; /* file descriptor (-1 with I/O callbacks) */
+	const tight_IO *io; /* I/O callbacks (built-in ones for 'fd') */
+	void *ud; /* userdata of 'io' */
+	off_t pos; /* offset of output after the bytes written to 'io' */
+	MD5ctx *md5; /* if not NULL, digest of bytes put into 'buf' */
+	uint mark; /* bytes of 'buf' before this are in 'md5' (or skipped) */
+	size_t skip; /* bytes to discard before writing to 'fd' */
+	size_t limit; /* bytes left to write to 'fd' (after 'skip') */
+	struct Pipe *pipe; /* write-behind pipe (if any), 'buf' is its slot */
+	size_t usersize; /* size of 'buf' without 'pipe' */
+	PageCache cache; /* page cache policy (without 'pipe') */
+	off_t cacheoff; /* offset of 'fd' (if 'cache' is active) */
+	byte copy; /* method of 'tightB_copy' ('COPY_*', see 'tbuffer.c') */
+	off_t hole; /* zero bytes not yet written (after 'buf') */
 } BuffWriter;
 
 
 TIGHT_FUNC void tightB_initbw(BuffWriter *bw, tight_State *ts, int fd);
 TIGHT_FUNC void tightB_writefile(BuffWriter *bw);
+TIGHT_FUNC void tightB_digestwriter(BuffWriter *bw);
 TIGHT_FUNC void tightB_writebyte(BuffWriter *bw, byte byte);
 TIGHT_FUNC void tightB_writenbits(BuffWriter *bw, int code, int len);
+TIGHT_FUNC void tightB_writebytes(BuffWriter *bw, const byte *p, size_t n);
+TIGHT_FUNC void tightB_writezeros(BuffWriter *bw, size_t n);
+TIGHT_FUNC void tightB_writevarint(BuffWriter *bw, size_t n);
 TIGHT_FUNC void tightB_writepending(BuffWriter *bw);
 TIGHT_FUNC off_t tightB_seekwriter(BuffWriter *bw, off_t off, int whence);
+TIGHT_FUNC size_t tightB_copy(BuffWriter *bw, BuffReader *br, size_t n);
+TIGHT_FUNC void tightB_writebehind(BuffWriter *bw);
+TIGHT_FUNC void tightB_endwritebehind(BuffWriter *bw);
 
 /* misc func */
 TIGHT_FUNC char *tightB_strdup(tight_State *ts, const char *str);
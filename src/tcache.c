@@ -0,0 +1,90 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "tcache.h"
+
+
+/* true if 'pc' handles pages of output */
+#define writeback(pc)	((pc)->write && \
+						 ((pc)->policy & (TIGHT_IO_DONTNEED | TIGHT_IO_WRITEBACK)))
+
+
+/* drop clean pages of 'fd' in range 'start' - 'end' */
+static void dropcache(int fd, off_t start, off_t end) {
+	if (end > start)
+		posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED);
+}
+
+
+/* start (or with 'wait' also wait for) writeback of 'start' - 'end' */
+static void flushcache(int fd, off_t start, off_t end, int wait) {
+	uint flags = SYNC_FILE_RANGE_WRITE;
+	if (end <= start)
+		return;
+	if (wait)
+		flags |= SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WAIT_AFTER;
+	sync_file_range(fd, start, end - start, flags);
+}
+
+
+/*
+ * Start policy 'policy' on 'fd' at offset 'start', only the page cache
+ * bits ('TIGHT_IO_DONTNEED', 'TIGHT_IO_WRITEBACK') are handled here.
+ */
+void tightC_init(PageCache *pc, int fd, int policy, int write, off_t start) {
+	pc->policy = policy & (TIGHT_IO_DONTNEED | TIGHT_IO_WRITEBACK);
+	pc->write = (write != 0);
+	pc->fd = ((write ? writeback(pc) : (pc->policy & TIGHT_IO_DONTNEED)) ? fd : -1);
+	pc->prev = pc->done = start;
+}
+
+
+/* I/O of 'fd' is done up to 'end', handle it once a chunk is complete */
+void tightC_advance(PageCache *pc, off_t end) {
+	if (pc->fd < 0 || end - pc->done < CACHECHUNK)
+		return;
+	if (pc->write) { /* start this chunk, wait for the previous one */
+		flushcache(pc->fd, pc->done, end, 0);
+		flushcache(pc->fd, pc->prev, pc->done, 1);
+		if (pc->policy & TIGHT_IO_DONTNEED)
+			dropcache(pc->fd, pc->prev, pc->done);
+		pc->prev = pc->done;
+	} else
+		dropcache(pc->fd, pc->done, end);
+	pc->done = end;
+}
+
+
+/* all I/O of 'fd' is done at 'end', handle the rest */
+void tightC_finish(PageCache *pc, off_t end) {
+	if (pc->fd < 0)
+		return;
+	if (pc->write) {
+		flushcache(pc->fd, pc->prev, end, 1);
+		if (pc->policy & TIGHT_IO_DONTNEED)
+			dropcache(pc->fd, pc->prev, end);
+	} else
+		dropcache(pc->fd, pc->done, end);
+	pc->prev = pc->done = end;
+	pc->fd = -1;
+}
+
+
+/*
+ * Open another description of the file of 'fd' with 'O_DIRECT', so
+ * flags of 'fd' are left alone; returns -1 if there is no '/proc' or
+ * the file system does not support 'O_DIRECT'.
+ */
+int tightC_opendirect(int fd, int write) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	return open(path, (write ? O_WRONLY : O_RDONLY) | O_DIRECT | O_CLOEXEC);
+}
@@ -0,0 +1,43 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+#ifndef TIGHTCACHE_H
+#define TIGHTCACHE_H
+
+#include <sys/types.h>
+
+#include "tight.h"
+#include "tinternal.h"
+
+
+/* pages are dropped (written back) in chunks of this many bytes */
+#define CACHECHUNK		((off_t)8 << 20)
+
+/* offset, size and address alignment of 'O_DIRECT' I/O */
+#define DIRECTALIGN		4096
+
+
+/*
+ * Page cache policy ('TIGHT_IO_*') of a file being streamed; 'done' is
+ * the end of the range that was already handled. Read side drops pages
+ * behind 'done'; write side starts writeback of each chunk and waits for
+ * the previous one ('prev' to 'done'), so dirty pages do not pile up.
+ */
+typedef struct PageCache {
+	int fd; /* file (-1 if policy is not active) */
+	int policy; /* 'TIGHT_IO_*' bits */
+	byte write; /* true for output */
+	off_t prev; /* start of chunk whose writeback was started (write) */
+	off_t done; /* end of handled range */
+} PageCache;
+
+
+TIGHT_FUNC void tightC_init(PageCache *pc, int fd, int policy, int write,
+							off_t start);
+TIGHT_FUNC void tightC_advance(PageCache *pc, off_t end);
+TIGHT_FUNC void tightC_finish(PageCache *pc, off_t end);
+TIGHT_FUNC int tightC_opendirect(int fd, int write);
+
+#endif
@@ -4,6 +4,7 @@
  *****************************************/
 
 #include <fcntl.h>
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -13,7 +14,11 @@
 #endif
 
 #include "tdebug.h"
+#include "tdedup.h"
+#include "tdelta.h"
+#include "tfse.h"
 #include "tinternal.h"
+#include "tscan.h"
 #include "tstate.h"
 #include "tbuffer.h"
 
@@ -68,12 +73,15 @@ static inline void writeOS(BuffWriter *bw) {
 }
 
 
-#define ALLMODES	(TIGHT_HUFFMAN | TIGHT_RLE)
+#define ALLMODES \
+	(TIGHT_HUFFMAN | TIGHT_RLE | TIGHT_ORDER1 | TIGHT_FSE | TIGHT_SEEKABLE | \
+	 TIGHT_DEDUP)
 
-/* write compression mode */
+/* write compression mode (and header flags) */
 static inline void writemode(BuffWriter *bw, int mode) {
 	t_trace("---Writing [mode]---\n");
-	t_assert(TIGHT_NONE <= mode && mode <= ALLMODES);
+	t_assert(TIGHT_NONE <= (mode & ~(HEADER_ARCHIVE | HEADER_DELTA)) &&
+			 (mode & ~(HEADER_ARCHIVE | HEADER_DELTA)) <= ALLMODES);
 	t_assert(mode <= UCHAR_MAX);
 	tightB_writebyte(bw, (byte)mode);
 	t_tracef(">>> 0x%02X <<<\n", mode);
@@ -98,36 +106,31 @@ static void writetree(BuffWriter *bw, TreeData *ht) {
 }
 
 
-static inline void writebindata(BuffWriter *bw, int mode) {
+/* write 'bindata', its MD5 digest (or zeros) is stored into 'checksum' */
+static inline void writebindata(BuffWriter *bw, int mode, byte *checksum) {
 	if (mode & TIGHT_HUFFMAN) {
+		MD5ctx ctx;
 		t_assert(bw->ts->hufftree);
+		tightB_writefile(bw); /* digest only 'bindata' */
+		tight5_init(&ctx);
+		bw->md5 = &ctx;
 		t_trace("---Writing [tree]---\n");
 		writetree(bw, bw->ts->hufftree);
 		t_trace("\n");
+		tightB_writepending(bw);
+		tightB_writefile(bw);
+		bw->md5 = NULL;
+		tight5_final(&ctx, checksum);
+	} else { /* no 'bindata' */
+		memset(checksum, 0, 16);
+		tightB_writefile(bw);
 	}
-	if (mode & TIGHT_RLE) {/* TODO(jure): implement LZW */}
-	tightB_writepending(bw);
-	tightB_writefile(bw);
 }
 
 
 /* write MD5 digest */
-static inline void writechecksum(BuffWriter *bw, int mode) {
-	byte checksum[16];
-
+static inline void writechecksum(BuffWriter *bw, byte *checksum) {
 	t_assert(bw->len == 0); /* buffer must be flushed */
-	/* TODO(jure): Implement LZW */
-	if (mode & TIGHT_RLE) {
-		/* not yet implemented, set dummy checksum */
-		memset(checksum, 0, sizeof(checksum));
-	} else {
-		t_assert(mode & TIGHT_HUFFMAN);
-		off_t bindatasz = tightB_seekwriter(bw, 0, SEEK_CUR) - TIGHTbindataoffset;
-		t_assert(bindatasz > 0);
-		tightB_seekwriter(bw, TIGHTbindataoffset, SEEK_SET);
-		tightB_genMD5(bw->ts, bindatasz, bw->fd, checksum);
-		t_assert(lseek(bw->fd, 0, SEEK_CUR) == TIGHTbindataoffset + bindatasz);
-	}
 	t_trace("---Writing [checksum(MD5)]---\n");
 	tightB_writebyte(bw, checksum[0]);
 	tightB_writebyte(bw, checksum[1]);
@@ -145,117 +148,1086 @@ static inline void writechecksum(BuffWriter *bw, int mode) {
 	tightB_writebyte(bw, checksum[13]);
 	tightB_writebyte(bw, checksum[14]);
 	tightB_writebyte(bw, checksum[15]);
-	tightD_printchecksum(checksum, sizeof(checksum));
+	tightD_printchecksum(checksum, 16);
 }
 
 
 /* compress header */
 static void writeheader(BuffWriter *bw, int mode) {
+	byte checksum[16];
 	writemagic(bw);
 	writeversion(bw);
 	writeOS(bw);
 	writemode(bw, mode);
-	writebindata(bw, mode);
-	writechecksum(bw, mode);
+	writebindata(bw, mode, checksum);
+	writechecksum(bw, checksum);
 	tightB_writefile(bw); /* write all */
 }
 
 
+/* order-0 entropy (in bits) of 'n' symbols with frequencies 'freqs' */
+static double shannonbits(const size_t *freqs, size_t n) {
+	double bits = 0.0;
+	for (int i = 0; i < TIGHTBYTES; i++)
+		if (freqs[i] != 0)
+			bits += (double)freqs[i] * log2((double)n / (double)freqs[i]);
+	return bits;
+}
+
+
 /* 
- * Write 'eof' for huffman codes; last 'EOFBITS'
- * of the last byte encode how many bits to read
- * starting from the byte before it + 'EOFBIAS'.
- * For example, in case last 'EOFBITS' are '001' (1),
- * then 7 bits will be read starting from the previous byte.
+ * Estimate (in bits) how large would the block with symbol
+ * frequencies 'freqs' be when encoded with its own huffman tree;
+ * payload is estimated from entropy and tree size is exact.
  */
-static void writeeof(BuffWriter *bw) {
-	if (bw->validbits >= 8) {
-		t_tracelong("(", tightD_printbits(bw->tmpbuf, 8), ")");
-		tightB_writebyte(bw, bw->tmpbuf);
-		bw->tmpbuf >>= 8;
-		bw->validbits -= 8;
-	}
-	t_assert(bw->validbits <= 8);
-	if (bw->validbits <= 5) { /* 'eof' can fit ? */
-		bw->tmpbuf &= ~(0) >> (8 - bw->validbits);
-		bw->tmpbuf <<= 3;
-		bw->tmpbuf |= bw->validbits + 2;
-		t_tracelong("(", tightD_printbits(bw->tmpbuf, 3), ")");
-		tightB_writebyte(bw, bw->tmpbuf);
-	} else { /* 'eof' must be in separate byte */
-		t_assert(bw->validbits <= 8);
-		t_tracelong("(", tightD_printbits(0, 8 - bw->validbits), ")");
-		int extrabits = bw->validbits - 6;
-		tightB_writenbits(bw, 0, 8 - bw->validbits);
-		tightB_writebyte(bw, bw->tmpbuf);
-		t_tracelong("(", tightD_printbits(extrabits, 8), ")");
-		tightB_writebyte(bw, extrabits);
-	}
-	bw->tmpbuf = 0;
-	bw->validbits = 0;
-	tightB_writefile(bw); /* write all */
+static size_t entropybits(const size_t *freqs, ulong n) {
+	size_t leafs = 0;
+	for (int i = 0; i < TIGHTBYTES; i++)
+		leafs += (freqs[i] != 0);
+	leafs += (leafs == 1); /* dummy leaf */
+	return (size_t)shannonbits(freqs, n) + (leafs * 10 - 1);
 }
-// 00010011
 
 
+/* size of tree (in bits) as written by 'writetree' */
+static size_t treebits(TreeData *t) {
+	if (t->left) /* parent ? */
+		return 1 + treebits(t->left) + treebits(t->right);
+	return 9; /* leaf */
+}
+
+
+/* 
+ * Size (in bits) of the symbols with frequencies 'freqs' encoded with
+ * 'codes'; returns SIZE_MAX if some symbol has no code.
+ */
+static size_t huffmanbits(const HuffCode *codes, const size_t *freqs) {
+	size_t bits = 0;
+	for (int i = 0; i < TIGHTBYTES; i++) {
+		if (freqs[i] != 0) {
+			if (t_unlikely(codes[i].nbits == 0))
+				return SIZE_MAX;
+			bits += freqs[i] * codes[i].nbits;
+		}
+	}
+	return bits;
+}
 
-/* compress file contents */
-static void huffmancompression(BuffReader *br, BuffWriter *bw) {
-	tight_State *ts = br->ts;
-	int c;
 
+/* write literals for 'rleencode', returns number of bytes written */
+static size_t rleliterals(BuffWriter *bw, const byte *p, ulong n) {
+	size_t size = n + (n + RLEMAXLIT - 1) / RLEMAXLIT;
+	while (bw && n > 0) {
+		ulong len = (n > RLEMAXLIT ? RLEMAXLIT : n);
+		tightB_writebyte(bw, len - 1);
+		tightB_writebytes(bw, p, len);
+		p += len;
+		n -= len;
+	}
+	return size;
+}
+
+
+/* 
+ * Run-length-encode 'n' bytes from 'p' into 'bw', returns the
+ * number of encoded bytes; in case 'bw' is NULL nothing gets
+ * written, this is used to get the size of 'BLOCK_RLE'.
+ */
+static size_t rleencode(const Kernels *k, BuffWriter *bw, const byte *p,
+						ulong n)
+{
+	size_t size = 0;
+	ulong lit = 0; /* start of pending literals */
+	ulong i = 0;
+
+	while (i < n) {
+		ulong run = k->runlength(&p[i], (n - i > RLEMAXRUN ? RLEMAXRUN : n - i));
+		if (run >= RLEMINRUN) {
+			size += rleliterals(bw, &p[lit], i - lit) + 2;
+			if (bw) {
+				tightB_writebyte(bw, 128 + run - RLEMINRUN);
+				tightB_writebyte(bw, p[i]);
+			}
+			lit = i + run;
+		}
+		i += run;
+	}
+	return size + rleliterals(bw, &p[lit], n - lit);
+}
+
+
+/* 
+ * Huffman encode 'n' bytes from 'p' with 'codes', 'tree' (if not NULL)
+ * is written before the codes (block has its own tree).
+ */
+static void huffmancompression(BuffWriter *bw, const byte *p, ulong n,
+							   TreeData *tree, const HuffCode *codes)
+{
 	t_assert(bw->validbits == 0);
 	t_trace("---Compressing [huffman]---\n");
-	while ((c = tightB_brgetc(br)) != TIGHTEOF) {
-		t_assert(c >= 0 && c <= UCHAR_MAX);
-		HuffCode *hc = &ts->codes[c];
+	if (tree)
+		writetree(bw, tree);
+#if defined(TIGHT_TRACE)
+	for (ulong i = 0; i < n; i++) {
+		const HuffCode *hc = &codes[p[i]];
 		t_trace("("); tightD_printbits(hc->code, hc->nbits); t_trace(")");
 		tightB_writenbits(bw, hc->code, hc->nbits);
 	}
-	writeeof(bw);
+#else
+	bw->ts->kernels->huffencode(bw, codes, p, n);
+#endif
+	tightB_writepending(bw); /* pad to byte boundary */
 	t_trace("\n");
 }
 
 
-/* huffman encoding */
-static void compressfile(BuffWriter *bw, BuffReader *br, int mode) {
-	t_assert(!(mode & TIGHT_NONE));
-	writeheader(bw, mode);
-	t_assert(bw->len == 0 && bw->validbits == 0);
-	if (mode & TIGHT_RLE) {/* TODO(jure): implement LZW */}
-	if (mode & TIGHT_HUFFMAN)
-		huffmancompression(br, bw);
-}
+/* block index entry (before it is written) */
+typedef struct BlockEntry {
+	size_t offset; /* file offset of block */
+	byte digest[16]; /* MD5 of uncompressed bytes */
+} BlockEntry;
 
 
 /* compression data */
 typedef struct CompressData {
 	const size_t *freqs;
+	struct Order1 *o1; /* order-1 statistics (if 'TIGHT_ORDER1') */
+	byte *fse; /* FSE output (if 'TIGHT_FSE') */
+	TreeData *tree; /* block tree candidate */
+	HuffCode codes[TIGHTBYTES]; /* codes of 'tree' */
+	Dedup dedup; /* chunker and chunk index (if 'TIGHT_DEDUP') */
+	Delta delta; /* reference index (if 'tight_setreference') */
+	BlockEntry *index; /* block index (if 'TIGHT_SEEKABLE') */
+	TempMem *tmindex; /* anchors 'index' */
+	uint nindex; /* number of elements in 'index' */
+	uint sizeindex; /* size of 'index' */
+	byte zerodigest[16]; /* MD5 of 'zerosize' zero bytes */
+	ulong zerosize; /* size of zero blocks in 'zerodigest', 0 if none */
+	ulong blocksize; /* uncompressed bytes in a block */
+	off_t pos; /* input offset of the next block (if 'sparse') */
+	off_t hole, holeend; /* next hole of input (if 'sparse') */
+	off_t insize; /* size of input (if 'sparse') */
+	byte sparse; /* input can have (more) holes */
 	int mode;
 } CompressData;
 
 
+/* 
+ * Build huffman tree for the block; new tree is kept only in case
+ * it results in block smaller than 'best'. Returns the size of the
+ * block in bytes or 0 if the new tree was discarded.
+ */
+static size_t tryblocktree(tight_State *ts, CompressData *cd, const size_t *freqs,
+						   size_t best)
+{
+	size_t size;
+
+	cd->tree = tightS_gentree(ts, freqs, cd->codes);
+	size = (treebits(cd->tree) + huffmanbits(cd->codes, freqs) + 7) / 8;
+	if (size < best) /* new tree is better ? */
+		return size;
+	tightT_freeparent(ts, cd->tree);
+	cd->tree = NULL;
+	return 0;
+}
+
+
+/* number of k-means passes when clustering order-1 contexts */
+#define O1PASSES		3
+
+/* extra bits for symbols not present in cluster (clustering cost) */
+#define O1MISSBITS		2.0
+
+
+/* order-1 statistics and trees of a single block */
+typedef struct Order1 {
+	uint32_t freqs[TIGHTBYTES][TIGHTBYTES]; /* [context][symbol] */
+	uint32_t total[TIGHTBYTES]; /* number of symbols in each context */
+	size_t cfreqs[TIGHT_O1TREES][TIGHTBYTES]; /* cluster frequencies */
+	HuffCode codes[TIGHT_O1TREES][TIGHTBYTES]; /* cluster codes */
+	float cost[TIGHT_O1TREES][TIGHTBYTES]; /* clustering cost of symbols */
+	TreeData *trees[TIGHT_O1TREES]; /* cluster trees */
+	byte map[TIGHTBYTES]; /* context -> cluster */
+	int ntrees; /* number of clusters */
+} Order1;
+
+
+/* bits needed to encode cluster index */
+static inline int o1mapbits(int ntrees) {
+	int bits = 0;
+	while ((1 << bits) < ntrees) bits++;
+	return bits;
+}
+
+
+/* count order-1 frequencies, context of the first byte is 0 */
+static void o1frequencies(Order1 *o1, const byte *p, ulong n) {
+	byte prev = 0;
+	for (int i = 0; i < TIGHTBYTES; i++) { /* clear previous block */
+		if (o1->total[i] != 0) {
+			memset(o1->freqs[i], 0, sizeof(o1->freqs[i]));
+			o1->total[i] = 0;
+		}
+	}
+	for (ulong i = 0; i < n; i++) {
+		o1->freqs[prev][p[i]]++;
+		o1->total[prev]++;
+		prev = p[i];
+	}
+}
+
+
+/* auxiliary to 'o1cluster', sum member contexts into cluster frequencies */
+static void o1sumclusters(Order1 *o1) {
+	memset(o1->cfreqs, 0, sizeof(o1->cfreqs));
+	for (int ctx = 0; ctx < TIGHTBYTES; ctx++) {
+		if (o1->total[ctx] == 0) continue;
+		size_t *cf = o1->cfreqs[o1->map[ctx]];
+		for (int i = 0; i < TIGHTBYTES; i++)
+			cf[i] += o1->freqs[ctx][i];
+	}
+}
+
+
+/* 
+ * Cluster contexts (previous bytes) into at most 'TIGHT_O1TREES'
+ * clusters, contexts with similar distributions end up sharing a tree.
+ * Starts from the most frequent contexts as seeds and then refines
+ * the clusters with a few k-means passes where the distance is the
+ * cost (in bits) of encoding context symbols with cluster distribution.
+ * Returns estimated block size in bits.
+ */
+static size_t o1cluster(Order1 *o1) {
+	byte syms[TIGHTBYTES]; /* symbols present in context */
+	int ntrees = 0;
+	int i, k, pass;
+
+	/* seeds are the most frequent contexts */
+	memset(o1->map, 0, sizeof(o1->map));
+	for (k = 0; k < TIGHT_O1TREES; k++) {
+		int best = -1;
+		for (i = 0; i < TIGHTBYTES; i++) {
+			if (o1->total[i] != 0 && o1->map[i] == 0 &&
+					(best < 0 || o1->total[i] > o1->total[best]))
+				best = i;
+		}
+		if (best < 0) break; /* no more contexts */
+		o1->map[best] = ++ntrees; /* mark as seed (biased) */
+	}
+	t_assert(ntrees > 0);
+	memset(o1->cfreqs, 0, sizeof(o1->cfreqs));
+	for (i = 0; i < TIGHTBYTES; i++) {
+		if (o1->map[i] != 0) {
+			o1->map[i]--; /* remove bias */
+			for (k = 0; k < TIGHTBYTES; k++)
+				o1->cfreqs[o1->map[i]][k] = o1->freqs[i][k];
+		}
+	}
+
+	/* refine clusters */
+	for (pass = 0; pass < O1PASSES && ntrees > 1; pass++) {
+		for (k = 0; k < ntrees; k++) {
+			size_t total = 0;
+			for (i = 0; i < TIGHTBYTES; i++)
+				total += o1->cfreqs[k][i];
+			double base = log2((double)(total + 1));
+			for (i = 0; i < TIGHTBYTES; i++) {
+				size_t f = o1->cfreqs[k][i];
+				o1->cost[k][i] = (f ? base - log2((double)f) : base + O1MISSBITS);
+			}
+		}
+		for (int ctx = 0; ctx < TIGHTBYTES; ctx++) {
+			int nsyms = 0;
+			if (o1->total[ctx] == 0) continue;
+			for (i = 0; i < TIGHTBYTES; i++)
+				if (o1->freqs[ctx][i] != 0)
+					syms[nsyms++] = i;
+			float bestcost = 0.0f;
+			for (k = 0; k < ntrees; k++) {
+				float c = 0.0f;
+				for (i = 0; i < nsyms; i++)
+					c += o1->freqs[ctx][syms[i]] * o1->cost[k][syms[i]];
+				if (k == 0 || c < bestcost) {
+					bestcost = c;
+					o1->map[ctx] = k;
+				}
+			}
+		}
+		o1sumclusters(o1);
+	}
+	if (ntrees == 1) /* everything in a single cluster ? */
+		o1sumclusters(o1);
+
+	/* remove empty clusters */
+	int remap[TIGHT_O1TREES];
+	int n = 0;
+	for (k = 0; k < ntrees; k++) {
+		size_t total = 0;
+		for (i = 0; i < TIGHTBYTES; i++)
+			total += o1->cfreqs[k][i];
+		remap[k] = n;
+		if (total != 0) {
+			if (n != k)
+				memcpy(o1->cfreqs[n], o1->cfreqs[k], sizeof(o1->cfreqs[k]));
+			n++;
+		}
+	}
+	for (i = 0; i < TIGHTBYTES; i++)
+		o1->map[i] = (o1->total[i] ? remap[o1->map[i]] : 0);
+	o1->ntrees = n;
+
+	/* estimate size */
+	size_t bits = 4 + TIGHTBYTES * o1mapbits(n);
+	for (k = 0; k < n; k++) {
+		size_t total = 0;
+		for (i = 0; i < TIGHTBYTES; i++)
+			total += o1->cfreqs[k][i];
+		bits += entropybits(o1->cfreqs[k], total);
+	}
+	return bits;
+}
+
+
+/* free order-1 trees */
+static void o1freetrees(tight_State *ts, Order1 *o1) {
+	for (int k = 0; k < o1->ntrees; k++) {
+		if (o1->trees[k]) {
+			tightT_freeparent(ts, o1->trees[k]);
+			o1->trees[k] = NULL;
+		}
+	}
+}
+
+
+/* 
+ * Build order-1 trees; trees are kept only in case they result
+ * in block smaller than 'best'. Returns the size of the block in
+ * bytes or 0 if trees were discarded.
+ */
+static size_t tryo1trees(tight_State *ts, Order1 *o1, size_t best) {
+	size_t bits = 4 + TIGHTBYTES * o1mapbits(o1->ntrees);
+	for (int k = 0; k < o1->ntrees; k++) {
+		o1->trees[k] = tightS_gentree(ts, o1->cfreqs[k], o1->codes[k]);
+		bits += treebits(o1->trees[k]);
+		bits += huffmanbits(o1->codes[k], o1->cfreqs[k]);
+	}
+	if ((bits + 7) / 8 < best)
+		return (bits + 7) / 8;
+	o1freetrees(ts, o1);
+	return 0;
+}
+
+
+/* huffman encode 'n' bytes from 'p' with the order-1 trees */
+static void o1compression(BuffWriter *bw, Order1 *o1, const byte *p, ulong n) {
+	int mapbits = o1mapbits(o1->ntrees);
+	byte prev = 0;
+	int k;
+
+	t_assert(bw->validbits == 0);
+	t_trace("---Compressing [order-1]---\n");
+	tightB_writenbits(bw, o1->ntrees - 1, 4);
+	if (mapbits > 0)
+		for (k = 0; k < TIGHTBYTES; k++)
+			tightB_writenbits(bw, o1->map[k], mapbits);
+	for (k = 0; k < o1->ntrees; k++)
+		writetree(bw, o1->trees[k]);
+	for (ulong i = 0; i < n; i++) {
+		HuffCode *hc = &o1->codes[o1->map[prev]][p[i]];
+		tightB_writenbits(bw, hc->code, hc->nbits);
+		prev = p[i];
+	}
+	tightB_writepending(bw); /* pad to byte boundary */
+	o1freetrees(bw->ts, o1);
+}
+
+
+/* write 'BLOCK_ZERO' of 'n' bytes */
+static void writezeroblock(BuffWriter *bw, ulong n) {
+	t_tracef("---Block [type %d, %lu -> 0]---\n", BLOCK_ZERO, n);
+	tightB_writebyte(bw, BLOCK_ZERO);
+	tightB_writevarint(bw, n);
+	tightB_writevarint(bw, 0);
+}
+
+
+/* true if all 'n' (> 0) bytes of 'p' are zero */
+static int allzero(const byte *p, ulong n) {
+	return (p[0] == 0 && memcmp(p, p + 1, n - 1) == 0);
+}
+
+
+/* 
+ * Compress block of 'n' bytes from 'p' using the cheapest method
+ * allowed by 'mode'; stored size is the upper bound.
+ */
+static void compressblock(BuffWriter *bw, CompressData *cd, const byte *p,
+						  ulong n)
+{
+	tight_State *ts = bw->ts;
+	int mode = cd->mode;
+	size_t freqs[TIGHTBYTES];
+	size_t best = n; /* 'BLOCK_STORED' */
+	size_t size;
+	TreeData *tree = NULL; /* tree written with 'BLOCK_HUFF' */
+	const HuffCode *codes = ts->codes;
+	int type = BLOCK_STORED;
+
+	if (allzero(p, n)) { /* hole that file system did not report */
+		writezeroblock(bw, n);
+		return;
+	}
+	if (mode & TIGHT_RLE) {
+		size = rleencode(ts->kernels, NULL, p, n);
+		if (size < best) {
+			best = size;
+			type = BLOCK_RLE;
+		}
+	}
+	if (mode & (TIGHT_HUFFMAN | TIGHT_FSE)) {
+		int phase = tightS_phase(ts, TIGHT_PHASE_HIST);
+		ts->kernels->histogram(freqs, p, n);
+		tightS_phase(ts, phase);
+	}
+	if (mode & TIGHT_HUFFMAN) {
+		if (ts->hufftree) { /* have previous tree ? */
+			size = huffmanbits(ts->codes, freqs);
+			if (size != SIZE_MAX && (size = (size + 7) / 8) < best) {
+				best = size;
+				type = BLOCK_HUFFPREV;
+			}
+		}
+		if ((entropybits(freqs, n) + 7) / 8 < best &&
+				(size = tryblocktree(ts, cd, freqs, best)) > 0) {
+			best = size;
+			type = BLOCK_HUFF;
+		}
+	}
+	if (mode & TIGHT_ORDER1) {
+		int phase = tightS_phase(ts, TIGHT_PHASE_HIST);
+		o1frequencies(cd->o1, p, n);
+		tightS_phase(ts, phase);
+		if ((o1cluster(cd->o1) + 7) / 8 < best &&
+				(size = tryo1trees(ts, cd->o1, best)) > 0) {
+			best = size;
+			type = BLOCK_ORDER1;
+		}
+	}
+	if ((mode & TIGHT_FSE) && tightF_estimate(freqs, n) < best &&
+			(size = tightF_compress(cd->fse, p, n, freqs)) < best) {
+		best = size;
+		type = BLOCK_FSE;
+	}
+	if (cd->tree) { /* have block tree candidate ? */
+		if (type != BLOCK_HUFF) {
+			tightT_freeparent(ts, cd->tree);
+			cd->tree = NULL;
+		} else if (mode & (TIGHT_SEEKABLE | TIGHT_DEDUP)) { /* keep header tree */
+			tree = cd->tree;
+			codes = cd->codes;
+		} else { /* replace previous tree */
+			tightS_freehufftree(ts);
+			ts->hufftree = tree = cd->tree;
+			memcpy(ts->codes, cd->codes, sizeof(ts->codes));
+			cd->tree = NULL;
+		}
+	}
+	if (cd->o1 && type != BLOCK_ORDER1)
+		o1freetrees(ts, cd->o1);
+	t_tracef("---Block [type %d, %lu -> %zu]---\n", type, n, best);
+	tightB_writebyte(bw, type);
+	tightB_writevarint(bw, n);
+	tightB_writevarint(bw, best);
+	switch (type) {
+	case BLOCK_STORED:
+		tightB_writebytes(bw, p, n);
+		break;
+	case BLOCK_RLE:
+		rleencode(ts->kernels, bw, p, n);
+		break;
+	case BLOCK_HUFF: case BLOCK_HUFFPREV:
+		huffmancompression(bw, p, n, tree, codes);
+		break;
+	case BLOCK_ORDER1:
+		o1compression(bw, cd->o1, p, n);
+		break;
+	case BLOCK_FSE: /* already compressed */
+		tightB_writebytes(bw, cd->fse, best);
+		break;
+	default: t_assert(0 && "unreachable");
+	}
+	if (cd->tree) { /* block-only tree ? */
+		tightT_freeparent(ts, cd->tree);
+		cd->tree = NULL;
+	}
+}
+
+
+/* current offset of 'bw' (including buffered bytes) */
+static size_t writeroffset(BuffWriter *bw) {
+	return tightB_seekwriter(bw, 0, SEEK_CUR) + bw->len;
+}
+
+
+/* maximum number of blocks in block index */
+#define MAXBLOCKS		(INT_MAX / (int)sizeof(BlockEntry))
+
+
+/*
+ * Add the next block of 'n' bytes at 'p' (NULL for zeros of a hole)
+ * to block index, with its offset and checksum.
+ */
+static void addblockentry(BuffWriter *bw, CompressData *cd, const byte *p,
+						  ulong n)
+{
+	BlockEntry *e;
+	int phase;
+
+	tightA_growvec(bw->ts, cd->index, cd->sizeindex, MAXBLOCKS, cd->nindex,
+				   "blocks");
+	updatetm(cd->tmindex, cd->index, cd->sizeindex * sizeof(BlockEntry));
+	e = &cd->index[cd->nindex++];
+	e->offset = writeroffset(bw);
+	phase = tightS_phase(bw->ts, TIGHT_PHASE_MD5);
+	if (p == NULL) { /* holes have the same size (except the last one) */
+		if (cd->zerosize != n) {
+			tight5_zeros(cd->zerodigest, n);
+			cd->zerosize = n;
+		}
+		memcpy(e->digest, cd->zerodigest, sizeof(e->digest));
+	} else {
+		MD5ctx ctx;
+		tight5_init(&ctx);
+		tight5_update(&ctx, (byte *)p, n);
+		tight5_final(&ctx, e->digest);
+	}
+	tightS_phase(bw->ts, phase);
+}
+
+
+/*
+ * Start looking for holes of 'br' (regular file, not pipelined);
+ * without 'md5' blocks in holes are not even read.
+ */
+static void startholes(BuffReader *br, CompressData *cd, MD5ctx *md5) {
+	struct stat st;
+	cd->sparse = (md5 == NULL && br->pipe == NULL && fstat(br->fd, &st) == 0 &&
+				  S_ISREG(st.st_mode));
+	if (cd->sparse) {
+		cd->insize = st.st_size;
+		cd->pos = cd->hole = cd->holeend = tightB_offsetreader(br);
+	}
+}
+
+
+/*
+ * Size of the next block in case it lies in a hole of input, 0
+ * otherwise; holes are looked up once 'pos' is past the previous one.
+ */
+static ulong holeblock(BuffReader *br, CompressData *cd) {
+	ulong n = cd->blocksize;
+	if (!cd->sparse)
+		return 0;
+	if (cd->pos >= cd->holeend && !(cd->sparse = tightB_nexthole(br, cd->pos,
+					cd->insize, &cd->hole, &cd->holeend)))
+		return 0;
+	if (cd->insize - cd->pos < (off_t)n) /* last block ? */
+		n = cd->insize - cd->pos;
+	return (n > 0 && cd->hole <= cd->pos && cd->pos + (off_t)n <= cd->holeend ?
+			n : 0);
+}
+
+
+/* write block in hole of 'n' bytes, they are skipped in 'br' */
+static void skipholeblock(BuffWriter *bw, BuffReader *br, CompressData *cd,
+						  ulong n)
+{
+	tightB_skip(br, n);
+	if (cd->mode & TIGHT_SEEKABLE)
+		addblockentry(bw, cd, NULL, n);
+	writezeroblock(bw, n);
+}
+
+
+/* mode bits that code blocks (without them all blocks are stored) */
+#define CODINGMODES		(TIGHT_HUFFMAN | TIGHT_RLE | TIGHT_ORDER1 | TIGHT_FSE)
+
+
+/* number of bytes of varint 'n' */
+static int varintsize(size_t n) {
+	int size = 1;
+	while (n >= 0x80) {
+		n >>= 7;
+		size++;
+	}
+	return size;
+}
+
+
+/* cut the next chunk out of 'n' bytes at 'p' (rest goes back to 'br') */
+static ulong cutchunk(BuffReader *br, CompressData *cd, const byte *p, ulong n) {
+	ulong size = tightE_cut(&cd->dedup, p, n);
+	tightB_unread(br, p + n, n - size);
+	return size;
+}
+
+
+/*
+ * Write chunk of 'n' bytes at 'p' as 'BLOCK_REF' in case the same chunk
+ * was already written, returns 0 if it was not (chunk is then added to
+ * chunk index, as it is about to be written at the current offset).
+ */
+static int refblock(BuffWriter *bw, CompressData *cd, const byte *p, ulong n) {
+	const Chunk *c = tightE_find(&cd->dedup, p, n);
+	size_t offset = bw->pos + bw->len; /* stream offset (no seeks) */
+	if (c == NULL) {
+		tightE_add(bw->ts, &cd->dedup, offset);
+		return 0;
+	}
+	t_tracef("---Block [type %d, %lu -> %zu]---\n", BLOCK_REF, n,
+			 offset - c->offset);
+	tightB_writebyte(bw, BLOCK_REF);
+	tightB_writevarint(bw, n);
+	tightB_writevarint(bw, varintsize(offset - c->offset));
+	tightB_writevarint(bw, offset - c->offset);
+	return 1;
+}
+
+
+/*
+ * Store the rest of 'br' (up to the size of the file) as stored blocks
+ * without looking at the bytes, which are copied in the kernel when
+ * possible (see 'tightB_copy'); blocks are the same as those of
+ * 'compressblock'. Block index needs checksums of the bytes, so it is
+ * not used with 'TIGHT_SEEKABLE'. Returns uncompressed size.
+ */
+static size_t storeblocks(BuffWriter *bw, BuffReader *br, CompressData *cd) {
+	off_t left = tightB_readerleft(br);
+	size_t rawsize = 0;
+
+	t_assert(!(cd->mode & TIGHT_SEEKABLE));
+	while (left > 0) {
+		ulong n = ((ulong)left < cd->blocksize ? (ulong)left : cd->blocksize);
+		if (holeblock(br, cd) == n) {
+			skipholeblock(bw, br, cd, n);
+		} else {
+			t_tracef("---Block [type %d, %lu -> %lu]---\n", BLOCK_STORED, n, n);
+			tightB_writebyte(bw, BLOCK_STORED);
+			tightB_writevarint(bw, n);
+			tightB_writevarint(bw, n);
+			if (t_unlikely(tightB_copy(bw, br, n) != n))
+				tightD_compresserror(bw->ts, "input file shrank");
+		}
+		cd->pos += n;
+		rawsize += n;
+		left -= n;
+	}
+	return rawsize;
+}
+
+
+/* 
+ * Compress contents of 'br' block by block until EOF, 'md5' (if not
+ * NULL) is updated with the uncompressed bytes; returns uncompressed size.
+ */
+static size_t compressblocks(BuffWriter *bw, BuffReader *br, CompressData *cd,
+							 MD5ctx *md5)
+{
+	const byte *p;
+	size_t rawsize = 0;
+	ulong n;
+
+	tightS_phase(bw->ts, TIGHT_PHASE_ENCODE);
+	cd->blocksize = (br->size < TIGHT_BLOCKSIZE ? br->size : TIGHT_BLOCKSIZE);
+	startholes(br, cd, md5);
+	if (cd->mode & TIGHT_DEDUP) /* blocks are chunks */
+		cd->blocksize = tightE_chunksize(&cd->dedup, cd->blocksize);
+	else if (!(cd->mode & (CODINGMODES | TIGHT_SEEKABLE)) &&
+			 md5 == NULL) /* stored only (without checksums) ? */
+		rawsize = storeblocks(bw, br, cd);
+	for (;;) { /* rest (or everything) */
+		if ((n = holeblock(br, cd)) > 0) {
+			skipholeblock(bw, br, cd, n);
+		} else {
+			n = cd->blocksize;
+			p = tightB_brblock(br, &n);
+			if (n == 0) /* EOF ? */
+				break;
+			if (cd->mode & TIGHT_DEDUP)
+				n = cutchunk(br, cd, p, n);
+			if (md5) {
+				int phase = tightS_phase(bw->ts, TIGHT_PHASE_MD5);
+				tight5_update(md5, (byte *)p, n);
+				tightS_phase(bw->ts, phase);
+			}
+			if (cd->mode & TIGHT_SEEKABLE)
+				addblockentry(bw, cd, p, n);
+			/* zero blocks are smaller than references */
+			if (!(cd->mode & TIGHT_DEDUP) || allzero(p, n) ||
+					!refblock(bw, cd, p, n))
+				compressblock(bw, cd, p, n);
+		}
+		cd->pos += n;
+		rawsize += n;
+	}
+	tightS_phase(bw->ts, TIGHT_PHASE_OTHER);
+	tightB_writebyte(bw, BLOCK_END);
+	return rawsize;
+}
+
+
+/* write 8 bytes of 'n' (little endian) */
+static void writeu64(BuffWriter *bw, uint64_t n) {
+	for (int i = 0; i < 8; i++)
+		tightB_writebyte(bw, (byte)(n >> (i * 8)));
+}
+
+
+/* write block index and its trailer */
+static void writeblockindex(BuffWriter *bw, CompressData *cd, size_t rawsize) {
+	size_t offset = writeroffset(bw);
+
+	t_trace("---Writing [block index]---\n");
+	for (uint i = 0; i < cd->nindex; i++) {
+		writeu64(bw, cd->index[i].offset);
+		tightB_writebytes(bw, cd->index[i].digest, sizeof(cd->index[i].digest));
+	}
+	writeu64(bw, offset);
+	writeu64(bw, rawsize);
+	/* single block does not depend on the size of read buffer */
+	writeu64(bw, (rawsize <= cd->blocksize ? TIGHT_BLOCKSIZE : cd->blocksize));
+	tightB_writebytes(bw, SEEKSUMMAGIC, sizeof(SEEKSUMMAGIC));
+}
+
+
+/* compress file contents block by block */
+static void compressfile(BuffWriter *bw, BuffReader *br, CompressData *cd) {
+	size_t rawsize;
+
+	writeheader(bw, cd->mode);
+	t_assert(bw->len == 0 && bw->validbits == 0);
+	tightB_readahead(br);
+	tightB_writebehind(bw);
+	rawsize = compressblocks(bw, br, cd, NULL);
+	if (cd->mode & TIGHT_SEEKABLE)
+		writeblockindex(bw, cd, rawsize);
+	tightB_endwritebehind(bw); /* write all */
+	tightB_endreadahead(br);
+}
+
+
+/* write 'BLOCK_COPY' of 'n' bytes at 'offset' of reference */
+static void copyblock(BuffWriter *bw, off_t offset, size_t n) {
+	t_tracef("---Block [type %d, %zu -> %d]---\n", BLOCK_COPY, n,
+			 varintsize(offset));
+	tightB_writebyte(bw, BLOCK_COPY);
+	tightB_writevarint(bw, n);
+	tightB_writevarint(bw, varintsize(offset));
+	tightB_writevarint(bw, offset);
+}
+
+
+/* compress 'n' bytes at 'p' that were not found in reference */
+static void literalblocks(BuffWriter *bw, CompressData *cd, const byte *p,
+						  size_t n)
+{
+	while (n > 0) {
+		ulong len = (n < cd->blocksize ? n : cd->blocksize);
+		compressblock(bw, cd, p, len);
+		p += len;
+		n -= len;
+	}
+}
+
+
+/*
+ * Compress contents of 'br' as delta until EOF; every offset of input
+ * is looked up in reference index, found blocks are extended both ways
+ * into 'BLOCK_COPY' and the bytes between them are compressed. Match
+ * that reaches the end of a read goes on into the next one, the last
+ * bytes that can't be hashed yet go back to 'br'. 'md5' is updated with
+ * the uncompressed bytes; returns uncompressed size.
+ */
+static size_t deltablocks(BuffWriter *bw, BuffReader *br, CompressData *cd,
+						  MD5ctx *md5)
+{
+	Delta *d = &cd->delta;
+	ulong bs = d->blocksize;
+	off_t copyoff = 0; /* open match */
+	size_t copylen = 0;
+	off_t disp = 0; /* reference offset minus input offset of last match */
+	size_t rawsize = 0;
+
+	tightS_phase(bw->ts, TIGHT_PHASE_ENCODE);
+	cd->blocksize = (br->size < TIGHT_BLOCKSIZE ? br->size : TIGHT_BLOCKSIZE);
+	for (;;) {
+		ulong n = br->size;
+		const byte *p = tightB_brblock(br, &n);
+		ulong i = 0, lit = 0, keep = 0;
+		uint64_t h = 0;
+		int phase;
+
+		if (n == 0) /* EOF ? */
+			break;
+		if (copylen > 0) { /* match of the previous read goes on ? */
+			i = lit = tightR_forward(d, copyoff + copylen, p, n);
+			copylen += i;
+			if (i < n) {
+				copyblock(bw, copyoff, copylen);
+				copylen = 0;
+			}
+		}
+		if (d->n > 0 && n - i >= bs)
+			h = tightR_hash(d, p + i);
+		while (d->n > 0 && n - i >= bs) {
+			off_t off = tightR_find(d, h, p + i, rawsize + i + disp);
+			if (off >= 0) {
+				size_t back = tightR_backward(d, off, p + i, i - lit);
+				literalblocks(bw, cd, p + lit, i - back - lit);
+				copyoff = off - back;
+				disp = off - (off_t)(rawsize + i);
+				copylen = back + bs + tightR_forward(d, off + bs, p + i + bs,
+													 n - i - bs);
+				i = lit = i + (copylen - back);
+				if (i == n) /* match can go on */
+					break;
+				copyblock(bw, copyoff, copylen);
+				copylen = 0;
+				if (n - i >= bs)
+					h = tightR_hash(d, p + i);
+			} else if (n - i > bs) {
+				h = tightR_roll(d, h, p[i], p[i + bs]);
+				i++;
+			} else
+				i++;
+		}
+		if (copylen == 0) {
+			/* unless nothing was hashed (EOF), keep bytes from 'i' on */
+			keep = (i > 0 ? n - i : 0);
+			literalblocks(bw, cd, p + lit, n - keep - lit);
+		}
+		phase = tightS_phase(bw->ts, TIGHT_PHASE_MD5);
+		tight5_update(md5, (byte *)p, n - keep);
+		tightS_phase(bw->ts, phase);
+		tightB_unread(br, p + n, keep);
+		rawsize += n - keep;
+	}
+	if (copylen > 0)
+		copyblock(bw, copyoff, copylen);
+	tightS_phase(bw->ts, TIGHT_PHASE_OTHER);
+	tightB_writebyte(bw, BLOCK_END);
+	return rawsize;
+}
+
+
+/* compress file contents as delta against reference */
+static void compressdelta(BuffWriter *bw, BuffReader *br, CompressData *cd) {
+	MD5ctx ctx;
+	byte checksum[16];
+
+	writeheader(bw, cd->mode | HEADER_DELTA);
+	tightB_writevarint(bw, cd->delta.refsize);
+	tightB_readahead(br);
+	tightB_writebehind(bw);
+	tight5_init(&ctx);
+	deltablocks(bw, br, cd, &ctx);
+	tight5_final(&ctx, checksum);
+	t_trace("---Writing [delta checksum(MD5)]---\n");
+	tightB_writebytes(bw, checksum, sizeof(checksum));
+	tightB_endwritebehind(bw); /* write all */
+	tightB_endreadahead(br);
+}
+
+
+/* check mode, build header tree and allocate per-mode data of 'cd' */
+static void initcompress(tight_State *ts, CompressData *cd) {
+	if (t_unlikely(cd->mode < 0 || (cd->mode & ~ALLMODES)))
+		tightD_compresserror(ts, "invalid mode bits");
+	if (t_unlikely((cd->mode & TIGHT_DEDUP) && (cd->mode & TIGHT_SEEKABLE)))
+		tightD_compresserror(ts, "deduplicated blocks can't be seekable");
+
+	if (cd->mode & TIGHT_HUFFMAN) /* using huffman coding ? */
+		tightS_gencodes(ts, cd->freqs); /* header tree */
+
+	cd->tree = NULL;
+	cd->o1 = NULL;
+	if (cd->mode & TIGHT_ORDER1) {
+		/* counts are zero or left consistent by the previous call */
+		cd->o1 = tightA_cached(ts, CACHE_ORDER1, sizeof(*cd->o1));
+		memset(cd->o1->trees, 0, sizeof(cd->o1->trees));
+		cd->o1->ntrees = 0;
+	}
+
+	cd->fse = NULL;
+	if (cd->mode & TIGHT_FSE)
+		cd->fse = tightA_cached(ts, CACHE_ENCFSE, FSEBOUND(TIGHT_BLOCKSIZE));
+
+	if (cd->mode & TIGHT_DEDUP) /* chunk index is shared by archive members */
+		tightE_init(ts, &cd->dedup);
+
+	cd->index = NULL;
+	cd->tmindex = NULL;
+	cd->nindex = cd->sizeindex = 0;
+	cd->zerosize = 0;
+	if (cd->mode & TIGHT_SEEKABLE) /* 'index' grows as needed */
+		cd->tmindex = tightA_newtempmem(ts);
+}
+
+
+/* free data allocated by 'initcompress' (per-state buffers are kept) */
+static void endcompress(tight_State *ts, CompressData *cd) {
+	if (cd->mode & TIGHT_DEDUP)
+		tightE_free(ts, &cd->dedup);
+	if (cd->tmindex) {
+		if (cd->index)
+			tightA_freevec(ts, cd->index, cd->sizeindex);
+		tightS_poptemp(ts);
+	}
+}
+
+
 /* run protected compression */
 static void pcompress(tight_State *ts, void *ud) {
 	BuffReader br; BuffWriter bw;
 	CompressData *cd = (CompressData*)ud;
 
-	if (t_unlikely(cd->mode < 0))
-		tightD_compresserror(ts, "invalid mode bits");
-	if (cd->mode & TIGHT_NONE)
-		return;
-
-	/* init reader and writer */
+	if (t_unlikely(ts->reffd >= 0 &&
+				   (cd->mode & (TIGHT_SEEKABLE | TIGHT_DEDUP))))
+		tightD_compresserror(ts, "delta can't be seekable or deduplicated");
+	initcompress(ts, cd);
 	tightB_initbr(&br, ts, ts->rfd);
 	tightB_initbw(&bw, ts, ts->wfd);
-
-	/* TODO(jure): implement LZW */
-	if (cd->mode & TIGHT_HUFFMAN) /* using huffman coding ? */
-		tightS_gencodes(ts, cd->freqs);
-
 	t_trace("\n***Compression start!***\n\n");
-	compressfile(&bw, &br, cd->mode);
+	if (ts->reffd >= 0) { /* delta ? */
+		tightR_init(ts, &cd->delta, ts->reffd);
+		compressdelta(&bw, &br, cd);
+		tightR_free(ts, &cd->delta);
+	} else
+		compressfile(&bw, &br, cd);
 	t_trace("\n***Compressing complete!***\n\n");
+	endcompress(ts, cd);
+}
+
+
+
+/*--------------------------------------------------------------------------
+ * Archive
+ *-------------------------------------------------------------------------- */
+
+/* archive data */
+typedef struct ArchiveData {
+	CompressData cd;
+	const char *const *names; /* member names */
+	tight_fOpen openfn; /* opens members */
+	void *ud; /* userdata for 'openfn' */
+	int rfd; /* currently open member or -1 */
+	int wfd; /* archive file */
+	int n; /* number of members */
+} ArchiveData;
+
+
+/* archive index entry (before it is written) */
+typedef struct ArchiveEntry {
+	size_t offset;
+	size_t size;
+	size_t rawsize;
+	byte checksum[16];
+} ArchiveEntry;
+
+
+/* write central index and trailer */
+static void writeindex(BuffWriter *bw, ArchiveData *ad, const ArchiveEntry *e) {
+	MD5ctx ctx;
+	byte checksum[16];
+	size_t offset;
+
+	t_trace("---Writing [archive index]---\n");
+	tightB_writefile(bw);
+	offset = writeroffset(bw);
+	tight5_init(&ctx);
+	bw->md5 = &ctx;
+	tightB_writevarint(bw, ad->n);
+	for (int i = 0; i < ad->n; i++) {
+		size_t len = strlen(ad->names[i]);
+		tightB_writevarint(bw, len);
+		tightB_writebytes(bw, (const byte *)ad->names[i], len);
+		tightB_writevarint(bw, e[i].offset);
+		tightB_writevarint(bw, e[i].size);
+		tightB_writevarint(bw, e[i].rawsize);
+		tightB_writebyte(bw, ad->cd.mode);
+		tightB_writebytes(bw, e[i].checksum, sizeof(e[i].checksum));
+	}
+	tightB_writefile(bw);
+	bw->md5 = NULL;
+	tight5_final(&ctx, checksum);
+	writeu64(bw, offset); /* trailer */
+	tightB_writebytes(bw, checksum, sizeof(checksum));
+	tightB_writebytes(bw, ARCMAGIC, sizeof(ARCMAGIC));
+	tightB_writefile(bw);
+}
+
+
+/* run protected archive compression */
+static void parchive(tight_State *ts, void *ud) {
+	ArchiveData *ad = (ArchiveData *)ud;
+	CompressData *cd = &ad->cd;
+	BuffReader br; BuffWriter bw;
+	ArchiveEntry *e;
+	TempMem *tm;
+
+	if (t_unlikely(ad->n < 0))
+		tightD_compresserror(ts, "invalid number of members");
+	if (t_unlikely(cd->mode & TIGHT_SEEKABLE))
+		tightD_compresserror(ts, "archive members can't be seekable");
+	initcompress(ts, cd);
+	tm = tightA_newtempmem(ts);
+	e = tightA_malloc(ts, (ad->n + 1) * sizeof(*e));
+	updatetm(tm, e, (ad->n + 1) * sizeof(*e));
+	tightB_initbw(&bw, ts, ad->wfd);
+	writeheader(&bw, cd->mode | HEADER_ARCHIVE);
+	for (int i = 0; i < ad->n; i++) {
+		MD5ctx ctx;
+		t_tracef("---Archive member [%s]---\n", ad->names[i]);
+		if (i > 0 && (cd->mode & TIGHT_HUFFMAN)) /* restore header tree */
+			tightS_gencodes(ts, cd->freqs);
+		if (t_unlikely((ad->rfd = ad->openfn(ad->ud, i)) < 0))
+			tightD_errnoerror(ts, ad->names[i]);
+		tightB_initbr(&br, ts, ad->rfd);
+		tight5_init(&ctx);
+		e[i].offset = writeroffset(&bw);
+		e[i].rawsize = compressblocks(&bw, &br, cd, &ctx);
+		e[i].size = writeroffset(&bw) - e[i].offset;
+		tight5_final(&ctx, e[i].checksum);
+		close(ad->rfd);
+		ad->rfd = -1;
+	}
+	writeindex(&bw, ad, e);
+	tightA_free(ts, e, (ad->n + 1) * sizeof(*e));
+	tightS_poptemp(ts);
+	endcompress(ts, cd);
+}
+
+
+TIGHT_API int tight_archive(tight_State *ts, int wfd, int mode,
+							const size_t *freqs, int n,
+							const char *const *names, tight_fOpen openfn,
+							void *ud)
+{
+	ArchiveData ad;
+	int status;
+	ad.cd.freqs = freqs;
+	ad.cd.mode = mode;
+	ad.names = names;
+	ad.openfn = openfn;
+	ad.ud = ud;
+	ad.rfd = -1;
+	ad.wfd = wfd;
+	ad.n = n;
+	t_assert(wfd >= 0);
+	status = tightS_protectedcall(ts, &ad, parchive);
+	if (ad.rfd >= 0) /* error while compressing member ? */
+		close(ad.rfd);
+	return status;
 }
 
 
@@ -263,8 +1235,282 @@ TIGHT_API int tight_compress(tight_State *ts, int mode, const size_t *freqs) {
 	CompressData cd;
 	cd.freqs = freqs;
 	cd.mode = mode;
-	t_assert(ts->rfd >= 0);
-	t_assert(ts->wfd >= 0);
-	t_assert(ts->rfd != ts->wfd);
+	t_assert(tightS_hasio(ts));
 	return tightS_protectedcall(ts, &cd, pcompress);
 }
+
+
+
+/*--------------------------------------------------------------------------
+ * Histogram
+ *-------------------------------------------------------------------------- */
+
+/* size of blocks counted by workers of 'tight_histogram' */
+#define HISTBLOCK		((ulong)1 << 20)
+
+/* bytes counted every 'stride' bytes of sampled 'tight_histogram' */
+#define HISTSAMPLE		((ulong)64 << 10)
+
+
+/* histogram data */
+typedef struct HistogramData {
+	size_t *freqs; /* result */
+	size_t (*wfreqs)[TIGHTBYTES]; /* histogram of each worker */
+	size_t stride; /* bytes from one sample to the next (0 if none) */
+	int nthreads;
+	int fd;
+} HistogramData;
+
+
+/* number of workers (up to 'n') worth starting for scan 's' */
+static int numworkers(Scan *s, int n) {
+	if (n < 1 || s->n == 0) /* no workers for streams */
+		return 1;
+	return (n > MAXWORKERS ? MAXWORKERS : n);
+}
+
+
+/* new zeroed histograms of 'n' workers, anchored in 'TempMem' */
+static size_t (*newfreqs(tight_State *ts, int n))[TIGHTBYTES] {
+	TempMem *tm = tightA_newtempmem(ts);
+	size_t (*wfreqs)[TIGHTBYTES] = tightA_malloc(ts, n * sizeof(*wfreqs));
+	updatetm(tm, wfreqs, n * sizeof(*wfreqs));
+	memset(wfreqs, 0, n * sizeof(*wfreqs));
+	return wfreqs;
+}
+
+
+/* free histograms allocated by 'newfreqs' */
+static void freefreqs(tight_State *ts, size_t (*wfreqs)[TIGHTBYTES], int n) {
+	tightA_free(ts, wfreqs, n * sizeof(*wfreqs));
+	tightS_poptemp(ts);
+}
+
+
+/* add histograms of 'n' workers to 'freqs' */
+static void mergefreqs(size_t *freqs, size_t (*wfreqs)[TIGHTBYTES], int n) {
+	for (int w = 0; w < n; w++)
+		for (int i = 0; i < TIGHTBYTES; i++)
+			freqs[i] += wfreqs[w][i];
+}
+
+
+/* histogram of 'n' bytes at 'p' (zeros if NULL) into 'freqs' */
+static void countblock(tight_State *ts, size_t *freqs, const byte *p, ulong n) {
+	if (p == NULL) { /* hole ? */
+		memset(freqs, 0, TIGHTBYTES * sizeof(size_t));
+		freqs[0] = n;
+	} else
+		ts->kernels->histogram(freqs, p, n);
+}
+
+
+/* add block to histogram of worker 'w' */
+static void histogramblock(tight_State *ts, void *ud, int w, size_t k,
+						   off_t off, const byte *p, ulong n)
+{
+	HistogramData *hd = (HistogramData *)ud;
+	size_t freqs[TIGHTBYTES];
+	(void)k; (void)off; /* unused */
+	countblock(ts, freqs, p, n);
+	for (int i = 0; i < TIGHTBYTES; i++)
+		hd->wfreqs[w][i] += freqs[i];
+}
+
+
+/* run protected histogram */
+static void phistogram(tight_State *ts, void *ud) {
+	HistogramData *hd = (HistogramData *)ud;
+	ulong blocksize = (hd->stride > 0 ? HISTSAMPLE : HISTBLOCK);
+	size_t counted = 0;
+	off_t rawsize;
+	Scan s;
+
+	tightW_initscan(&s, hd->fd, blocksize, hd->stride / blocksize);
+	hd->nthreads = numworkers(&s, hd->nthreads);
+	hd->wfreqs = newfreqs(ts, hd->nthreads);
+	rawsize = tightW_scan(ts, &s, hd->nthreads, histogramblock, hd);
+	memset(hd->freqs, 0, TIGHTBYTES * sizeof(size_t));
+	mergefreqs(hd->freqs, hd->wfreqs, hd->nthreads);
+	freefreqs(ts, hd->wfreqs, hd->nthreads);
+	if (hd->stride > 0) { /* scale samples to the whole input */
+		for (int i = 0; i < TIGHTBYTES; i++)
+			counted += hd->freqs[i];
+		double scale = (counted > 0 ? (double)rawsize / counted : 1.0);
+		for (int i = 0; i < TIGHTBYTES; i++) /* keep a code for each byte */
+			hd->freqs[i] = (hd->freqs[i] > 0 ? (size_t)(hd->freqs[i] * scale + 0.5)
+											 : 1);
+	}
+}
+
+
+TIGHT_API int tight_histogram(tight_State *ts, int fd, int nthreads,
+							  size_t stride, size_t *freqs)
+{
+	HistogramData hd;
+	t_assert(fd >= 0 || ts->io != NULL);
+	hd.freqs = freqs;
+	hd.stride = stride;
+	hd.nthreads = nthreads;
+	hd.fd = fd;
+	return tightS_protectedcall(ts, &hd, phistogram);
+}
+
+
+
+/*--------------------------------------------------------------------------
+ * Estimate
+ *-------------------------------------------------------------------------- */
+
+/* estimate data */
+typedef struct EstimateData {
+	tight_Estimate *est;
+	const size_t *freqs; /* frequencies of header table */
+	const HuffCode *codes; /* codes of header table */
+	size_t (*wfreqs)[TIGHTBYTES]; /* histogram of each worker */
+	TempMem *tmblocks; /* anchors 'est->blocks' */
+	size_t stride; /* bytes from one estimated block to the next */
+	int nthreads;
+	int fd;
+} EstimateData;
+
+
+/* 
+ * Estimate block 'k' of 'n' bytes at 'p' the way 'compressblock' picks
+ * the method of a block in 'TIGHT_HUFFMAN | TIGHT_SEEKABLE' mode.
+ */
+static void estimateblock(tight_State *ts, void *ud, int w, size_t k,
+						  off_t off, const byte *p, ulong n)
+{
+	EstimateData *ed = (EstimateData *)ud;
+	tight_Estimate *est = ed->est;
+	size_t freqs[TIGHTBYTES];
+	HuffCode codes[TIGHTBYTES];
+	TreeData *tree;
+	tight_Block *b;
+	size_t size, best = n;
+
+	if (k >= (size_t)est->nblocks) { /* input of unknown size (in order) ? */
+		int arena = tightA_usearena(ts, 0); /* 'blocks' outlive the call */
+		tightA_growvec(ts, est->blocks, est->sizeblocks_, MAXBLOCKS, k, "blocks");
+		updatetm(ed->tmblocks, est->blocks, est->sizeblocks_ * sizeof(*est->blocks));
+		tightA_usearena(ts, arena);
+		est->nblocks = k + 1;
+	}
+	b = &est->blocks[k];
+	b->offset = off;
+	b->rawsize = n;
+	countblock(ts, freqs, p, n);
+	for (int i = 0; i < TIGHTBYTES; i++)
+		ed->wfreqs[w][i] += freqs[i];
+	b->entropy = shannonbits(freqs, n) / n;
+	size = huffmanbits(ed->codes, freqs);
+	b->tablesize = (size != SIZE_MAX ? (size + 7) / 8 : 0);
+	tree = tightS_gentree(ts, freqs, codes);
+	b->huffsize = (treebits(tree) + huffmanbits(codes, freqs) + 7) / 8;
+	tightT_freeparent(ts, tree);
+	b->method = TIGHT_BLOCK_STORED;
+	if (p == NULL || allzero(p, n)) {
+		b->method = TIGHT_BLOCK_ZERO;
+		best = 0;
+	} else {
+		if (b->tablesize != 0 && b->tablesize < best) {
+			best = b->tablesize;
+			b->method = TIGHT_BLOCK_TABLE;
+		}
+		if ((entropybits(freqs, n) + 7) / 8 < best && b->huffsize < best) {
+			best = b->huffsize;
+			b->method = TIGHT_BLOCK_HUFF;
+		}
+	}
+	b->size = 1 + varintsize(n) + varintsize(best) + best;
+}
+
+
+/* sum up blocks and histograms of workers into totals of 'est' */
+static void sumestimate(tight_State *ts, EstimateData *ed, Scan *s,
+						off_t rawsize)
+{
+	tight_Estimate *est = ed->est;
+	size_t nblocks = ((size_t)rawsize + s->blocksize - 1) / s->blocksize;
+	unsigned long long size = 0, table = 0;
+	double scale, bits;
+
+	mergefreqs(est->freqs, ed->wfreqs, ed->nthreads);
+	for (int i = 0; i < est->nblocks; i++) {
+		const tight_Block *b = &est->blocks[i];
+		est->counted += b->rawsize;
+		size += b->size;
+		table += (b->tablesize != 0 ? b->tablesize : b->rawsize);
+	}
+	est->rawsize = rawsize;
+	scale = (est->counted > 0 ? (double)est->rawsize / est->counted : 0.0);
+	bits = shannonbits(est->freqs, est->counted);
+	est->entropy = (est->counted > 0 ? bits / est->counted : 0.0);
+	est->entropysize = (unsigned long long)(bits / 8 * scale + 0.5);
+	est->tablesize = (unsigned long long)(table * scale + 0.5);
+	est->headersize = sizeof(MAGIC) + 3 + 1 + 1 + 16 +
+					  (treebits(ts->hufftree) + 7) / 8;
+	est->size = est->headersize + (unsigned long long)(size * scale + 0.5) +
+				1 + nblocks * SEEKENTRYSIZE + SEEKTRAILERSIZE; /* end and index */
+}
+
+
+/* run protected estimate */
+static void pestimate(tight_State *ts, void *ud) {
+	EstimateData *ed = (EstimateData *)ud;
+	tight_Estimate *est = ed->est;
+	ulong blocksize = TIGHT_BLOCKSIZE;
+	off_t rawsize;
+	Scan s;
+
+	if (ts->rbuffsize > 0 && ts->rbuffsize < blocksize) /* as 'compressblocks' */
+		blocksize = ts->rbuffsize;
+	tightS_gencodes(ts, ed->freqs); /* header table */
+	ed->codes = ts->codes;
+	tightW_initscan(&s, ed->fd, blocksize, ed->stride / blocksize);
+	ed->tmblocks = tightA_newtempmem(ts);
+	if (s.n > 0) { /* regular file ? */
+		int arena = tightA_usearena(ts, 0); /* 'blocks' outlive the call */
+		tightA_ensurevec(ts, est->blocks, est->sizeblocks_, MAXBLOCKS, 0, s.n,
+						 "blocks");
+		updatetm(ed->tmblocks, est->blocks, est->sizeblocks_ * sizeof(*est->blocks));
+		tightA_usearena(ts, arena);
+		memset(est->blocks, 0, s.n * sizeof(*est->blocks));
+		est->nblocks = s.n;
+	}
+	ed->nthreads = numworkers(&s, ed->nthreads);
+	ed->wfreqs = newfreqs(ts, ed->nthreads);
+	rawsize = tightW_scan(ts, &s, ed->nthreads, estimateblock, ed);
+	sumestimate(ts, ed, &s, rawsize);
+	freefreqs(ts, ed->wfreqs, ed->nthreads);
+	tightS_poptemp(ts); /* 'est' owns 'blocks' now */
+}
+
+
+TIGHT_API int tight_estimate(tight_State *ts, int fd, const size_t *freqs,
+							 int nthreads, size_t stride, tight_Estimate *est)
+{
+	EstimateData ed;
+	int status;
+	t_assert(fd >= 0 || ts->io != NULL);
+	memset(est, 0, sizeof(*est));
+	ed.est = est;
+	ed.freqs = freqs;
+	ed.stride = stride;
+	ed.nthreads = nthreads;
+	ed.fd = fd;
+	status = tightS_protectedcall(ts, &ed, pestimate);
+	if (status != TIGHT_OK) /* 'blocks' were freed */
+		memset(est, 0, sizeof(*est));
+	return status;
+}
+
+
+TIGHT_API void tight_freeestimate(tight_State *ts, tight_Estimate *est) {
+	if (est->blocks)
+		tightA_free(ts, est->blocks, est->sizeblocks_ * sizeof(*est->blocks));
+	est->blocks = NULL;
+	est->nblocks = 0;
+	est->sizeblocks_ = 0;
+}
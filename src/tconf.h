@@ -18,16 +18,53 @@
 #endif
 
 
-/* buffer size when reading input file */
+/* default buffer size when reading input file */
 #if !defined(TIGHT_RBUFFSIZE)
 #define TIGHT_RBUFFSIZE				131072	/* 128 KiB */
 #endif
 
 
-/* buffer size when writting ouput file */
+/* default buffer size when writting ouput file */
 #if !defined(TIGHT_WBUFFSIZE)
 #define TIGHT_WBUFFSIZE				TIGHT_RBUFFSIZE
 #endif
 
 
+/* 
+ * Limits of I/O buffer sizes set with 'tight_setbuffers' and the
+ * largest buffer chosen automatically (for large files).
+ */
+#if !defined(TIGHT_MINBUFFSIZE)
+#define TIGHT_MINBUFFSIZE			1024	/* 1 KiB */
+#endif
+
+#if !defined(TIGHT_MAXBUFFSIZE)
+#define TIGHT_MAXBUFFSIZE			(256u << 20)	/* 256 MiB */
+#endif
+
+#if !defined(TIGHT_MAXAUTOBUFF)
+#define TIGHT_MAXAUTOBUFF			(4u << 20)	/* 4 MiB */
+#endif
+
+
+/* 
+ * Size of uncompressed data in a single block, each block
+ * is encoded independently with the cheapest available method;
+ * blocks are smaller when read buffer is smaller than this.
+ */
+#if !defined(TIGHT_BLOCKSIZE)
+#define TIGHT_BLOCKSIZE				TIGHT_RBUFFSIZE
+#endif
+
+
+/* 
+ * Maximum number of huffman trees in a single order-1 block,
+ * previous byte contexts get clustered into at most this many
+ * trees; must be in range [1, 16].
+ */
+#if !defined(TIGHT_O1TREES)
+#define TIGHT_O1TREES				8
+#endif
+
+
 #endif
@@ -17,6 +17,7 @@
 static void seterrorfmt(tight_State *ts, const char *fmt, va_list ap) {
 	Buffer buf;
 	const char *end;
+	int arena = tightA_usearena(ts, 0); /* message outlives the call */
 
 	tightB_init(ts, &buf);
 	while ((end = strchr(fmt, '%')) != NULL) {
@@ -63,6 +64,7 @@ static void seterrorfmt(tight_State *ts, const char *fmt, va_list ap) {
 		tightA_free(ts, ts->error, strlen(ts->error) + 1);
 	ts->error = tightB_string(&buf);
 	tightS_poptemp(ts);
+	tightA_usearena(ts, arena);
 }
 
 
@@ -92,6 +94,17 @@ t_noret tightD_decompresserror(tight_State *ts, const char *desc) {
 }
 
 
+/* decompression error in block at 'offset' (uncompressed 'rawoffset') */
+t_noret tightD_blockerror(tight_State *ts, const char *desc, size_t offset,
+						  size_t rawoffset)
+{
+	t_assert(desc != NULL);
+	errormsg(ts, "decompression error (%s, block at offset %z, "
+				 "uncompressed offset %z)", desc, offset, rawoffset);
+	tightS_throw(ts, TIGHT_ERRDECOMP);
+}
+
+
 /* malformed TIGHT header error */
 t_noret tightD_headererror(tight_State *ts, const char *extra) {
 	extra = (extra ? extra : "");
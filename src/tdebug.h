@@ -18,6 +18,8 @@
 
 TIGHT_FUNC t_noret tightD_compresserror(tight_State *ts, const char *desc);
 TIGHT_FUNC t_noret tightD_decompresserror(tight_State *ts, const char *desc);
+TIGHT_FUNC t_noret tightD_blockerror(tight_State *ts, const char *desc,
+									 size_t offset, size_t rawoffset);
 TIGHT_FUNC t_noret tightD_headererror(tight_State *ts, const char *extra);
 TIGHT_FUNC t_noret tightD_errnoerror(tight_State *ts, const char *fn);
 TIGHT_FUNC t_noret tightD_limiterror(tight_State *ts, const char *what, size_t limit);
@@ -3,7 +3,14 @@
  * Refer to 'tight.h' for license details.
  *****************************************/
 
+#define _POSIX_C_SOURCE		200809L /* 'pread' */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #if defined(TIGHT_TRACE)
 #include <ctype.h>
@@ -11,15 +18,13 @@
 
 #include "tbuffer.h"
 #include "tdebug.h"
+#include "tfse.h"
 #include "tight.h"
 #include "tinternal.h"
+#include "tscan.h"
 #include "tstate.h"
 
 
-/* extract 'eof' bits from 'bits' */
-#define geofbits(bits)		((bits) & 0x07)
-
-
 
 /* read header 'magic' */
 static void readmagic(BuffReader *br) {
@@ -47,6 +52,8 @@ static void readversion(BuffReader *br, TIGHT *header) {
 			t_tracef(">>> %.*s <<<\n", (int)sizeof(header->version), header->version);
 			if (t_unlikely(header->version[0] != TIGHT_VERSION_MAJOR[0]))
 				tightD_versionerror(br->ts, header->version[0]);
+			if (t_unlikely(header->version[1] != TIGHT_VERSION_MINOR[0]))
+				tightD_headererror(br->ts, " (unsupported minor version)");
 			return; /* ok */
 		}
 	}
@@ -76,37 +83,108 @@ static void readmode(BuffReader *br, TIGHT *header) {
 }
 
 
-/* auxiliary to 'readbindata' */
-static TreeData *decompresstree(BuffReader *br) {
-	int bits = tightB_readnbits(br, 1);
+/* bits in 'BitReader' container */
+#define BITSMAX			((int)(sizeof(uint64_t) * CHAR_BIT))
+
+
+/* 
+ * Bit reader for block payload, it knows how many payload bytes
+ * are left to prevent reading past the block; in case decoder needs
+ * more bits than there are in the payload, zero bits are provided and
+ * 'pad' tracks them, this way decoder does not need to check for
+ * the end of payload on each symbol.
+ */
+typedef struct BitReader {
+	BuffReader *br;
+	size_t left; /* payload bytes not yet read */
+	uint64_t bits; /* bit buffer */
+	int n; /* valid bits in 'bits' */
+	int pad; /* zero bits appended after the end of payload */
+} BitReader;
+
+
+static inline void initbits(BitReader *b, BuffReader *br, size_t size) {
+	b->br = br;
+	b->left = size;
+	b->bits = 0;
+	b->n = b->pad = 0;
+}
+
+
+/* read payload bytes until 'b' contains at least 'need' bits */
+static void fillbits(BitReader *b, int need) {
+	t_assert(need <= BITSMAX - 7);
+	while (b->n < need) {
+		if (t_likely(b->left > 0)) {
+			int c = tightB_brgetc(b->br);
+			if (t_unlikely(c == TIGHTEOF))
+				tightD_decompresserror(b->br->ts, "truncated block");
+			b->bits |= (uint64_t)c << b->n;
+			b->left--;
+		} else { /* end of payload */
+			b->pad += 8;
+		}
+		b->n += 8;
+	}
+}
+
+
+/* read (lazily) 'n' bits */
+static inline uint getbits(BitReader *b, int n) {
+	uint res;
+	t_assert(0 < n && n <= 16);
+	if (b->n < n)
+		fillbits(b, n);
+	res = b->bits & ((1u << n) - 1);
+	b->bits >>= n;
+	b->n -= n;
+	return res;
+}
+
+
+/* 
+ * Check that payload was fully consumed; only padding bits of
+ * the last byte can be left over.
+ */
+static void endbits(BitReader *b) {
+	if (t_unlikely(b->left > 0 || b->n < b->pad || b->n - b->pad >= 8))
+		tightD_decompresserror(b->br->ts, "block size mismatch");
+}
+
+
+/* read huffman tree, 'depth' is the depth of the current node */
+static TreeData *decompresstree(BitReader *b, int depth) {
+	int bits = getbits(b, 1);
 	if (bits == 0) { /* parent ? */ 
+		if (t_unlikely(depth >= MAXCODE))
+			tightD_decompresserror(b->br->ts, "huffman tree too deep");
 		t_trace("[");
-		TreeData *t1 = decompresstree(br);
+		TreeData *t1 = decompresstree(b, depth + 1);
 		t_trace(", ");
-		TreeData *t2 = decompresstree(br);
+		TreeData *t2 = decompresstree(b, depth + 1);
 		t_trace("]");
-		return tightT_newparent(br->ts, t1, t2, 0);
+		return tightT_newparent(b->br->ts, t1, t2, 0);
 	} else { /* leaf */
-		bits = tightB_readnbits(br, 8); /* get symbol */
+		bits = getbits(b, 8); /* get symbol */
 		t_tracef((isgraph(bits) ? "%c" : "%d"), bits);
-		return tightT_newleaf(br->ts, 0, bits);
+		return tightT_newleaf(b->br->ts, 0, bits);
 	}
 }
 
 
 /* decompress header 'bindata' */
 static inline void readbindata(BuffReader *br, TIGHT* header) {
+	BitReader b;
+
 	if (header->mode & TIGHT_HUFFMAN) { /* have huffman tree ? */
 		t_trace("---Decompressing [tree]----\n");
-		br->ts->hufftree = decompresstree(br); /* anchor to state */
+		tightS_freehufftree(br->ts);
+		initbits(&b, br, SIZE_MAX); /* size unknown, 'getbits' is lazy */
+		br->ts->hufftree = decompresstree(&b, 0); /* anchor to state */
 		header->bindata = 1;
 		t_trace("\n");
 		tightD_printtree(br->ts->hufftree);
-		t_assert(br->ts->hufftree != NULL);
-		t_assert(br->validbits > 0); /* should have leftover */
-		tightB_readpending(br, NULL); /* rest is just padding */
-	} else {
-		t_assert(header->mode & (TIGHT_RLE | TIGHT_NONE));
+		t_assert(b.n < 8); /* rest is just padding */
 	}
 }
 
@@ -126,23 +204,10 @@ static void readchecksum(BuffReader *br, TIGHT *header) {
 }
 
 
-/* verify decompressed 'checksum' */ 
-static void verifychecksum(BuffReader *br, TIGHT *header, off_t bindatastart,
-						   ulong bindatasize) 
-{
-	byte out[16];
-	off_t offset;
-
-	/* reset reader */
-	tightB_initbr(br, br->ts, br->fd);
-	/* TODO(jure): Implement LZW */
-	if (header->mode & TIGHT_RLE) return;
-	if (t_unlikely((offset = lseek(br->fd, bindatastart, SEEK_SET)) < 0))
-		tightD_errnoerror(br->ts, "lseek (input file)");
-	t_assert(br->validbits == 0);
-	tightB_genMD5(br->ts, bindatasize, br->fd, out);
-	t_assert((ulong)tightB_offsetreader(br) == bindatastart + bindatasize);
-	int res = memcmp(out, header->checksum, sizeof(out));
+/* verify decompressed 'checksum' against digest 'out' of 'bindata' */ 
+static void verifychecksum(BuffReader *br, TIGHT *header, const byte *out) {
+	if (!header->bindata) return;
+	int res = memcmp(out, header->checksum, sizeof(header->checksum));
 	if (t_unlikely(res != 0))
 		tightD_headererror(br->ts, " (checksum doesn't match)");
 }
@@ -150,6 +215,9 @@ static void verifychecksum(BuffReader *br, TIGHT *header, off_t bindatastart,
 
 /* decompress 'TIGHT' header */
 static void readheader(BuffReader *br, TIGHT *header) {
+	MD5ctx ctx;
+	byte out[16];
+
 	t_assert(sizeof(header->magic) == sizeof(MAGIC));
 	memset(header, 0, sizeof(*header));
 	memcpy(header->magic, MAGIC, sizeof(header->magic));
@@ -157,127 +225,1532 @@ static void readheader(BuffReader *br, TIGHT *header) {
 	readversion(br, header);
 	readOS(br, header);
 	readmode(br, header);
-	off_t bindatastart = tightB_offsetreader(br);
+	tight5_init(&ctx);
+	tightB_startdigest(br, &ctx); /* digest 'bindata' as it is read */
 	readbindata(br, header);
-	off_t bindatasize = tightB_offsetreader(br) - bindatastart;
+	tightB_enddigest(br);
+	tight5_final(&ctx, out);
 	readchecksum(br, header);
-	off_t endofheader = tightB_offsetreader(br);
-	verifychecksum(br, header, bindatastart, bindatasize);
-	if (t_unlikely(lseek(br->fd, endofheader, SEEK_SET) < 0))
-		tightD_errnoerror(br->ts, "lseek (input file)");
+	verifychecksum(br, header, out);
+}
+
+
+/* read block header varint */
+static size_t readvarint(BuffReader *br) {
+	size_t n = 0;
+	uint shift = 0;
+	int c;
+
+	do {
+		c = tightB_brgetc(br);
+		if (t_unlikely(c == TIGHTEOF))
+			tightD_decompresserror(br->ts, "truncated block header");
+		if (t_unlikely(shift >= sizeof(n) * CHAR_BIT))
+			tightD_decompresserror(br->ts, "invalid block size");
+		n |= (size_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return n;
+}
+
+
+/* copy 'n' bytes from 'br' to 'bw' */
+static void copybytes(BuffWriter *bw, BuffReader *br, size_t n) {
+	while (n > 0) {
+		ulong len = (n > br->size ? br->size : n);
+		const byte *p = tightB_brblock(br, &len);
+		if (t_unlikely(len == 0))
+			tightD_decompresserror(br->ts, "truncated block");
+		tightB_writebytes(bw, p, len);
+		n -= len;
+	}
+}
+
+
+/* decode 'BLOCK_RLE' of 'size' bytes into 'rawsize' bytes */
+static void rledecompression(BuffWriter *bw, BuffReader *br, size_t rawsize,
+							 size_t size)
+{
+	size_t len;
+	int c;
+
+	t_trace("---Decompressing [rle]---\n");
+	while (size > 0) {
+		c = tightB_brgetc(br);
+		if (t_unlikely(c == TIGHTEOF))
+			tightD_decompresserror(br->ts, "truncated block");
+		size--;
+		if (c < 128) { /* literals ? */
+			len = c + 1;
+			if (t_unlikely(len > size || len > rawsize))
+				tightD_decompresserror(br->ts, "invalid rle literals");
+			copybytes(bw, br, len);
+			size -= len;
+		} else { /* run */
+			len = c - 128 + RLEMINRUN;
+			if (t_unlikely(size == 0 || len > rawsize))
+				tightD_decompresserror(br->ts, "invalid rle run");
+			c = tightB_brgetc(br);
+			if (t_unlikely(c == TIGHTEOF))
+				tightD_decompresserror(br->ts, "truncated block");
+			size--;
+			for (size_t i = 0; i < len; i++)
+				tightB_writebyte(bw, c);
+		}
+		rawsize -= len;
+	}
+	if (t_unlikely(rawsize != 0))
+		tightD_decompresserror(br->ts, "rle size mismatch");
 }
 
 
-/* get symbol from huffman 'code' */
-static int getsymbol(TreeData **cp, TreeData *curr, int *code, int *nbits, int limit) 
+/* bits resolved by a single 'DecodeEntry' lookup */
+#define DECBITS			10
+
+/* number of entries in decode table */
+#define DECSIZE			(1 << DECBITS)
+
+
+/* 
+ * Decode table entry; indexed by the next 'DECBITS' bits, codes
+ * not longer than 'DECBITS' are resolved directly, otherwise 't'
+ * is the subtree where to continue walking bit by bit.
+ */
+typedef struct DecodeEntry {
+	const TreeData *t; /* subtree, NULL if 'sym' is resolved */
+	ushrt sym; /* decoded symbol */
+	byte nbits; /* bits consumed */
+} DecodeEntry;
+
+
+/* fill decode table 'tab' from tree 't' at 'depth' with 'code' prefix */
+static void filltable(DecodeEntry *tab, const TreeData *t, uint code, int depth) {
+	if (t->left == NULL || depth == DECBITS) {
+		for (uint i = code; i < DECSIZE; i += (1u << depth)) {
+			tab[i].t = (t->left ? t : NULL);
+			tab[i].sym = t->c;
+			tab[i].nbits = depth;
+		}
+	} else {
+		filltable(tab, t->left, code, depth + 1);
+		filltable(tab, t->right, code | (1u << depth), depth + 1);
+	}
+}
+
+
+/* get symbol using decode table 'tab' */
+static inline int getsymbol(BitReader *b, const DecodeEntry *tab) {
+	const DecodeEntry *e;
+	const TreeData *t;
+
+	if (b->n < MAXCODE)
+		fillbits(b, BITSMAX - 7);
+	e = &tab[b->bits & (DECSIZE - 1)];
+	b->bits >>= e->nbits;
+	b->n -= e->nbits;
+	if (t_likely(e->t == NULL)) /* resolved ? */
+		return e->sym;
+	for (t = e->t; t->left != NULL; b->n--) { /* walk the rest */
+		t = (b->bits & 0x01 ? t->right : t->left);
+		b->bits >>= 1;
+	}
+	return t->c;
+}
+
+
+/* entry of block index with checksum */
+typedef struct BlockCheck {
+	uint64_t offset; /* file offset of the block */
+	byte digest[16]; /* MD5 of its uncompressed bytes */
+} BlockCheck;
+
+
+/* maximum number of collected 'BlockCheck's */
+#define MAXCHECKS		(INT_MAX / (int)sizeof(BlockCheck))
+
+
+/* how decoded blocks are checked ('check' in 'DecompressData') */
+#define CHECK_NONE		0	/* not at all */
+#define CHECK_INDEX		1	/* against 'checks' read from block index */
+#define CHECK_COLLECT	2	/* 'checks' are collected, index follows blocks */
+
+
+/* decompression data */
+typedef struct DecompressData {
+	DecodeEntry *tables; /* decode tables, first one is for 'hufftree' */
+	TreeData *trees[TIGHT_O1TREES]; /* order-1 trees */
+	int ntrees; /* number of order-1 trees */
+	int havetable; /* true if first table is built from 'hufftree' */
+	int seekable; /* true if 'BLOCK_HUFF' trees are block-only */
+	BuffReader *ref; /* reader of reference (delta) or NULL */
+	off_t refpos; /* offset of 'ref', -1 if not known */
+	off_t refsize; /* size of reference */
+	size_t stop; /* stop after this many uncompressed bytes */
+	byte *fse; /* FSE payload and output (allocated on demand) */
+	int locate; /* true if 'block' and 'rawpos' are kept (verification) */
+	off_t block; /* offset of the current block, -1 if none */
+	size_t rawpos; /* uncompressed offset of the current block */
+	size_t blockraw; /* uncompressed size of the current block */
+	size_t nblocks; /* number of decoded blocks */
+	int check; /* how decoded blocks are checked ('CHECK_*') */
+	BlockCheck *checks; /* entries of decoded blocks */
+	size_t nchecks; /* number of 'checks' ('CHECK_INDEX') */
+	uint sizechecks; /* size of 'checks' ('CHECK_COLLECT') */
+	size_t checkraw; /* uncompressed offset of the first of 'checks' */
+	size_t checksize; /* uncompressed bytes in a block (of 'checks') */
+	TempMem *tmchecks; /* anchors 'checks' */
+	byte zerodigest[16]; /* MD5 of 'zerosize' zero bytes */
+	size_t zerosize; /* size of zero blocks in 'zerodigest', 0 if none */
+} DecompressData;
+
+
+/* size of 'fse' in 'DecompressData' */
+#define FSESCRATCH		(TIGHT_BLOCKSIZE * 2 + 32)
+
+/* size of 'tables' in 'DecompressData' */
+#define DECTABSIZE		((TIGHT_O1TREES + 1) * DECSIZE * sizeof(DecodeEntry))
+
+
+/* free order-1 trees (and block-only tree) */
+static void o1freetrees(tight_State *ts, DecompressData *dd) {
+	while (dd->ntrees > 0) {
+		TreeData *t = dd->trees[--dd->ntrees];
+		tightT_freeparent(ts, t);
+	}
+}
+
+
+/* decode huffman block, 'tree' is true if block has its own tree */
+static void huffmandecompression(BuffWriter *bw, BuffReader *br,
+								 DecompressData *dd, size_t rawsize,
+								 size_t size, int tree)
 {
-	if (curr->left == NULL) { /* leaf ? */
-		t_assert(curr->right == NULL);
-		t_tracef((isgraph(curr->c) ? "%c" : "%hu"), curr->c);
-		return curr->c;
-	} else if (*nbits <= limit) { /* hit limit ? */
-		*cp = curr; /* set checkpoint */
-		return -1; /* return indicator */
-	} else { /* parent */
-		byte direction = *code & 0x01;
-		*code >>= 1;
-		t_assert(*nbits > 0);
-		*nbits -= 1;
-		int sym;
-		if (direction) /* 1 (right) */
-			sym = getsymbol(cp, curr->right, code, nbits, limit);
-		else /* 0 (left) */
-			sym = getsymbol(cp, curr->left, code, nbits, limit);
-		return sym;
-	}
-}
-
-
-/* decompress file contents */
-static inline void huffmandecompression(BuffWriter *bw, BuffReader *br) {
 	tight_State *ts = bw->ts;
-	TreeData *at = ts->hufftree; /* checkpoint */
-	int ahead, sym = -1, code, left;
+	const DecodeEntry *tab = dd->tables;
+	BitReader b;
 
-	t_assert(br->validbits == 0); /* data must be aligned */
-	t_assert(ts->hufftree != NULL); /* must have decompressed huffman tree */
 	t_trace("---Decompressing [huffman]---\n");
+	initbits(&b, br, size);
+	if (tree && dd->seekable) { /* block-only tree (kept in order-1 slot) */
+		t_assert(dd->ntrees == 0);
+		dd->trees[0] = decompresstree(&b, 0);
+		dd->ntrees = 1;
+		tightD_printtree(dd->trees[0]);
+		int phase = tightS_phase(ts, TIGHT_PHASE_TREE);
+		filltable(&dd->tables[DECSIZE], dd->trees[0], 0, 0);
+		tightS_phase(ts, phase);
+		tab = &dd->tables[DECSIZE];
+	} else if (tree) {
+		tightS_freehufftree(ts);
+		ts->hufftree = decompresstree(&b, 0);
+		tightD_printtree(ts->hufftree);
+		dd->havetable = 0;
+	} else if (t_unlikely(ts->hufftree == NULL)) {
+		tightD_decompresserror(ts, "missing huffman tree");
+	}
+	if (tab == dd->tables && !dd->havetable) {
+		int phase = tightS_phase(ts, TIGHT_PHASE_TREE);
+		filltable(dd->tables, ts->hufftree, 0, 0);
+		dd->havetable = 1;
+		tightS_phase(ts, phase);
+	}
+	while (rawsize-- > 0)
+		tightB_writebyte(bw, getsymbol(&b, tab));
+	endbits(&b);
+	o1freetrees(ts, dd);
+}
 
-	int c1 = tightB_brgetc(br);
-	if (t_unlikely(c1 == TIGHTEOF)) { /* empty file ? */
-		t_assert(bw->len == 0); /* nothing to write */
-		return;
+
+/* decode order-1 block */
+static void o1decompression(BuffWriter *bw, BuffReader *br, DecompressData *dd,
+							size_t rawsize, size_t size)
+{
+	tight_State *ts = bw->ts;
+	byte map[TIGHTBYTES];
+	const DecodeEntry *tabs[TIGHTBYTES]; /* context -> decode table */
+	BitReader b;
+	int ntrees, mapbits, k;
+	int prev = 0;
+
+	t_trace("---Decompressing [order-1]---\n");
+	initbits(&b, br, size);
+	ntrees = getbits(&b, 4) + 1;
+	if (t_unlikely(ntrees > TIGHT_O1TREES))
+		tightD_decompresserror(ts, "too many order-1 trees");
+	for (mapbits = 0; (1 << mapbits) < ntrees; mapbits++);
+	for (k = 0; k < TIGHTBYTES; k++) {
+		map[k] = (mapbits > 0 ? getbits(&b, mapbits) : 0);
+		if (t_unlikely(map[k] >= ntrees))
+			tightD_decompresserror(ts, "invalid order-1 context map");
+	}
+	for (k = 0; k < ntrees; k++) {
+		dd->trees[k] = decompresstree(&b, 0);
+		dd->ntrees++;
+		int phase = tightS_phase(ts, TIGHT_PHASE_TREE);
+		filltable(&dd->tables[(k + 1) * DECSIZE], dd->trees[k], 0, 0);
+		tightS_phase(ts, phase);
+	}
+	for (k = 0; k < TIGHTBYTES; k++)
+		tabs[k] = &dd->tables[(map[k] + 1) * DECSIZE];
+	while (rawsize-- > 0) {
+		prev = getsymbol(&b, tabs[prev]);
+		tightB_writebyte(bw, prev);
+	}
+	endbits(&b);
+	o1freetrees(ts, dd);
+}
+
+
+/* decode FSE block */
+static void fsedecompression(BuffWriter *bw, BuffReader *br, DecompressData *dd,
+							 size_t rawsize, size_t size)
+{
+	tight_State *ts = bw->ts;
+	byte *in, *out;
+
+	t_trace("---Decompressing [FSE]---\n");
+	if (t_unlikely(rawsize > TIGHT_BLOCKSIZE || size > TIGHT_BLOCKSIZE))
+		tightD_decompresserror(ts, "FSE block too large");
+	if (dd->fse == NULL)
+		dd->fse = tightA_cached(ts, CACHE_DECFSE, FSESCRATCH);
+	in = dd->fse + 8; /* 8 bytes of padding on both sides */
+	out = in + TIGHT_BLOCKSIZE + 8;
+	if (t_unlikely(tightB_brread(br, in, size) != size))
+		tightD_decompresserror(ts, "truncated block");
+	memset(in + size, 0, 8);
+	tightF_decompress(ts, out, rawsize, in, size);
+	tightB_writebytes(bw, out, rawsize);
+}
+
+
+/* 'BLOCK_REF' decodes the block it refers to */
+static void refdecompression(BuffWriter *bw, BuffReader *br,
+							 DecompressData *dd, size_t rawsize, size_t size);
+
+/* 'BLOCK_COPY' copies bytes of reference */
+static void copydecompression(BuffWriter *bw, BuffReader *br,
+							  DecompressData *dd, size_t rawsize, size_t size);
+
+
+/* decode block of 'type' (its header was read) */
+static void decodeblock(BuffWriter *bw, BuffReader *br, DecompressData *dd,
+						int type, size_t rawsize, size_t size)
+{
+	t_tracef("---Block [type %d, %zu -> %zu]---\n", type, size, rawsize);
+	switch (type) {
+	case BLOCK_STORED:
+		if (t_unlikely(rawsize != size))
+			tightD_decompresserror(br->ts, "stored block size mismatch");
+		if (t_unlikely(tightB_copy(bw, br, size) != size))
+			tightD_decompresserror(br->ts, "truncated block");
+		break;
+	case BLOCK_RLE:
+		rledecompression(bw, br, rawsize, size);
+		break;
+	case BLOCK_HUFF: case BLOCK_HUFFPREV:
+		huffmandecompression(bw, br, dd, rawsize, size, type == BLOCK_HUFF);
+		break;
+	case BLOCK_ORDER1:
+		o1decompression(bw, br, dd, rawsize, size);
+		break;
+	case BLOCK_FSE:
+		fsedecompression(bw, br, dd, rawsize, size);
+		break;
+	case BLOCK_REF:
+		refdecompression(bw, br, dd, rawsize, size);
+		break;
+	case BLOCK_COPY:
+		copydecompression(bw, br, dd, rawsize, size);
+		break;
+	case BLOCK_ZERO:
+		if (t_unlikely(size != 0 || rawsize > TIGHT_BLOCKSIZE))
+			tightD_decompresserror(br->ts, "invalid zero block");
+		tightB_writezeros(bw, rawsize);
+		break;
+	default:
+		tightD_decompresserror(br->ts, "unknown block type");
+	}
+}
+
+
+/* size of varint 'n' */
+static int varintsize(size_t n) {
+	int size = 1;
+	while (n >= 0x80) {
+		n >>= 7;
+		size++;
+	}
+	return size;
+}
+
+
+/*
+ * Decode 'BLOCK_REF' by decoding the block it refers to, input must be
+ * seekable; reader continues after the reference.
+ */
+static void refdecompression(BuffWriter *bw, BuffReader *br,
+							 DecompressData *dd, size_t rawsize, size_t size)
+{
+	tight_State *ts = br->ts;
+	off_t end = tightB_offsetreader(br); /* end of block header */
+	off_t start = end - (1 + varintsize(rawsize) + varintsize(size));
+	size_t dist = readvarint(br);
+	int type;
+
+	t_trace("---Decompressing [reference]---\n");
+	if (t_unlikely(varintsize(dist) != (int)size || dist == 0 || start < 0 ||
+				   dist > (size_t)start))
+		tightD_decompresserror(ts, "invalid block reference");
+	tightB_seekreader(br, start - dist, SEEK_SET);
+	type = tightB_brgetc(br);
+	if (t_unlikely(type == TIGHTEOF || type == BLOCK_END ||
+				   type == BLOCK_REF || type == BLOCK_ZERO))
+		tightD_decompresserror(ts, "invalid block reference");
+	if (t_unlikely(readvarint(br) != rawsize))
+		tightD_decompresserror(ts, "block reference size mismatch");
+	decodeblock(bw, br, dd, type, rawsize, readvarint(br));
+	tightB_seekreader(br, end + size, SEEK_SET);
+}
+
+
+/* decode 'BLOCK_COPY' of reference bytes (seeks only when not in order) */
+static void copydecompression(BuffWriter *bw, BuffReader *br,
+							  DecompressData *dd, size_t rawsize, size_t size)
+{
+	size_t offset = readvarint(br);
+
+	t_trace("---Decompressing [copy]---\n");
+	if (t_unlikely(dd->ref == NULL || varintsize(offset) != (int)size ||
+				   offset > (size_t)dd->refsize ||
+				   rawsize > (size_t)dd->refsize - offset))
+		tightD_decompresserror(br->ts, "invalid copy block");
+	if ((off_t)offset != dd->refpos)
+		tightB_seekreader(dd->ref, offset, SEEK_SET);
+	dd->refpos = -1; /* unknown in case copy fails */
+	if (t_unlikely(tightB_copy(bw, dd->ref, rawsize) != rawsize))
+		tightD_decompresserror(br->ts, "reference file shrank");
+	dd->refpos = offset + rawsize;
+}
+
+
+/* start digest of the next block into 'ctx' */
+static void startcheck(BuffWriter *bw, DecompressData *dd, MD5ctx *ctx,
+					   int type)
+{
+	if (dd->check == CHECK_COLLECT) {
+		tightA_growvec(bw->ts, dd->checks, dd->sizechecks, MAXCHECKS,
+					   dd->nblocks, "blocks");
+		updatetm(dd->tmchecks, dd->checks,
+				 dd->sizechecks * sizeof(*dd->checks));
+	} else if (t_unlikely(dd->nblocks >= dd->nchecks)) {
+		tightD_decompresserror(bw->ts, "more blocks than in block index");
+	}
+	tightB_digestwriter(bw); /* bytes before the block are not in it */
+	if (type != BLOCK_ZERO) { /* zeros can still become a hole */
+		tight5_init(ctx);
+		bw->md5 = ctx;
 	}
+}
+
 
-	t_trace("[");
-	int c2 = tightB_brgetc(br);
-	if (t_unlikely(c2 == TIGHTEOF)) { /* 'eof' in 'c1' ? */
-		left = geofbits(c1) - 2; /* eof without bias */
-		t_assert(left <= 8 - EOFBITS);
-		code = c1 >> 3;
-		goto eof;
-	}
-
-	code = (c2 << 8) | c1;
-	left = MAXCODE;
-	while ((ahead = tightB_brgetc(br)) != TIGHTEOF) {
-		t_assert(left == MAXCODE);
-		for (;;) {
-			sym = getsymbol(&at, at, &code, &left, MAXCODE >> 1);
-			if (sym == -1) break; /* check next 8 bits */
-			t_trace(",");
-			at = ts->hufftree;
-			tightB_writebyte(bw, sym);
+/* check (or collect) digest of the decoded block of 'rawsize' bytes */
+static void endcheck(BuffWriter *bw, DecompressData *dd, MD5ctx *ctx,
+					 size_t rawsize)
+{
+	BlockCheck *c = &dd->checks[dd->nblocks];
+	byte out[16];
+
+	if (bw->md5) {
+		tightB_digestwriter(bw);
+		bw->md5 = NULL;
+		tight5_final(ctx, out);
+	} else { /* zero block */
+		if (dd->zerosize != rawsize) {
+			int phase = tightS_phase(bw->ts, TIGHT_PHASE_MD5);
+			tight5_zeros(dd->zerodigest, rawsize);
+			dd->zerosize = rawsize;
+			tightS_phase(bw->ts, phase);
 		}
-		t_assert(left == 8);
-		code |= ahead << left;
-		left += 8;
-	}
-	t_assert(left == MAXCODE);
-	/* eof with bias and previous byte has 8 valid bits */
-	left = geofbits(code >> 8) + EOFBIAS;
-	t_assert(left <= MAXCODE - EOFBITS);
-	code = ((code & 0xff00) >> 3) | (code & 0xff);
-
-eof:
-	while (left > 0) {
-		t_trace((sym != -1 ? "," : ""));
-		sym = getsymbol(&at, at, &code, &left, 0);
-		if (t_unlikely(sym == -1)) {
-			t_trace("\n");
-			tightD_decompresserror(ts, "invalid huffman code");
+		memcpy(out, dd->zerodigest, sizeof(out));
+	}
+	if (dd->check == CHECK_COLLECT)
+		memcpy(c->digest, out, sizeof(out));
+	else if (t_unlikely(memcmp(out, c->digest, sizeof(out)) != 0))
+		tightD_blockerror(bw->ts, "block checksum doesn't match", c->offset,
+						  dd->checkraw + dd->nblocks * dd->checksize);
+}
+
+
+/* 
+ * Decompress blocks until 'BLOCK_END' (or until 'stop' bytes of 'dd'
+ * are decoded), returns uncompressed size. Blocks are checked against
+ * 'checks' of 'dd' (if any).
+ */
+static size_t decompressblocks(BuffWriter *bw, BuffReader *br,
+							   DecompressData *dd)
+{
+	size_t rawsize, size, total = 0;
+	MD5ctx ctx;
+	int type;
+
+	t_assert(dd->check == CHECK_NONE || bw->md5 == NULL);
+	tightS_phase(br->ts, TIGHT_PHASE_DECODE);
+	while (total < dd->stop && (type = tightB_brgetc(br)) != BLOCK_END) {
+		if (t_unlikely(type == TIGHTEOF))
+			tightD_decompresserror(br->ts, "missing end block");
+		if (dd->locate) { /* in case the block is corrupt */
+			dd->block = tightB_offsetreader(br) - 1;
+			dd->rawpos = total;
+			dd->blockraw = 0; /* not known yet */
 		}
-		at = ts->hufftree;
-		t_assert(sym >= 0);
-		tightB_writebyte(bw, sym);
+		rawsize = readvarint(br);
+		size = readvarint(br);
+		dd->blockraw = rawsize;
+		if (dd->check != CHECK_NONE)
+			startcheck(bw, dd, &ctx, type);
+		decodeblock(bw, br, dd, type, rawsize, size);
+		if (dd->check != CHECK_NONE)
+			endcheck(bw, dd, &ctx, rawsize);
+		dd->nblocks++;
+		total += rawsize;
 	}
-	t_trace("]\n");
-	t_assert(left == 0);
+	tightS_phase(br->ts, TIGHT_PHASE_OTHER);
 	tightB_writefile(bw); /* write all */
+	return total;
+}
+
+
+/* initialize 'dd', decode tables are per-state buffer */
+static void initdecompress(tight_State *ts, DecompressData *dd) {
+	dd->tables = tightA_cached(ts, CACHE_DECTABLES, DECTABSIZE);
+	dd->ntrees = 0;
+	dd->havetable = 0;
+	dd->seekable = 0;
+	dd->ref = NULL;
+	dd->refpos = -1;
+	dd->refsize = 0;
+	dd->stop = SIZE_MAX;
+	dd->fse = NULL;
+	dd->locate = 0;
+	dd->block = -1;
+	dd->rawpos = 0;
+	dd->blockraw = 0;
+	dd->nblocks = 0;
+	dd->check = CHECK_NONE;
+	dd->checks = NULL;
+	dd->nchecks = 0;
+	dd->sizechecks = 0;
+	dd->tmchecks = NULL;
+	dd->zerosize = 0;
+}
+
+
+/*
+ * Check reference of delta file (its size follows the header) and
+ * start reading it with 'ref'.
+ */
+static void startdelta(BuffReader *br, DecompressData *dd, BuffReader *ref) {
+	tight_State *ts = br->ts;
+	struct stat st;
+	size_t refsize = readvarint(br);
+
+	if (t_unlikely(ts->reffd < 0))
+		tightD_headererror(ts, " (missing reference file)");
+	if (t_unlikely(fstat(ts->reffd, &st) < 0))
+		tightD_errnoerror(ts, "fstat (reference file)");
+	if (t_unlikely(!S_ISREG(st.st_mode) || (size_t)st.st_size != refsize))
+		tightD_headererror(ts, " (reference file doesn't match)");
+	tightB_initrefbr(ref, ts, ts->reffd);
+	dd->ref = ref;
+	dd->refsize = st.st_size;
 }
 
 
-/* TODO(jure): implement LZW */
-/* TODO(jure): Implement Vitter algorithm */
-/* TODO(jure): combine Huffman and LZW to prevent reading the file twice */
+/* read MD5 of delta contents and verify it against digest 'out' */
+static void verifydelta(BuffReader *br, const byte *out) {
+	byte checksum[16];
+	if (t_unlikely(tightB_brread(br, checksum, sizeof(checksum)) !=
+				   sizeof(checksum)))
+		tightD_decompresserror(br->ts, "missing delta checksum");
+	tightD_printchecksum(checksum, sizeof(checksum));
+	if (t_unlikely(memcmp(out, checksum, sizeof(checksum)) != 0))
+		tightD_decompresserror(br->ts,
+				"delta checksum doesn't match reference");
+}
+
+
+/* 'TIGHT_SEEKABLE' blocks are checked against block index */
+static void startchecks(BuffReader *br, DecompressData *dd);
+static void endchecks(BuffReader *br, DecompressData *dd);
+
+
 /* protected decompression */
 static void pdecompress(tight_State *ts, void *ud) {
 	TIGHT header;
-	BuffReader br; BuffWriter bw;
+	BuffReader br, ref; BuffWriter bw;
+	DecompressData dd;
+	MD5ctx ctx;
+	byte out[16];
 
 	t_trace("\n***Decompression start!***\n\n");
 	(void)ud; /* unused */
 	tightB_initbr(&br, ts, ts->rfd);
 	tightB_initbw(&bw, ts, ts->wfd);
 	readheader(&br, &header);
-	if (header.mode & TIGHT_HUFFMAN)
-		huffmandecompression(&bw, &br);
-	if (header.mode & TIGHT_RLE) {}
+	if (t_unlikely(header.mode & HEADER_ARCHIVE))
+		tightD_headererror(ts, " (file is an archive)");
+	initdecompress(ts, &dd);
+	dd.seekable = (header.mode & (TIGHT_SEEKABLE | TIGHT_DEDUP)) != 0;
+	if (header.mode & TIGHT_SEEKABLE)
+		startchecks(&br, &dd);
+	if (header.mode & HEADER_DELTA) {
+		startdelta(&br, &dd, &ref);
+		tight5_init(&ctx);
+		bw.md5 = &ctx;
+	}
+	if (!(header.mode & TIGHT_DEDUP)) /* references seek the input */
+		tightB_readahead(&br);
+	tightB_writebehind(&bw);
+	decompressblocks(&bw, &br, &dd);
+	endchecks(&br, &dd);
+	if (header.mode & HEADER_DELTA) {
+		tight5_final(&ctx, out);
+		verifydelta(&br, out);
+	}
+	tightB_endwritebehind(&bw);
+	tightB_endreadahead(&br);
 	t_trace("\n***Decompression complete!***\n\n");
 }
 
 
 TIGHT_API int tight_decompress(tight_State *ts) {
-	t_assert(ts->rfd >= 0 && ts->wfd >= 0 && ts->rfd != ts->wfd);
+	t_assert(tightS_hasio(ts));
 	return tightS_protectedcall(ts, NULL, pdecompress);
 }
+
+
+
+/*--------------------------------------------------------------------------
+ * Archive
+ *-------------------------------------------------------------------------- */
+
+/* seek reader 'br' to 'offset' */
+static void seekreader(BuffReader *br, off_t offset) {
+	tightB_seekreader(br, offset, SEEK_SET);
+}
+
+
+/* get 8 bytes from 'p' (little endian) */
+static uint64_t getu64(const byte *p) {
+	uint64_t n = 0;
+	for (int i = 7; i >= 0; i--)
+		n = (n << 8) | p[i];
+	return n;
+}
+
+
+/* read exactly 'n' bytes into 'out' */
+static void readbytes(BuffReader *br, byte *out, size_t n) {
+	if (t_unlikely(tightB_brread(br, out, n) != n))
+		tightD_headererror(br->ts, " (truncated index)");
+}
+
+
+/* read archive header and check it is an archive, returns its end offset */
+static off_t readarchiveheader(BuffReader *br, TIGHT *header) {
+	seekreader(br, 0);
+	readheader(br, header);
+	if (t_unlikely(!(header->mode & HEADER_ARCHIVE)))
+		tightD_headererror(br->ts, " (not an archive)");
+	return tightB_offsetreader(br);
+}
+
+
+/* index reading data */
+typedef struct IndexData {
+	tight_Index *index;
+	int fd;
+} IndexData;
+
+
+/* protected index reading */
+static void preadindex(tight_State *ts, void *ud) {
+	IndexData *id = (IndexData *)ud;
+	tight_Index *index = id->index;
+	BuffReader br;
+	TIGHT header;
+	byte trailer[ARCTRAILERSIZE], out[16];
+	TempMem *tmm, *tmn;
+	off_t start, end, offset;
+	size_t size, n, used = 0;
+
+	tightB_initbr(&br, ts, id->fd);
+	start = readarchiveheader(&br, &header);
+	end = tightB_seekreader(&br, 0, SEEK_END);
+	if (t_unlikely(end - start < ARCTRAILERSIZE))
+		tightD_headererror(ts, " (missing archive trailer)");
+	end -= ARCTRAILERSIZE;
+	seekreader(&br, end);
+	readbytes(&br, trailer, sizeof(trailer));
+	if (t_unlikely(memcmp(&trailer[24], ARCMAGIC, sizeof(ARCMAGIC)) != 0))
+		tightD_headererror(ts, " (invalid archive trailer)");
+	offset = getu64(trailer);
+	if (t_unlikely(offset < start || offset > end))
+		tightD_headererror(ts, " (invalid archive index offset)");
+	size = end - offset;
+	seekreader(&br, offset);
+	tightB_genMD5(ts, size, id->fd, out);
+	if (t_unlikely(memcmp(out, &trailer[8], sizeof(out)) != 0))
+		tightD_headererror(ts, " (archive index checksum doesn't match)");
+
+	seekreader(&br, offset);
+	n = readvarint(&br);
+	if (t_unlikely(n > size / ARCMINENTRY || n > INT_MAX))
+		tightD_headererror(ts, " (invalid archive member count)");
+	index->n = n;
+	index->namessize_ = size + 1;
+	tightA_usearena(ts, 0); /* 'index' outlives the call */
+	tmm = tightA_newtempmem(ts);
+	index->members = tightA_malloc(ts, (n + 1) * sizeof(tight_Member));
+	updatetm(tmm, index->members, (n + 1) * sizeof(tight_Member));
+	tmn = tightA_newtempmem(ts);
+	index->names_ = tightA_malloc(ts, index->namessize_);
+	updatetm(tmn, index->names_, index->namessize_);
+	for (size_t i = 0; i < n; i++) {
+		tight_Member *m = &index->members[i];
+		size_t len = readvarint(&br);
+		if (t_unlikely(len >= index->namessize_ - used))
+			tightD_headererror(ts, " (invalid archive member name)");
+		readbytes(&br, (byte *)&index->names_[used], len);
+		index->names_[used + len] = '\0';
+		m->name = &index->names_[used];
+		used += len + 1;
+		m->offset = readvarint(&br);
+		m->size = readvarint(&br);
+		m->rawsize = readvarint(&br);
+		readbytes(&br, out, 1);
+		m->mode = out[0];
+		readbytes(&br, m->checksum, sizeof(m->checksum));
+		if (t_unlikely(m->offset < (size_t)start || m->offset > (size_t)offset ||
+					   m->size > (size_t)offset - m->offset))
+			tightD_headererror(ts, " (invalid archive member offset)");
+	}
+	/* 'index' owns the memory now */
+	tightS_poptemp(ts);
+	tightS_poptemp(ts);
+}
+
+
+TIGHT_API int tight_readindex(tight_State *ts, int fd, tight_Index *index) {
+	IndexData id;
+	t_assert(fd >= 0);
+	id.index = index;
+	id.fd = fd;
+	index->members = NULL;
+	index->names_ = NULL;
+	index->n = 0;
+	index->namessize_ = 0;
+	return tightS_protectedcall(ts, &id, preadindex);
+}
+
+
+TIGHT_API void tight_freeindex(tight_State *ts, tight_Index *index) {
+	if (index->members)
+		tightA_free(ts, index->members, (index->n + 1) * sizeof(tight_Member));
+	if (index->names_)
+		tightA_free(ts, index->names_, index->namessize_);
+	index->members = NULL;
+	index->names_ = NULL;
+	index->n = 0;
+}
+
+
+/* protected member extraction */
+static void pextract(tight_State *ts, void *ud) {
+	const tight_Member *m = (const tight_Member *)ud;
+	BuffReader br; BuffWriter bw;
+	DecompressData dd;
+	TIGHT header;
+	MD5ctx ctx;
+	byte out[16];
+	size_t rawsize;
+
+	tightB_initbr(&br, ts, ts->rfd);
+	tightB_initbw(&bw, ts, ts->wfd);
+	readarchiveheader(&br, &header); /* shared tree */
+	seekreader(&br, m->offset);
+	tight5_init(&ctx);
+	bw.md5 = &ctx;
+	initdecompress(ts, &dd);
+	dd.seekable = (header.mode & TIGHT_DEDUP) != 0;
+	rawsize = decompressblocks(&bw, &br, &dd);
+	tight5_final(&ctx, out);
+	if (t_unlikely(rawsize != m->rawsize))
+		tightD_decompresserror(ts, "archive member size mismatch");
+	if (t_unlikely(memcmp(out, m->checksum, sizeof(out)) != 0))
+		tightD_decompresserror(ts, "archive member checksum doesn't match");
+}
+
+
+TIGHT_API int tight_extract(tight_State *ts, const tight_Member *member) {
+	t_assert(tightS_hasio(ts));
+	return tightS_protectedcall(ts, (void *)member, pextract);
+}
+
+
+
+/*--------------------------------------------------------------------------
+ * Range decompression
+ *-------------------------------------------------------------------------- */
+
+/* range of uncompressed bytes */
+typedef struct RangeData {
+	size_t offset;
+	size_t length;
+} RangeData;
+
+
+/* block index of seekable file */
+typedef struct BlockIndex {
+	uint64_t offset; /* offset of index */
+	uint64_t rawsize; /* uncompressed size */
+	uint64_t blocksize; /* uncompressed bytes in a block */
+	uint64_t nblocks; /* number of blocks */
+	int entrysize; /* size of index entry */
+} BlockIndex;
+
+
+/*
+ * Read trailer of block index that starts after header (at 'start')
+ * into 'bi', index entries hold checksums only if 'entrysize' is
+ * 'SEEKENTRYSIZE'.
+ */
+static void readblockindex(BuffReader *br, BlockIndex *bi, off_t start) {
+	tight_State *ts = br->ts;
+	byte trailer[SEEKTRAILERSIZE];
+	off_t end;
+
+	end = tightB_seekreader(br, 0, SEEK_END);
+	if (t_unlikely(end - start < SEEKTRAILERSIZE))
+		tightD_headererror(ts, " (missing block index trailer)");
+	end -= SEEKTRAILERSIZE;
+	seekreader(br, end);
+	readbytes(br, trailer, sizeof(trailer));
+	if (memcmp(&trailer[24], SEEKSUMMAGIC, sizeof(SEEKSUMMAGIC)) == 0)
+		bi->entrysize = SEEKENTRYSIZE;
+	else if (memcmp(&trailer[24], SEEKMAGIC, sizeof(SEEKMAGIC)) == 0)
+		bi->entrysize = 8;
+	else
+		tightD_headererror(ts, " (invalid block index trailer)");
+	bi->offset = getu64(trailer);
+	bi->rawsize = getu64(&trailer[8]);
+	bi->blocksize = getu64(&trailer[16]);
+	if (t_unlikely(bi->blocksize == 0 || bi->offset < (uint64_t)start ||
+				   bi->offset > (uint64_t)end))
+		tightD_headererror(ts, " (invalid block index)");
+	bi->nblocks = bi->rawsize / bi->blocksize +
+				  (bi->rawsize % bi->blocksize != 0);
+	if (t_unlikely((end - bi->offset) / bi->entrysize != bi->nblocks ||
+				   (end - bi->offset) % bi->entrysize != 0))
+		tightD_headererror(ts, " (invalid block index)");
+}
+
+
+/*
+ * Read index entries of 'n' blocks from block 'first' of block index
+ * 'bi' into 'checks' of 'dd'; index of older files has no checksums,
+ * their blocks are not checked.
+ */
+static void readchecks(BuffReader *br, DecompressData *dd,
+					   const BlockIndex *bi, uint64_t first, uint64_t n)
+{
+	tight_State *ts = br->ts;
+	byte entry[SEEKENTRYSIZE];
+	BlockCheck *checks;
+
+	if (bi->entrysize != SEEKENTRYSIZE || n == 0)
+		return;
+	dd->tmchecks = tightA_newtempmem(ts);
+	checks = tightA_malloc(ts, n * sizeof(*checks));
+	updatetm(dd->tmchecks, checks, n * sizeof(*checks));
+	seekreader(br, bi->offset + first * SEEKENTRYSIZE);
+	for (uint64_t i = 0; i < n; i++) {
+		readbytes(br, entry, sizeof(entry));
+		checks[i].offset = getu64(entry);
+		memcpy(checks[i].digest, &entry[8], sizeof(checks[i].digest));
+	}
+	dd->check = CHECK_INDEX;
+	dd->checks = checks;
+	dd->nchecks = n;
+	dd->checkraw = first * bi->blocksize;
+	dd->checksize = bi->blocksize;
+}
+
+
+/*
+ * Check digests of decoded blocks collected into 'dd' against block
+ * index that follows them; index of older files has no checksums.
+ */
+static void checkcollected(BuffReader *br, DecompressData *dd) {
+	tight_State *ts = br->ts;
+	size_t n = dd->nblocks * SEEKENTRYSIZE + SEEKTRAILERSIZE;
+	size_t got;
+	TempMem *tm;
+	byte *index;
+
+	tm = tightA_newtempmem(ts);
+	index = tightA_malloc(ts, n);
+	updatetm(tm, index, n);
+	got = tightB_brread(br, index, n);
+	if (got == dd->nblocks * 8 + SEEKTRAILERSIZE &&
+			memcmp(&index[got - 8], SEEKMAGIC, sizeof(SEEKMAGIC)) == 0) {
+		tightA_free(ts, index, n);
+		tightS_poptemp(ts);
+		return;
+	}
+	if (t_unlikely(got != n ||
+				   memcmp(&index[n - 8], SEEKSUMMAGIC, sizeof(SEEKSUMMAGIC)) != 0))
+		tightD_headererror(ts, " (invalid block index trailer)");
+	for (size_t i = 0; i < dd->nblocks; i++) {
+		const byte *entry = &index[i * SEEKENTRYSIZE];
+		if (t_unlikely(memcmp(dd->checks[i].digest, &entry[8],
+							  sizeof(dd->checks[i].digest)) != 0))
+			tightD_blockerror(ts, "block checksum doesn't match",
+							  getu64(entry), i * getu64(&index[n - 16]));
+	}
+	tightA_free(ts, index, n);
+	tightS_poptemp(ts);
+}
+
+
+/*
+ * Finish checks of 'dd' once blocks were decoded from 'br' and free
+ * 'checks' (if any).
+ */
+static void endchecks(BuffReader *br, DecompressData *dd) {
+	if (dd->check == CHECK_INDEX && t_unlikely(dd->nblocks != dd->nchecks))
+		tightD_decompresserror(br->ts, "fewer blocks than in block index");
+	else if (dd->check == CHECK_COLLECT)
+		checkcollected(br, dd);
+	if (dd->checks)
+		tightA_free(br->ts, dd->checks, (dd->check == CHECK_COLLECT ?
+					dd->sizechecks : dd->nchecks) * sizeof(*dd->checks));
+	if (dd->tmchecks)
+		tightS_poptemp(br->ts);
+	dd->check = CHECK_NONE;
+	dd->checks = NULL;
+	dd->tmchecks = NULL;
+}
+
+
+/*
+ * Read checksums of all blocks from block index, 'br' is positioned
+ * after header and stays there; in case input can't seek (pipe) the
+ * digests of decoded blocks are collected and checked against the
+ * index once it is read.
+ */
+static void startchecks(BuffReader *br, DecompressData *dd) {
+	BlockIndex bi;
+	off_t start;
+	int canseek = 0;
+
+	if (br->io->seek) {
+		tightS_count(br->ts, seeks, 1);
+		canseek = (br->io->seek(br->ud, 0, SEEK_CUR) >= 0);
+	}
+	if (!canseek) {
+		dd->check = CHECK_COLLECT;
+		dd->tmchecks = tightA_newtempmem(br->ts);
+		return;
+	}
+	start = tightB_offsetreader(br);
+	readblockindex(br, &bi, start);
+	readchecks(br, dd, &bi, 0, bi.nblocks);
+	seekreader(br, start);
+}
+
+
+/* 
+ * Position 'br' at the block covering 'offset' using the block index
+ * that starts after header (at 'start'), 'stop' and 'skip' are adjusted
+ * relative to that block; blocks up to 'stop' are checked against the
+ * index.
+ */
+static void seekblock(BuffReader *br, BuffWriter *bw, DecompressData *dd,
+					  off_t start, size_t offset)
+{
+	byte entry[8];
+	uint64_t first, boffset, end;
+	BlockIndex bi;
+
+	readblockindex(br, &bi, start);
+	if (offset >= bi.rawsize) { /* nothing to decode ? */
+		dd->stop = 0;
+		return;
+	}
+	first = offset / bi.blocksize;
+	seekreader(br, bi.offset + first * bi.entrysize);
+	readbytes(br, entry, sizeof(entry));
+	boffset = getu64(entry);
+	if (t_unlikely(boffset < (uint64_t)start || boffset >= bi.offset))
+		tightD_headererror(br->ts, " (invalid block offset)");
+	end = (dd->stop < bi.rawsize ? dd->stop : bi.rawsize);
+	readchecks(br, dd, &bi, first,
+			   (end - first * bi.blocksize + bi.blocksize - 1) / bi.blocksize);
+	seekreader(br, boffset);
+	bw->skip = offset - first * bi.blocksize;
+	dd->stop -= first * bi.blocksize;
+}
+
+
+/* protected range decompression */
+static void prange(tight_State *ts, void *ud) {
+	RangeData *rd = (RangeData *)ud;
+	BuffReader br, ref; BuffWriter bw;
+	DecompressData dd;
+	TIGHT header;
+
+	tightB_initbr(&br, ts, ts->rfd);
+	tightB_initbw(&bw, ts, ts->wfd);
+	readheader(&br, &header);
+	if (t_unlikely(header.mode & HEADER_ARCHIVE))
+		tightD_headererror(ts, " (file is an archive)");
+	initdecompress(ts, &dd);
+	bw.skip = rd->offset;
+	bw.limit = rd->length;
+	dd.stop = (rd->length > SIZE_MAX - rd->offset ? SIZE_MAX :
+			   rd->offset + rd->length);
+	dd.seekable = (header.mode & TIGHT_DEDUP) != 0;
+	if (header.mode & HEADER_DELTA)
+		startdelta(&br, &dd, &ref);
+	if (header.mode & TIGHT_SEEKABLE) {
+		dd.seekable = 1;
+		seekblock(&br, &bw, &dd, tightB_offsetreader(&br), rd->offset);
+	}
+	decompressblocks(&bw, &br, &dd);
+	endchecks(&br, &dd);
+}
+
+
+TIGHT_API int tight_decompress_range(tight_State *ts, size_t offset,
+									 size_t length)
+{
+	RangeData rd;
+	t_assert(tightS_hasio(ts));
+	rd.offset = offset;
+	rd.length = length;
+	return tightS_protectedcall(ts, &rd, prange);
+}
+
+
+
+/*--------------------------------------------------------------------------
+ * Verification
+ *-------------------------------------------------------------------------- */
+
+/* units of verification, each is decoded on its own */
+#define UNIT_BLOCK		0	/* block of seekable file */
+#define UNIT_MEMBER		1	/* archive member */
+#define UNIT_STREAM		2	/* whole file */
+
+
+/*
+ * Input of verification, 'fd' is read with 'pread' (or 'io' of the
+ * caller) so that each worker has its own offset; reads stop at 'end'
+ * (if not -1), there is no point reading past the unit. Output is
+ * discarded.
+ */
+typedef struct VerifyIO {
+	int fd; /* input, -1 for 'io' */
+	const tight_IO *io; /* callbacks of the caller (if 'fd' is -1) */
+	void *ud; /* userdata of 'io' */
+	off_t pos; /* offset of input */
+	off_t end; /* reads stop here, -1 if they don't */
+} VerifyIO;
+
+
+static long verifyread(void *ud, void *buf, size_t n) {
+	VerifyIO *vio = (VerifyIO *)ud;
+	ssize_t res;
+
+	if (vio->end >= 0 && (off_t)n > vio->end - vio->pos)
+		n = (vio->pos < vio->end ? vio->end - vio->pos : 0);
+	if (n == 0)
+		return 0;
+	do {
+		res = (vio->fd >= 0 ? pread(vio->fd, buf, n, vio->pos) :
+							  vio->io->read(vio->ud, buf, n));
+	} while (res < 0 && errno == EINTR);
+	if (res > 0)
+		vio->pos += res;
+	return res;
+}
+
+
+static long verifywrite(void *ud, const void *buf, size_t n) {
+	(void)ud; (void)buf; /* nothing is written */
+	return n;
+}
+
+
+static long long verifyseek(void *ud, long long off, int whence) {
+	VerifyIO *vio = (VerifyIO *)ud;
+	long long res = -1;
+	struct stat st;
+
+	if (vio->fd < 0) {
+		if (vio->io->seek)
+			res = vio->io->seek(vio->ud, off, whence);
+		else
+			errno = ESPIPE;
+	} else {
+		if (whence == SEEK_SET)
+			res = off;
+		else if (whence == SEEK_CUR)
+			res = vio->pos + off;
+		else if (fstat(vio->fd, &st) == 0) /* 'SEEK_END' */
+			res = st.st_size + off;
+		else
+			return -1;
+		if (res < 0)
+			errno = EINVAL;
+	}
+	if (res >= 0)
+		vio->pos = res;
+	return res;
+}
+
+
+static const tight_IO verifyio = {
+	verifyread, verifywrite, verifyseek, NULL, NULL, NULL
+};
+
+
+/* verification data */
+typedef struct VerifyData {
+	tight_Verify *v;
+	tight_Index index; /* central index (if 'UNIT_MEMBER') */
+	BlockIndex bi; /* block index (if 'UNIT_BLOCK') */
+	off_t start; /* end of header */
+	size_t nunits; /* number of units */
+	size_t next; /* next unit to verify (shared by workers) */
+	int kind; /* kind of units ('UNIT_*') */
+	int checked; /* true if units have checksums */
+	int stop; /* true once a worker ran out of memory */
+	int fd;
+	const tight_IO *io; /* callbacks of the caller (if 'fd' is -1) */
+	void *ud; /* userdata of 'io' */
+} VerifyData;
+
+
+/* verification worker */
+typedef struct VerifyWorker {
+	VerifyData *vd;
+	tight_State *ts; /* private state (caller state without workers) */
+	pthread_t thread;
+	VerifyIO vio;
+	DecompressData dd; /* kept after errors, it locates the corrupt block */
+	size_t k; /* unit being verified */
+	off_t offset; /* compressed offset of unit 'k' */
+	size_t rawoffset; /* uncompressed offset of unit 'k' */
+	size_t rawsize; /* uncompressed size of unit 'k' (if known) */
+	size_t decoded; /* uncompressed bytes of unit 'k' (once decoded) */
+	tight_Corrupt c; /* corrupt block about to be added */
+	tight_Corrupt *corrupt; /* corrupt blocks found by this worker */
+	uint ncorrupt; /* number of 'corrupt' */
+	uint sizecorrupt; /* size of 'corrupt' */
+	int status; /* 'TIGHT_ERRMEM' if the worker ran out of memory */
+} VerifyWorker;
+
+
+/* maximum number of corrupt blocks */
+#define MAXCORRUPT		(INT_MAX / (int)sizeof(tight_Corrupt))
+
+
+/* protected call of 'fn' with input (and output) of 'vio' */
+static int verifycall(tight_State *ts, VerifyIO *vio, void *ud,
+					  fProtected fn)
+{
+	const tight_IO *io = ts->io;
+	void *ioud = ts->ioud;
+	int status;
+
+	ts->io = &verifyio;
+	ts->ioud = vio;
+	status = tightS_protectedcall(ts, ud, fn);
+	ts->io = io;
+	ts->ioud = ioud;
+	return status;
+}
+
+
+/* protected reading of header and index (if any) into 'vd' */
+static void pverifyindex(tight_State *ts, void *ud) {
+	VerifyData *vd = (VerifyData *)ud;
+	BuffReader br, ref;
+	DecompressData dd;
+	TIGHT header;
+
+	tightB_initbr(&br, ts, -1);
+	seekreader(&br, 0);
+	readheader(&br, &header);
+	vd->start = tightB_offsetreader(&br);
+	if (header.mode & HEADER_ARCHIVE) {
+		IndexData id;
+		if (t_unlikely(vd->fd < 0))
+			tightD_headererror(ts, " (archive needs file descriptor)");
+		id.index = &vd->index;
+		id.fd = vd->fd;
+		preadindex(ts, &id); /* 'vd' owns the index */
+		vd->kind = UNIT_MEMBER;
+		vd->nunits = vd->index.n;
+		vd->checked = 1;
+		for (int i = 0; i < vd->index.n; i++)
+			vd->v->rawsize += vd->index.members[i].rawsize;
+	} else if (header.mode & TIGHT_SEEKABLE) {
+		readblockindex(&br, &vd->bi, vd->start);
+		vd->kind = UNIT_BLOCK;
+		vd->nunits = vd->bi.nblocks;
+		vd->checked = (vd->bi.entrysize == SEEKENTRYSIZE);
+		vd->v->rawsize = vd->bi.rawsize;
+	} else {
+		if (header.mode & HEADER_DELTA) { /* check reference up front */
+			initdecompress(ts, &dd);
+			startdelta(&br, &dd, &ref);
+			vd->checked = 1;
+		}
+		vd->kind = UNIT_STREAM;
+		vd->nunits = 1;
+	}
+}
+
+
+/*
+ * Read entry of block 'k' (and offset of the next one) from block
+ * index, returns offset of the block; its end is stored into 'end'
+ * and its checksum (if any) into 'digest'.
+ */
+static off_t readblockentry(BuffReader *br, VerifyWorker *vw, off_t *end,
+							byte *digest)
+{
+	const BlockIndex *bi = &vw->vd->bi;
+	byte entry[SEEKENTRYSIZE + 8];
+	off_t pos = bi->offset + vw->k * bi->entrysize;
+	uint64_t offset, next = bi->offset;
+
+	vw->vio.end = pos + bi->entrysize + 8;
+	seekreader(br, pos);
+	readbytes(br, entry, bi->entrysize);
+	offset = getu64(entry);
+	memcpy(digest, &entry[8], bi->entrysize - 8);
+	if (vw->k + 1 < bi->nblocks) {
+		readbytes(br, entry, 8);
+		next = getu64(entry);
+	}
+	if (t_unlikely(offset < (uint64_t)vw->vd->start || offset >= next ||
+				   next > bi->offset))
+		tightD_headererror(br->ts, " (invalid block offset)");
+	*end = next;
+	return offset;
+}
+
+
+/* protected verification of unit 'k' of worker 'vw' */
+static void pverifyunit(tight_State *ts, void *ud) {
+	VerifyWorker *vw = (VerifyWorker *)ud;
+	VerifyData *vd = vw->vd;
+	DecompressData *dd = &vw->dd;
+	BuffReader br, ref; BuffWriter bw;
+	TIGHT header;
+	MD5ctx ctx;
+	byte digest[16], out[16];
+	off_t end = -1;
+	size_t rawsize;
+
+	dd->block = -1;
+	dd->nblocks = 0;
+	vw->decoded = 0;
+	tightB_initbr(&br, ts, -1);
+	tightB_initbw(&bw, ts, -1);
+	vw->vio.end = (vd->kind == UNIT_STREAM ? -1 : vd->start);
+	seekreader(&br, 0);
+	readheader(&br, &header); /* header tree */
+	initdecompress(ts, dd);
+	dd->seekable = (header.mode & (TIGHT_SEEKABLE | TIGHT_DEDUP)) != 0;
+	if (vd->kind == UNIT_BLOCK) {
+		vw->offset = readblockentry(&br, vw, &end, digest);
+		dd->stop = vw->rawsize; /* a single block */
+	} else if (vd->kind == UNIT_MEMBER) {
+		const tight_Member *m = &vd->index.members[vw->k];
+		if (!(header.mode & TIGHT_DEDUP)) /* references go back */
+			end = m->offset + m->size;
+		memcpy(digest, m->checksum, sizeof(digest));
+	} else if (header.mode & HEADER_DELTA) {
+		startdelta(&br, dd, &ref);
+	}
+	if (vd->kind != UNIT_STREAM) {
+		vw->vio.end = end;
+		seekreader(&br, vw->offset);
+	}
+	tight5_init(&ctx);
+	bw.md5 = &ctx;
+	dd->locate = 1;
+	rawsize = decompressblocks(&bw, &br, dd);
+	dd->block = -1; /* the rest is about the whole unit */
+	vw->decoded = rawsize;
+	tight5_final(&ctx, out);
+	if (vd->kind == UNIT_STREAM) {
+		if (header.mode & HEADER_DELTA)
+			verifydelta(&br, out);
+	} else if (t_unlikely(rawsize != vw->rawsize)) {
+		tightD_decompresserror(ts, (vd->kind == UNIT_BLOCK ?
+				"block size doesn't match index" :
+				"archive member size mismatch"));
+	} else if (t_unlikely((vd->kind == UNIT_MEMBER ||
+						   vd->bi.entrysize == SEEKENTRYSIZE) &&
+						  memcmp(out, digest, sizeof(out)) != 0)) {
+		tightD_decompresserror(ts, (vd->kind == UNIT_BLOCK ?
+				"block checksum doesn't match" :
+				"archive member checksum doesn't match"));
+	}
+}
+
+
+/* set offsets and size of unit 'k' of 'vw' (before it is verified) */
+static void setunit(VerifyWorker *vw, size_t k) {
+	VerifyData *vd = vw->vd;
+	vw->k = k;
+	vw->rawoffset = 0;
+	vw->rawsize = 0;
+	if (vd->kind == UNIT_BLOCK) { /* index entry until it is read */
+		vw->offset = vd->bi.offset + k * vd->bi.entrysize;
+		vw->rawoffset = k * vd->bi.blocksize;
+		vw->rawsize = (vd->bi.rawsize - vw->rawoffset < vd->bi.blocksize ?
+					   vd->bi.rawsize - vw->rawoffset : vd->bi.blocksize);
+	} else if (vd->kind == UNIT_MEMBER) {
+		vw->offset = vd->index.members[k].offset;
+		vw->rawsize = vd->index.members[k].rawsize;
+	} else {
+		vw->offset = vd->start;
+	}
+}
+
+
+/* protected adding of corrupt block 'c' of 'vw' */
+static void paddcorrupt(tight_State *ts, void *ud) {
+	VerifyWorker *vw = (VerifyWorker *)ud;
+	int arena = tightA_usearena(ts, 0); /* 'corrupt' outlives the call */
+	tightA_growvec(ts, vw->corrupt, vw->sizecorrupt, MAXCORRUPT,
+				   vw->ncorrupt, "corrupt blocks");
+	tightA_usearena(ts, arena);
+	vw->corrupt[vw->ncorrupt++] = vw->c;
+}
+
+
+/* add corrupt block of unit 'k' of 'vw' (its verification failed) */
+static int addcorrupt(VerifyWorker *vw, int status) {
+	tight_Corrupt *c = &vw->c;
+	const char *error = tight_geterror(vw->ts);
+
+	c->offset = vw->offset;
+	c->rawoffset = vw->rawoffset;
+	c->rawsize = (vw->vd->kind == UNIT_STREAM ? vw->decoded : vw->rawsize);
+	if (vw->dd.block >= 0 && vw->vd->kind != UNIT_BLOCK) { /* in a block ? */
+		c->offset = vw->dd.block;
+		c->rawoffset = vw->rawoffset + vw->dd.rawpos;
+		c->rawsize = vw->dd.blockraw;
+	}
+	c->member = (vw->vd->kind == UNIT_MEMBER ? (int)vw->k : -1);
+	c->status = status;
+	snprintf(c->error, sizeof(c->error), "%s", (error ? error : ""));
+	return tightS_protectedcall(vw->ts, vw, paddcorrupt);
+}
+
+
+/* verify units of 'vd' until they run out (or a worker fails) */
+static void verifyunits(VerifyWorker *vw) {
+	VerifyData *vd = vw->vd;
+	size_t k;
+
+	while (!__atomic_load_n(&vd->stop, __ATOMIC_RELAXED) &&
+			(k = __atomic_fetch_add(&vd->next, 1, __ATOMIC_RELAXED)) <
+			vd->nunits) {
+		int status;
+		setunit(vw, k);
+		status = verifycall(vw->ts, &vw->vio, vw, pverifyunit);
+		o1freetrees(vw->ts, &vw->dd); /* left by a corrupt block */
+		__atomic_fetch_add(&vd->v->nblocks, vw->dd.nblocks, __ATOMIC_RELAXED);
+		if (vd->checked)
+			__atomic_fetch_add(&vd->v->nchecked, vw->dd.nblocks,
+							   __ATOMIC_RELAXED);
+		if (vd->kind == UNIT_STREAM)
+			vd->v->rawsize = (vw->dd.block >= 0 ? vw->dd.rawpos : vw->decoded);
+		if (status == TIGHT_OK)
+			continue;
+		if (status == TIGHT_ERRMEM || addcorrupt(vw, status) != TIGHT_OK) {
+			vw->status = TIGHT_ERRMEM;
+			__atomic_store_n(&vd->stop, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+
+/* worker thread */
+static void *verifyworker(void *ud) {
+	verifyunits((VerifyWorker *)ud);
+	return NULL;
+}
+
+
+/* initialize worker 'vw' of 'vd' with state 'ts' */
+static void initworker(VerifyWorker *vw, VerifyData *vd, tight_State *ts) {
+	vw->vd = vd;
+	vw->ts = ts;
+	vw->vio.fd = vd->fd;
+	vw->vio.io = vd->io;
+	vw->vio.ud = vd->ud;
+	vw->dd.ntrees = 0;
+	vw->corrupt = NULL;
+	vw->ncorrupt = vw->sizecorrupt = 0;
+	vw->status = TIGHT_OK;
+}
+
+
+/* compare corrupt blocks by file order */
+static int cmpcorrupt(const void *a, const void *b) {
+	const tight_Corrupt *ca = (const tight_Corrupt *)a;
+	const tight_Corrupt *cb = (const tight_Corrupt *)b;
+	if (ca->member != cb->member)
+		return (ca->member < cb->member ? -1 : 1);
+	if (ca->rawoffset != cb->rawoffset)
+		return (ca->rawoffset < cb->rawoffset ? -1 : 1);
+	return (ca->offset > cb->offset) - (ca->offset < cb->offset);
+}
+
+
+/* merge data */
+typedef struct MergeData {
+	tight_Verify *v;
+	VerifyWorker *workers;
+	int n; /* number of 'workers' */
+} MergeData;
+
+
+/* protected merge of corrupt blocks of workers into 'v' */
+static void pmergecorrupt(tight_State *ts, void *ud) {
+	MergeData *md = (MergeData *)ud;
+	tight_Verify *v = md->v;
+	uint n = 0;
+
+	for (int i = 0; i < md->n; i++) {
+		if (t_unlikely(md->workers[i].status != TIGHT_OK))
+			tightS_throw(ts, md->workers[i].status); /* out of memory */
+		n += md->workers[i].ncorrupt;
+	}
+	if (n == 0)
+		return;
+	tightA_usearena(ts, 0); /* 'corrupt' outlives the call */
+	v->corrupt = tightA_malloc(ts, n * sizeof(tight_Corrupt));
+	v->sizecorrupt_ = n;
+	for (int i = 0; i < md->n; i++) {
+		const VerifyWorker *vw = &md->workers[i];
+		if (vw->ncorrupt == 0)
+			continue;
+		memcpy(&v->corrupt[v->ncorrupt], vw->corrupt,
+			   vw->ncorrupt * sizeof(tight_Corrupt));
+		v->ncorrupt += vw->ncorrupt;
+	}
+	qsort(v->corrupt, v->ncorrupt, sizeof(tight_Corrupt), cmpcorrupt);
+}
+
+
+/*
+ * Verify units of 'vd' with 'nworkers' threads; in case none of them
+ * can be started units are verified by the caller. Returns status.
+ */
+static int verifyparallel(tight_State *ts, VerifyData *vd, int nworkers) {
+	VerifyWorker workers[MAXWORKERS];
+	MergeData md;
+	int status;
+	int n = 0;
+
+	if (nworkers > MAXWORKERS)
+		nworkers = MAXWORKERS;
+	if ((size_t)nworkers > vd->nunits)
+		nworkers = vd->nunits;
+	if (vd->fd < 0) /* callbacks have a single position */
+		nworkers = 1;
+	while (nworkers > 1 && n < nworkers) {
+		VerifyWorker *vw = &workers[n];
+		tight_State *wts = tight_new(ts->frealloc, ts->ud);
+		if (wts == NULL)
+			break;
+		tight_setbuffers(wts, ts->rbuffsize, ts->wbuffsize);
+		initworker(vw, vd, wts);
+		if (pthread_create(&vw->thread, NULL, verifyworker, vw) != 0) {
+			tight_free(wts);
+			break;
+		}
+		n++;
+	}
+	if (n == 0) { /* no workers ? */
+		initworker(&workers[0], vd, ts);
+		verifyunits(&workers[0]);
+		n = 1;
+	} else {
+		for (int i = 0; i < n; i++)
+			pthread_join(workers[i].thread, NULL);
+	}
+	md.v = vd->v;
+	md.workers = workers;
+	md.n = n;
+	status = tightS_protectedcall(ts, &md, pmergecorrupt);
+	for (int i = 0; i < n; i++) {
+		VerifyWorker *vw = &workers[i];
+		if (vw->corrupt)
+			tightA_freevec(vw->ts, vw->corrupt, vw->sizecorrupt);
+		if (vw->ts != ts)
+			tight_free(vw->ts);
+	}
+	return status;
+}
+
+
+TIGHT_API int tight_verify(tight_State *ts, int fd, int nthreads,
+						   tight_Verify *v)
+{
+	VerifyData vd;
+	VerifyIO vio;
+	int status;
+
+	t_assert(fd >= 0 || (ts->io != NULL && ts->io->read != NULL));
+	memset(v, 0, sizeof(*v));
+	memset(&vd, 0, sizeof(vd));
+	vd.v = v;
+	vd.fd = fd;
+	vd.io = ts->io;
+	vd.ud = ts->ioud;
+	vio.fd = fd;
+	vio.io = ts->io;
+	vio.ud = ts->ioud;
+	vio.pos = 0;
+	vio.end = -1;
+	status = verifycall(ts, &vio, &vd, pverifyindex);
+	if (status == TIGHT_OK && vd.nunits > 0)
+		status = verifyparallel(ts, &vd, nthreads);
+	tight_freeindex(ts, &vd.index);
+	if (status != TIGHT_OK) {
+		tight_freeverify(ts, v);
+		memset(v, 0, sizeof(*v));
+	}
+	return status;
+}
+
+
+TIGHT_API void tight_freeverify(tight_State *ts, tight_Verify *v) {
+	if (v->corrupt)
+		tightA_free(ts, v->corrupt, v->sizecorrupt_ * sizeof(*v->corrupt));
+	v->corrupt = NULL;
+	v->ncorrupt = 0;
+	v->sizecorrupt_ = 0;
+}
@@ -0,0 +1,162 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+#include <string.h>
+
+#include "tdebug.h"
+#include "tdedup.h"
+#include "tmd5.h"
+#include "tstate.h"
+
+
+/* initial size of chunk index */
+#define MINCHUNKS		1024
+
+/* maximum size of chunk index */
+#define MAXCHUNKS		((uint)1 << 30)
+
+
+/* next value of 'splitmix64' generator with state 'x' */
+static uint64_t splitmix64(uint64_t *x) {
+	uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+
+/* mask of the top 'bits' bits of the hash (they depend on 64 bytes) */
+static uint64_t topbits(int bits) {
+	return ~(uint64_t)0 << (64 - bits);
+}
+
+
+/* allocate empty chunk index of 'size' entries */
+static void newindex(tight_State *ts, Dedup *d, uint size) {
+	d->chunks = tightA_malloc(ts, size * sizeof(Chunk));
+	updatetm(d->tm, d->chunks, size * sizeof(Chunk));
+	memset(d->chunks, 0, size * sizeof(Chunk));
+	d->size = size;
+}
+
+
+/* initialize chunker (with the largest chunks) and empty chunk index */
+void tightE_init(tight_State *ts, Dedup *d) {
+	uint64_t x = 0; /* fixed seed, chunks must be the same in every run */
+	for (int i = 0; i < TIGHTBYTES; i++)
+		d->gear[i] = splitmix64(&x);
+	tightE_chunksize(d, CDCMAXSIZE);
+	d->n = 0;
+	d->tm = tightA_newtempmem(ts);
+	newindex(ts, d, MINCHUNKS);
+}
+
+
+/*
+ * Set chunks to at most 'max' bytes (clamped to 'CDCMAXSIZE'), average
+ * is a quarter and minimum a sixteenth of it; returns maximum size.
+ */
+ulong tightE_chunksize(Dedup *d, ulong max) {
+	int bits = 0;
+	if (max > CDCMAXSIZE)
+		max = CDCMAXSIZE;
+	d->max = max;
+	d->avg = max / 4;
+	d->min = max / 16;
+	while (((ulong)2 << bits) <= d->avg)
+		bits++;
+	d->masks = topbits(bits + 2);
+	d->maskl = topbits(bits > 2 ? bits - 2 : 1);
+	return max;
+}
+
+
+/* free chunk index */
+void tightE_free(tight_State *ts, Dedup *d) {
+	tightA_free(ts, d->chunks, d->size * sizeof(Chunk));
+	tightS_poptemp(ts);
+}
+
+
+/*
+ * Size of the chunk at the start of 'n' bytes at 'p'; in case there
+ * is no cut point in them, whole 'n' (at most 'max') is the chunk.
+ */
+ulong tightE_cut(const Dedup *d, const byte *p, ulong n) {
+	ulong mid = (n < d->avg ? n : d->avg);
+	uint64_t h = 0;
+	ulong i;
+
+	t_assert(n <= d->max);
+	for (i = d->min; i < mid; i++) {
+		h = (h << 1) + d->gear[p[i]];
+		if (!(h & d->masks))
+			return i + 1;
+	}
+	for (; i < n; i++) {
+		h = (h << 1) + d->gear[p[i]];
+		if (!(h & d->maskl))
+			return i + 1;
+	}
+	return n;
+}
+
+
+/* slot of 'c' in index, first free one if 'c' is not in it */
+static uint findslot(const Dedup *d, const Chunk *c) {
+	uint64_t h;
+	uint i;
+
+	memcpy(&h, c->digest, sizeof(h));
+	i = (uint)(h ^ c->size) & (d->size - 1);
+	while (d->chunks[i].size != 0 && (d->chunks[i].size != c->size ||
+				memcmp(d->chunks[i].digest, c->digest, sizeof(c->digest)) != 0))
+		i = (i + 1) & (d->size - 1);
+	return i;
+}
+
+
+/*
+ * Look up chunk of 'n' bytes at 'p' by its digest, returns its index
+ * entry or NULL if chunk was not seen yet ('tightE_add' adds it).
+ */
+const Chunk *tightE_find(Dedup *d, const byte *p, ulong n) {
+	MD5ctx ctx;
+
+	t_assert(n > 0);
+	tight5_init(&ctx);
+	tight5_update(&ctx, (byte *)p, n);
+	tight5_final(&ctx, d->last.digest);
+	d->last.size = n;
+	d->slot = findslot(d, &d->last);
+	return (d->chunks[d->slot].size != 0 ? &d->chunks[d->slot] : NULL);
+}
+
+
+/* double the size of chunk index */
+static void growindex(tight_State *ts, Dedup *d) {
+	Chunk *old = d->chunks;
+	uint size = d->size;
+
+	if (t_unlikely(size >= MAXCHUNKS))
+		tightD_limiterror(ts, "chunks", MAXCHUNKS / 2);
+	newindex(ts, d, size * 2); /* 'tm' anchors the new index */
+	for (uint i = 0; i < size; i++)
+		if (old[i].size != 0)
+			d->chunks[findslot(d, &old[i])] = old[i];
+	tightA_free(ts, old, size * sizeof(Chunk));
+}
+
+
+/* add chunk of the latest 'tightE_find' stored in block at 'offset' */
+void tightE_add(tight_State *ts, Dedup *d, size_t offset) {
+	if (d->n + 1 > d->size / 2) { /* keep index at most half full */
+		growindex(ts, d);
+		d->slot = findslot(d, &d->last);
+	}
+	d->last.offset = offset;
+	d->chunks[d->slot] = d->last;
+	d->n++;
+}
@@ -0,0 +1,57 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+#ifndef TIGHTDEDUP_H
+#define TIGHTDEDUP_H
+
+#include <stdint.h>
+
+#include "tight.h"
+#include "talloc.h"
+#include "tinternal.h"
+
+
+/* largest chunk (smaller if blocks are smaller) */
+#define CDCMAXSIZE		((ulong)64 << 10)
+
+
+/* entry of chunk index */
+typedef struct Chunk {
+	byte digest[16]; /* MD5 of chunk bytes */
+	size_t offset; /* output offset of the block holding the chunk */
+	ulong size; /* size of chunk, 0 if entry is free */
+} Chunk;
+
+
+/*
+ * Content-defined chunker and index of chunks written so far. Chunk
+ * boundaries are cut with a gear rolling hash (FastCDC): no cut before
+ * 'min' bytes, harder cut condition ('masks') up to 'avg' bytes and
+ * easier one ('maskl') after it, so that chunk sizes stay close to
+ * 'avg'; chunk never exceeds 'max'. Boundaries depend only on nearby
+ * bytes, so equal data is cut into equal chunks wherever it is.
+ */
+typedef struct Dedup {
+	uint64_t gear[TIGHTBYTES]; /* random value of each byte */
+	uint64_t masks; /* cut condition before 'avg' */
+	uint64_t maskl; /* cut condition after 'avg' */
+	ulong min, avg, max; /* chunk sizes */
+	Chunk *chunks; /* open addressing hash table */
+	TempMem *tm; /* anchors 'chunks' */
+	uint size; /* size of 'chunks' (power of 2) */
+	uint n; /* number of chunks in 'chunks' */
+	uint slot; /* slot of the chunk of the latest 'tightE_find' */
+	Chunk last; /* chunk of the latest 'tightE_find' */
+} Dedup;
+
+
+TIGHT_FUNC void tightE_init(tight_State *ts, Dedup *d);
+TIGHT_FUNC ulong tightE_chunksize(Dedup *d, ulong max);
+TIGHT_FUNC void tightE_free(tight_State *ts, Dedup *d);
+TIGHT_FUNC ulong tightE_cut(const Dedup *d, const byte *p, ulong n);
+TIGHT_FUNC const Chunk *tightE_find(Dedup *d, const byte *p, ulong n);
+TIGHT_FUNC void tightE_add(tight_State *ts, Dedup *d, size_t offset);
+
+#endif
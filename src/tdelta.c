@@ -0,0 +1,252 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+#define _POSIX_C_SOURCE		200809L /* 'pread' */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "tdebug.h"
+#include "tdelta.h"
+#include "tstate.h"
+
+
+/* smallest reference index */
+#define MINREFBLOCKS		16
+
+
+/* load window of reference at 'off' (up to the end of reference) */
+static void loadwindow(Delta *d, off_t off) {
+	size_t done = 0;
+
+	if (off < 0)
+		off = 0;
+	while (done < d->bufsize && off + (off_t)done < d->refsize) {
+		ssize_t res = pread(d->fd, d->buf + done, d->bufsize - done,
+							off + done);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (t_unlikely(res < 0))
+			tightD_errnoerror(d->ts, "pread (reference file)");
+		if (res == 0) /* reference shrank */
+			break;
+		done += res;
+		tightS_count(d->ts, reads, 1);
+		tightS_count(d->ts, bytesin, res);
+	}
+	d->bufoff = off;
+	d->bufn = done;
+}
+
+
+/*
+ * Bytes of reference at 'off', their number (up to the end of window)
+ * is stored into 'n' (0 past the end of reference). Window is moved
+ * so that it ends at 'off' in case 'back' is true, otherwise it keeps
+ * a quarter (whole blocks) before 'off' for backward matching.
+ */
+static const byte *window(Delta *d, off_t off, int back, size_t *n) {
+	if (off < d->bufoff || off >= d->bufoff + (off_t)d->bufn) {
+		off_t before = (d->bufsize / 4) & ~(off_t)(d->blocksize - 1);
+		loadwindow(d, (back ? off + 1 - (off_t)d->bufsize : off - before));
+	}
+	if (off < d->bufoff || off >= d->bufoff + (off_t)d->bufn) {
+		*n = 0;
+		return NULL;
+	}
+	*n = d->bufn - (off - d->bufoff);
+	return d->buf + (off - d->bufoff);
+}
+
+
+/* slot of hash 'h' in reference index */
+#define slot(d,h)	((size_t)(((h) * 0x9E3779B97F4A7C15ULL) >> (d)->shift))
+
+
+/*
+ * Add block of 'p' at 'offset', the first of equal hashes is kept; zero
+ * blocks are left out, zeros of input are smaller as 'BLOCK_ZERO'.
+ */
+static void addblock(Delta *d, const byte *p, off_t offset) {
+	uint64_t h = tightR_hash(d, p);
+	size_t i = slot(d, h);
+	if (h == 0 && p[0] == 0 && memcmp(p, p + 1, d->blocksize - 1) == 0)
+		return;
+	while (d->blocks[i].offset >= 0) {
+		if (d->blocks[i].hash == h)
+			return;
+		i = (i + 1) & (d->size - 1);
+	}
+	d->blocks[i].hash = h;
+	d->blocks[i].offset = offset;
+	d->n++;
+}
+
+
+/* allocate reference index for 'nblocks' blocks */
+static void newindex(tight_State *ts, Delta *d, size_t nblocks) {
+	d->size = MINREFBLOCKS;
+	d->shift = 64 - 4;
+	while (d->size < nblocks * 2) { /* keep index at most half full */
+		d->size *= 2;
+		d->shift--;
+	}
+	d->tm = tightA_newtempmem(ts);
+	d->blocks = tightA_malloc(ts, d->size * sizeof(RefBlock));
+	updatetm(d->tm, d->blocks, d->size * sizeof(RefBlock));
+	for (size_t i = 0; i < d->size; i++)
+		d->blocks[i].offset = -1;
+	d->n = 0;
+}
+
+
+/* initialize 'd' and index the blocks of reference 'fd' */
+void tightR_init(tight_State *ts, Delta *d, int fd) {
+	struct stat st;
+
+	if (t_unlikely(fstat(fd, &st) < 0))
+		tightD_errnoerror(ts, "fstat (reference file)");
+	if (t_unlikely(!S_ISREG(st.st_mode)))
+		tightD_compresserror(ts, "reference is not a regular file");
+	d->ts = ts;
+	d->fd = fd;
+	d->refsize = st.st_size;
+	d->blocksize = DELTAMINBLOCK;
+	while ((size_t)(d->refsize / d->blocksize) > DELTAMAXBLOCKS)
+		d->blocksize *= 2;
+	d->power = 1;
+	for (ulong i = 1; i < d->blocksize; i++)
+		d->power *= DELTAMULT;
+	/* window holds whole blocks, so that indexing never straddles it */
+	d->bufsize = (d->blocksize > DELTAWINDOW ? d->blocksize : DELTAWINDOW);
+	d->buf = tightA_cachedbuffer(ts, CACHE_REFBUF, d->bufsize);
+	d->bufoff = 0;
+	d->bufn = 0;
+	newindex(ts, d, d->refsize / d->blocksize);
+	for (off_t off = 0; off + (off_t)d->blocksize <= d->refsize;
+			off += d->blocksize) {
+		if (off + (off_t)d->blocksize > d->bufoff + (off_t)d->bufn) {
+			loadwindow(d, off);
+			if (d->bufn < d->blocksize) /* reference shrank */
+				break;
+		}
+		addblock(d, d->buf + (off - d->bufoff), off);
+	}
+}
+
+
+/* free reference index */
+void tightR_free(tight_State *ts, Delta *d) {
+	tightA_free(ts, d->blocks, d->size * sizeof(RefBlock));
+	tightS_poptemp(ts);
+}
+
+
+/* 'DELTAMULT' to the power of 4 */
+#define MULT4		(DELTAMULT * DELTAMULT * DELTAMULT * DELTAMULT)
+
+
+/*
+ * Rolling hash of 'blocksize' bytes at 'p'; every fourth byte goes into
+ * its own lane (independent multiplications), lanes are then combined
+ * into the same hash as byte by byte.
+ */
+uint64_t tightR_hash(const Delta *d, const byte *p) {
+	uint64_t h0 = 0, h1 = 0, h2 = 0, h3 = 0;
+	for (ulong i = 0; i < d->blocksize; i += 4) {
+		h0 = h0 * MULT4 + p[i];
+		h1 = h1 * MULT4 + p[i + 1];
+		h2 = h2 * MULT4 + p[i + 2];
+		h3 = h3 * MULT4 + p[i + 3];
+	}
+	return ((h0 * DELTAMULT + h1) * DELTAMULT + h2) * DELTAMULT + h3;
+}
+
+
+/*
+ * Offset of reference bytes equal to 'blocksize' bytes at 'p' with hash
+ * 'h', -1 if there are none. Only the first of equal blocks is indexed,
+ * so in case it is found 'hint' (where the previous match would go on)
+ * is tried first; this keeps matches in order for repetitive reference.
+ */
+off_t tightR_find(Delta *d, uint64_t h, const byte *p, off_t hint) {
+	size_t i = slot(d, h);
+	while (d->blocks[i].offset >= 0) {
+		if (d->blocks[i].hash == h) { /* equal hashes are not indexed twice */
+			off_t off = d->blocks[i].offset;
+			if (hint != off && hint >= 0 &&
+					hint <= d->refsize - (off_t)d->blocksize &&
+					tightR_forward(d, hint, p, d->blocksize) == d->blocksize)
+				return hint;
+			return (tightR_forward(d, off, p, d->blocksize) == d->blocksize ?
+					off : -1);
+		}
+		i = (i + 1) & (d->size - 1);
+	}
+	return -1;
+}
+
+
+/* number of equal bytes at the start of 'n' bytes at 'p' and 'q' */
+static size_t equalbytes(const byte *p, const byte *q, size_t n) {
+	size_t i = 0;
+	while (n - i >= sizeof(uint64_t)) {
+		uint64_t a, b;
+		memcpy(&a, p + i, sizeof(a));
+		memcpy(&b, q + i, sizeof(b));
+		if (a != b)
+			break;
+		i += sizeof(a);
+	}
+	while (i < n && p[i] == q[i])
+		i++;
+	return i;
+}
+
+
+/* number of equal bytes of reference at 'off' and 'n' bytes at 'p' */
+size_t tightR_forward(Delta *d, off_t off, const byte *p, size_t n) {
+	size_t done = 0;
+	while (done < n) {
+		size_t len, eq;
+		const byte *r = window(d, off + done, 0, &len);
+		if (len == 0) /* end of reference */
+			break;
+		if (len > n - done)
+			len = n - done;
+		eq = equalbytes(r, p + done, len);
+		done += eq;
+		if (eq < len)
+			break;
+	}
+	return done;
+}
+
+
+/*
+ * Number of equal bytes before reference 'off' and before 'p', up to
+ * 'n' of them (going backward).
+ */
+size_t tightR_backward(Delta *d, off_t off, const byte *p, size_t n) {
+	size_t done = 0;
+	while (done < n && off > (off_t)done) {
+		off_t last = off - 1 - done; /* next byte to compare */
+		size_t len, k = 0;
+		const byte *r = window(d, last, 1, &len);
+		if (len == 0) /* reference shrank */
+			break;
+		len = last - d->bufoff + 1; /* bytes before (and at) 'last' */
+		if (len > n - done)
+			len = n - done;
+		while (k < len && *(r - k) == *(p - 1 - done - k))
+			k++;
+		done += k;
+		if (k < len)
+			break;
+	}
+	return done;
+}
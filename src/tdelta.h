@@ -0,0 +1,77 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+#ifndef TIGHTDELTA_H
+#define TIGHTDELTA_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "tight.h"
+#include "talloc.h"
+#include "tinternal.h"
+
+
+/* smallest indexed block of reference */
+#define DELTAMINBLOCK		64
+
+/* indexed blocks of reference (larger reference gets larger blocks) */
+#define DELTAMAXBLOCKS		((size_t)1 << 20)
+
+/* size of reference window */
+#define DELTAWINDOW			((size_t)256 << 10)
+
+/* multiplier of the rolling hash */
+#define DELTAMULT			0x100000001B3ULL
+
+
+/* entry of reference index */
+typedef struct RefBlock {
+	uint64_t hash; /* rolling hash of block bytes */
+	off_t offset; /* offset of block in reference, -1 if entry is free */
+} RefBlock;
+
+
+/*
+ * Index of reference file for delta compression. Reference is split
+ * into blocks of 'blocksize' bytes and the rolling hash of each block
+ * is indexed; input is scanned with the same rolling hash, so that a
+ * block of reference is found at any input offset. Reference is read
+ * with 'pread' through a window.
+ */
+typedef struct Delta {
+	tight_State *ts;
+	RefBlock *blocks; /* open addressing hash table */
+	TempMem *tm; /* anchors 'blocks' */
+	size_t size; /* size of 'blocks' (power of 2) */
+	size_t n; /* number of blocks in 'blocks' */
+	ulong blocksize; /* size of indexed blocks (power of 2) */
+	uint64_t power; /* 'DELTAMULT' to the power of 'blocksize' - 1 */
+	int shift; /* hash bits dropped for slot of 'blocks' */
+	int fd; /* reference file */
+	off_t refsize; /* size of reference */
+	byte *buf; /* window of reference (per-state buffer) */
+	size_t bufsize; /* size of 'buf' */
+	off_t bufoff; /* reference offset of 'buf' */
+	size_t bufn; /* valid bytes in 'buf' */
+} Delta;
+
+
+/* hash of 'p' after dropping 'out' and adding 'in' (rolls by one byte) */
+#define tightR_roll(d,h,out,in) \
+	(((h) - (uint64_t)(out) * (d)->power) * DELTAMULT + (in))
+
+
+TIGHT_FUNC void tightR_init(tight_State *ts, Delta *d, int fd);
+TIGHT_FUNC void tightR_free(tight_State *ts, Delta *d);
+TIGHT_FUNC uint64_t tightR_hash(const Delta *d, const byte *p);
+TIGHT_FUNC off_t tightR_find(Delta *d, uint64_t h, const byte *p,
+							  off_t hint);
+TIGHT_FUNC size_t tightR_forward(Delta *d, off_t off, const byte *p,
+								 size_t n);
+TIGHT_FUNC size_t tightR_backward(Delta *d, off_t off, const byte *p,
+								  size_t n);
+
+#endif
@@ -0,0 +1,426 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+/*
+ * Table-based asymmetric numeral systems (tANS), also known
+ * as finite state entropy (FSE).
+ * Block payload consists of normalized counts header followed
+ * by the bitstream, bitstream is written backwards (last symbol
+ * first) and it is read forwards from the end of the payload.
+ * Two interleaved states are used, even symbols are coded with
+ * the first state and odd symbols with the second one.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "tdebug.h"
+#include "tfse.h"
+
+
+/* maximum number of states */
+#define FSEMAXSTATES	(1 << FSEMAXLOG)
+
+
+/* normalized counts */
+typedef ushrt FSEcounts[TIGHTBYTES];
+
+
+/* encoding transform for a single symbol */
+typedef struct FSEsymbol {
+	uint32_t deltanbits; /* (state + deltanbits) >> 16 = bits to flush */
+	int deltastate; /* offset of the symbol states in 'statetab' */
+} FSEsymbol;
+
+
+/* decoding table entry (state) */
+typedef struct FSEstate {
+	ushrt base; /* base of next state */
+	byte sym; /* decoded symbol */
+	byte nbits; /* bits to read for next state */
+} FSEstate;
+
+
+
+/* index of highest set bit, 'x' must not be 0 */
+static inline int highbit(uint32_t x) {
+	t_assert(x != 0);
+#if defined(__GNUC__)
+	return 31 - __builtin_clz(x);
+#else
+	int n = 0;
+	while (x >>= 1) n++;
+	return n;
+#endif
+}
+
+
+/* little endian 64-bit store */
+static inline void store64(byte *p, uint64_t v) {
+	for (int i = 0; i < 8; i++)
+		p[i] = (byte)(v >> (i * 8));
+}
+
+
+/* little endian 64-bit load */
+static inline uint64_t load64(const byte *p) {
+	uint64_t v = 0;
+	for (int i = 0; i < 8; i++)
+		v |= (uint64_t)p[i] << (i * 8);
+	return v;
+}
+
+
+
+/*--------------------------------------------------------------------------
+ * Normalized counts
+ *-------------------------------------------------------------------------- */
+
+/* pick table log for 'n' symbols out of which 'nsyms' are distinct */
+static int tablelog(ulong n, int nsyms) {
+	int log = FSEMAXLOG;
+	while (log > FSEMINLOG && (1ul << (log - 1)) >= n)
+		log--;
+	while ((1 << log) < nsyms)
+		log++;
+	t_assert(log <= FSEMAXLOG);
+	return log;
+}
+
+
+/*
+ * Scale 'freqs' of 'n' symbols so that they sum up to '1 << log',
+ * each present symbol gets at least 1.
+ */
+static void normalize(FSEcounts norm, const size_t *freqs, ulong n, int log) {
+	int total = 1 << log;
+	int sum = 0, largest = -1;
+	int i;
+
+	for (i = 0; i < TIGHTBYTES; i++) {
+		if (freqs[i] == 0) {
+			norm[i] = 0;
+			continue;
+		}
+		uint64_t v = ((uint64_t)freqs[i] * total + (n >> 1)) / n;
+		norm[i] = (v == 0 ? 1 : v);
+		sum += norm[i];
+		if (largest < 0 || freqs[i] > freqs[largest])
+			largest = i;
+	}
+	t_assert(largest >= 0);
+	while (sum > total) { /* too many rounded up, take from the richest */
+		int max = largest;
+		for (i = 0; i < TIGHTBYTES; i++)
+			if (norm[i] > norm[max])
+				max = i;
+		t_assert(norm[max] > 1);
+		norm[max]--;
+		sum--;
+	}
+	norm[largest] += total - sum;
+}
+
+
+/* bits needed to write values in range [0, 'n') */
+static inline int countbits(int n) {
+	return (n > 1 ? highbit(n - 1) + 1 : 0);
+}
+
+
+/* size of normalized counts header in bits */
+static size_t headerbits(const FSEcounts norm, int log) {
+	int left = 1 << log;
+	size_t bits = 4;
+	for (int i = 0; left > 0; i++) {
+		bits++;
+		if (norm[i] != 0) {
+			bits += countbits(left);
+			left -= norm[i];
+		}
+	}
+	return bits;
+}
+
+
+/*
+ * Estimate size of FSE compressed block of 'n' bytes
+ * with symbol frequencies 'freqs'.
+ */
+size_t tightF_estimate(const size_t *freqs, ulong n) {
+	FSEcounts norm;
+	double bits = 0.0;
+	int log, nsyms = 0;
+
+	for (int i = 0; i < TIGHTBYTES; i++)
+		nsyms += (freqs[i] != 0);
+	if (t_unlikely(nsyms == 0))
+		return 0;
+	log = tablelog(n, nsyms);
+	normalize(norm, freqs, n, log);
+	for (int i = 0; i < TIGHTBYTES; i++)
+		if (norm[i] != 0)
+			bits += freqs[i] * (log - log2((double)norm[i]));
+	bits += headerbits(norm, log) + 2 * log + 1;
+	return ((size_t)bits + 7) / 8;
+}
+
+
+/* spread symbols across the table */
+static void spread(byte *symtab, const FSEcounts norm, int log) {
+	uint total = 1u << log;
+	uint step = (total >> 1) + (total >> 3) + 3;
+	uint pos = 0;
+	for (int i = 0; i < TIGHTBYTES; i++) {
+		for (int j = 0; j < norm[i]; j++) {
+			symtab[pos] = i;
+			pos = (pos + step) & (total - 1);
+		}
+	}
+	t_assert(pos == 0);
+}
+
+
+
+/*--------------------------------------------------------------------------
+ * Encoder
+ *-------------------------------------------------------------------------- */
+
+/* forward bit writer */
+typedef struct BitOut {
+	byte *p; /* output position */
+	uint64_t bits; /* bits not yet flushed */
+	int n; /* number of bits in 'bits' */
+} BitOut;
+
+
+static inline void putbits(BitOut *out, uint64_t v, int nbits) {
+	t_assert(out->n + nbits <= 64);
+	out->bits |= (v & ((1ull << nbits) - 1)) << out->n;
+	out->n += nbits;
+}
+
+
+/* flush whole bytes, this always stores 8 bytes */
+static inline void flushbits(BitOut *out) {
+	store64(out->p, out->bits);
+	out->p += out->n >> 3;
+	out->bits = (out->n >= 64 ? 0 : out->bits >> (out->n & ~7));
+	out->n &= 7;
+}
+
+
+/* write normalized counts header */
+static void writecounts(BitOut *out, const FSEcounts norm, int log) {
+	int left = 1 << log;
+	putbits(out, log, 4);
+	for (int i = 0; left > 0; i++) {
+		putbits(out, norm[i] != 0, 1);
+		if (norm[i] != 0) {
+			putbits(out, norm[i] - 1, countbits(left));
+			left -= norm[i];
+		}
+		flushbits(out);
+	}
+}
+
+
+/* encode symbol 'c' with 'state' */
+#define encodesym(out,state,c) { \
+	const FSEsymbol *s_ = &symtt[c]; \
+	int nb_ = ((state) + s_->deltanbits) >> 16; \
+	putbits(out, state, nb_); \
+	state = statetab[((state) >> nb_) + s_->deltastate]; }
+
+
+/*
+ * Compress 'n' bytes from 'p' with symbol frequencies 'freqs' into 'out',
+ * which must hold at least 'FSEBOUND(n)' bytes.
+ * Returns the size of compressed payload.
+ */
+size_t tightF_compress(byte *out, const byte *p, ulong n, const size_t *freqs) {
+	FSEcounts norm;
+	FSEsymbol symtt[TIGHTBYTES];
+	ushrt statetab[FSEMAXSTATES];
+	byte symtab[FSEMAXSTATES];
+	ushrt cumul[TIGHTBYTES];
+	BitOut bo;
+	int log, nsyms = 0, total = 0;
+	uint32_t s0, s1; /* states */
+	int i;
+
+	t_assert(n > 0);
+	for (i = 0; i < TIGHTBYTES; i++)
+		nsyms += (freqs[i] != 0);
+	log = tablelog(n, nsyms);
+	normalize(norm, freqs, n, log);
+	spread(symtab, norm, log);
+
+	/* build encoding table */
+	for (i = 0; i < TIGHTBYTES; i++) {
+		cumul[i] = total;
+		if (norm[i] == 0) continue;
+		if (norm[i] == 1) {
+			symtt[i].deltanbits = ((uint32_t)log << 16) - (1u << log);
+			symtt[i].deltastate = total - 1;
+		} else {
+			int maxbits = log - highbit(norm[i] - 1);
+			uint32_t minstate = (uint32_t)norm[i] << maxbits;
+			symtt[i].deltanbits = ((uint32_t)maxbits << 16) - minstate;
+			symtt[i].deltastate = total - norm[i];
+		}
+		total += norm[i];
+	}
+	for (i = 0; i < (1 << log); i++)
+		statetab[cumul[symtab[i]]++] = (1 << log) + i;
+
+	/* header */
+	bo.p = out; bo.bits = 0; bo.n = 0;
+	writecounts(&bo, norm, log);
+	if (bo.n > 0) { /* pad header to byte boundary */
+		bo.p++;
+		bo.bits = 0; bo.n = 0;
+	}
+
+	/* bitstream, from the last symbol to the first */
+	s0 = s1 = 1u << log;
+	ulong j = n;
+	if (j & 1) { /* odd number of symbols ? */
+		j--;
+		encodesym(&bo, s0, p[j]);
+		flushbits(&bo);
+	}
+	while (j > 0) {
+		j -= 2;
+		encodesym(&bo, s1, p[j + 1]);
+		encodesym(&bo, s0, p[j]);
+		flushbits(&bo);
+	}
+	putbits(&bo, s0 - (1u << log), log);
+	putbits(&bo, s1 - (1u << log), log);
+	putbits(&bo, 1, 1); /* end mark */
+	flushbits(&bo);
+	return (bo.p - out) + (bo.n > 0);
+}
+
+
+
+/*--------------------------------------------------------------------------
+ * Decoder
+ *-------------------------------------------------------------------------- */
+
+/* read normalized counts header, returns the table log */
+static int readcounts(tight_State *ts, FSEcounts norm, const byte **pp,
+					  const byte *end)
+{
+	const byte *p = *pp;
+	uint64_t bits = 0;
+	int n = 0, left, log, i;
+
+#define needbits(nb) \
+	while (n < (nb)) { \
+		if (t_unlikely(p >= end)) goto corrupt; \
+		bits |= (uint64_t)*p++ << n; n += 8; }
+#define getbits(v,nb) \
+	{ needbits(nb); v = bits & ((1u << (nb)) - 1); bits >>= (nb); n -= (nb); }
+
+	memset(norm, 0, sizeof(FSEcounts));
+	getbits(log, 4);
+	if (t_unlikely(log < FSEMINLOG || log > FSEMAXLOG))
+		goto corrupt;
+	left = 1 << log;
+	for (i = 0; left > 0; i++) {
+		int present, count, nb;
+		if (t_unlikely(i >= TIGHTBYTES))
+			goto corrupt;
+		getbits(present, 1);
+		if (present) {
+			nb = countbits(left);
+			if (nb > 0) {
+				getbits(count, nb);
+			} else {
+				count = 0;
+			}
+			count++;
+			if (t_unlikely(count > left))
+				goto corrupt;
+			norm[i] = count;
+			left -= count;
+		}
+	}
+	*pp = p; /* rest of the byte is padding */
+	return log;
+corrupt:
+	tightD_decompresserror(ts, "invalid FSE header");
+	return 0; /* UNREACHED */
+
+#undef getbits
+#undef needbits
+}
+
+
+/* read 'nb' bits ending at 'pos' (reading backwards) */
+#define readback(in,pos,nb) \
+	((pos) -= (nb), \
+	 (uint32_t)(load64((in) + ((pos) >> 3)) >> ((pos) & 7)) & ((1u << (nb)) - 1))
+
+
+/*
+ * Decompress 'size' bytes of payload 'in' into 'rawsize' bytes of 'out';
+ * 8 bytes before and after 'in' must be readable.
+ */
+void tightF_decompress(tight_State *ts, byte *out, ulong rawsize,
+					   const byte *in, size_t size)
+{
+	FSEcounts norm;
+	FSEstate dtab[FSEMAXSTATES];
+	byte symtab[FSEMAXSTATES];
+	ushrt next[TIGHTBYTES];
+	const byte *end = in + size;
+	const byte *stream;
+	long pos; /* bit position in 'stream' */
+	uint32_t s0, s1; /* states */
+	int log, i;
+
+	log = readcounts(ts, norm, &in, end);
+	spread(symtab, norm, log);
+	memcpy(next, norm, sizeof(next));
+	for (i = 0; i < (1 << log); i++) {
+		byte c = symtab[i];
+		uint32_t x = next[c]++;
+		int nb = log - highbit(x);
+		dtab[i].sym = c;
+		dtab[i].nbits = nb;
+		dtab[i].base = (x << nb) - (1u << log);
+	}
+
+	stream = in;
+	if (t_unlikely(stream >= end || end[-1] == 0))
+		tightD_decompresserror(ts, "invalid FSE bitstream");
+	pos = (long)(end - stream - 1) * 8 + highbit(end[-1]);
+	if (t_unlikely(pos < 2 * log))
+		tightD_decompresserror(ts, "invalid FSE bitstream");
+	s1 = readback(stream, pos, log);
+	s0 = readback(stream, pos, log);
+
+	ulong j = 0;
+	for (; j + 1 < rawsize; j += 2) {
+		const FSEstate *e0 = &dtab[s0];
+		const FSEstate *e1 = &dtab[s1];
+		out[j] = e0->sym;
+		out[j + 1] = e1->sym;
+		s0 = e0->base + readback(stream, pos, e0->nbits);
+		s1 = e1->base + readback(stream, pos, e1->nbits);
+		if (t_unlikely(pos < 0))
+			tightD_decompresserror(ts, "truncated FSE bitstream");
+	}
+	if (j < rawsize) { /* odd number of symbols ? */
+		const FSEstate *e0 = &dtab[s0];
+		out[j] = e0->sym;
+		s0 = e0->base + readback(stream, pos, e0->nbits);
+	}
+	if (t_unlikely(pos != 0 || s0 != 0 || s1 != 0))
+		tightD_decompresserror(ts, "invalid FSE bitstream");
+}
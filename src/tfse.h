@@ -0,0 +1,32 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+#ifndef TIGHTFSE_H
+#define TIGHTFSE_H
+
+#include "tight.h"
+#include "tinternal.h"
+
+
+/* limits for FSE table log (table has '1 << log' states) */
+#define FSEMINLOG		5
+#define FSEMAXLOG		11
+
+
+/* 
+ * Upper bound on the size of FSE compressed block of 'n' bytes;
+ * includes normalized counts header and space for 8 byte stores
+ * past the end of the output.
+ */
+#define FSEBOUND(n)		((n) * 2 + 512)
+
+
+TIGHT_FUNC size_t tightF_estimate(const size_t *freqs, ulong n);
+TIGHT_FUNC size_t tightF_compress(byte *out, const byte *p, ulong n,
+								  const size_t *freqs);
+TIGHT_FUNC void tightF_decompress(tight_State *ts, byte *out, ulong rawsize,
+								  const byte *in, size_t size);
+
+#endif
@@ -3,10 +3,12 @@
  * Refer to 'tight.h' for license details.
  *****************************************/
 
-#define _POSIX_C_SOURCE		199309L
+#define _POSIX_C_SOURCE		200112L
+#define _GNU_SOURCE /* 'SEEK_DATA' and 'SEEK_HOLE' */
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -48,6 +50,29 @@
 #define tabs(x)			((x) < 0 ? -(x) : (x))
 
 
+/* maximum number of batch workers */
+#define MAXJOBS			256
+
+
+/* arena size of each 'tight_State' (per-call memory of any mode) */
+#define ARENASIZE		(2 * 1024 * 1024)
+
+/* arena room for per-state buffers (largest automatic I/O buffers, huge
+   page aligned, and coding tables); only touched pages take memory */
+#define ARENAKEEP		(2 * ((size_t)TIGHT_MAXAUTOBUFF + ARENASIZE) + ARENASIZE)
+
+
+/* '-q' samples 64 KiB every 'SAMPLESTRIDE' bytes of files of at least
+   'SAMPLEMIN' bytes, smaller files are counted in full */
+#define SAMPLESTRIDE	((off_t)16 << 20)
+#define SAMPLEMIN		(4 * SAMPLESTRIDE)
+
+
+/* '--stats' output formats */
+#define STATSTEXT		1
+#define STATSJSON		2
+
+
 
 typedef unsigned char uchar;
 
@@ -57,11 +82,33 @@ typedef struct CLI_context {
 	tight_State *ts; /* state for errors */
 	const char *infile; /* input file */
 	const char *outfile; /* output file */
+	const char *reffile; /* reference file of delta ('--ref') */
+	const char **files; /* file arguments (compacted in 'argv') */
+	int nfiles; /* number of 'files' */
+	int jobs; /* number of batch workers, 0 if not in batch mode */
+	size_t rangeoff; /* start of '-r' range */
+	size_t rangelen; /* length of '-r' range */
+	size_t buffsize; /* '-b' I/O buffer size, 0 if automatic */
 	uchar huffman; /* use huffman coding */
 	uchar rle; /* use rle */
+	uchar order1; /* use order-1 huffman */
+	uchar fse; /* use FSE */
+	uchar seekable; /* write block index */
+	uchar dedup; /* store repeated chunks as references */
+	uchar sample; /* sampled histogram ('-q') */
+	uchar pipelined; /* I/O engine ('TIGHT_PIPE_*') */
+	uchar iopolicy; /* page cache policy ('TIGHT_IO_*') */
+	uchar range; /* decompress only '-r' range */
 	uchar decompress; /* decompress */
 	uchar time; /* time the execution */
 	uchar verbose; /* verbose output */
+	uchar stats; /* print statistics ('STATSTEXT' or 'STATSJSON') */
+	uchar archive; /* create archive */
+	uchar extract; /* extract archive members */
+	uchar list; /* list archive members */
+	uchar analyze; /* estimate compressed size ('--analyze') */
+	uchar verify; /* verify compressed files ('-T') */
+	uchar unverified; /* accept files without checksums ('-T') */
 } CLIctx;
 
 
@@ -73,6 +120,10 @@ static char *t_outfile = NULL;
 static size_t t_frequencies[256];
 
 
+/* nanoseconds spent in 'histogram' */
+static unsigned long long t_histns = 0;
+
+
 
 /* memory allocator */
 static void *trealloc(void *block, void *ud, size_t os, size_t ns) {
@@ -107,7 +158,15 @@ static void tprintf(FILE *fp, const char *fmt, ...) {
 /* print usage */
 static void usage(void) {
 	tprint(stdout,
-		"usage: tight [-dhl] [INFILE] [OUTFILE]\n"
+		"usage: tight [-CVvhtdclofsDpuq] [-b SIZE] [-i POLICY] [INFILE] [OUTFILE]\n"
+		"       tight [-CVvt] -r OFFSET:LENGTH INFILE OUTFILE\n"
+		"       tight [-CVvtdclof] --ref REFERENCE INFILE [OUTFILE]\n"
+		"       tight [-CVvhtdclofsDpuq] [-i POLICY] -j N FILE...\n"
+		"       tight [-CVvtclofDq] -a ARCHIVE FILE...\n"
+		"       tight [-CVvt] [-j N] -x ARCHIVE [MEMBER...]\n"
+		"       tight -L ARCHIVE\n"
+		"       tight --analyze [-q] [-j N] FILE...\n"
+		"       tight -T [-j N] [--ref REFERENCE] [--allow-unverified] FILE...\n"
 		"              -C  show copyright\n"
 		"              -V  enable verbose output\n"
 		"              -v  show version information\n"
@@ -115,7 +174,39 @@ static void usage(void) {
 		"              -t  time the execution\n"
 		"              -d  decompress INFILE into OUTFILE\n"
 		"              -c  use huffman compression\n"
-		"              -l  (NOT IMPLEMENTED) use run-length-encoding when compressing\n"
+		"              -l  use run-length-encoding when compressing\n"
+		"              -o  also use order-1 (previous byte) huffman trees\n"
+		"              -f  use FSE (tANS) entropy coding when compressing\n"
+		"              -s  write block index (seekable file for '-r')\n"
+		"              -D  deduplicate, cut input into content-defined chunks\n"
+		"                  and store repeated ones as references\n"
+		"              -q  estimate huffman table of large files from samples\n"
+		"                  (64 KiB every 16 MiB) instead of reading them\n"
+		"              -r  decompress only LENGTH bytes at OFFSET of INFILE\n"
+		"                  (sizes can have K, M or G suffix)\n"
+		"              -b  use I/O buffers of SIZE bytes (default automatic)\n"
+		"              -p  read ahead and write behind in I/O threads\n"
+		"              -u  read ahead and write behind with io_uring\n"
+		"              -i  page cache POLICY, comma separated list of 'cached',\n"
+		"                  'dontneed', 'writeback' and 'direct' (O_DIRECT)\n"
+		"              -j  compress (decompress) FILEs into FILE.tit (FILE)\n"
+		"                  using N worker threads\n"
+		"              -a  compress FILEs into a single ARCHIVE\n"
+		"              -x  extract all (or listed) members of ARCHIVE\n"
+		"              -L  list members of ARCHIVE\n"
+		"              -T  verify compressed FILEs without writing anything,\n"
+		"                  blocks of seekable files and archive members are\n"
+		"                  checked in parallel by N threads, corrupt ones are\n"
+		"                  reported with their offsets\n"
+		"                  (files without checksums are unverified and\n"
+		"                  fail unless '--allow-unverified' is given)\n"
+		"           --ref  compress INFILE as delta against REFERENCE (bytes\n"
+		"                  found in it are stored as their offsets), '-d'\n"
+		"                  decompresses it with the same REFERENCE\n"
+		"         --stats  print statistics (--stats=json for JSON)\n"
+		"       --analyze  print JSON estimate of FILEs compressed with '-cs'\n"
+		"                  (histogram, entropy and sizes of each block)\n"
+		"                  without writing them, using N threads\n"
 	);
 }
 
@@ -163,6 +254,56 @@ static int trymakeoutfile(CLIctx *ctx) {
 
 
 
+/* 
+ * Parse size with optional binary suffix ('K', 'M' or 'G') up to 'end'
+ * character, returns pointer past the size or NULL on error.
+ */
+static const char *parsesize(const char *s, int end, size_t *out) {
+	unsigned long long n;
+	int shift = 0;
+	char *p;
+
+	if (*s < '0' || '9' < *s)
+		return NULL;
+	errno = 0;
+	n = strtoull(s, &p, 10);
+	switch (*p) {
+	case 'K': case 'k': shift = 10; p++; break;
+	case 'M': case 'm': shift = 20; p++; break;
+	case 'G': case 'g': shift = 30; p++; break;
+	}
+	if (errno != 0 || *p != end || n > (SIZE_MAX >> shift))
+		return NULL;
+	*out = (size_t)n << shift;
+	return p;
+}
+
+
+/* parse '-i' policy list into 'TIGHT_IO_*' bits, returns -1 on error */
+static int parsepolicy(const char *s) {
+	static const struct { const char *name; int bit; } policies[] = {
+		{ "cached", TIGHT_IO_CACHED }, { "dontneed", TIGHT_IO_DONTNEED },
+		{ "writeback", TIGHT_IO_WRITEBACK }, { "direct", TIGHT_IO_DIRECT },
+	};
+	int policy = TIGHT_IO_CACHED;
+
+	for (;;) {
+		size_t len = strcspn(s, ",");
+		size_t i = 0;
+		while (i < sizeof(policies) / sizeof(policies[0]) &&
+			   !(strlen(policies[i].name) == len &&
+				 strncmp(s, policies[i].name, len) == 0))
+			i++;
+		if (i == sizeof(policies) / sizeof(policies[0]))
+			return -1;
+		policy |= policies[i].bit;
+		if (s[len] == '\0')
+			return policy;
+		s += len + 1;
+	}
+}
+
+
 /* parse cli args */
 static int parseargs(CLIctx *ctx, int argc, const char **argv) {
 #define jmpifhaveopt(arg,i,l)		if (arg[++i] != '\0') goto l
@@ -174,12 +315,43 @@ static int parseargs(CLIctx *ctx, int argc, const char **argv) {
 	int nomoreopts;
 
 	nomoreopts = 0;
+	ctx->files = argv; /* file arguments are compacted in place */
+	ctx->nfiles = 0;
 	while (argc-- > 0) {
 		const char *arg = *argv++;
 		switch (arg[0]) {
 		case '-':
 			if (nomoreopts) 
 				goto filearg;
+			if (strncmp(arg, "--stats", sizeof("--stats") - 1) == 0) {
+				const char *fmt = arg + sizeof("--stats") - 1;
+				if (*fmt == '\0' || strcmp(fmt, "=text") == 0) {
+					ctx->stats = STATSTEXT;
+				} else if (strcmp(fmt, "=json") == 0) {
+					ctx->stats = STATSJSON;
+				} else {
+					terrorf("unknown statistics format '%s'", fmt);
+					return argserr;
+				}
+				break;
+			} else if (strcmp(arg, "--analyze") == 0) {
+				ctx->analyze = 1;
+				break;
+			} else if (strcmp(arg, "--allow-unverified") == 0) {
+				ctx->unverified = 1;
+				break;
+			} else if (strncmp(arg, "--ref", sizeof("--ref") - 1) == 0 &&
+					   (arg[5] == '\0' || arg[5] == '=')) {
+				if (arg[5] == '=') { /* '--ref=FILE' ? */
+					ctx->reffile = &arg[6];
+				} else if (argc-- > 0) {
+					ctx->reffile = *argv++;
+				} else {
+					terror("missing reference file for '--ref'");
+					return argserr;
+				}
+				break;
+			}
 			i = 1;
 readmore:
 			switch(arg[i]) {
@@ -194,14 +366,109 @@ readmore:
 				ctx->rle = 1;
 				jmpifhaveopt(arg, i, readmore);
 				break;
+			case 'f': /* use FSE */
+				ctx->fse = 1;
+				jmpifhaveopt(arg, i, readmore);
+				break;
+			case 's': /* seekable */
+				ctx->seekable = 1;
+				jmpifhaveopt(arg, i, readmore);
+				break;
+			case 'D': /* deduplicate */
+				ctx->dedup = 1;
+				jmpifhaveopt(arg, i, readmore);
+				break;
+			case 'q': /* sampled histogram */
+				ctx->sample = 1;
+				jmpifhaveopt(arg, i, readmore);
+				break;
+			case 'p': /* pipelined I/O */
+				ctx->pipelined = TIGHT_PIPE_THREADS;
+				jmpifhaveopt(arg, i, readmore);
+				break;
+			case 'u': /* io_uring I/O */
+				ctx->pipelined = TIGHT_PIPE_URING;
+				jmpifhaveopt(arg, i, readmore);
+				break;
+			case 'i': { /* I/O policy */
+				const char *s = &arg[i + 1];
+				if (*s == '\0') { /* policy is the next argument ? */
+					if (argc-- <= 0) {
+						terror("missing policy for '-i'");
+						return argserr;
+					}
+					s = *argv++;
+				}
+				int policy = parsepolicy(s);
+				if (policy < 0) {
+					terrorf("invalid I/O policy '%s'", s);
+					return argserr;
+				}
+				ctx->iopolicy = policy;
+				break;
+			}
+			case 'r': { /* decompress range */
+				const char *r = &arg[i + 1];
+				if (*r == '\0') { /* range is the next argument ? */
+					if (argc-- <= 0) {
+						terror("missing range for '-r'");
+						return argserr;
+					}
+					r = *argv++;
+				}
+				const char *p = parsesize(r, ':', &ctx->rangeoff);
+				if (p == NULL || parsesize(p + 1, '\0', &ctx->rangelen) == NULL) {
+					terrorf("invalid range '%s' (expected OFFSET:LENGTH)", r);
+					return argserr;
+				}
+				ctx->range = ctx->decompress = 1;
+				break;
+			}
+			case 'b': { /* buffer size */
+				const char *s = &arg[i + 1];
+				if (*s == '\0') { /* size is the next argument ? */
+					if (argc-- <= 0) {
+						terror("missing size for '-b'");
+						return argserr;
+					}
+					s = *argv++;
+				}
+				if (parsesize(s, '\0', &ctx->buffsize) == NULL || ctx->buffsize == 0) {
+					terrorf("invalid buffer size '%s'", s);
+					return argserr;
+				}
+				break;
+			}
+			case 'o': /* use order-1 huffman */
+				ctx->order1 = 1;
+				jmpifhaveopt(arg, i, readmore);
+				break;
 			case 'd': /* decode */
 				ctx->decompress = 1;
 				jmpifhaveopt(arg, i, readmore);
 				break;
-			case 't': /* decode */
+			case 't': /* time */
 				ctx->time = 1;
 				jmpifhaveopt(arg, i, readmore);
 				break;
+			case 'j': { /* batch workers */
+				const char *n = &arg[i + 1];
+				char *end;
+				if (*n == '\0') { /* number is the next argument ? */
+					if (argc-- <= 0) {
+						terror("missing number of workers for '-j'");
+						return argserr;
+					}
+					n = *argv++;
+				}
+				long jobs = strtol(n, &end, 10);
+				if (*end != '\0' || jobs < 1 || jobs > MAXJOBS) {
+					terrorf("invalid number of workers '%s' (1-%d)", n, MAXJOBS);
+					return argserr;
+				}
+				ctx->jobs = jobs;
+				break;
+			}
 			case 'C': /* display copyright */
 				copyright();
 				return argsexit;
@@ -216,6 +483,22 @@ readmore:
 				ctx->verbose = 1;
 				jmpifhaveopt(arg, i, readmore);
 				break;
+			case 'a': /* create archive */
+				ctx->archive = 1;
+				jmpifhaveopt(arg, i, readmore);
+				break;
+			case 'x': /* extract archive */
+				ctx->extract = 1;
+				jmpifhaveopt(arg, i, readmore);
+				break;
+			case 'L': /* list archive */
+				ctx->list = 1;
+				jmpifhaveopt(arg, i, readmore);
+				break;
+			case 'T': /* verify */
+				ctx->verify = 1;
+				jmpifhaveopt(arg, i, readmore);
+				break;
 			default:
 				terrorf("unknown option '-%c'", arg[i]);
 				return argserr;
@@ -223,17 +506,71 @@ readmore:
 			break;
 		default:
 filearg:
-			if (ctx->infile && ctx->outfile) {
-				terror("already have input and output file arguments");
-				return argserr;
-			} else if (ctx->infile) {
-				ctx->outfile = arg;
-			} else {
-				ctx->infile = arg;
-			}
+			ctx->files[ctx->nfiles++] = arg;
 			break;
 		}
 	}
+	if (ctx->verify) {
+		if (ctx->decompress || ctx->range || ctx->analyze ||
+				ctx->archive + ctx->extract + ctx->list) {
+			terror("'-T' can't be used with '-d', '-r', '-a', '-x', '-L' or '--analyze'");
+			return argserr;
+		} else if (ctx->nfiles == 0) {
+			terror("missing input files");
+			usage();
+			return argserr;
+		}
+		return argsok;
+	} else if (ctx->unverified) {
+		terror("'--allow-unverified' can only be used with '-T'");
+		return argserr;
+	}
+	if (ctx->reffile && (ctx->analyze || ctx->jobs ||
+						 ctx->archive + ctx->extract + ctx->list)) {
+		terror("'--ref' can't be used with '--analyze', '-j', '-a', '-x' or '-L'");
+		return argserr;
+	} else if (ctx->reffile && (ctx->seekable || ctx->dedup)) {
+		terror("'--ref' can't be used with '-s' or '-D'");
+		return argserr;
+	}
+	if (ctx->analyze) {
+		if (ctx->decompress || ctx->archive + ctx->extract + ctx->list) {
+			terror("'--analyze' can't be used with '-d', '-r', '-a', '-x' or '-L'");
+			return argserr;
+		} else if (ctx->nfiles == 0) {
+			terror("missing input files");
+			usage();
+			return argserr;
+		}
+		return argsok;
+	}
+	if (ctx->range && (ctx->jobs || ctx->archive + ctx->extract + ctx->list)) {
+		terror("'-r' can't be used with '-j', '-a', '-x' or '-L'");
+		return argserr;
+	}
+	if (ctx->archive + ctx->extract + ctx->list > 1) {
+		terror("only one of '-a', '-x' and '-L' can be used");
+		return argserr;
+	} else if (ctx->archive + ctx->extract + ctx->list > 0) { /* archive ? */
+		if (ctx->nfiles == 0 || (ctx->archive && ctx->nfiles < 2)) {
+			terrorf("%s", ctx->nfiles == 0 ? "missing archive" : "missing archive members");
+			usage();
+			return argserr;
+		}
+		return argsok;
+	} else if (ctx->jobs) { /* batch mode ? */
+		if (ctx->nfiles == 0) {
+			terror("missing input files");
+			usage();
+			return argserr;
+		}
+		return argsok;
+	} else if (ctx->nfiles > 2) {
+		terror("already have input and output file arguments");
+		return argserr;
+	}
+	ctx->infile = (ctx->nfiles > 0 ? ctx->files[0] : NULL);
+	ctx->outfile = (ctx->nfiles > 1 ? ctx->files[1] : NULL);
 	if (!ctx->infile) { /* missing input file ? */
 		terror("missing input file");
 		usage(); /* give a hint */
@@ -252,67 +589,52 @@ filearg:
 }
 
 
-typedef struct tfile_buffer {
-	tight_State *ts; /* for panic */
-	uchar buf[TIGHT_RBUFFSIZE];
-	uchar *p; /* current position in 'buf' */
-	ssize_t n; /* how many chars left in 'buf' */
-	int fd; /* file descriptor */
-	int wfd; /* for close in case of errors */
-} tfilebuff;
-
-
-/* get character */
-#define tgetchar(fb)		((fb)->n-- > 0 ? *(fb)->p++ : fillfilebuf(fb))
-
-
-static void initfb(tight_State *ts, tfilebuff *fb, int fd, int wfd) {
-	fb->ts = ts;
-	fb->p = fb->buf;
-	fb->n = 0;
-	fb->fd = fd;
-	fb->wfd = wfd;
+/* number of threads for work on a single file ('-j N' or all CPUs) */
+static int numthreads(const CLIctx *ctx) {
+	long ncpu;
+	if (ctx->jobs > 0)
+		return ctx->jobs;
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	return (ncpu < 1 ? 1 : ncpu > MAXJOBS ? MAXJOBS : (int)ncpu);
 }
 
 
-/* file 'tfilebuff' */
-static int fillfilebuf(tfilebuff *fb) {
-	fb->n = read(fb->fd, fb->buf, sizeof(fb->buf));
-	if (fb->n < 0) {
-		close(fb->fd); close(fb->wfd);
-		tdief(fb->ts, "read error (input file): %s", strerror(errno));
-	}
-	if (fb->n == 0)
-		return EOF;
-	fb->p = fb->buf;
-	fb->n--;
-	return *fb->p++;
+/* true if '-q' samples histogram of 'fd' */
+static int sampled(const CLIctx *ctx, int fd) {
+	struct stat st;
+	return (ctx->sample && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+			st.st_size >= SAMPLEMIN);
 }
 
 
-/* get character frequencies from file descriptor 'rfd' */
-static void getfrequencies(tight_State *ts, int rfd, int wfd) {
-	tfilebuff fb; /* file buffer */
-	int c;
-
-	initfb(ts, &fb, rfd, wfd);
-	memset(t_frequencies, 0, 256 * sizeof(size_t));;
-	while ((c = tgetchar(&fb)) != EOF)
-		t_frequencies[c]++;
-	if (lseek(rfd, 0, SEEK_SET) < 0) {
-		close(rfd); close(wfd);
-		tdief(ts, "seek error input file: %s", strerror(errno));
+/*
+ * Character frequencies for huffman table of 'fd' (file 'name') counted
+ * by 'nthreads' threads ('-q' samples them) and rewind it, returns -1
+ * on error (after reporting it).
+ */
+static int histogram(const CLIctx *ctx, tight_State *ts, const char *name,
+					 int fd, int nthreads, size_t *freqs)
+{
+	if (tight_histogram(ts, fd, nthreads,
+				(sampled(ctx, fd) ? SAMPLESTRIDE : 0), freqs) != TIGHT_OK) {
+		terrorf("'%s': %s", name, tight_geterror(ts));
+		return -1;
+	} else if (lseek(fd, 0, SEEK_SET) < 0) {
+		terrorf("read error '%s': %s", name, strerror(errno));
+		return -1;
 	}
+	return 0;
 }
 
 
 /* get encoding/decoding mode */
 static inline int getmode(CLIctx *ctx) {
-	int mode = (ctx->huffman * TIGHT_HUFFMAN) | (ctx->rle * TIGHT_RLE);
-	/* TODO(jure): implement LZW */
+	int mode = (ctx->huffman * TIGHT_HUFFMAN) | (ctx->rle * TIGHT_RLE) |
+			   (ctx->fse * TIGHT_FSE);
 	if (!mode) 
 		mode = TIGHT_DEFAULT;
-	return mode;
+	return mode | (ctx->order1 * TIGHT_ORDER1) | (ctx->seekable * TIGHT_SEEKABLE) |
+		   (ctx->dedup * TIGHT_DEDUP);
 }
 
 
@@ -330,6 +652,59 @@ static inline int tgettime(struct timespec *ts) {
 }
 
 
+/* nanoseconds elapsed from 'start' to 'end' */
+static inline unsigned long long elapsedns(struct timespec *end,
+										   struct timespec *start)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000ull +
+		   end->tv_nsec - start->tv_nsec;
+}
+
+
+/* print statistics 'st' collected by the library */
+static void printstats(const tight_Stats *st, int format) {
+	static const char *phases[TIGHT_NPHASES] = {
+		"other", "histogram", "tree", "encode", "decode", "md5", "read", "write",
+	};
+
+	if (format == STATSJSON) {
+		tprintf(stdout, "{\"bytes_in\": %llu, \"bytes_out\": %llu, "
+				"\"reads\": %llu, \"writes\": %llu, \"seeks\": %llu, "
+				"\"syscalls\": %llu, \"allocs\": %llu, \"frees\": %llu, "
+				"\"ns\": {\"cli_histogram\": %llu",
+				st->bytesin, st->bytesout, st->reads, st->writes, st->seeks,
+				st->syscalls, st->allocs, st->frees, t_histns);
+		for (int i = 0; i < TIGHT_NPHASES; i++)
+			tprintf(stdout, ", \"%s\": %llu", phases[i], st->ns[i]);
+		tprint(stdout, "}}\n");
+	} else {
+		tprintf(stdout, "%-14s %llu\n%-14s %llu\n%-14s %llu\n%-14s %llu\n"
+				"%-14s %llu\n%-14s %llu\n%-14s %llu\n%-14s %llu\n",
+				"bytes in", st->bytesin, "bytes out", st->bytesout,
+				"reads", st->reads, "writes", st->writes, "seeks", st->seeks,
+				"syscalls", st->syscalls, "allocs", st->allocs, "frees", st->frees);
+		tprintf(stdout, "%-14s %.3f ms\n", "cli histogram", t_histns / 1e6);
+		for (int i = 0; i < TIGHT_NPHASES; i++)
+			tprintf(stdout, "%-14s %.3f ms\n", phases[i], st->ns[i] / 1e6);
+	}
+}
+
+
+/* add statistics 'st' to 'sum' */
+static void addstats(tight_Stats *sum, const tight_Stats *st) {
+	sum->bytesin += st->bytesin;
+	sum->bytesout += st->bytesout;
+	sum->reads += st->reads;
+	sum->writes += st->writes;
+	sum->seeks += st->seeks;
+	sum->syscalls += st->syscalls;
+	sum->allocs += st->allocs;
+	sum->frees += st->frees;
+	for (int i = 0; i < TIGHT_NPHASES; i++)
+		sum->ns[i] += st->ns[i];
+}
+
+
 /* print size change (verbose) */
 static inline void printsizechange(off_t insize, off_t outsize) {
 	off_t size = insize - outsize;
@@ -340,6 +715,621 @@ static inline void printsizechange(off_t insize, off_t outsize) {
 }
 
 
+
+/* ---------------------------------------------------------------------------
+ * Batch mode ('-j N'); files are processed largest-first by a pool of
+ * workers, each worker reuses its own 'tight_State'.
+ * --------------------------------------------------------------------------- */
+
+/* batch job */
+typedef struct tjob {
+	const char *infile; /* input file (or member name) */
+	off_t size; /* input size (for scheduling) */
+	const tight_Member *member; /* archive member if extracting */
+} tjob;
+
+
+/* batch shared by workers */
+typedef struct tbatch {
+	CLIctx *ctx;
+	const char *archive; /* archive if extracting */
+	tjob *jobs; /* jobs sorted by size (descending) */
+	int njobs; /* number of 'jobs' */
+	int next; /* next job to take */
+	int mode; /* compression mode */
+	int failed; /* number of failed jobs */
+	off_t insize; /* sum of input sizes */
+	off_t outsize; /* sum of output sizes */
+	unsigned long long histns; /* sum of histogram times */
+	tight_Stats stats; /* sum of statistics */
+	pthread_mutex_t lock;
+} tbatch;
+
+
+/* compare jobs by size (largest first) */
+static int cmpjobs(const void *a, const void *b) {
+	off_t sa = ((const tjob *)a)->size, sb = ((const tjob *)b)->size;
+	return (sa < sb) - (sa > sb);
+}
+
+
+/* make output filename for 'infile', returns NULL on error */
+static char *joboutfile(CLIctx *ctx, const char *infile) {
+	size_t len = strlen(infile);
+	char *outfile;
+
+	if (ctx->decompress) { /* strip '.tit' */
+		if (len <= sizeof(".tit") - 1 ||
+				strcmp(&infile[len - sizeof(".tit") + 1], ".tit") != 0) {
+			terrorf("file '%s' has no '.tit' extension -- skipping", infile);
+			return NULL;
+		}
+		len -= sizeof(".tit") - 1;
+		if ((outfile = malloc(len + 1)) == NULL)
+			return NULL;
+		memcpy(outfile, infile, len);
+		outfile[len] = '\0';
+	} else { /* append '.tit' */
+		const char *p = strrchr(infile, '.');
+		if (p != NULL && !strcmp(p, ".tit")) {
+			terrorf("file '%s' has '.tit' extension -- skipping", infile);
+			return NULL;
+		}
+		if ((outfile = malloc(len + sizeof(".tit"))) == NULL)
+			return NULL;
+		memcpy(outfile, infile, len);
+		memcpy(&outfile[len], ".tit", sizeof(".tit"));
+	}
+	return outfile;
+}
+
+
+/* hint the kernel to start reading 'job' ('archfd' is archive or -1) */
+static void prefetch(const tjob *job, int archfd) {
+	if (job->member) { /* archive member ? */
+		posix_fadvise(archfd, job->member->offset, job->member->size,
+					  POSIX_FADV_WILLNEED);
+	} else {
+		int fd = open(job->infile, O_RDONLY);
+		if (fd >= 0) {
+			posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+			close(fd);
+		}
+	}
+}
+
+
+/* true if extracting member 'name' would write outside of current directory */
+static int unsafename(const char *name) {
+	if (name[0] == '\0' || name[0] == '/')
+		return 1;
+	for (const char *p = name; *p; p++) {
+		if (p[0] == '.' && p[1] == '.' && (p == name || p[-1] == '/') &&
+				(p[2] == '/' || p[2] == '\0'))
+			return 1;
+	}
+	return 0;
+}
+
+
+/* extract 'job' from archive 'archfd' with state 'ts', returns non-zero on failure */
+static int extractjob(tbatch *b, tight_State *ts, const tjob *job, int archfd,
+					  off_t *outsize)
+{
+	const tight_Member *m = job->member;
+	int wfd, status;
+
+	if (unsafename(m->name)) {
+		terrorf("member '%s' has unsafe name -- skipping", m->name);
+		return -1;
+	}
+	wfd = open(m->name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (wfd < 0) {
+		openerror(m->name);
+		return -1;
+	}
+	if (b->ctx->verbose)
+		tprintf(stdout, MSGFMT("extracting '%s'.."), m->name);
+	tight_setfiles(ts, archfd, wfd);
+	status = tight_extract(ts, m);
+	if (status != TIGHT_OK)
+		terrorf("'%s': %s", m->name, tight_geterror(ts));
+	else
+		*outsize = m->rawsize;
+	close(wfd);
+	return status;
+}
+
+
+/* 
+ * Run a single job with state 'ts', on success 'outsize' is the size
+ * of output file and 'histns' time of the histogram pass; returns
+ * non-zero on failure.
+ */
+static int runjob(tbatch *b, tight_State *ts, const tjob *job, size_t *freqs,
+				  off_t *outsize, unsigned long long *histns)
+{
+	CLIctx *ctx = b->ctx;
+	char *outfile = joboutfile(ctx, job->infile);
+	struct stat st;
+	int rfd = -1, wfd = -1;
+	int status = -1;
+
+	*histns = 0;
+	if (outfile == NULL)
+		return -1;
+	if ((rfd = open(job->infile, O_RDONLY, 0)) < 0) {
+		openerror(job->infile);
+		goto done;
+	}
+	wfd = open(outfile, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (wfd < 0) {
+		openerror(outfile);
+		goto done;
+	}
+	if (ctx->verbose) {
+		tprintf(stdout, MSGFMT("%s '%s' into '%s'.."), 
+				ctx->decompress ? "decompressing" : "compressing",
+				job->infile, outfile);
+	}
+	tight_setfiles(ts, rfd, wfd);
+	if (ctx->decompress) {
+		status = tight_decompress(ts);
+	} else {
+		const size_t *f = NULL;
+		if (b->mode & TIGHT_HUFFMAN) {
+			struct timespec hstart, hend;
+			tgettime(&hstart);
+			/* batch workers already use the CPUs, count in this one */
+			if (histogram(ctx, ts, job->infile, rfd, 1, freqs) < 0)
+				goto done;
+			tgettime(&hend);
+			*histns = elapsedns(&hend, &hstart);
+			f = freqs;
+		}
+		status = tight_compress(ts, b->mode, f);
+	}
+	if (status != TIGHT_OK) {
+		terrorf("'%s': %s", job->infile, tight_geterror(ts));
+	} else if (fstat(wfd, &st) < 0) {
+		terrorf("stat '%s': %s", outfile, strerror(errno));
+		status = -1;
+	} else {
+		*outsize = st.st_size;
+	}
+done:
+	if (rfd >= 0) close(rfd);
+	if (wfd >= 0) close(wfd);
+	free(outfile);
+	return status;
+}
+
+
+/* batch worker */
+static void *worker(void *ud) {
+	tbatch *b = (tbatch *)ud;
+	size_t freqs[256];
+	tight_State *ts = tight_new(trealloc, NULL);
+	tight_Stats st;
+	int archfd = -1;
+
+	if (ts != NULL) {
+		tight_setstats(ts, b->ctx->stats);
+		tight_setarena(ts, ARENASIZE + ARENAKEEP); /* without it 'trealloc' is used */
+		tight_setbuffers(ts, b->ctx->buffsize, b->ctx->buffsize);
+		tight_setpipelined(ts, b->ctx->pipelined);
+		tight_setiopolicy(ts, b->ctx->iopolicy);
+	}
+	if (b->archive && (archfd = open(b->archive, O_RDONLY)) < 0)
+		openerror(b->archive);
+	for (;;) {
+		unsigned long long histns = 0;
+		off_t outsize = 0;
+		int status = -1;
+
+		pthread_mutex_lock(&b->lock);
+		int k = b->next++;
+		pthread_mutex_unlock(&b->lock);
+		if (k >= b->njobs)
+			break;
+		if (k + 1 < b->njobs) /* warm up the next job */
+			prefetch(&b->jobs[k + 1], archfd);
+		if (ts == NULL)
+			terrorf("'%s': couldn't allocate state", b->jobs[k].infile);
+		else if (b->archive && archfd >= 0)
+			status = extractjob(b, ts, &b->jobs[k], archfd, &outsize);
+		else if (!b->archive)
+			status = runjob(b, ts, &b->jobs[k], freqs, &outsize, &histns);
+		pthread_mutex_lock(&b->lock);
+		if (status != TIGHT_OK) {
+			b->failed++;
+		} else {
+			b->insize += (b->jobs[k].member ? (off_t)b->jobs[k].member->size
+											: b->jobs[k].size);
+			b->outsize += outsize;
+			b->histns += histns;
+		}
+		if (ts != NULL && b->ctx->stats) {
+			tight_getstats(ts, &st);
+			addstats(&b->stats, &st);
+		}
+		pthread_mutex_unlock(&b->lock);
+	}
+	if (ts != NULL)
+		tight_free(ts);
+	if (archfd >= 0)
+		close(archfd);
+	return NULL;
+}
+
+
+/* run sorted jobs of 'b' on 'ctx->jobs' workers */
+static void runpool(tbatch *b) {
+	pthread_t threads[MAXJOBS];
+	int nthreads, i;
+
+	qsort(b->jobs, b->njobs, sizeof(*b->jobs), cmpjobs);
+	pthread_mutex_init(&b->lock, NULL);
+	nthreads = (b->ctx->jobs < b->njobs ? b->ctx->jobs : b->njobs);
+	if (nthreads < 1)
+		nthreads = 1;
+	for (i = 0; i < nthreads; i++) {
+		int err = pthread_create(&threads[i], NULL, worker, b);
+		if (err != 0) {
+			terrorf("pthread_create: %s", strerror(err));
+			break;
+		}
+	}
+	if (i == 0) /* no workers ? */
+		worker(b);
+	nthreads = i;
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&b->lock);
+}
+
+
+/* run batch, returns exit status */
+static int runbatch(CLIctx *ctx) {
+	struct timespec start, end;
+	struct stat st;
+	tbatch b;
+	int i;
+
+	memset(&b, 0, sizeof(b));
+	b.ctx = ctx;
+	b.mode = (ctx->decompress ? TIGHT_NONE : getmode(ctx));
+	if ((b.jobs = malloc(ctx->nfiles * sizeof(*b.jobs))) == NULL) {
+		terror("out of memory");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < ctx->nfiles; i++) {
+		b.jobs[b.njobs].infile = ctx->files[i];
+		b.jobs[b.njobs].member = NULL;
+		if (stat(ctx->files[i], &st) < 0) { /* fail early */
+			terrorf("stat '%s': %s", ctx->files[i], strerror(errno));
+			b.failed++;
+			continue;
+		}
+		b.jobs[b.njobs++].size = st.st_size;
+	}
+	tgettime(&start);
+	runpool(&b);
+	tgettime(&end);
+
+	tprintf(stdout, MSGFMT("%d file(s) %s, %d failed, %ld -> %ld bytes"),
+			ctx->nfiles - b.failed, (ctx->decompress ? "decompressed" : "compressed"),
+			b.failed, (long)b.insize, (long)b.outsize);
+	if (ctx->time)
+		printmonoclock(&end, &start);
+	if (ctx->stats) {
+		t_histns = b.histns;
+		printstats(&b.stats, ctx->stats);
+	}
+	free(b.jobs);
+	return (b.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+
+
+
+/* ---------------------------------------------------------------------------
+ * Archives ('-a', '-x' and '-L')
+ * --------------------------------------------------------------------------- */
+
+/* open member 'i' for 'tight_archive' */
+static int openmember(void *ud, int i) {
+	CLIctx *ctx = (CLIctx *)ud;
+	return open(ctx->files[i + 1], O_RDONLY);
+}
+
+
+/* create archive 'files[0]' from 'files[1..]', returns exit status */
+static int createarchive(CLIctx *ctx) {
+	int mode = getmode(ctx);
+	size_t *freqs = NULL;
+	struct timespec start, end;
+	struct stat st;
+	int wfd, status;
+
+	tgettime(&start);
+	if (mode & TIGHT_HUFFMAN) { /* shared table from all members */
+		size_t f[256];
+		memset(t_frequencies, 0, sizeof(t_frequencies));
+		for (int i = 1; i < ctx->nfiles; i++) {
+			int fd = open(ctx->files[i], O_RDONLY);
+			if (fd < 0) {
+				openerror(ctx->files[i]);
+				return EXIT_FAILURE;
+			} else if (histogram(ctx, ctx->ts, ctx->files[i], fd,
+								 numthreads(ctx), f) < 0) {
+				close(fd);
+				return EXIT_FAILURE;
+			}
+			close(fd);
+			for (int c = 0; c < 256; c++)
+				t_frequencies[c] += f[c];
+		}
+		freqs = t_frequencies;
+		tgettime(&end);
+		t_histns = elapsedns(&end, &start);
+	}
+	wfd = open(ctx->files[0], O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (wfd < 0) {
+		openerror(ctx->files[0]);
+		return EXIT_FAILURE;
+	}
+	tight_setstats(ctx->ts, ctx->stats);
+	status = tight_archive(ctx->ts, wfd, mode, freqs, ctx->nfiles - 1,
+						   &ctx->files[1], openmember, ctx);
+	tgettime(&end);
+	if (status != TIGHT_OK) {
+		terrorf("%s", tight_geterror(ctx->ts));
+	} else {
+		if (ctx->verbose && fstat(wfd, &st) == 0)
+			tprintf(stdout, MSGFMT("archived %d file(s) into '%s' (%ld bytes)"),
+					ctx->nfiles - 1, ctx->files[0], (long)st.st_size);
+		if (ctx->time)
+			printmonoclock(&end, &start);
+		if (ctx->stats) {
+			tight_Stats stats;
+			tight_getstats(ctx->ts, &stats);
+			printstats(&stats, ctx->stats);
+		}
+	}
+	close(wfd);
+	return (status == TIGHT_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+
+/* find member 'name' in 'index' */
+static const tight_Member *findmember(const tight_Index *index, const char *name) {
+	for (int i = 0; i < index->n; i++)
+		if (strcmp(index->members[i].name, name) == 0)
+			return &index->members[i];
+	return NULL;
+}
+
+
+/* list or extract members of archive 'files[0]', returns exit status */
+static int readarchive(CLIctx *ctx) {
+	struct timespec start, end;
+	tight_Index index;
+	tbatch b;
+	int fd, status, total;
+
+	if ((fd = open(ctx->files[0], O_RDONLY)) < 0) {
+		openerror(ctx->files[0]);
+		return EXIT_FAILURE;
+	}
+	status = tight_readindex(ctx->ts, fd, &index);
+	close(fd);
+	if (status != TIGHT_OK) {
+		terrorf("'%s': %s", ctx->files[0], tight_geterror(ctx->ts));
+		return EXIT_FAILURE;
+	}
+	if (ctx->list) {
+		for (int i = 0; i < index.n; i++)
+			tprintf(stdout, "%12llu %12llu %s\n", index.members[i].rawsize,
+					index.members[i].size, index.members[i].name);
+		tight_freeindex(ctx->ts, &index);
+		return EXIT_SUCCESS;
+	}
+
+	memset(&b, 0, sizeof(b));
+	b.ctx = ctx;
+	b.archive = ctx->files[0];
+	b.jobs = malloc((index.n + ctx->nfiles) * sizeof(*b.jobs));
+	if (b.jobs == NULL) {
+		terror("out of memory");
+		tight_freeindex(ctx->ts, &index);
+		return EXIT_FAILURE;
+	}
+	for (int i = 0; i < (ctx->nfiles > 1 ? ctx->nfiles - 1 : index.n); i++) {
+		const tight_Member *m = (ctx->nfiles > 1
+								 ? findmember(&index, ctx->files[i + 1])
+								 : &index.members[i]);
+		if (m == NULL) {
+			terrorf("no member '%s' in archive", ctx->files[i + 1]);
+			b.failed++;
+			continue;
+		}
+		b.jobs[b.njobs].infile = m->name;
+		b.jobs[b.njobs].size = m->rawsize;
+		b.jobs[b.njobs++].member = m;
+	}
+	if (ctx->jobs == 0)
+		ctx->jobs = 1;
+	total = b.njobs + b.failed;
+	tgettime(&start);
+	runpool(&b);
+	tgettime(&end);
+	tprintf(stdout, MSGFMT("%d member(s) extracted, %d failed, %ld -> %ld bytes"),
+			total - b.failed, b.failed, (long)b.insize, (long)b.outsize);
+	if (ctx->time)
+		printmonoclock(&end, &start);
+	if (ctx->stats)
+		printstats(&b.stats, ctx->stats);
+	free(b.jobs);
+	tight_freeindex(ctx->ts, &index);
+	return (b.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+
+
+
+/* ---------------------------------------------------------------------------
+ * Estimate ('--analyze')
+ * --------------------------------------------------------------------------- */
+
+/* print 's' as JSON string */
+static void printjsonstring(FILE *fp, const char *s) {
+	fputc('"', fp);
+	for (; *s; s++) {
+		uchar c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(fp, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
+
+
+/* print estimate 'est' of 'file' as a single line of JSON */
+static void printestimate(const char *file, const tight_Estimate *est,
+						  int sampled)
+{
+	static const char *methods[] = { "stored", "huffman", "table", "zero" };
+
+	fputs("{\"file\": ", stdout);
+	printjsonstring(stdout, file);
+	printf(", \"size\": %llu, \"counted\": %llu, \"sampled\": %s, "
+		   "\"entropy\": %.6f, \"entropy_size\": %llu, \"header_size\": %llu, "
+		   "\"table_size\": %llu, \"estimate\": %llu, \"ratio\": %.6f, "
+		   "\"histogram\": [", est->rawsize, est->counted,
+		   (sampled ? "true" : "false"), est->entropy, est->entropysize,
+		   est->headersize, est->tablesize, est->size,
+		   (est->rawsize > 0 ? (double)est->size / est->rawsize : 0.0));
+	for (int c = 0; c < 256; c++)
+		printf("%s%zu", (c > 0 ? ", " : ""), est->freqs[c]);
+	fputs("], \"blocks\": [", stdout);
+	for (int i = 0; i < est->nblocks; i++) {
+		const tight_Block *b = &est->blocks[i];
+		printf("%s{\"offset\": %llu, \"size\": %lu, \"entropy\": %.6f, "
+			   "\"huffman\": %lu, \"table\": %lu, \"method\": \"%s\", "
+			   "\"estimate\": %lu}", (i > 0 ? ", " : ""), b->offset,
+			   b->rawsize, b->entropy, b->huffsize, b->tablesize,
+			   methods[b->method], b->size);
+	}
+	fputs("]}\n", stdout);
+	fflush(stdout);
+}
+
+
+/* print estimate of each file, returns exit status */
+static int analyze(CLIctx *ctx) {
+	int nthreads = numthreads(ctx);
+	int failed = 0;
+	tight_Estimate est;
+	for (int i = 0; i < ctx->nfiles; i++) {
+		const char *file = ctx->files[i];
+		int fd = open(file, O_RDONLY);
+		int sample;
+		if (fd < 0) {
+			openerror(file);
+			failed++;
+			continue;
+		}
+		sample = sampled(ctx, fd);
+		if (histogram(ctx, ctx->ts, file, fd, nthreads, t_frequencies) < 0) {
+			failed++;
+		} else if (tight_estimate(ctx->ts, fd, t_frequencies, nthreads,
+					(sample ? SAMPLESTRIDE : 0), &est) != TIGHT_OK) {
+			terrorf("'%s': %s", file, tight_geterror(ctx->ts));
+			failed++;
+		} else {
+			printestimate(file, &est, sample);
+			tight_freeestimate(ctx->ts, &est);
+		}
+		close(fd);
+	}
+	return (failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+
+
+/* ---------------------------------------------------------------------------
+ * Verification ('-T')
+ * --------------------------------------------------------------------------- */
+
+/* print corrupt blocks of 'v' of 'file' (or that it is fine) */
+static void printverify(const char *file, const tight_Verify *v) {
+	if (v->ncorrupt == 0 && v->nchecked < v->nblocks) {
+		tprintf(stdout, "%s: UNVERIFIED (no checksums, %llu bytes, "
+				"%llu blocks decoded)\n", file, v->rawsize, v->nblocks);
+		return;
+	} else if (v->ncorrupt == 0) {
+		tprintf(stdout, "%s: OK (%llu bytes, %llu blocks)\n",
+				file, v->rawsize, v->nblocks);
+		return;
+	}
+	for (int i = 0; i < v->ncorrupt; i++) {
+		const tight_Corrupt *c = &v->corrupt[i];
+		if (c->member >= 0)
+			tprintf(stdout, "%s: member %d: ", file, c->member);
+		else
+			tprintf(stdout, "%s: ", file);
+		tprintf(stdout, "corrupt block at offset %llu (uncompressed offset %llu, "
+				"%llu bytes): %s\n", c->offset, c->rawoffset, c->rawsize,
+				c->error);
+	}
+}
+
+
+/* verify each file, returns exit status */
+static int verify(CLIctx *ctx) {
+	struct timespec start, end;
+	int nthreads = numthreads(ctx);
+	int failed = 0, reffd = -1;
+	tight_Verify v;
+
+	if (ctx->reffile && (reffd = open(ctx->reffile, O_RDONLY)) < 0) {
+		openerror(ctx->reffile);
+		return EXIT_FAILURE;
+	}
+	tight_setreference(ctx->ts, reffd);
+	tgettime(&start);
+	for (int i = 0; i < ctx->nfiles; i++) {
+		const char *file = ctx->files[i];
+		int fd = open(file, O_RDONLY);
+		if (fd < 0) {
+			openerror(file);
+			failed++;
+			continue;
+		}
+		if (tight_verify(ctx->ts, fd, nthreads, &v) != TIGHT_OK) {
+			terrorf("'%s': %s", file, tight_geterror(ctx->ts));
+			failed++;
+		} else {
+			printverify(file, &v);
+			failed += (v.ncorrupt > 0 ||
+					   (v.nchecked < v.nblocks && !ctx->unverified));
+			tight_freeverify(ctx->ts, &v);
+		}
+		close(fd);
+	}
+	if (ctx->time && tgettime(&end) == 0)
+		printmonoclock(&end, &start);
+	if (reffd >= 0)
+		close(reffd);
+	return (failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+
+
 /* cleanup with status 'c' */
 #define tdefer(c) \
 	{ status = (c); goto cleanup; }
@@ -351,13 +1341,14 @@ int main(int argc, const char **argv) {
 	int status = TIGHT_OK;
 	struct timespec start, end;
 	struct stat st;
-	int rfd = -1, wfd = -1;
+	int rfd = -1, wfd = -1, reffd = -1;
 
 	tight_State *ts = tight_new(trealloc, NULL);
 	if (ts == NULL) {
 		terror("couldn't allocate state");
 		exit(EXIT_FAILURE);
 	}
+	tight_setarena(ts, ARENASIZE + ARENAKEEP); /* without it 'trealloc' is used */
 
 	memset(&ctx, 0, sizeof(ctx));
 	ctx.ts = ts;
@@ -367,15 +1358,29 @@ int main(int argc, const char **argv) {
 		status = EXIT_FAILURE;
 	if (status == EXIT_FAILURE || res == argsexit)
 		goto cleanup;
+	tight_setbuffers(ts, ctx.buffsize, ctx.buffsize);
+	tight_setpipelined(ts, ctx.pipelined);
+	tight_setiopolicy(ts, ctx.iopolicy);
+	if (ctx.analyze) { /* estimate ? */
+		status = analyze(&ctx);
+		goto cleanup;
+	} else if (ctx.verify) { /* verify ? */
+		status = verify(&ctx);
+		goto cleanup;
+	} else if (ctx.archive) { /* create archive ? */
+		status = createarchive(&ctx);
+		goto cleanup;
+	} else if (ctx.extract || ctx.list) { /* read archive ? */
+		status = readarchive(&ctx);
+		goto cleanup;
+	} else if (ctx.jobs) { /* batch mode ? */
+		status = runbatch(&ctx);
+		goto cleanup;
+	}
 
 	int mode = TIGHT_NONE;
-	if (!ctx.decompress) {
+	if (!ctx.decompress)
 		mode = getmode(&ctx);
-		if (mode == TIGHT_RLE) {
-			terror("run-length-encoding not implemented");
-			tdefer(EXIT_FAILURE);
-		}
-	}
 
 	rfd = open(ctx.infile, O_RDONLY, 0);
 	if (rfd < 0) {
@@ -388,7 +1393,15 @@ int main(int argc, const char **argv) {
 		tdefer(errno);
 	}
 	tight_setfiles(ts, rfd, wfd);
-
+	tight_setstats(ts, ctx.stats);
+	if (ctx.reffile) { /* delta ? */
+		reffd = open(ctx.reffile, O_RDONLY, 0);
+		if (reffd < 0) {
+			openerror(ctx.reffile);
+			tdefer(errno);
+		}
+		tight_setreference(ts, reffd);
+	}
 
 	if (ctx.verbose && stat(ctx.infile, &st) < 0) {
 		terrorf("stat '%s': %s", ctx.infile, strerror(errno));
@@ -406,12 +1419,21 @@ int main(int argc, const char **argv) {
 				ctx.infile, ctx.outfile);
 	}
 
-	if (ctx.decompress) { /* decompress ? */
+	if (ctx.range) { /* decompress range ? */
+		status = tight_decompress_range(ts, ctx.rangeoff, ctx.rangelen);
+	} else if (ctx.decompress) { /* decompress ? */
 		status = tight_decompress(ts);
 	} else { /* compress */
 		size_t *freqs = NULL;
-		if (mode & TIGHT_HUFFMAN) {
-			getfrequencies(ts, rfd, wfd);
+		/* only bytes not in reference are coded, blocks get own trees */
+		if ((mode & TIGHT_HUFFMAN) && reffd < 0) {
+			struct timespec hstart, hend;
+			tgettime(&hstart);
+			if (histogram(&ctx, ts, ctx.infile, rfd, numthreads(&ctx),
+						  t_frequencies) < 0)
+				tdefer(TIGHT_ERRNO);
+			tgettime(&hend);
+			t_histns = elapsedns(&hend, &hstart);
 			freqs = t_frequencies;
 		}
 		status = tight_compress(ts, mode, freqs);
@@ -439,11 +1461,19 @@ int main(int argc, const char **argv) {
 		printsizechange(insize, outsize);
 	}
 
+	if (ctx.stats) {
+		tight_Stats stats;
+		tight_getstats(ts, &stats);
+		printstats(&stats, ctx.stats);
+	}
+
 cleanup:
 	if (rfd > 0) 
 		close(rfd);
 	if (wfd > 0) 
 		close(wfd);
+	if (reffd > 0)
+		close(reffd);
 	if (t_outfile != NULL)
 		trealloc(t_outfile, NULL, strlen(t_outfile) + 1, 0);
 	tight_free(ts);
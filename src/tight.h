@@ -27,9 +27,9 @@ extern "C" {
 #define TIGHT_NAME			"tight"
 
 /* version */
-#define TIGHT_VERSION_NUM		100
+#define TIGHT_VERSION_NUM		110
 #define TIGHT_VERSION_MAJOR		"1"
-#define TIGHT_VERSION_MINOR		"0"
+#define TIGHT_VERSION_MINOR		"1"
 #define TIGHT_VERSION_RELEASE	"0"
 #define TIGHT_VERSION			TIGHT_VERSION_MAJOR "." TIGHT_VERSION_MINOR
 #define TIGHT_RELEASE			TIGHT_VERSION "." TIGHT_VERSION_RELEASE
@@ -48,6 +48,10 @@ typedef struct tight_State tight_State;
 typedef void *(*tight_fRealloc)(void *block, void *ud, size_t os, size_t ns);
 
 
+/* open archive member 'i' for reading, returns descriptor or -1 ('errno') */
+typedef int (*tight_fOpen)(void *ud, int i);
+
+
 
 /* status codes */
 #define TIGHT_ERRNO			(-1)	/* errno error */
@@ -60,14 +64,55 @@ typedef void *(*tight_fRealloc)(void *block, void *ud, size_t os, size_t ns);
 #define TIGHT_ERRLIMIT		6		/* internal limit error */
 
 
-/* modes for compression */
-#define TIGHT_NONE			0
+/* 
+ * Modes for compression; input is split into blocks and each
+ * block is stored with the cheapest method allowed by the mode bits,
+ * blocks that would not shrink are always stored as is. Blocks of
+ * zero bytes (and holes of sparse input) take no space in any mode,
+ * decompression writes them back as holes where the output allows it.
+ * With 'TIGHT_DEDUP' blocks are content-defined chunks and chunks that
+ * were already written (also by previous archive members) are stored
+ * as references to them; it can't be combined with 'TIGHT_SEEKABLE'
+ * and decompression then needs seekable input.
+ */
+#define TIGHT_NONE			0		/* store blocks uncompressed */
 #define TIGHT_HUFFMAN		1		/* compress with huffman codes */
-#define TIGHT_RLE			2		/* TODO(jure): implement */
+#define TIGHT_RLE			2		/* compress with run-length-encoding */
+#define TIGHT_ORDER1		4		/* huffman codes chosen by previous byte */
+#define TIGHT_FSE			8		/* compress with FSE (tANS) */
+#define TIGHT_SEEKABLE		16		/* write block index ('tight_decompress_range') */
+#define TIGHT_DEDUP			32		/* store repeated chunks as references */
 #define TIGHT_DEFAULT		(TIGHT_HUFFMAN | TIGHT_RLE)
 
 
 
+/* phases of 'tight_Stats', time of each phase excludes nested phases */
+#define TIGHT_PHASE_OTHER	0		/* header, setup and the rest */
+#define TIGHT_PHASE_HIST	1		/* block histograms */
+#define TIGHT_PHASE_TREE	2		/* huffman trees, codes and decode tables */
+#define TIGHT_PHASE_ENCODE	3		/* cost model and block encoding */
+#define TIGHT_PHASE_DECODE	4		/* block decoding */
+#define TIGHT_PHASE_MD5		5		/* header checksum */
+#define TIGHT_PHASE_READ	6		/* 'read' calls */
+#define TIGHT_PHASE_WRITE	7		/* 'write' calls */
+#define TIGHT_NPHASES		8
+
+
+/* statistics of the latest 'tight_compress' or 'tight_decompress' */
+typedef struct tight_Stats {
+	unsigned long long bytesin; /* bytes read */
+	unsigned long long bytesout; /* bytes written */
+	unsigned long long reads; /* 'read' calls */
+	unsigned long long writes; /* 'write' calls */
+	unsigned long long seeks; /* 'lseek' calls */
+	unsigned long long syscalls; /* 'read', 'write' and 'io_uring_enter' calls */
+	unsigned long long allocs; /* 'frealloc' allocations (and reallocations) */
+	unsigned long long frees; /* 'frealloc' deallocations */
+	unsigned long long ns[TIGHT_NPHASES]; /* nanoseconds spent in each phase */
+} tight_Stats;
+
+
+
 /*
  * Get current version string (semantic versioning).
  */
@@ -99,6 +144,115 @@ TIGHT_API void tight_free(tight_State *ts);
 TIGHT_API void tight_setfiles(tight_State *ts, int rfd, int wfd);
 
 
+/*
+ * I/O callbacks of 'tight_setio', each gets 'ud' of 'tight_setio' as
+ * its first argument and returns -1 on errors (with 'errno' set).
+ * 'read' reads up to 'n' bytes of input into 'buf' and returns their
+ * number (0 at the end of input); 'write' writes up to 'n' bytes of
+ * 'buf' into output and returns their number. 'seek' is optional, it
+ * moves the input like 'lseek' (offset 0 is the start of input) and
+ * returns the new offset; only 'tight_decompress_range' of seekable
+ * files and 'tight_extract' need it ('tight_decompress' uses it to
+ * check blocks of seekable files before they are written).
+ * Zero-copy callbacks are optional too and are used instead of 'read'
+ * ('write') when set: 'readbuf' lends the next chunk of input, stored
+ * into '*buf' and valid until the next call, and returns its size (0
+ * at the end of input); 'writebuf' lends a buffer for output, stored
+ * into '*buf', and returns its size, 'commit' hands that buffer back,
+ * its 'n' bytes at 'p' are the output.
+ */
+typedef struct tight_IO {
+	long (*read)(void *ud, void *buf, size_t n);
+	long (*write)(void *ud, const void *buf, size_t n);
+	long long (*seek)(void *ud, long long off, int whence);
+	long (*readbuf)(void *ud, const void **buf);
+	long (*writebuf)(void *ud, void **buf);
+	int (*commit)(void *ud, const void *p, size_t n);
+} tight_IO;
+
+
+/*
+ * Set I/O callbacks 'io' (and their 'ud'), input and output of the
+ * following calls then go through them instead of file descriptors;
+ * 'io' must stay valid while it is set. File descriptors are served
+ * by built-in callbacks, which also have fast paths of their own that
+ * need a descriptor ('tight_setpipelined', 'tight_setiopolicy', kernel
+ * copies and holes). 'tight_setfiles' and 'tight_reset' unset 'io'.
+ */
+TIGHT_API void tight_setio(tight_State *ts, const tight_IO *io, void *ud);
+
+
+/*
+ * Set reference file 'fd' (-1 unsets it) of the following calls;
+ * 'tight_compress' then writes a delta file, input bytes found in
+ * reference are stored as their offsets in it and only the rest is
+ * compressed ('TIGHT_SEEKABLE' and 'TIGHT_DEDUP' can't be used).
+ * Delta files decompress only with the same reference, it is checked
+ * by its size and MD5 of decompressed contents. Reference must be a
+ * regular file, it is read with 'pread' (compression) and through its
+ * own buffer (decompression). 'tight_reset' unsets it.
+ */
+TIGHT_API void tight_setreference(tight_State *ts, int fd);
+
+
+/*
+ * Reset per-stream state (file descriptors, reference, huffman tree of
+ * the previous stream, error message and statistics) so that the state
+ * can be reused for another stream. Buffers, decode tables, arena and
+ * header huffman table (cached while the same 'freqs' are used) are kept.
+ */
+TIGHT_API void tight_reset(tight_State *ts);
+
+
+/*
+ * Set sizes of read and write buffers (clamped to 'TIGHT_MINBUFFSIZE'
+ * and 'TIGHT_MAXBUFFSIZE'); size 0 (default) means automatic, derived
+ * from preferred I/O size and size of the input file. Buffers are
+ * allocated on first use and kept by the state; compressed blocks are
+ * not larger than the read buffer.
+ */
+TIGHT_API void tight_setbuffers(tight_State *ts, size_t rsize, size_t wsize);
+
+
+/* I/O engines of 'tight_setpipelined' */
+#define TIGHT_PIPE_OFF		0		/* plain 'read' and 'write' calls */
+#define TIGHT_PIPE_THREADS	1		/* read-ahead and write-behind threads */
+#define TIGHT_PIPE_URING	2		/* io_uring, several requests in flight */
+
+
+/*
+ * Set I/O engine that overlaps I/O with coding; 'tight_compress' and
+ * 'tight_decompress' then read the input ahead and write the output
+ * behind (when input is a regular file larger than 1 MiB). With
+ * 'TIGHT_PIPE_URING' requests for a ring of buffers are kept in flight
+ * and submitted in batches with io_uring (registered buffers and file
+ * when allowed); if io_uring is not available plain 'read' and 'write'
+ * calls are used. Output is the same, default is 'TIGHT_PIPE_OFF'.
+ */
+TIGHT_API void tight_setpipelined(tight_State *ts, int engine);
+
+
+/* I/O policy bits of 'tight_setiopolicy' */
+#define TIGHT_IO_CACHED		0		/* page cache is left alone */
+#define TIGHT_IO_DONTNEED	1		/* drop pages once they are done */
+#define TIGHT_IO_WRITEBACK	2		/* write output back as it is produced */
+#define TIGHT_IO_DIRECT		4		/* bypass the page cache ('O_DIRECT') */
+
+
+/*
+ * Set how 'tight_compress' and 'tight_decompress' treat the page cache
+ * when streaming regular files larger than 1 MiB, so that large jobs do
+ * not evict the working set of other processes. With 'TIGHT_IO_DONTNEED'
+ * pages of input (and written back pages of output) are dropped in 8 MiB
+ * chunks; with 'TIGHT_IO_WRITEBACK' writeback of output is started for
+ * each chunk, so dirty pages do not pile up. 'TIGHT_IO_DIRECT' does
+ * aligned I/O with 'O_DIRECT' through a pipe of 'tight_setpipelined'
+ * (threads if that is off); file systems without 'O_DIRECT' fall back
+ * to cached I/O. Output is the same, default is 'TIGHT_IO_CACHED'.
+ */
+TIGHT_API void tight_setiopolicy(tight_State *ts, int policy);
+
+
 /*
  * Compress previously set 'rfd' into 'wfd'.
  * Compression algorithms and strategies being used correspond to 'mode' bitmask.
@@ -106,6 +260,8 @@ TIGHT_API void tight_setfiles(tight_State *ts, int rfd, int wfd);
  * used when 'mode' contains 'TIGHT_HUFFMAN', in case it is omitted (NULL) 
  * while 'mode' bits expect 'freqs' to be valid, internal frequency table 
  * is used, omitting this might result in suboptimal compression ratio.
+ * Huffman table built from 'freqs' is stored in the header and blocks
+ * can reuse it whenever that is cheaper than storing their own table.
  * Upon completion returns one of the status codes and removes previously set
  * file descriptors from 'tight_State'.
  * If no errors occurred, file offset for 'rfd' will be at the end of the file.
@@ -119,6 +275,9 @@ TIGHT_API int tight_compress(tight_State *ts, int mode, const size_t *freqs);
  * Decompressing does not require prior knowledge on how the input file 
  * is encoded, all of the information required for correct decompression is
  * contained inside of the compressed file.
+ * Each block of 'TIGHT_SEEKABLE' files is checked against MD5 in the
+ * block index (read up front, or after the blocks if 'rfd' can't seek),
+ * error message of a corrupt block holds its offsets.
  * Upon completion returns one of the status codes and removes previously
  * set file descriptors from 'tight_State'.
  * If no errors occurred, file offset for 'rfd' will be at the end of the file.
@@ -127,6 +286,229 @@ TIGHT_API int tight_compress(tight_State *ts, int mode, const size_t *freqs);
 TIGHT_API int tight_decompress(tight_State *ts);
 
 
+/*
+ * Decompress 'length' bytes starting at uncompressed 'offset' of
+ * previously set 'rfd' into 'wfd'; range is clipped to the end of data.
+ * Files compressed with 'TIGHT_SEEKABLE' have a block index, only
+ * the blocks covering the range are read, decoded and checked against
+ * MD5 in the index ('rfd' must be seekable); other files are decoded
+ * from the start up to the end of the range.
+ * Status codes and file descriptors are handled as in 'tight_decompress'.
+ */
+TIGHT_API int tight_decompress_range(tight_State *ts, size_t offset,
+									 size_t length);
+
+
+/* archive member, entry of the archive central index */
+typedef struct tight_Member {
+	const char *name; /* member name */
+	unsigned long long offset; /* offset of member blocks in the archive */
+	unsigned long long size; /* compressed size */
+	unsigned long long rawsize; /* uncompressed size */
+	int mode; /* compression mode */
+	unsigned char checksum[16]; /* MD5 of uncompressed contents */
+} tight_Member;
+
+
+/* archive central index */
+typedef struct tight_Index {
+	tight_Member *members; /* members in archive order */
+	int n; /* number of 'members' */
+	char *names_; /* (private) storage for member names */
+	size_t namessize_; /* (private) size of 'names_' */
+} tight_Index;
+
+
+/*
+ * Compress 'n' members into a single archive written into 'wfd', 'names'
+ * are member names stored in the central index. Each member is opened
+ * with 'openfn' right before it is compressed, read until EOF and closed.
+ * 'mode' and 'freqs' are the same as for 'tight_compress'; huffman table
+ * built from 'freqs' is stored once in the archive header and each member
+ * starts with it as its previous table, so small members can share it.
+ * 'wfd' must be seekable. Returns one of the status codes.
+ */
+TIGHT_API int tight_archive(tight_State *ts, int wfd, int mode,
+							const size_t *freqs, int n,
+							const char *const *names, tight_fOpen openfn,
+							void *ud);
+
+
+/*
+ * Read central index of archive 'fd' into 'index', members can then be
+ * extracted in any order (and in parallel, each 'tight_State' with its own
+ * file descriptor of the archive). 'index' must be freed with
+ * 'tight_freeindex' using a state with the same allocator.
+ * Returns one of the status codes.
+ */
+TIGHT_API int tight_readindex(tight_State *ts, int fd, tight_Index *index);
+
+
+/*
+ * Free 'index' read by 'tight_readindex'.
+ */
+TIGHT_API void tight_freeindex(tight_State *ts, tight_Index *index);
+
+
+/*
+ * Extract archive 'member' from 'rfd' (archive) into 'wfd', both set
+ * with 'tight_setfiles'. Member contents are verified against size and
+ * checksum from the index. Returns one of the status codes.
+ */
+TIGHT_API int tight_extract(tight_State *ts, const tight_Member *member);
+
+
+/* corrupt block found by 'tight_verify' */
+typedef struct tight_Corrupt {
+	unsigned long long offset; /* compressed offset of the block */
+	unsigned long long rawoffset; /* uncompressed offset (in its member) */
+	unsigned long long rawsize; /* uncompressed size, 0 if not known */
+	int member; /* archive member of the block, -1 if not an archive */
+	int status; /* status code of the error */
+	char error[80]; /* error message (truncated) */
+} tight_Corrupt;
+
+
+/* result of 'tight_verify' */
+typedef struct tight_Verify {
+	unsigned long long rawsize; /* uncompressed size */
+	unsigned long long nblocks; /* number of decoded blocks */
+	unsigned long long nchecked; /* of them the ones covered by checksums */
+	tight_Corrupt *corrupt; /* corrupt blocks in file order */
+	int ncorrupt; /* number of 'corrupt' */
+	unsigned sizecorrupt_; /* (private) size of 'corrupt' */
+} tight_Verify;
+
+
+/*
+ * Verify compressed 'fd' (-1 for input callbacks of 'tight_setio',
+ * 'read' and 'seek' are used) by decoding it from offset 0 without
+ * writing anything.
+ * Blocks of 'TIGHT_SEEKABLE' files and archive members are decoded on
+ * their own by 'nthreads' threads (allocator of 'ts' must be thread
+ * safe then; callbacks are read by the caller only) with 'pread', and
+ * checked against MD5 in block index (older seekable files have none)
+ * or central index; archives need 'fd'. Other files are decoded in
+ * order up to the first corrupt block, only delta files have a checksum
+ * of contents (its reference must be set). File with 'nchecked' of
+ * 'v' below 'nblocks' decoded fine, but it is not verified (blocks have
+ * no checksums). Corrupt blocks are stored into 'v', which must be freed
+ * with 'tight_freeverify'. Returns 'TIGHT_OK' if the file was verified
+ * (whether or not it has corrupt blocks), otherwise one of the status
+ * codes (malformed header or index, missing reference).
+ */
+TIGHT_API int tight_verify(tight_State *ts, int fd, int nthreads,
+						   tight_Verify *v);
+
+
+/*
+ * Free corrupt blocks of 'v' found by 'tight_verify'.
+ */
+TIGHT_API void tight_freeverify(tight_State *ts, tight_Verify *v);
+
+
+/*
+ * Count bytes of 'fd' (-1 for input callbacks of 'tight_setio') into
+ * 'freqs', table of symbol frequencies for 'tight_compress'. Regular
+ * files are split into ranges counted by 'nthreads' threads (allocator
+ * of 'ts' must be thread safe then) with 'pread' into private tables
+ * that are merged at the end, holes are not read and file offset is
+ * kept; other input is read in order up to EOF. With 'stride' > 0
+ * only 64 KiB every 'stride' bytes are counted, counts are scaled to
+ * the size of input and bytes that were not seen get count 1 (so they
+ * still have a code). Returns one of the status codes.
+ */
+TIGHT_API int tight_histogram(tight_State *ts, int fd, int nthreads,
+							  size_t stride, size_t *freqs);
+
+
+/* methods of 'tight_Block' */
+#define TIGHT_BLOCK_STORED	0		/* stored as is */
+#define TIGHT_BLOCK_HUFF	1		/* huffman codes with its own tree */
+#define TIGHT_BLOCK_TABLE	2		/* huffman codes of header table */
+#define TIGHT_BLOCK_ZERO	3		/* zero bytes */
+
+
+/* estimate of a single block */
+typedef struct tight_Block {
+	unsigned long long offset; /* uncompressed offset */
+	unsigned long rawsize; /* uncompressed size */
+	unsigned long size; /* compressed size (with block header) */
+	unsigned long huffsize; /* huffman tree and codes of its own tree */
+	unsigned long tablesize; /* codes of header table, 0 if it can't code it */
+	double entropy; /* order-0 entropy in bits per byte */
+	int method; /* cheapest method ('TIGHT_BLOCK_*') */
+} tight_Block;
+
+
+/* estimate of compressed size of input */
+typedef struct tight_Estimate {
+	unsigned long long rawsize; /* size of input */
+	unsigned long long counted; /* bytes of estimated blocks */
+	size_t freqs[256]; /* histogram of estimated blocks */
+	double entropy; /* order-0 entropy of 'freqs' in bits per byte */
+	unsigned long long entropysize; /* 'rawsize' coded at 'entropy' */
+	unsigned long long tablesize; /* blocks coded with header table */
+	unsigned long long headersize; /* header with header table */
+	unsigned long long size; /* compressed size */
+	tight_Block *blocks; /* estimated blocks in input order */
+	int nblocks; /* number of 'blocks' */
+	unsigned sizeblocks_; /* (private) size of 'blocks' */
+} tight_Estimate;
+
+
+/*
+ * Estimate the size 'fd' (-1 for input callbacks of 'tight_setio')
+ * would have when compressed with 'TIGHT_HUFFMAN | TIGHT_SEEKABLE'
+ * and huffman table built from 'freqs' (as in 'tight_compress'),
+ * nothing is written. Block by block the cost model of the compressor
+ * is run on exact sizes of huffman trees and codes, so 'size' is the
+ * size of the compressed file. With 'stride' above the block size
+ * only one block in every 'stride' bytes is estimated and sizes in
+ * 'est' are scaled to the whole input. Blocks of regular files are
+ * estimated by 'nthreads' threads (allocator of 'ts' must be thread
+ * safe then), other input is read in order. 'est' must be freed with
+ * 'tight_freeestimate'. Returns one of the status codes.
+ */
+TIGHT_API int tight_estimate(tight_State *ts, int fd, const size_t *freqs,
+							 int nthreads, size_t stride, tight_Estimate *est);
+
+
+/*
+ * Free blocks of 'est' estimated by 'tight_estimate'.
+ */
+TIGHT_API void tight_freeestimate(tight_State *ts, tight_Estimate *est);
+
+
+/*
+ * Set arena of 'size' bytes, allocated once with 'frealloc'; during
+ * 'tight_compress', 'tight_decompress' and other calls working on files,
+ * internal memory is served from arena and released at once at the end
+ * of the call. Per-state buffers (I/O buffers, tables, header tree) are
+ * taken from the end of arena and kept across calls and 'tight_reset'.
+ * Calls make no 'frealloc' calls as long as arena is large enough,
+ * otherwise 'frealloc' serves the rest. Size 0 frees the arena.
+ * Returns 'TIGHT_OK' or 'TIGHT_ERRMEM'.
+ */
+TIGHT_API int tight_setarena(tight_State *ts, size_t size);
+
+
+/*
+ * Enable (non-zero 'enable') or disable statistics collection.
+ * When enabled, each 'tight_compress' and 'tight_decompress' resets
+ * statistics and collects them anew; when disabled (default) the
+ * overhead is a single branch per counter.
+ */
+TIGHT_API void tight_setstats(tight_State *ts, int enable);
+
+
+/*
+ * Get statistics of the latest 'tight_compress' or 'tight_decompress'
+ * into 'stats'; all zeros if statistics collection was disabled.
+ */
+TIGHT_API void tight_getstats(const tight_State *ts, tight_Stats *stats);
+
+
 /*
  * Get message describing the latest error.
  * Returns NULL if no error occurred.
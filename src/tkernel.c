@@ -0,0 +1,289 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tbuffer.h"
+#include "tkernel.h"
+#include "tstate.h"
+
+#if defined(TIGHT_X86KERNELS)
+#include <immintrin.h>
+#endif
+
+
+
+/*
+ * - SCALAR -
+ */
+
+static void histogramscalar(size_t *freqs, const byte *p, ulong n) {
+	memset(freqs, 0, TIGHTBYTES * sizeof(size_t));
+	for (ulong i = 0; i < n; i++)
+		freqs[p[i]]++;
+}
+
+
+static ulong runlengthscalar(const byte *p, ulong n) {
+	ulong i = 1;
+	while (i < n && p[i] == p[0])
+		i++;
+	return i;
+}
+
+
+static void huffencodescalar(BuffWriter *bw, const HuffCode *codes,
+							 const byte *p, ulong n)
+{
+	for (ulong i = 0; i < n; i++)
+		tightB_writenbits(bw, codes[p[i]].code, codes[p[i]].nbits);
+}
+
+
+static const Kernels kscalar = {
+	"scalar", histogramscalar, runlengthscalar, huffencodescalar
+};
+
+
+
+#if defined(TIGHT_X86KERNELS)
+
+#define t_target(isa)		__attribute__((target(isa)))
+
+
+/*
+ * - SHARED -
+ * Histogram and huffman bit packing are not dispatched per instruction
+ * set: all x86 variants use these two plain C kernels (unrolled, built
+ * for the baseline CPU), so a variant only changes the run scan.
+ */
+
+/* bytes counted before 32-bit sub-histograms are merged */
+#define HISTCHUNK		((ulong)1 << 30)
+
+
+/*
+ * Histogram with 4 interleaved 32-bit sub-histograms, bytes are
+ * loaded 8 at a time; this breaks the dependency between equal
+ * consecutive bytes (byte order in the word does not matter).
+ */
+static void histogramx4(size_t *freqs, const byte *p, ulong n) {
+	uint32_t c[4][TIGHTBYTES];
+
+	memset(freqs, 0, TIGHTBYTES * sizeof(size_t));
+	while (n > 0) {
+		ulong len = (n > HISTCHUNK ? HISTCHUNK : n);
+		ulong i = 0;
+		memset(c, 0, sizeof(c));
+		for (; i + 8 <= len; i += 8) {
+			uint64_t w;
+			memcpy(&w, &p[i], sizeof(w));
+			c[0][w & 0xff]++; c[1][(w >> 8) & 0xff]++;
+			c[2][(w >> 16) & 0xff]++; c[3][(w >> 24) & 0xff]++;
+			c[0][(w >> 32) & 0xff]++; c[1][(w >> 40) & 0xff]++;
+			c[2][(w >> 48) & 0xff]++; c[3][w >> 56]++;
+		}
+		for (; i < len; i++)
+			c[0][p[i]]++;
+		for (int s = 0; s < TIGHTBYTES; s++)
+			freqs[s] += (size_t)c[0][s] + c[1][s] + c[2][s] + c[3][s];
+		p += len;
+		n -= len;
+	}
+}
+
+
+/*
+ * Huffman encode with 64-bit bit accumulator, flushing 32 bits at a
+ * time straight into 'bw->buf'; byte stream and final 'tmpbuf' state
+ * are the same as with 'tightB_writenbits'.
+ */
+static void huffencodeacc(BuffWriter *bw, const HuffCode *codes,
+						  const byte *p, ulong n)
+{
+	uint64_t acc = bw->tmpbuf;
+	int nacc = bw->validbits;
+
+	for (ulong i = 0; i < n; i++) {
+		const HuffCode *hc = &codes[p[i]];
+		acc |= (uint64_t)(uint)hc->code << nacc;
+		nacc += hc->nbits;
+		if (nacc >= 32) {
+			if (t_unlikely(bw->len + 4 > bw->size)) { /* keep flushes full */
+				tightB_writebyte(bw, acc & 0xff);
+				tightB_writebyte(bw, (acc >> 8) & 0xff);
+				tightB_writebyte(bw, (acc >> 16) & 0xff);
+				tightB_writebyte(bw, (acc >> 24) & 0xff);
+			} else {
+				bw->buf[bw->len++] = acc & 0xff;
+				bw->buf[bw->len++] = (acc >> 8) & 0xff;
+				bw->buf[bw->len++] = (acc >> 16) & 0xff;
+				bw->buf[bw->len++] = (acc >> 24) & 0xff;
+			}
+			acc >>= 32;
+			nacc -= 32;
+		}
+	}
+	while (nacc >= 16) { /* 'tmpbuf' holds less than a short */
+		tightB_writebyte(bw, acc & 0xff);
+		tightB_writebyte(bw, (acc >> 8) & 0xff);
+		acc >>= 16;
+		nacc -= 16;
+	}
+	bw->tmpbuf = (ushrt)acc;
+	bw->validbits = nacc;
+}
+
+
+
+/*
+ * - SSE4.2 -
+ */
+
+/* first mismatch of 16 bytes with 'pcmpestri' */
+t_target("sse4.2")
+static ulong runlengthsse42(const byte *p, ulong n) {
+	__m128i c = _mm_set1_epi8((char)p[0]);
+	ulong i = 1;
+
+	if (n < 2 || p[1] != p[0]) /* most runs are a single byte */
+		return 1;
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)&p[i]);
+		int idx = _mm_cmpestri(c, 16, v, 16, _SIDD_UBYTE_OPS |
+							   _SIDD_CMP_EQUAL_EACH | _SIDD_NEGATIVE_POLARITY);
+		if (idx < 16)
+			return i + idx;
+	}
+	while (i < n && p[i] == p[0])
+		i++;
+	return i;
+}
+
+
+static const Kernels ksse42 = {
+	"sse42", histogramx4, runlengthsse42, huffencodeacc
+};
+
+
+
+/*
+ * - AVX2 -
+ */
+
+/* first mismatch of 32 bytes with 'vpcmpeqb' and 'vpmovmskb' */
+t_target("avx2")
+static ulong runlengthavx2(const byte *p, ulong n) {
+	__m256i c = _mm256_set1_epi8((char)p[0]);
+	ulong i = 1;
+
+	if (n < 2 || p[1] != p[0]) /* most runs are a single byte */
+		return 1;
+	for (; i + 32 <= n; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)&p[i]);
+		uint eq = (uint)_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, v));
+		if (eq != 0xffffffffu)
+			return i + __builtin_ctz(~eq);
+	}
+	while (i < n && p[i] == p[0])
+		i++;
+	return i;
+}
+
+
+static const Kernels kavx2 = {
+	"avx2", histogramx4, runlengthavx2, huffencodeacc
+};
+
+
+
+/*
+ * - BMI -
+ */
+
+/* first mismatch of 8 bytes with 'xor' and 'tzcnt' (little endian) */
+t_target("bmi")
+static ulong runlengthbmi(const byte *p, ulong n) {
+	uint64_t c = p[0] * 0x0101010101010101ull;
+	ulong i = 1;
+
+	if (n < 2 || p[1] != p[0]) /* most runs are a single byte */
+		return 1;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t w;
+		memcpy(&w, &p[i], sizeof(w));
+		if ((w ^= c) != 0)
+			return i + (__builtin_ctzll(w) >> 3);
+	}
+	while (i < n && p[i] == p[0])
+		i++;
+	return i;
+}
+
+
+static const Kernels kbmi = {
+	"bmi", histogramx4, runlengthbmi, huffencodeacc
+};
+
+#endif
+
+
+
+/*
+ * - SELECTION -
+ */
+
+/* variants from the most to the least preferred */
+static const Kernels *const variants[] = {
+#if defined(TIGHT_X86KERNELS)
+	&kavx2, &kbmi, &ksse42,
+#endif
+	&kscalar,
+};
+
+#define NVARIANTS	((int)(sizeof(variants) / sizeof(variants[0])))
+
+
+/* true if CPU supports variant 'k' */
+static int supported(const Kernels *k) {
+#if defined(TIGHT_X86KERNELS)
+	__builtin_cpu_init();
+	if (k == &kavx2)
+		return __builtin_cpu_supports("avx2");
+	if (k == &kbmi)
+		return __builtin_cpu_supports("bmi");
+	if (k == &ksse42)
+		return __builtin_cpu_supports("sse4.2");
+#endif
+	return (k == &kscalar);
+}
+
+
+/* get variant 'name' if the CPU supports it, otherwise NULL */
+const Kernels *tightK_variant(const char *name) {
+	for (int i = 0; i < NVARIANTS; i++)
+		if (strcmp(variants[i]->name, name) == 0)
+			return (supported(variants[i]) ? variants[i] : NULL);
+	return NULL;
+}
+
+
+/*
+ * Select kernels for this CPU; 'KERNELSENV' can name a variant
+ * (unknown or unsupported names are ignored).
+ */
+const Kernels *tightK_select(void) {
+	const char *env = getenv(KERNELSENV);
+	const Kernels *k;
+
+	if (env && (k = tightK_variant(env)) != NULL)
+		return k;
+	for (int i = 0; i < NVARIANTS; i++)
+		if (supported(variants[i]))
+			return variants[i];
+	return &kscalar;
+}
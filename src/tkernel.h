@@ -0,0 +1,48 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+#ifndef TIGHTKERNEL_H
+#define TIGHTKERNEL_H
+
+#include "tight.h"
+#include "tinternal.h"
+
+
+/* x86 variants are built with per-function target attributes */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TIGHT_X86KERNELS
+#endif
+
+
+/* environment variable that overrides kernel selection */
+#define KERNELSENV		"TIGHT_KERNELS"
+
+
+struct BuffWriter;
+struct HuffCode;
+
+
+/*
+ * Hot kernels of one instruction set variant, selected once per
+ * state in 'tight_new'; all variants produce identical results.
+ * Only the run scan is specific to the instruction set, histogram
+ * and bit packing are shared plain C kernels of all x86 variants.
+ */
+typedef struct Kernels {
+	const char *name; /* variant name ("scalar", "sse42", ...) */
+	/* count symbol frequencies of 'n' bytes in 'p' (clears 'freqs') */
+	void (*histogram)(size_t *freqs, const byte *p, ulong n);
+	/* number of leading bytes of 'p' equal to 'p[0]' ('n' > 0) */
+	ulong (*runlength)(const byte *p, ulong n);
+	/* write huffman codes of 'n' bytes in 'p' with 'codes' */
+	void (*huffencode)(struct BuffWriter *bw, const struct HuffCode *codes,
+					   const byte *p, ulong n);
+} Kernels;
+
+
+TIGHT_FUNC const Kernels *tightK_select(void);
+TIGHT_FUNC const Kernels *tightK_variant(const char *name);
+
+#endif
@@ -250,3 +250,18 @@ void tight5_final(MD5ctx *ctx, byte digest[16]) {
 	encode(digest, ctx->state, 16); /* store state in digest */
 	memset(ctx, 0, sizeof(*ctx)); /* zero-out sensitive data */
 }
+
+
+/* MD5 of 'n' zero bytes into 'digest' */
+void tight5_zeros(byte digest[16], ulong n) {
+	static const byte zeros[4096];
+	MD5ctx ctx;
+
+	tight5_init(&ctx);
+	while (n > 0) {
+		ulong len = (n < sizeof(zeros) ? n : sizeof(zeros));
+		tight5_update(&ctx, (byte *)zeros, len);
+		n -= len;
+	}
+	tight5_final(&ctx, digest);
+}
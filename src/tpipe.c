@@ -0,0 +1,496 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+#define _POSIX_C_SOURCE		200809L
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "talloc.h"
+#include "tpipe.h"
+#include "tstate.h"
+
+
+/* ring indexes and flags shared between the threads */
+#define pload(x)		__atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define pstore(x,v)		__atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+
+
+/* true when the condition a side of the pipe waits for is met */
+typedef int (*fReady)(Pipe *p);
+
+
+/* producer has a free slot */
+static int haveroom(Pipe *p) {
+	return (p->head - pload(p->tail) < (uint)p->nslots || pload(p->stop));
+}
+
+/* consumer has a filled slot */
+static int havedata(Pipe *p) {
+	return (pload(p->head) != p->tail || pload(p->stop));
+}
+
+/* all produced slots were consumed */
+static int drained(Pipe *p) {
+	return (pload(p->tail) == p->head);
+}
+
+
+/* park until 'ready' */
+static void await(Pipe *p, fReady ready) {
+	if (ready(p))
+		return;
+	pthread_mutex_lock(&p->lock);
+	while (!ready(p))
+		pthread_cond_wait(&p->cond, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+/* wake the other side (after updating 'head', 'tail' or 'stop') */
+static void wake(Pipe *p) {
+	pthread_mutex_lock(&p->lock);
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+/*
+ * File for I/O of '*n' bytes of 'buf' at 'off'; 'O_DIRECT' description
+ * if addresses are aligned, '*n' is then trimmed to whole blocks (the
+ * rest is done through the page cache by the next request).
+ */
+static int iofd(Pipe *p, const byte *buf, size_t *n, off_t off) {
+	if (p->dfd < 0 || ((uintptr_t)buf | (size_t)off) % DIRECTALIGN != 0 ||
+			*n < DIRECTALIGN)
+		return p->fd;
+	*n -= *n % DIRECTALIGN;
+	return p->dfd;
+}
+
+
+
+/*--------------------------------------------------------------------------
+ * I/O threads
+ *-------------------------------------------------------------------------- */
+
+/* read ahead until EOF, error or stop */
+static void *readloop(void *ud) {
+	Pipe *p = (Pipe *)ud;
+	ssize_t n;
+
+	do {
+		await(p, haveroom);
+		if (pload(p->stop))
+			break;
+		PipeSlot *s = &p->slots[p->head % p->nslots];
+		size_t len = p->size;
+		off_t off = p->base + p->issued;
+		int fd = iofd(p, s->buf, &len, off);
+		while ((n = pread(fd, s->buf, len, off)) < 0 && errno == EINTR)
+			p->syscalls++;
+		p->syscalls++;
+		s->off = 0;
+		s->n = (n > 0 ? (size_t)n : 0);
+		s->err = (n < 0 ? errno : 0);
+		s->fileoff = off;
+		p->issued += s->n;
+		pstore(p->head, p->head + 1);
+		wake(p);
+	} while (n > 0); /* last slot holds EOF (or error) */
+	return NULL;
+}
+
+
+/* write queued buffers until stop (and drained) or abort */
+static void *writeloop(void *ud) {
+	Pipe *p = (Pipe *)ud;
+
+	for (;;) {
+		await(p, havedata);
+		if (pload(p->head) == p->tail || pload(p->stop) > 1)
+			break;
+		PipeSlot *s = &p->slots[p->tail % p->nslots];
+		const byte *buf = s->buf + s->off;
+		off_t off = s->fileoff;
+		size_t left = s->n;
+		while (left > 0 && pload(p->err) == 0) { /* after error only drain */
+			size_t len = left;
+			int fd = iofd(p, buf, &len, off);
+			ssize_t n = pwrite(fd, buf, len, off);
+			p->syscalls++;
+			if (n < 0 && errno != EINTR) {
+				pstore(p->err, errno);
+			} else if (n > 0) {
+				buf += n;
+				off += n;
+				left -= n;
+			}
+		}
+		tightC_advance(&p->pc, s->fileoff + s->n);
+		pstore(p->tail, p->tail + 1);
+		wake(p);
+	}
+	return NULL;
+}
+
+
+
+/*--------------------------------------------------------------------------
+ * io_uring engine
+ *-------------------------------------------------------------------------- */
+
+/*
+ * Slots for buffers of 'size' bytes, about 'URINGBYTES' in flight; power
+ * of 2, so slot indexes stay consistent when 'head' and 'tail' wrap.
+ */
+static int uringslots(size_t size) {
+	int n = PIPESLOTS;
+	while (n < PIPEMAXSLOTS && (size_t)n * 2 * size <= URINGBYTES)
+		n *= 2;
+	return n;
+}
+
+
+/* queue (the rest of) request of slot 's' */
+static void uringqueue(Pipe *p, PipeSlot *s) {
+	byte *buf = s->buf + s->off + s->done;
+	size_t len = (p->write ? s->n : p->size) - s->done;
+	off_t off = s->fileoff + s->done;
+	int fd = iofd(p, buf, &len, off);
+	tightU_prep(&p->ring, (p->write ? URING_WRITE : URING_READ), fd, buf, len,
+				off, (ulong)(s - p->slots));
+	s->busy = 1;
+	p->inflight++;
+}
+
+
+/* submit prepared requests once there are 'batch' of them */
+static void uringflush(Pipe *p) {
+	int res;
+	if (p->ring.pending >= p->batch && (res = tightU_submit(&p->ring, 0)) < 0)
+		p->err = (p->err ? p->err : -res);
+}
+
+
+/* queue read of the next 'size' bytes of 'fd' into slot 's' */
+static void uringread(Pipe *p, PipeSlot *s) {
+	s->off = s->done = s->n = 0;
+	s->err = 0;
+	s->fileoff = p->base + p->issued;
+	p->issued += p->size;
+	uringqueue(p, s);
+}
+
+
+/* handle completion 'res' of slot 's' */
+static void uringdone(Pipe *p, PipeSlot *s, int res) {
+	size_t len = (p->write ? s->n : p->size);
+
+	p->inflight--;
+	if (res < 0 || (res == 0 && p->write)) { /* error ? */
+		s->err = (res < 0 ? -res : EIO);
+		if (p->err == 0)
+			p->err = s->err;
+	} else {
+		s->done += res;
+		if (res > 0 && s->done < len) { /* short, queue the rest */
+			uringqueue(p, s);
+			return;
+		}
+		if (!p->write) { /* EOF if short */
+			s->n = s->done;
+			p->eof |= (s->done < len);
+		}
+	}
+	s->busy = 0;
+}
+
+
+/*
+ * Reap available completions; if 'wait' is true also submit prepared
+ * requests and wait for at least one completion (unless nothing is in
+ * flight); returns 0 or errno if the ring itself failed.
+ */
+static int uringreap(Pipe *p, int wait) {
+	ulong ud;
+	int res;
+
+	if (wait && p->inflight > 0 && (res = tightU_submit(&p->ring, 1)) < 0)
+		return -res;
+	while (tightU_reap(&p->ring, &ud, &res))
+		uringdone(p, &p->slots[ud], res);
+	if (p->write) { /* 'tail' follows writes completed in order */
+		off_t end = -1;
+		while (p->tail != p->head && !p->slots[p->tail % p->nslots].busy) {
+			PipeSlot *s = &p->slots[p->tail++ % p->nslots];
+			end = s->fileoff + s->n;
+		}
+		if (end >= 0)
+			tightC_advance(&p->pc, end);
+	}
+	return 0;
+}
+
+
+/* wait until slot 's' has no request in flight */
+static int uringwait(Pipe *p, PipeSlot *s) {
+	int err = uringreap(p, 0);
+	while (err == 0 && s->busy)
+		err = uringreap(p, 1);
+	return err;
+}
+
+
+/* wait until no request is in flight */
+static int uringdrain(Pipe *p) {
+	int err = 0;
+	while (err == 0 && p->inflight > 0)
+		err = uringreap(p, 1);
+	return err;
+}
+
+
+/* set up ring for 'p', reads of all slots are submitted right away */
+static int uringopen(Pipe *p, byte *buf) {
+	int fds[URINGFILES];
+	if (tightU_init(&p->ring, p->nslots) != 0)
+		return -1;
+	fds[0] = p->fd;
+	fds[1] = p->dfd;
+	tightU_register(&p->ring, fds, (p->dfd >= 0 ? 2 : 1), buf,
+					p->nslots * p->size);
+	p->uring = 1;
+	p->batch = (p->nslots / 4 > 1 ? p->nslots / 4 : 1);
+	if (!p->write) {
+		for (int i = 0; i < p->nslots; i++)
+			uringread(p, &p->slots[i]);
+		if (tightU_submit(&p->ring, 0) < 0) {
+			tightU_free(&p->ring);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/* stop the engine, all requests in flight are completed */
+static void uringclose(Pipe *p) {
+	if (uringdrain(p) != 0) /* ring failed, let the kernel cancel */
+		p->err = (p->err ? p->err : EIO);
+	p->syscalls += p->ring.enters;
+	tightU_free(&p->ring);
+}
+
+
+
+/*--------------------------------------------------------------------------
+ * Coder side
+ *-------------------------------------------------------------------------- */
+
+/*
+ * With 'TIGHT_IO_DIRECT' open 'O_DIRECT' description of 'p->fd' and make
+ * slots whole blocks; read pipe starts at the block holding 'base' (its
+ * head is skipped), write pipe has shorter first slot, so the following
+ * ones are at block boundaries. Returns the slot size.
+ */
+static size_t startdirect(tight_State *ts, Pipe *p, size_t size) {
+	p->dfd = -1;
+	p->first = size;
+	if (!(ts->iopolicy & TIGHT_IO_DIRECT) ||
+			(p->dfd = tightC_opendirect(p->fd, p->write)) < 0)
+		return size;
+	size_t head = (size_t)(p->base % DIRECTALIGN);
+	if (p->write) {
+		size = (size < DIRECTALIGN ? DIRECTALIGN : size - size % DIRECTALIGN);
+		p->first = size - head;
+	} else {
+		size = (size + DIRECTALIGN - 1) & ~(size_t)(DIRECTALIGN - 1);
+		p->base -= head;
+		p->bytes = p->pos = head;
+	}
+	return size;
+}
+
+
+/*
+ * Start read (or write) pipe on 'fd' with slot buffers of (about) 'size'
+ * bytes, engine is chosen by 'ts->pipelined' (threads if it is off and
+ * only 'TIGHT_IO_DIRECT' wants the pipe); returns NULL if 'fd' is not
+ * seekable or engine could not be started (io_uring not available),
+ * in which case caller does direct I/O. Caller fills write slots of
+ * 'p->size' bytes ('p->first' bytes for the first one).
+ */
+Pipe *tightP_open(tight_State *ts, int fd, size_t size, int write) {
+	off_t base = lseek(fd, 0, SEEK_CUR);
+	int uring = (ts->pipelined == TIGHT_PIPE_URING);
+	Pipe tmp, *p;
+	byte *buf;
+
+	tightS_count(ts, seeks, 1);
+	if (base < 0)
+		return NULL;
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.fd = fd;
+	tmp.base = base;
+	tmp.write = (write != 0);
+	size = startdirect(ts, &tmp, size);
+	tmp.nslots = (uring ? uringslots(size) : PIPESLOTS);
+	tmp.size = size;
+	tmp.memsize = sizeof(Pipe) + BUFFALIGN + tmp.nslots * size;
+	int arena = tightA_usearena(ts, 0); /* too large for the arena */
+	p = tightA_malloc(ts, tmp.memsize);
+	tightA_usearena(ts, arena);
+	*p = tmp;
+	buf = (byte *)(((uintptr_t)(p + 1) + BUFFALIGN - 1) & ~(uintptr_t)(BUFFALIGN - 1));
+	for (int i = 0; i < p->nslots; i++)
+		p->slots[i].buf = buf + i * size;
+	tightC_init(&p->pc, fd, ts->iopolicy, write, p->base);
+	if (uring) {
+		if (uringopen(p, buf) == 0)
+			return p;
+	} else {
+		pthread_mutex_init(&p->lock, NULL);
+		pthread_cond_init(&p->cond, NULL);
+		if (pthread_create(&p->thread, NULL, write ? writeloop : readloop, p) == 0)
+			return p;
+		pthread_cond_destroy(&p->cond);
+		pthread_mutex_destroy(&p->lock);
+	}
+	if (p->dfd >= 0)
+		close(p->dfd);
+	tightA_free(ts, p, p->memsize);
+	return NULL;
+}
+
+
+/*
+ * Stop the engine and free 'p', write pipe is drained first unless
+ * 'abort' is true (file offset is then moved past the written bytes);
+ * returns the first write error (errno) or 0.
+ */
+int tightP_close(tight_State *ts, Pipe *p, int abort) {
+	int err;
+
+	if (p->uring) { /* requests in flight are always completed */
+		uringclose(p);
+	} else {
+		pstore(p->stop, abort ? 2 : 1);
+		wake(p);
+		pthread_join(p->thread, NULL);
+		pthread_cond_destroy(&p->cond);
+		pthread_mutex_destroy(&p->lock);
+	}
+	if (p->write && !abort && lseek(p->fd, p->base + p->bytes, SEEK_SET) < 0 &&
+			p->err == 0)
+		p->err = errno;
+	tightC_finish(&p->pc, p->base + (p->write ? p->bytes : p->issued));
+	if (p->dfd >= 0)
+		close(p->dfd);
+	err = p->err;
+	tightS_count(ts, syscalls, p->syscalls);
+	tightA_free(ts, p, p->memsize);
+	return err;
+}
+
+
+/* 'read' from read pipe, EOF and errors are sticky */
+ssize_t tightP_read(Pipe *p, byte *out, size_t n) {
+	PipeSlot *s = &p->slots[p->tail % p->nslots];
+	size_t len;
+
+	if (p->uring) {
+		int err = uringwait(p, s);
+		if (t_unlikely(err != 0 && s->busy)) {
+			errno = err;
+			return -1;
+		}
+	} else
+		await(p, havedata);
+	if (t_unlikely(s->err != 0)) {
+		errno = s->err;
+		return -1;
+	}
+	if (s->n <= p->pos) /* EOF ? */
+		return 0;
+	len = s->n - p->pos;
+	if (len > n)
+		len = n;
+	memcpy(out, s->buf + p->pos, len);
+	p->pos += len;
+	p->bytes += len;
+	if (p->pos == s->n) { /* hand the slot back */
+		p->pos = 0;
+		tightC_advance(&p->pc, s->fileoff + s->n);
+		pstore(p->tail, p->tail + 1);
+		if (!p->uring)
+			wake(p);
+		else if (p->eof) /* nothing to read ahead */
+			s->n = 0;
+		else {
+			uringread(p, s);
+			uringflush(p);
+		}
+	}
+	return len;
+}
+
+
+/* buffer of the next write pipe slot */
+byte *tightP_writebuf(Pipe *p) {
+	PipeSlot *s = &p->slots[p->head % p->nslots];
+	if (p->uring) {
+		int err = uringwait(p, s);
+		if (t_unlikely(err != 0)) { /* ring failed, slot bytes are lost */
+			s->busy = 0;
+			p->err = (p->err ? p->err : err);
+		}
+	} else
+		await(p, haveroom);
+	return s->buf;
+}
+
+
+/*
+ * Queue 'n' bytes at 'off' of the buffer returned by 'tightP_writebuf';
+ * returns errno of an earlier failed write or 0.
+ */
+int tightP_write(Pipe *p, size_t off, size_t n) {
+	PipeSlot *s = &p->slots[p->head % p->nslots];
+	s->off = off;
+	s->n = n;
+	s->fileoff = p->base + p->bytes;
+	p->bytes += n;
+	if (p->uring) {
+		s->done = 0;
+		p->head++;
+		if (p->err == 0) { /* after error nothing more is written */
+			uringqueue(p, s);
+			uringflush(p);
+		}
+		return p->err;
+	}
+	pstore(p->head, p->head + 1);
+	wake(p);
+	return pload(p->err);
+}
+
+
+/*
+ * Wait until all queued buffers are written, 'fd' is then at the end of
+ * the written bytes; returns 'write' errno or 0.
+ */
+int tightP_sync(Pipe *p) {
+	int err = 0;
+	if (p->uring)
+		err = uringdrain(p);
+	else
+		await(p, drained);
+	if (err == 0 && lseek(p->fd, p->base + p->bytes, SEEK_SET) < 0)
+		err = errno;
+	return (pload(p->err) ? pload(p->err) : err);
+}
@@ -0,0 +1,90 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+#ifndef TIGHTPIPE_H
+#define TIGHTPIPE_H
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "tcache.h"
+#include "tight.h"
+#include "tinternal.h"
+#include "turing.h"
+
+
+/* buffers in a pipe ring (thread engine) */
+#define PIPESLOTS		4
+
+/* max buffers in a pipe ring (io_uring engine, see 'uringslots') */
+#define PIPEMAXSLOTS	32
+
+/* io_uring engine keeps about this many bytes in flight */
+#define URINGBYTES		((size_t)4 << 20)
+
+/* only files larger than this are pipelined (thread start is not free) */
+#define PIPEMINSIZE		((off_t)1 << 20)
+
+
+/* ring buffer */
+typedef struct PipeSlot {
+	byte *buf;
+	size_t off; /* start of data in 'buf' */
+	size_t n; /* bytes in 'buf' (0 on EOF in read pipe) */
+	int err; /* errno of failed 'read', 0 otherwise */
+	off_t fileoff; /* file offset of 'buf + off' */
+	size_t done; /* bytes of request completed so far (io_uring) */
+	byte busy; /* request in flight (io_uring) */
+} PipeSlot;
+
+
+/*
+ * Single producer single consumer ring of 'nslots' buffers between the
+ * coder and the I/O engine; in read pipe the engine reads 'fd' ahead of
+ * the coder, in write pipe it writes buffers filled by the coder.
+ * Thread engine: 'head' is only written by the producer and 'tail' only
+ * by the consumer (with release stores), mutex and condition variable
+ * are only used to park the side that has nothing to do.
+ * io_uring engine: there is no thread, the coder keeps requests for all
+ * free slots in flight (at explicit offsets) and reaps completions.
+ */
+typedef struct Pipe {
+	PipeSlot slots[PIPEMAXSLOTS];
+	int nslots; /* slots in use */
+	size_t size; /* size of each slot buffer */
+	size_t first; /* bytes of the first write slot ('O_DIRECT' alignment) */
+	uint head; /* slots produced */
+	uint tail; /* slots consumed */
+	size_t pos; /* consumer position in the current slot (read pipe) */
+	off_t base; /* offset of 'fd' when pipe was started (or synced) */
+	off_t bytes; /* bytes consumed (read pipe) or queued (write pipe) */
+	off_t issued; /* bytes requested ahead of 'base' (read pipe) */
+	int err; /* first 'write' error (write pipe) */
+	int fd;
+	int dfd; /* 'O_DIRECT' description of 'fd' (-1 if none) */
+	int stop; /* 1 to finish (write pipe drains first), 2 to abort */
+	byte write; /* true if write pipe */
+	byte eof; /* read request hit EOF (io_uring) */
+	byte uring; /* true if io_uring engine */
+	uint inflight; /* requests in flight (io_uring) */
+	uint batch; /* requests prepared before they are submitted (io_uring) */
+	Uring ring; /* io_uring instance (if 'uring') */
+	PageCache pc; /* page cache policy of 'fd' */
+	unsigned long long syscalls; /* I/O system calls of the engine */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t memsize; /* size of the allocation holding the pipe */
+} Pipe;
+
+
+TIGHT_FUNC Pipe *tightP_open(tight_State *ts, int fd, size_t size, int write);
+TIGHT_FUNC int tightP_close(tight_State *ts, Pipe *p, int abort);
+TIGHT_FUNC ssize_t tightP_read(Pipe *p, byte *out, size_t n);
+TIGHT_FUNC byte *tightP_writebuf(Pipe *p);
+TIGHT_FUNC int tightP_write(Pipe *p, size_t off, size_t n);
+TIGHT_FUNC int tightP_sync(Pipe *p);
+
+#endif
@@ -0,0 +1,222 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+#define _GNU_SOURCE /* 'SEEK_DATA' */
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "talloc.h"
+#include "tbuffer.h"
+#include "tdebug.h"
+#include "tscan.h"
+#include "tstate.h"
+
+
+/* scan worker */
+typedef struct ScanWorker {
+	Scan *s;
+	tight_State *ts; /* private state */
+	pthread_t thread;
+	int w; /* index of worker */
+	int status; /* status of the protected call of 'ts' */
+} ScanWorker;
+
+
+/* initialize scan 's' of 'fd' (-1 for I/O callbacks) */
+void tightW_initscan(Scan *s, int fd, ulong blocksize, size_t stride) {
+	struct stat st;
+
+	t_assert(blocksize > 0);
+	s->fd = fd;
+	s->size = -1;
+	s->blocksize = blocksize;
+	s->stride = (stride > 0 ? stride : 1);
+	s->n = 0;
+	s->next = 0;
+	s->err = 0;
+	s->stop = 0;
+	s->sparse = 0;
+	if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		size_t nblocks = ((size_t)st.st_size + blocksize - 1) / blocksize;
+		s->size = st.st_size;
+		s->n = (nblocks + s->stride - 1) / s->stride;
+#if defined(SEEK_DATA)
+		/* fewer blocks allocated than the size needs ? */
+		s->sparse = ((off_t)st.st_blocks * 512 < st.st_size &&
+					 (s->offset = lseek(fd, 0, SEEK_CUR)) >= 0);
+#endif
+	}
+}
+
+
+/* true if 'n' bytes at 'off' of 's' lie in a hole */
+static int inhole(Scan *s, off_t off, ulong n) {
+#if defined(SEEK_DATA)
+	off_t data = lseek(s->fd, off, SEEK_DATA);
+	return (data < 0 ? errno == ENXIO : data >= off + (off_t)n);
+#else
+	(void)s; (void)off; (void)n;
+	return 0;
+#endif
+}
+
+
+/* read 'n' bytes at 'off' into 'buf', returns bytes read or -1 */
+static ssize_t readat(int fd, byte *buf, size_t n, off_t off) {
+	size_t done = 0;
+	while (done < n) {
+		ssize_t res = pread(fd, buf + done, n - done, off + done);
+		if (res < 0 && errno == EINTR)
+			continue;
+		else if (res < 0)
+			return -1;
+		else if (res == 0) /* EOF (file shrank) */
+			break;
+		done += res;
+	}
+	return done;
+}
+
+
+/* scan blocks of 's' until they run out (or a worker fails) */
+static void scanblocks(tight_State *ts, Scan *s, int w) {
+	byte *buf = tightA_cachedbuffer(ts, CACHE_RBUF, s->blocksize);
+	size_t k;
+
+	while (!__atomic_load_n(&s->stop, __ATOMIC_RELAXED) &&
+			(k = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED)) < s->n) {
+		off_t off = (off_t)(k * s->stride) * (off_t)s->blocksize;
+		ulong len = (s->size - off < (off_t)s->blocksize ? (ulong)(s->size - off)
+														  : s->blocksize);
+		ssize_t n;
+		if (s->sparse && inhole(s, off, len)) {
+			s->fn(ts, s->ud, w, k, off, NULL, len);
+			continue;
+		}
+		n = readat(s->fd, buf, len, off);
+		if (t_unlikely(n < 0)) {
+			if (!__atomic_exchange_n(&s->stop, 1, __ATOMIC_RELAXED))
+				s->err = errno;
+			return;
+		}
+		if (n > 0)
+			s->fn(ts, s->ud, w, k, off, buf, n);
+	}
+}
+
+
+/* protected part of a worker */
+static void pscanworker(tight_State *ts, void *ud) {
+	ScanWorker *sw = (ScanWorker *)ud;
+	scanblocks(ts, sw->s, sw->w);
+}
+
+
+/* worker thread */
+static void *scanworker(void *ud) {
+	ScanWorker *sw = (ScanWorker *)ud;
+	sw->status = tightS_protectedcall(sw->ts, sw, pscanworker);
+	if (sw->status != TIGHT_OK)
+		__atomic_store_n(&sw->s->stop, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+
+/*
+ * Scan with 'nworkers' threads; in case none of them can be started
+ * blocks are scanned by the caller. Returns status of the workers.
+ */
+static int scanparallel(tight_State *ts, Scan *s, int nworkers) {
+	ScanWorker workers[MAXWORKERS];
+	int status = TIGHT_OK;
+	int n = 0;
+
+	while (n < nworkers) {
+		ScanWorker *sw = &workers[n];
+		sw->s = s;
+		sw->w = n;
+		sw->status = TIGHT_OK;
+		if ((sw->ts = tight_new(ts->frealloc, ts->ud)) == NULL)
+			break;
+		if (pthread_create(&sw->thread, NULL, scanworker, sw) != 0) {
+			tight_free(sw->ts);
+			break;
+		}
+		n++;
+	}
+	if (n == 0) { /* no workers ? */
+		scanblocks(ts, s, 0);
+		return TIGHT_OK;
+	}
+	for (int i = 0; i < n; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].status != TIGHT_OK)
+			status = workers[i].status;
+		tight_free(workers[i].ts);
+	}
+	return status;
+}
+
+
+/* scan input of unknown size in order */
+static off_t scanstream(tight_State *ts, Scan *s) {
+	BuffReader br;
+	const byte *p;
+	off_t off = 0;
+	size_t i = 0;
+	ulong n;
+
+	tightB_initbr(&br, ts, s->fd);
+	if (s->blocksize > br.size)
+		s->blocksize = br.size;
+	for (;;) {
+		n = s->blocksize;
+		p = tightB_brblock(&br, &n);
+		if (n == 0) /* EOF ? */
+			break;
+		if (i % s->stride == 0)
+			s->fn(ts, s->ud, 0, s->n++, off, p, n);
+		off += n;
+		i++;
+	}
+	return off;
+}
+
+
+/*
+ * Scan blocks of 's' with up to 'nworkers' workers calling 'fn' for
+ * each of them; returns the size of input. Offset of regular files
+ * is kept, other input is read up to EOF.
+ */
+off_t tightW_scan(tight_State *ts, Scan *s, int nworkers, fScanBlock fn,
+				  void *ud)
+{
+	int status = TIGHT_OK;
+	s->fn = fn;
+	s->ud = ud;
+	if (s->size < 0) /* not a regular file ? */
+		return scanstream(ts, s);
+	if (nworkers > MAXWORKERS)
+		nworkers = MAXWORKERS;
+	if ((size_t)nworkers > s->n)
+		nworkers = s->n;
+	if (nworkers > 1)
+		status = scanparallel(ts, s, nworkers);
+	else
+		scanblocks(ts, s, 0);
+	if (s->sparse) /* 'SEEK_DATA' moved it */
+		lseek(s->fd, s->offset, SEEK_SET);
+	if (t_unlikely(status != TIGHT_OK)) /* workers only fail to allocate */
+		tightS_throw(ts, TIGHT_ERRMEM);
+	if (t_unlikely(s->err != 0)) {
+		errno = s->err;
+		tightD_errnoerror(ts, "pread");
+	}
+	return s->size;
+}
@@ -0,0 +1,57 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+#ifndef TIGHTSCAN_H
+#define TIGHTSCAN_H
+
+#include <sys/types.h>
+
+#include "tight.h"
+#include "tinternal.h"
+
+
+/* maximum number of scan workers */
+#define MAXWORKERS		256
+
+
+/*
+ * Called for the 'k'-th scanned block of 'n' bytes at 'p' (input
+ * offset 'off') by worker 'w' (0 to number of workers - 1); 'ts' is
+ * the private state of the worker (caller state without workers).
+ * Blocks in holes of input are not read, 'p' is NULL for them.
+ */
+typedef void (*fScanBlock)(tight_State *ts, void *ud, int w, size_t k,
+						   off_t off, const byte *p, ulong n);
+
+
+/*
+ * Scan of input blocks; every 'stride'-th block of input is passed to
+ * the callback. Blocks of regular files are read with 'pread' by a
+ * pool of workers, each with its own state (allocator of the caller
+ * state must be thread safe), in any order; other inputs are read in
+ * order by the caller.
+ */
+typedef struct Scan {
+	int fd; /* input file (-1 for I/O callbacks) */
+	off_t size; /* size of input, -1 if not known before the scan */
+	ulong blocksize; /* size of blocks */
+	size_t stride; /* blocks from one scanned block to the next */
+	size_t n; /* number of blocks to scan, 0 if 'size' is not known */
+	size_t next; /* next block to scan (shared by workers) */
+	off_t offset; /* offset of 'fd' before the scan */
+	int err; /* 'errno' of the first failed read, 0 otherwise */
+	int stop; /* true once a worker failed */
+	byte sparse; /* input has holes */
+	fScanBlock fn;
+	void *ud; /* userdata of 'fn' */
+} Scan;
+
+
+TIGHT_FUNC void tightW_initscan(Scan *s, int fd, ulong blocksize,
+								size_t stride);
+TIGHT_FUNC off_t tightW_scan(tight_State *ts, Scan *s, int nworkers,
+							 fScanBlock fn, void *ud);
+
+#endif
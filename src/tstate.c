@@ -3,14 +3,18 @@
  * Refer to 'tight.h' for license details.
  *****************************************/
 
+#define _POSIX_C_SOURCE		199309L
+
 #include <stdarg.h>
 #include <string.h>
 #include <limits.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "tstate.h"
 #include "tdebug.h"
 #include "talloc.h"
+#include "tpipe.h"
 
 
 
@@ -73,6 +77,27 @@ const byte MAGIC[8] = {
 };
 
 
+/* archive trailer magic */
+const byte ARCMAGIC[8] = {
+	0x54, 0x49, 0x47, 0x48, 0x54, /* T I G H T */
+	0x41, 0x52, 0x43, /* A R C */
+};
+
+
+/* block index trailer magic (offsets only, files of older versions) */
+const byte SEEKMAGIC[8] = {
+	0x54, 0x49, 0x47, 0x48, 0x54, /* T I G H T */
+	0x49, 0x44, 0x58, /* I D X */
+};
+
+
+/* block index trailer magic (index with checksums) */
+const byte SEEKSUMMAGIC[8] = {
+	0x54, 0x49, 0x47, 0x48, 0x54, /* T I G H T */
+	0x49, 0x44, 0x35, /* I D 5 */
+};
+
+
 typedef struct TreeHeap {
 	TreeData *trees[TIGHTCODES]; /* trees */
 	int len; /* number of elements in 'trees' */
@@ -89,22 +114,43 @@ TIGHT_API tight_State *tight_new(tight_fRealloc frealloc, void *userdata) {
 	ts->ud = userdata;
 	ts->error = NULL;
 	ts->temp = NULL;
+	ts->arena.base = NULL;
+	ts->arena.size = 0;
+	ts->arena.kept = 0;
+	ts->arena.on = 0;
+	tightA_resetarena(ts);
 	ts->hufftree = NULL;
 	memset(ts->codes, 0, sizeof(ts->codes));
+	ts->htree = NULL;
+	memset(ts->cache, 0, sizeof(ts->cache));
+	ts->kernels = tightK_select();
+	ts->rbuffsize = ts->wbuffsize = 0;
+	ts->rpipe = ts->wpipe = NULL;
+	ts->pipelined = 0;
+	ts->iopolicy = TIGHT_IO_CACHED;
 	ts->errjmp = NULL;
 	ts->rfd = ts->wfd = -1;
+	ts->reffd = -1;
+	ts->io = NULL;
+	ts->ioud = NULL;
+	memset(&ts->stats, 0, sizeof(ts->stats));
+	ts->phasestart = 0;
+	ts->phase = TIGHT_PHASE_OTHER;
+	ts->statson = 0;
 	return ts;
 }
 
 
 /* delete state */
 TIGHT_API void tight_free(tight_State *ts) {
-	if (ts->hufftree) 
-		tightT_freeparent(ts, ts->hufftree);
+	tightS_freehufftree(ts);
+	tightA_freecache(ts); /* with nodes of 'htree' */
 	if (ts->error)
 		tightA_free(ts, ts->error, strlen(ts->error) + 1);
 	for (TempMem *curr = ts->temp; curr != NULL; curr = curr->next)
 		tightA_freetempmem(ts, curr);
+	if (ts->arena.base)
+		ts->frealloc(ts->arena.base, ts->ud, ts->arena.size, 0);
 	ts->frealloc(ts, ts->ud, SIZEOFSTATE, 0);
 }
 
@@ -131,19 +177,16 @@ static void tightqsort(TreeData **v, int start, int end) {
 }
 
 
-/* binary search */
+/* binary search (first tree with frequency not above that of 'td') */
 static unsigned int getsortedindex(TreeData **v, int low, int high, TreeData *td) {
-	int mid;
-
-	if (t_unlikely(low >= high)) return low;
 	while (low <= high) {
-		mid = low + ((high - low) >> 1);
+		int mid = low + ((high - low) >> 1);
 		if (v[mid]->freq > td->freq) 
 			low = mid + 1;
 		else
 			high = mid - 1;
 	}
-	return mid;
+	return low;
 }
 
 
@@ -186,23 +229,31 @@ static inline unsigned reversebits(uint code, int len) {
 
 /* TODO(jure): 'Tree' doesn't need frequency, pass 'combfreqs'
  * as userdata to quicksort implementation */
-/* generate huffman codes table and build huffman tree */
-void tightS_gencodes(tight_State *ts, const size_t *freqs) {
+/* 
+ * Build huffman tree and generate its codes into 'codes'.
+ * Codes are limited to 'MAXCODE' bits, in case the tree is too
+ * deep, frequencies get flattened and the tree is rebuilt.
+ */
+TreeData *tightS_gentree(tight_State *ts, const size_t *freqs, HuffCode *codes) {
 	TempMem *tm, *tmstart = ts->temp;
 	TreeHeap ht; /* huffman tree stack */
 	size_t combfreqs[TIGHTCODES]; /* freqs + combined frequencies */
 	int parents[TIGHTCODES]; /* parent frequency indexes in 'combfreqs' */
 	TreeData *t1, *t2, *t; /* left/right subtree */
-	int fi = TIGHTBYTES; /* next available position in 'combfreqs' */
+	int fi; /* next available position in 'combfreqs' */
+	int maxbits; /* longest code */
 	int i; /* loop counter */
+	int phase = tightS_phase(ts, TIGHT_PHASE_TREE);
 
 	if (t_unlikely(freqs == NULL)) /* use internal_freqs ? */
 		freqs = internal_freqs;
 
-	memset(ts->codes, 0, sizeof(ts->codes));
-	memset(&ht, 0, sizeof(ht));
 	memcpy(combfreqs, freqs, TIGHTBYTES * sizeof(size_t));
+
+buildtree:
+	memset(&ht, 0, sizeof(ht));
 	memset(&combfreqs[TIGHTBYTES], 0, TIGHTBYTES * sizeof(size_t));
+	fi = TIGHTBYTES;
 
 makeleafs:
 	for (i = 0; i < TIGHTBYTES; i++) {
@@ -220,6 +271,14 @@ makeleafs:
 		goto makeleafs;
 	}
 
+	if (t_unlikely(ht.len == 1)) { /* single symbol ? */
+		/* add dummy leaf, this way each code has at least 1 bit */
+		tm = tightA_newtempmem(ts);
+		t = tightT_newleaf(ts, 0, (ht.trees[0]->c + 1) % TIGHTBYTES);
+		updatetm(tm, t, sizeof(*t));
+		ht.trees[ht.len++] = t;
+	}
+
 	tightqsort(ht.trees, 0, ht.len - 1); /* sort leaf trees */
 	printTreeHeap(&ht);
 
@@ -232,7 +291,7 @@ makeleafs:
 		updatetm(tm, t, sizeof(*t));
 		sortedinsert(&ht, t); /* t1 <- t -> t2 */
 		printTreeHeap(&ht);
-		combfreqs[fi] = t1->c + t2->freq;
+		combfreqs[fi] = t1->freq + t2->freq;
 		parents[t1->c] = -fi; /* left */
 		parents[t2->c] = fi; /* right */
 		fi++; /* advance index into 'combfreqs' */
@@ -240,14 +299,14 @@ makeleafs:
 	t_assert(ht.len == 1);
 	t1 = ht.trees[--ht.len]; /* pop huffman tree */
 	parents[t1->c] = t1->c;
-	ts->hufftree = t1; /* anchor to state */
-	tightD_printtree(ts->hufftree);
+	tightD_printtree(t1);
 	while (ts->temp != tmstart) /* unlink and free temporary memory */
 		tightS_poptemp(ts);
 
 	/* build huffman codes */
 	int nbits, code, y;
-	memset(ts->codes, 0, sizeof(ts->codes));
+	memset(codes, 0, TIGHTBYTES * sizeof(*codes));
+	maxbits = 0;
 	for (i = 0; i < TIGHTBYTES; i++) {
 		if (combfreqs[i] == 0) /* skip 0 frequency bytes */
 			continue;
@@ -258,25 +317,101 @@ makeleafs:
 			y = t_abs(parents[y]); /* follow the node to root */
 			nbits++; /* increment number of bits in 'code' */
 		}
-		t_assert(nbits > 0 || parents[y] == t1->c);
-		if (t_likely(nbits > 0)) {
-			ts->codes[i].code = reversebits(code, nbits);
-			ts->codes[i].nbits = nbits;
-		} else {
-			ts->codes[i].code = ts->codes[i].nbits = 0;
+		t_assert(nbits > 0);
+		if (nbits > maxbits)
+			maxbits = nbits;
+		if (t_likely(nbits <= MAXCODE)) {
+			codes[i].code = reversebits(code, nbits);
+			codes[i].nbits = nbits;
 		}
-		t_tracef("[%d]=", i); tightD_printbits(ts->codes[i].code, nbits); t_trace("\n");
+		t_tracef("[%d]=", i); tightD_printbits(codes[i].code, nbits); t_trace("\n");
+	}
+
+	if (t_unlikely(maxbits > MAXCODE)) { /* codes too long ? */
+		tightT_freeparent(ts, t1);
+		for (i = 0; i < TIGHTBYTES; i++) /* flatten frequencies */
+			if (combfreqs[i] != 0)
+				combfreqs[i] = (combfreqs[i] >> 1) | 1;
+		goto buildtree;
+	}
+	tightS_phase(ts, phase);
+	return t1;
+}
+
+
+/* drop 'hufftree', cached header tree is kept */
+void tightS_freehufftree(tight_State *ts) {
+	if (ts->hufftree && ts->hufftree != ts->htree)
+		tightT_freeparent(ts, ts->hufftree);
+	ts->hufftree = NULL;
+}
+
+
+/* 
+ * Generate huffman codes table and build huffman tree,
+ * previous huffman tree (if any) is freed. Header tree is cached
+ * in the state and reused while 'freqs' stay the same; it is built
+ * in per-call memory and copied into a single per-state buffer.
+ */
+void tightS_gencodes(tight_State *ts, const size_t *freqs) {
+	tightS_freehufftree(ts);
+	if (freqs == NULL)
+		freqs = internal_freqs;
+	if (ts->htree == NULL || memcmp(ts->hfreqs, freqs, sizeof(ts->hfreqs)) != 0) {
+		TreeData *nodes, *t;
+		ts->htree = NULL;
+		nodes = tightA_cached(ts, CACHE_HTREE, TIGHTCODES * sizeof(TreeData));
+		t = tightS_gentree(ts, freqs, ts->hcodes);
+		ts->htree = tightT_copytree(nodes, t);
+		tightT_freeparent(ts, t);
+		memcpy(ts->hfreqs, freqs, sizeof(ts->hfreqs));
 	}
+	ts->hufftree = ts->htree;
+	memcpy(ts->codes, ts->hcodes, sizeof(ts->codes));
 }
 
 
 TIGHT_API void tight_setfiles(tight_State *ts, int rfd, int wfd) {
 	t_assert(rfd >= 0); t_assert(wfd >= 0); t_assert(wfd != rfd);
-	if (ts->hufftree)
-		tightT_freeparent(ts, ts->hufftree);
+	tightS_freehufftree(ts);
 	memset(ts->codes, 0, sizeof(ts->codes));
 	ts->rfd = rfd;
 	ts->wfd = wfd;
+	ts->io = NULL;
+}
+
+
+TIGHT_API void tight_setio(tight_State *ts, const tight_IO *io, void *ud) {
+	t_assert(io != NULL);
+	t_assert(io->read != NULL || io->readbuf != NULL);
+	t_assert(io->write != NULL || (io->writebuf != NULL && io->commit != NULL));
+	tightS_freehufftree(ts);
+	memset(ts->codes, 0, sizeof(ts->codes));
+	ts->rfd = ts->wfd = -1;
+	ts->io = io;
+	ts->ioud = ud;
+}
+
+
+TIGHT_API void tight_setreference(tight_State *ts, int fd) {
+	t_assert(fd >= -1);
+	ts->reffd = fd;
+}
+
+
+TIGHT_API void tight_reset(tight_State *ts) {
+	t_assert(ts->errjmp == NULL && ts->temp == NULL);
+	tightS_freehufftree(ts);
+	memset(ts->codes, 0, sizeof(ts->codes));
+	ts->rfd = ts->wfd = -1;
+	ts->reffd = -1;
+	ts->io = NULL;
+	if (ts->error) {
+		tightA_free(ts, ts->error, strlen(ts->error) + 1);
+		ts->error = NULL;
+	}
+	memset(&ts->stats, 0, sizeof(ts->stats));
+	ts->phase = TIGHT_PHASE_OTHER;
 }
 
 
@@ -289,6 +424,36 @@ void tightS_poptemp(tight_State *ts) {
 }
 
 
+/* current monotonic time in nanoseconds */
+static unsigned long long nanotime(void) {
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (unsigned long long)tp.tv_sec * 1000000000ull + tp.tv_nsec;
+}
+
+
+/* charge time since the last switch to current phase and switch to 'phase' */
+int tightS_setphase(tight_State *ts, int phase) {
+	unsigned long long now = nanotime();
+	int prev = ts->phase;
+	t_assert(0 <= phase && phase < TIGHT_NPHASES);
+	ts->stats.ns[prev] += now - ts->phasestart;
+	ts->phasestart = now;
+	ts->phase = phase;
+	return prev;
+}
+
+
+/* abort I/O threads left running by an error */
+static void closepipes(tight_State *ts) {
+	if (ts->rpipe)
+		tightP_close(ts, ts->rpipe, 1);
+	if (ts->wpipe)
+		tightP_close(ts, ts->wpipe, 1);
+	ts->rpipe = ts->wpipe = NULL;
+}
+
+
 /* run protected function 'fn' */
 int tightS_protectedcall(tight_State *ts, void *ud, fProtected fn) {
 	Tightjmpbuf errjmp;
@@ -296,18 +461,49 @@ int tightS_protectedcall(tight_State *ts, void *ud, fProtected fn) {
 	ts->errjmp = &errjmp;
 	ts->status = TIGHT_OK;
 	errjmp.haveap = 0;
+	if (ts->statson) { /* start collecting anew ? */
+		memset(&ts->stats, 0, sizeof(ts->stats));
+		ts->phase = TIGHT_PHASE_OTHER;
+		ts->phasestart = nanotime();
+	}
+	tightA_usearena(ts, 1);
 	if (setjmp(errjmp.buf) == 0)
 		fn(ts, ud);
 	if (errjmp.haveap)
 		va_end(errjmp.ap);
 	ts->errjmp = NULL;
+	if (t_unlikely(ts->rpipe || ts->wpipe)) /* call was interrupted ? */
+		closepipes(ts);
+	if (ts->arena.base) { /* release per-call memory ? */
+		if (ts->arena.spilled > 0) /* 'hufftree' might be on heap ? */
+			tightS_freehufftree(ts);
+		ts->hufftree = NULL;
+		tightA_usearena(ts, 0);
+		tightA_resetarena(ts);
+	}
+	tightS_phase(ts, TIGHT_PHASE_OTHER); /* charge the last phase */
 	return ts->status;
 }
 
 
+TIGHT_API void tight_setstats(tight_State *ts, int enable) {
+	ts->statson = (enable != 0);
+	memset(&ts->stats, 0, sizeof(ts->stats));
+}
+
+
+TIGHT_API void tight_getstats(const tight_State *ts, tight_Stats *stats) {
+	*stats = ts->stats;
+}
+
+
 /* auxiliary to 'tightS_throw' */
 static inline void freetempmem(tight_State *ts) {
 	TempMem *curr = ts->temp;
+	if (ts->arena.base && ts->arena.spilled == 0) { /* all in arena ? */
+		ts->temp = NULL; /* released by 'tightA_resetarena' */
+		return;
+	}
 	while (curr != NULL) {
 		TempMem *tm = curr->next;
 		tightA_freetempmem(ts, curr);
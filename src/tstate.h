@@ -19,6 +19,7 @@
 #include "talloc.h"
 #include "tight.h"
 #include "tinternal.h"
+#include "tkernel.h"
 #include "tmd5.h"
 #include "ttree.h"
 
@@ -34,17 +35,100 @@
 /* maximum bits in huffman code */
 #define MAXCODE			16
 
-/* check 'encodeeof' */
-#define EOFBIAS			6
 
-/* in how many bits 'eof' is encoded */
-#define EOFBITS			3
+/* 
+ * Block types; each block starts with type byte followed
+ * by uncompressed and compressed size (varints), except
+ * 'BLOCK_END' which only consists of type byte.
+ */
+#define BLOCK_END		0	/* end of blocks */
+#define BLOCK_STORED	1	/* uncompressed bytes */
+#define BLOCK_RLE		2	/* run-length-encoded bytes */
+#define BLOCK_HUFF		3	/* huffman tree + huffman codes */
+#define BLOCK_HUFFPREV	4	/* huffman codes (previous tree) */
+#define BLOCK_ORDER1	5	/* context map + trees + huffman codes */
+#define BLOCK_FSE		6	/* FSE normalized counts + bitstream */
+#define BLOCK_ZERO		7	/* zero bytes (hole), compressed size is 0 */
+#define BLOCK_REF		8	/* varint distance back to equal block */
+#define BLOCK_COPY		9	/* varint offset of bytes in reference */
+
+
+/*
+ * Header 'mode' bit 'TIGHT_DEDUP'; blocks are content-defined chunks
+ * and a chunk that was already written is 'BLOCK_REF', its payload is
+ * the distance (in bytes of the compressed stream) from the start of
+ * this block back to the start of the block holding the chunk, which
+ * is never another 'BLOCK_REF' (or 'BLOCK_ZERO'). As with
+ * 'TIGHT_SEEKABLE', 'BLOCK_HUFF' trees are block-only, so referenced
+ * blocks can be decoded on their own. Archive members share chunks.
+ */
+
+
+/* 
+ * 'BLOCK_RLE' control bytes; control byte below 128 is followed by
+ * (control + 1) literal bytes, otherwise it is followed by a single
+ * byte repeated (control - 128 + 'RLEMINRUN') times.
+ */
+#define RLEMINRUN		3
+#define RLEMAXRUN		(127 + RLEMINRUN)
+#define RLEMAXLIT		128
+
+
+/* 
+ * Header 'mode' flag of archives; archive header is followed by
+ * member blocks (each ending with 'BLOCK_END'), central index and
+ * trailer. Index is a varint count followed by entries: varint name
+ * length, name, varint offset, varint size, varint rawsize, mode byte
+ * and MD5 of member contents. Trailer is index offset (8 bytes, little
+ * endian), MD5 of index and 'ARCMAGIC'.
+ */
+#define HEADER_ARCHIVE		0x80
+
+/*
+ * Header 'mode' flag of delta files ('tight_setreference'); header is
+ * followed by varint size of reference, blocks and MD5 of uncompressed
+ * contents. 'BLOCK_COPY' holds no bytes, its payload is the offset of
+ * its (uncompressed size) bytes in reference; other blocks hold input
+ * bytes that were not found in reference.
+ */
+#define HEADER_DELTA		0x40
+
+/* 
+ * Header 'mode' bit 'TIGHT_SEEKABLE'; blocks are followed (after
+ * 'BLOCK_END') by block index and trailer. 'BLOCK_HUFF' trees are
+ * only used by their own block and 'BLOCK_HUFFPREV' always refers to
+ * header tree, this way each block can be decoded on its own. Index
+ * holds file offset of each block (8 bytes, little endian) and MD5 of
+ * its uncompressed bytes, all blocks except the last one hold the same
+ * number of uncompressed bytes. Trailer is index offset, uncompressed
+ * size and block size (each 8 bytes, little endian), followed by
+ * 'SEEKSUMMAGIC'; older files end with 'SEEKMAGIC' and their index
+ * holds only the offsets.
+ */
+#define SEEKTRAILERSIZE		(8 + 8 + 8 + 8)
+
+/* size of block index entry ('SEEKSUMMAGIC') */
+#define SEEKENTRYSIZE		(8 + 16)
+
+
+/* size of archive trailer */
+#define ARCTRAILERSIZE		(8 + 16 + 8)
+
+/* smallest archive index entry */
+#define ARCMINENTRY			(1 + 1 + 1 + 1 + 1 + 16)
 
 
 
 /* MAGIC global, defined in 'tstate.c' */
 extern const byte MAGIC[8];
 
+/* archive trailer magic, defined in 'tstate.c' */
+extern const byte ARCMAGIC[8];
+
+/* block index trailer magics, defined in 'tstate.c' */
+extern const byte SEEKMAGIC[8];
+extern const byte SEEKSUMMAGIC[8];
+
 
 /* internal header (actual memory representation) */
 typedef struct TIGHT_header {
@@ -83,18 +167,55 @@ struct tight_State {
 	void *ud; /* userdata for 'frealloc' */
 	char *error; /* error string */
 	TempMem *temp; /* temporary memory to clean */
+	Arena arena; /* per-call allocations (if set) */
 	TreeData *hufftree; /* huffman tree */
 	HuffCode codes[TIGHTBYTES]; /* huffman codes */
+	TreeData *htree; /* cached header tree (built from 'hfreqs') */
+	HuffCode hcodes[TIGHTBYTES]; /* codes of 'htree' */
+	size_t hfreqs[TIGHTBYTES]; /* frequencies of 'htree' */
+	CacheMem cache[NCACHE]; /* per-state buffers */
+	const Kernels *kernels; /* hot kernels for this CPU */
+	size_t rbuffsize; /* read buffer size (0 if automatic) */
+	size_t wbuffsize; /* write buffer size (0 if automatic) */
+	struct Pipe *rpipe; /* read-ahead pipe of the current call (if any) */
+	struct Pipe *wpipe; /* write-behind pipe of the current call (if any) */
 	Tightjmpbuf *errjmp; /* for error recovery */
 	int rfd; /* file descriptor open for reading */
 	int wfd; /* file descriptor open for writing */
+	int reffd; /* reference file of delta ('tight_setreference') or -1 */
+	const tight_IO *io; /* I/O callbacks ('tight_setio') or NULL */
+	void *ioud; /* userdata of 'io' */
 	volatile int status; /* status code */
+	tight_Stats stats; /* statistics */
+	unsigned long long phasestart; /* start of current phase [ns] */
+	int phase; /* current phase */
+	byte statson; /* true if collecting 'stats' */
+	byte pipelined; /* I/O engine ('TIGHT_PIPE_*', see 'tpipe.h') */
+	byte iopolicy; /* page cache policy ('TIGHT_IO_*', see 'tcache.h') */
 };
 
 
+/* add 'n' to statistics counter 'c' */
+#define tightS_count(ts,c,n) \
+	(t_unlikely((ts)->statson) ? (void)((ts)->stats.c += (n)) : (void)0)
+
+/* switch to phase 'p', returns previous phase (or 0 if not collecting) */
+#define tightS_phase(ts,p) \
+	(t_unlikely((ts)->statson) ? tightS_setphase(ts, p) : 0)
+
+/* true if input and output are set (descriptors or callbacks) */
+#define tightS_hasio(ts) \
+	((ts)->io != NULL || \
+	 ((ts)->rfd >= 0 && (ts)->wfd >= 0 && (ts)->rfd != (ts)->wfd))
+
+
 TIGHT_FUNC t_noret tightS_throw(tight_State *ts, int err);
 TIGHT_FUNC void tightS_gencodes(tight_State *ts, const size_t *freqs);
+TIGHT_FUNC void tightS_freehufftree(tight_State *ts);
+TIGHT_FUNC TreeData *tightS_gentree(tight_State *ts, const size_t *freqs,
+									HuffCode *codes);
 TIGHT_FUNC void tightS_poptemp(tight_State *ts);
+TIGHT_FUNC int tightS_setphase(tight_State *ts, int phase);
 TIGHT_FUNC int tightS_protectedcall(tight_State *ts, void *ud, fProtected fn);
 
 #endif
@@ -33,6 +33,25 @@ TreeData *tightT_newparent(tight_State *ts, TreeData *t1, TreeData *t2, ushrt id
 }
 
 
+/* copy 't' into 'nodes' from index '*n' on */
+static TreeData *copynodes(TreeData *nodes, size_t *n, const TreeData *t) {
+	TreeData *c = &nodes[(*n)++];
+	*c = *t;
+	if (t->left)
+		c->left = copynodes(nodes, n, t->left);
+	if (t->right)
+		c->right = copynodes(nodes, n, t->right);
+	return c;
+}
+
+
+/* copy tree 't' into consecutive 'nodes' (enough for any tree), returns root */
+TreeData *tightT_copytree(TreeData *nodes, const TreeData *t) {
+	size_t n = 0;
+	return copynodes(nodes, &n, t);
+}
+
+
 /* free parent and its children */
 void tightT_freeparent(tight_State *ts, TreeData *tdroot) {
 	if (tdroot->left)
@@ -23,5 +23,6 @@ TIGHT_FUNC TreeData *tightT_newleaf(tight_State *ts, size_t freq, ushrt c);
 TIGHT_FUNC void tightT_freeparent(tight_State *ts, TreeData *tdroot);
 TIGHT_FUNC TreeData *tightT_newparent(tight_State *ts, TreeData *t1,
 									  TreeData *t2, ushrt idx);
+TIGHT_FUNC TreeData *tightT_copytree(TreeData *nodes, const TreeData *t);
 
 #endif
@@ -0,0 +1,239 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "turing.h"
+
+#if defined(TIGHT_URING)
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+
+/* ring indexes shared with the kernel */
+#define uload(x)		__atomic_load_n(x, __ATOMIC_ACQUIRE)
+#define ustore(x,v)		__atomic_store_n(x, (v), __ATOMIC_RELEASE)
+
+
+/* map ring 'off' of 'u->fd' */
+static void *mapring(Uring *u, size_t size, off_t off) {
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				   u->fd, off);
+	return (p == MAP_FAILED ? NULL : p);
+}
+
+
+/*
+ * Set up ring with (at least) 'entries' submission entries;
+ * returns 0 or -1 if io_uring is not available (kernel too old,
+ * disabled or blocked by seccomp), 'u' is then unusable.
+ */
+int tightU_init(Uring *u, uint entries) {
+	struct io_uring_params params;
+	byte *sq, *cq;
+
+	memset(u, 0, sizeof(*u));
+	memset(&params, 0, sizeof(params));
+	u->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (u->fd < 0)
+		return -1;
+	if (!(params.features & IORING_FEAT_RW_CUR_POS)) /* no 'IORING_OP_READ' */
+		goto fail;
+	u->sqringsize = params.sq_off.array + params.sq_entries * sizeof(uint);
+	u->cqringsize = params.cq_off.cqes +
+					params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) { /* one mapping ? */
+		if (u->cqringsize > u->sqringsize)
+			u->sqringsize = u->cqringsize;
+		u->cqringsize = 0;
+	}
+	u->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+	if ((u->sqring = mapring(u, u->sqringsize, IORING_OFF_SQ_RING)) == NULL)
+		goto fail;
+	u->cqring = u->sqring;
+	if (u->cqringsize > 0 &&
+			(u->cqring = mapring(u, u->cqringsize, IORING_OFF_CQ_RING)) == NULL)
+		goto fail;
+	if ((u->sqes = mapring(u, u->sqessize, IORING_OFF_SQES)) == NULL)
+		goto fail;
+	sq = (byte *)u->sqring;
+	cq = (byte *)u->cqring;
+	u->sqhead = (uint *)(sq + params.sq_off.head);
+	u->sqtail = (uint *)(sq + params.sq_off.tail);
+	u->sqarray = (uint *)(sq + params.sq_off.array);
+	u->sqmask = *(uint *)(sq + params.sq_off.ring_mask);
+	u->sqentries = params.sq_entries;
+	u->cqhead = (uint *)(cq + params.cq_off.head);
+	u->cqtail = (uint *)(cq + params.cq_off.tail);
+	u->cqmask = *(uint *)(cq + params.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return 0;
+fail:
+	tightU_free(u);
+	return -1;
+}
+
+
+/* unmap and close ring (requests in flight must be completed) */
+void tightU_free(Uring *u) {
+	if (u->sqes)
+		munmap(u->sqes, u->sqessize);
+	if (u->cqring && u->cqring != u->sqring)
+		munmap(u->cqring, u->cqringsize);
+	if (u->sqring)
+		munmap(u->sqring, u->sqringsize);
+	if (u->fd >= 0)
+		close(u->fd);
+	u->sqes = NULL;
+	u->sqring = u->cqring = NULL;
+	u->fd = -1;
+}
+
+
+/*
+ * Try to register 'nfds' files 'fds' (at most 'URINGFILES') and buffer
+ * 'buf' of 'size' bytes, so the kernel does not look up the file and pin
+ * pages for each request; either can fail (e.g. 'RLIMIT_MEMLOCK'),
+ * requests then use plain 'fd'/'buf'.
+ */
+void tightU_register(Uring *u, const int *fds, int nfds, byte *buf,
+					 size_t size)
+{
+	struct iovec iov;
+
+	iov.iov_base = buf;
+	iov.iov_len = size;
+	u->fixedbufs = (syscall(__NR_io_uring_register, u->fd,
+							IORING_REGISTER_BUFFERS, &iov, 1) == 0);
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES,
+				fds, nfds) == 0) {
+		memcpy(u->files, fds, nfds * sizeof(int));
+		u->nfiles = nfds;
+	}
+}
+
+
+/*
+ * Prepare 'op' of 'n' bytes of 'buf' at offset 'off' of 'fd'; entry is
+ * submitted by the next 'tightU_submit' ('ud' comes back in completion).
+ * Caller keeps the number of requests in flight below 'sqentries'.
+ */
+void tightU_prep(Uring *u, int op, int fd, byte *buf, size_t n, off_t off,
+				 ulong ud)
+{
+	uint tail = *u->sqtail;
+	uint idx = tail & u->sqmask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (u->fixedbufs) {
+		sqe->opcode = (op == URING_READ ? IORING_OP_READ_FIXED :
+					   IORING_OP_WRITE_FIXED);
+		sqe->buf_index = 0;
+	} else
+		sqe->opcode = (op == URING_READ ? IORING_OP_READ : IORING_OP_WRITE);
+	sqe->fd = fd;
+	for (int i = 0; i < u->nfiles; i++) {
+		if (u->files[i] == fd) { /* registered ? */
+			sqe->fd = i;
+			sqe->flags = IOSQE_FIXED_FILE;
+			break;
+		}
+	}
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = (uint)n;
+	sqe->off = (uint64_t)off;
+	sqe->user_data = ud;
+	u->sqarray[idx] = idx;
+	ustore(u->sqtail, tail + 1);
+	u->pending++;
+}
+
+
+/*
+ * Submit prepared entries (in a single system call) and wait until at
+ * least 'wait' completions are available; returns 0 or -errno.
+ */
+int tightU_submit(Uring *u, uint wait) {
+	uint flags = (wait > 0 ? IORING_ENTER_GETEVENTS : 0);
+	int n;
+
+	if (u->pending == 0 && wait == 0)
+		return 0;
+	do {
+		n = syscall(__NR_io_uring_enter, u->fd, u->pending, wait, flags, NULL, 0);
+		u->enters++;
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -errno;
+	u->pending -= ((uint)n < u->pending ? (uint)n : u->pending);
+	return 0;
+}
+
+
+/*
+ * Take the next completion if there is one; returns 1 and sets 'ud' and
+ * 'res' (bytes or -errno), otherwise returns 0.
+ */
+int tightU_reap(Uring *u, ulong *ud, int *res) {
+	uint head = *u->cqhead;
+	if (head == uload(u->cqtail))
+		return 0;
+	struct io_uring_cqe *cqe = &u->cqes[head & u->cqmask];
+	*ud = (ulong)cqe->user_data;
+	*res = cqe->res;
+	ustore(u->cqhead, head + 1);
+	return 1;
+}
+
+
+#else /* no io_uring */
+
+
+int tightU_init(Uring *u, uint entries) {
+	(void)entries;
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+	return -1;
+}
+
+
+void tightU_free(Uring *u) { (void)u; }
+
+
+void tightU_register(Uring *u, const int *fds, int nfds, byte *buf,
+					 size_t size)
+{
+	(void)u; (void)fds; (void)nfds; (void)buf; (void)size;
+}
+
+
+void tightU_prep(Uring *u, int op, int fd, byte *buf, size_t n, off_t off,
+				 ulong ud)
+{
+	(void)u; (void)op; (void)fd; (void)buf; (void)n; (void)off; (void)ud;
+}
+
+
+int tightU_submit(Uring *u, uint wait) {
+	(void)u; (void)wait;
+	return -ENOSYS;
+}
+
+
+int tightU_reap(Uring *u, ulong *ud, int *res) {
+	(void)u; (void)ud; (void)res;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,63 @@
+/*****************************************
+ * Copyright (C) 2024 Jure B.
+ * Refer to 'tight.h' for license details.
+ *****************************************/
+
+#ifndef TIGHTURING_H
+#define TIGHTURING_H
+
+#include <sys/types.h>
+
+#include "tight.h"
+#include "tinternal.h"
+
+
+/* io_uring is used through raw system calls (no liburing) */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define TIGHT_URING
+#endif
+#endif
+
+
+/* operations of 'tightU_prep' */
+#define URING_READ		0
+#define URING_WRITE		1
+
+/* max files registered by 'tightU_register' */
+#define URINGFILES		2
+
+
+/*
+ * Submission and completion rings of an io_uring instance; only the
+ * coder thread uses it, kernel is the other side of both rings.
+ */
+typedef struct Uring {
+	int fd; /* ring file descriptor (-1 if not set up) */
+	uint *sqhead, *sqtail, *sqarray; /* submission queue */
+	uint sqmask, sqentries;
+	struct io_uring_sqe *sqes;
+	uint *cqhead, *cqtail; /* completion queue */
+	uint cqmask;
+	struct io_uring_cqe *cqes;
+	void *sqring; size_t sqringsize; /* mappings */
+	void *cqring; size_t cqringsize;
+	size_t sqessize;
+	uint pending; /* prepared entries not yet submitted */
+	int files[URINGFILES]; /* registered files (index is the fixed file) */
+	int nfiles; /* registered files (0 if none) */
+	byte fixedbufs; /* true if buffers are registered (as buffer 0) */
+	unsigned long long enters; /* 'io_uring_enter' calls */
+} Uring;
+
+
+TIGHT_FUNC int tightU_init(Uring *u, uint entries);
+TIGHT_FUNC void tightU_free(Uring *u);
+TIGHT_FUNC void tightU_register(Uring *u, const int *fds, int nfds, byte *buf,
+							   size_t size);
+TIGHT_FUNC void tightU_prep(Uring *u, int op, int fd, byte *buf, size_t n,
+							off_t off, ulong ud);
+TIGHT_FUNC int tightU_submit(Uring *u, uint wait);
+TIGHT_FUNC int tightU_reap(Uring *u, ulong *ud, int *res);
+
+#endif